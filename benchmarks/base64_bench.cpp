@@ -0,0 +1,64 @@
+// base64 throughput
+// GB/s of the kernel picked for this cpu, from sizes that stay in L1 to
+// ones that stream from memory
+
+// setman
+#include "base64.hpp"
+
+// std
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace setman::materials;
+using bench_clock = std::chrono::steady_clock;
+
+// what the passes read back, so they are not optimized away
+static volatile unsigned sink;
+
+// runs `pass` until a quarter second has gone by, and returns GB/s of
+// `bytes` a pass
+template <typename Pass> static double throughput(size_t bytes, Pass pass)
+{
+    pass(); // warm the caches and fault the pages in
+
+    size_t passes = 0;
+    const auto start = bench_clock::now();
+    auto elapsed = bench_clock::duration::zero();
+    do {
+        pass();
+        ++passes;
+        elapsed = bench_clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(250));
+
+    const std::chrono::duration<double> seconds = elapsed;
+    return static_cast<double>(bytes * passes) / seconds.count() / 1e9;
+}
+
+int main()
+{
+    std::printf("base64 %s\n", std::string(b64_implementation()).c_str());
+    std::printf("%10s %12s %12s\n", "bytes", "encode GB/s", "decode GB/s");
+
+    std::mt19937 random(1);
+    for (size_t len : {1u << 10, 1u << 14, 1u << 18, 1u << 22, 1u << 26}) {
+        std::vector<unsigned char> bytes(len);
+        for (auto &byte : bytes)
+            byte = static_cast<unsigned char>(random());
+        std::string text(b64_encoded_size(len), '\0');
+        std::vector<unsigned char> decoded(b64_decoded_size(text.size()));
+
+        // both in bytes of raw data, so the two columns compare
+        const double encode = throughput(len, [&] {
+            b64_encode(bytes.data(), len, text.data());
+            sink = static_cast<unsigned char>(text[len / 2]);
+        });
+        const double decode = throughput(len, [&] {
+            auto written = b64_decode(text.data(), text.size(), decoded.data());
+            sink = written ? decoded[len / 2] : 1;
+        });
+        std::printf("%10zu %12.2f %12.2f\n", len, encode, decode);
+    }
+}
@@ -0,0 +1,104 @@
+// response parsing
+// microseconds and allocations a parse of a recorded Google, DeepL and
+// OpenRouter response. the payloads are read from the directory given as
+// the first argument, benchmarks/payloads by default.
+
+// setman
+#include "ai_endpoints/deepl.hpp"
+#include "ai_endpoints/google.hpp"
+#include "ai_endpoints/openrouter.hpp"
+
+// std
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#ifndef SETMAN_BENCH_PAYLOADS
+#define SETMAN_BENCH_PAYLOADS "benchmarks/payloads"
+#endif
+
+using namespace setman::ai;
+using bench_clock = std::chrono::steady_clock;
+
+// every allocation in the process, counted so a parse's can be told
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// what the passes read back, so they are not optimized away
+static volatile size_t sink;
+
+static std::string load(const std::filesystem::path &file)
+{
+    std::ifstream in(file, std::ios::binary);
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+// parses until a quarter second has gone by, and prints the time and
+// allocations a parse took
+template <typename Parse>
+static void measure(const char *name, const std::string &body, Parse parse)
+{
+    auto warm = parse(body);
+    if (!warm.valid) {
+        std::printf("%-11s did not parse: %s\n", name, warm.error.c_str());
+        return;
+    }
+
+    size_t passes = 0;
+    const size_t before = allocations;
+    const auto start = bench_clock::now();
+    auto elapsed = bench_clock::duration::zero();
+    do {
+        auto response = parse(body);
+        sink = response.content.size();
+        ++passes;
+        elapsed = bench_clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(250));
+
+    const std::chrono::duration<double, std::micro> micros = elapsed;
+    std::printf("%-11s %8zu %10.1f %10.1f\n", name, body.size(),
+                micros.count() / passes,
+                static_cast<double>(allocations - before) / passes);
+}
+
+int main(int argc, char **argv)
+{
+    const std::filesystem::path payloads =
+        argc > 1 ? argv[1] : SETMAN_BENCH_PAYLOADS;
+    const std::string google = load(payloads / "google.json");
+    const std::string deepl = load(payloads / "deepl.json");
+    const std::string openrouter = load(payloads / "openrouter.json");
+    if (google.empty() || deepl.empty() || openrouter.empty()) {
+        std::fprintf(stderr, "no payloads in %s\n", payloads.c_str());
+        return 1;
+    }
+
+    std::printf("%-11s %8s %10s %10s\n", "response", "bytes", "us/parse",
+                "allocs");
+    measure("google", google, [](const std::string &body) {
+        return google_response::parse(body, 200);
+    });
+    measure("deepl", deepl, [](const std::string &body) {
+        return deepl_response::parse(body, 200);
+    });
+    measure("openrouter", openrouter, [](const std::string &body) {
+        return openrouter_response::parse(body, 200);
+    });
+}
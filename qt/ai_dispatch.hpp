@@ -0,0 +1,29 @@
+// ai dispatch
+// hands responses from the transport thread back to the ui thread
+
+#pragma once
+
+#include <QCoreApplication>
+#include <QMetaObject>
+#include <QObject>
+#include <QPointer>
+#include <functional>
+#include <utility>
+
+// wraps `handler` so it runs queued on the ui thread, and not at all once
+// `context` is gone: the window a request was made for may be closed
+// before its response arrives
+template <typename Response>
+std::function<void(Response)>
+on_qt_thread(QObject *context, std::function<void(Response)> handler) {
+    return [guard = QPointer<QObject>(context),
+            handler = std::move(handler)](Response response) {
+        QMetaObject::invokeMethod(
+            qApp,
+            [guard, handler, response = std::move(response)] {
+                if (guard)
+                    handler(response);
+            },
+            Qt::QueuedConnection);
+    };
+}
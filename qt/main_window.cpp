@@ -1,16 +1,32 @@
 // main window imp
 
 #include "config.hpp"
+#include "ai_dispatch.hpp"
 #include "ai_endpoints/google.hpp"
 #include "main_window.hpp"
+#include "materials/image_preprocessor.hpp"
 #include "materials/material.hpp"
+#include "thumbnail_service.hpp"
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QScrollBar>
+#include <QStandardPaths>
 #include <QStatusBar>
+#include <QThreadPool>
 #include <filesystem>
 
 namespace fs = std::filesystem;
 
+namespace {
+
+// what on_ocr sends, once it is prepared
+struct ocr_upload {
+    fs::path file;
+    std::string mime_type;
+};
+
+} // namespace
+
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     init_ui();
     init_menu_bar();
@@ -20,7 +36,7 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     resize(1200, 800);
 }
 
-MainWindow::~MainWindow() {}
+MainWindow::~MainWindow() { ocr_cancel_.cancel(); }
 
 void MainWindow::init_ui() {
     central_widget = new QWidget(this);
@@ -37,8 +53,22 @@ void MainWindow::init_ui() {
     // left panel
     cut_list = new QListWidget(this);
     cut_list->setMinimumWidth(300);
+    cut_list->setUniformItemSizes(true);
     connect(cut_list, &QListWidget::itemClicked, this,
             &MainWindow::on_cut_select);
+
+    // thumbnails are decoded off the ui thread, visible rows first
+    fs::path cache_dir =
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            .toStdString();
+    thumbnails_ = new ThumbnailService(cache_dir / "thumbnails", 96, this);
+    cut_list->setIconSize(QSize(thumbnails_->edge(), thumbnails_->edge()));
+    connect(thumbnails_, &ThumbnailService::thumbnail_ready, this,
+            &MainWindow::on_thumbnail_ready);
+    connect(cut_list->verticalScrollBar(), &QScrollBar::valueChanged, this,
+            &MainWindow::request_visible_thumbnails);
+    connect(cut_list->verticalScrollBar(), &QScrollBar::rangeChanged, this,
+            &MainWindow::request_visible_thumbnails);
     content_layout->addWidget(cut_list);
 
     // right panel (cut details)
@@ -123,6 +153,11 @@ void MainWindow::init_config() {
 
     if (!apikey.empty()) {
         ocr_client_ = setman::ai::new_google_client(apikey);
+        // asking about the same sheet again references its upload
+        // instead of sending the whole image
+        if (ocr_client_)
+            ocr_client_->set_file_uploads(
+                std::make_shared<setman::ai::FileUploads>());
     } else {
         QMessageBox::warning(this, "API Key Missing",
                              "No key found in env or in config file");
@@ -141,11 +176,7 @@ void MainWindow::on_open_project() {
     status_label->setText("Loaded project directory:" + dir);
     statusBar()->showMessage("Project loaded: " + dir, 3000);
 
-    // placeholder
-    cut_list->clear();
-    cut_list->addItem("poop");
-    cut_list->addItem("doop");
-    cut_list->addItem("sloop");
+    load_keyframes(dir);
 }
 
 void MainWindow::on_new_project() {
@@ -160,6 +191,8 @@ void MainWindow::on_cut_select(QListWidgetItem *item) {
 }
 
 void MainWindow::load_keyframes(const QString &directory) {
+    thumbnails_->clear_queue();
+    thumbnail_items_.clear();
     cut_list->clear();
 
     fs::path dir(directory.toStdString());
@@ -181,11 +214,47 @@ void MainWindow::load_keyframes(const QString &directory) {
             auto *item = new QListWidgetItem(filename, cut_list);
             item->setData(Qt::UserRole, filepath); // store full path
             cut_list->addItem(item);
+            thumbnail_items_.insert(filepath, item);
         }
     }
 
     statusBar()->showMessage(
         QString("Found %1 images in path.").arg(cut_list->count()), 3000);
+
+    request_visible_thumbnails();
+}
+
+void MainWindow::request_visible_thumbnails() {
+    QRect viewport = cut_list->viewport()->rect();
+    QListWidgetItem *first = cut_list->itemAt(viewport.topLeft());
+    if (!first)
+        return;
+    QListWidgetItem *last = cut_list->itemAt(viewport.bottomLeft());
+
+    int from = cut_list->row(first);
+    int to = last ? cut_list->row(last) : cut_list->count() - 1;
+
+    QStringList missing;
+    for (int row = from; row <= to; row++) {
+        QListWidgetItem *item = cut_list->item(row);
+        QString path = item->data(Qt::UserRole).toString();
+        if (path.isEmpty())
+            continue;
+
+        QPixmap pixmap = thumbnails_->cached(path);
+        if (!pixmap.isNull())
+            item->setIcon(pixmap);
+        else if (item->icon().isNull())
+            missing << path;
+    }
+
+    thumbnails_->request(missing);
+}
+
+void MainWindow::on_thumbnail_ready(const QString &path,
+                                    const QPixmap &pixmap) {
+    if (QListWidgetItem *item = thumbnail_items_.value(path))
+        item->setIcon(pixmap);
 }
 
 void MainWindow::on_ocr() {
@@ -198,10 +267,46 @@ void MainWindow::on_ocr() {
 
     ocr_button->setEnabled(false);
     ocr_content->setText("Processing");
-    statusBar()->showMessage("Sending to Gemini");
+    statusBar()->showMessage("Preparing image");
 
     fs::path imgpath(current_img_path_.toStdString());
-    auto result = setman::materials::file_to_b64(imgpath);
+    fs::path cache_dir =
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            .toStdString();
+
+    // a downscaled grayscale copy is a fraction of the upload and reads
+    // just as well; the original is sent if it cannot be produced.
+    // decoding a full sheet takes long enough to freeze the window, so it
+    // happens on the pool and the request is sent from the ui thread
+    auto send = on_qt_thread<ocr_upload>(this, [this](ocr_upload upload) {
+        send_ocr(upload.file, upload.mime_type);
+    });
+    QThreadPool::globalInstance()->start([imgpath, cache_dir, send] {
+        setman::materials::ImagePreprocessor preprocessor(cache_dir / "ocr");
+        auto prepared = preprocessor.process(imgpath);
+
+        ocr_upload upload{imgpath, "image/jpeg"}; // default
+        if (prepared.has_value()) {
+            upload = {prepared->file, prepared->mime_type};
+        } else {
+            auto ext = setman::materials::file_extension_of(imgpath);
+            if (ext.has_value()) {
+                if (*ext == "png")
+                    upload.mime_type = "image/png";
+                else if (*ext == "webp")
+                    upload.mime_type = "image/webp";
+                // etc.
+            }
+        }
+        send(std::move(upload));
+    });
+}
+
+void MainWindow::send_ocr(const fs::path &upload,
+                          const std::string &mime_type) {
+    statusBar()->showMessage("Sending to Gemini");
+
+    auto result = setman::materials::file_to_b64_stream(upload);
 
     if (!result.has_value()) {
         QString errmsg = QString::fromStdString(result.error().message());
@@ -211,40 +316,41 @@ void MainWindow::on_ocr() {
         return;
     }
 
-    auto ext = setman::materials::file_extension_of(imgpath);
-    std::string mime_type = "image/jpeg"; // default
-    if (ext.has_value()) {
-        if (*ext == "png")
-            mime_type = "image/png";
-        else if (*ext == "webp")
-            mime_type = "image/webp";
-        // etc.
-    }
-
     setman::ai::google_request req;
     req.set_model("gemini-2.0-flash-exp");
-    req.add_inline_image(result.value(), mime_type);
+    // encoded from the mapped file while curl sends it
+    req.add_inline_image(setman::ai::curl_helpers::stream_from(*result),
+                         mime_type);
     req.add_text("Please extract all visible text in this image. Provide this "
                  "text in a structured format");
 
-    auto response = ocr_client_->send(req);
-
-    if (!response.valid) {
-        ocr_content->setText("Error: " +
-                             QString::fromStdString(response.error));
-        statusBar()->showMessage("Gemini request failed", 3000);
-    } else {
-        const auto &content = response.content;
-        if (!content.empty()) {
-            QString text = QString::fromStdString(content[0]);
-            ocr_content->setText(text);
-
-            statusBar()->showMessage("Response received!", 3000);
+    // the window stays responsive while Gemini works; the response is
+    // handled back on the ui thread
+    ocr_cancel_ = {};
+    auto on_response = [this](const setman::ai::google_response &response) {
+        if (!response.valid) {
+            ocr_content->setText("Error: " +
+                                 QString::fromStdString(response.error));
+            statusBar()->showMessage("Gemini request failed", 3000);
         } else {
-            ocr_content->setText("No content in response");
-            statusBar()->showMessage("Empty response", 3000);
+            const auto &content = response.content;
+            if (!content.empty()) {
+                QString text = QString::fromStdString(content[0]);
+                ocr_content->setText(text);
+
+                statusBar()->showMessage("Response received!", 3000);
+            } else {
+                ocr_content->setText("No content in response");
+                statusBar()->showMessage("Empty response", 3000);
+            }
         }
-    }
 
-    ocr_button->setEnabled(true);
+        ocr_button->setEnabled(true);
+    };
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::minutes(2);
+    ocr_client_->send(
+        req,
+        on_qt_thread<setman::ai::google_response>(this, std::move(on_response)),
+        {.cancel = ocr_cancel_, .deadline = deadline});
 }
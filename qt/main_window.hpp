@@ -2,8 +2,10 @@
 
 #pragma once
 
+#include "ai_endpoints/transport.hpp"
 #include <QAction>
 #include <QHBoxLayout>
+#include <QHash>
 #include <QLabel>
 #include <QListWidget>
 #include <QMainWindow>
@@ -13,11 +15,15 @@
 #include <QTextEdit>
 #include <QVBoxLayout>
 #include <QWidget>
+#include <filesystem>
+#include <string>
 
 namespace setman::ai {
 class GoogleClient;
 }
 
+class ThumbnailService;
+
 class MainWindow : public QMainWindow {
     Q_OBJECT
 
@@ -30,6 +36,7 @@ class MainWindow : public QMainWindow {
     void on_new_project();
     void on_cut_select(QListWidgetItem *item);
     void on_ocr();
+    void on_thumbnail_ready(const QString &path, const QPixmap &pixmap);
 
   private:
     void init_ui();
@@ -37,6 +44,10 @@ class MainWindow : public QMainWindow {
     void init_config();
 
     void load_keyframes(const QString &directory);
+    void request_visible_thumbnails();
+
+    void send_ocr(const std::filesystem::path &upload,
+                  const std::string &mime_type);
 
     QListWidget *cut_list;
     QLabel *status_label;
@@ -46,6 +57,10 @@ class MainWindow : public QMainWindow {
     QTextEdit *ocr_content;
     QLabel *image_preview;
 
+    ThumbnailService *thumbnails_;
+    QHash<QString, QListWidgetItem *> thumbnail_items_; // by full path
+
     std::unique_ptr<setman::ai::GoogleClient> ocr_client_;
+    setman::ai::CancelToken ocr_cancel_; // the request in flight, if any
     QString current_img_path_;
 };
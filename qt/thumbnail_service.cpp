@@ -0,0 +1,132 @@
+// thumbnail service imp
+
+#include "thumbnail_service.hpp"
+#include "error.hpp"
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QThread>
+#include <algorithm>
+
+static constexpr int memory_cache_kib = 64 * 1024;
+
+ThumbnailService::ThumbnailService(
+    const std::filesystem::path &cache_directory, int edge, QObject *parent)
+    : QObject(parent), preprocessor_(cache_directory), edge_(edge),
+      pixmaps_(memory_cache_kib) {
+    // leave a core for the ui thread
+    pool_.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+}
+
+ThumbnailService::~ThumbnailService() {
+    clear_queue();
+    pool_.waitForDone();
+    // results still posted to this object are dropped along with it
+}
+
+QPixmap ThumbnailService::cached(const QString &path) {
+    if (QPixmap *pixmap = pixmaps_.object(path))
+        return *pixmap;
+    return {};
+}
+
+void ThumbnailService::request(const QStringList &paths) {
+    {
+        QMutexLocker lock(&mutex_);
+
+        // walk backwards so the first path ends up at the very front
+        for (auto it = paths.crbegin(); it != paths.crend(); ++it) {
+            const QString &path = *it;
+            if (failed_.contains(path) || pixmaps_.contains(path))
+                continue;
+
+            if (pending_.contains(path)) {
+                auto queued = std::find(queue_.begin(), queue_.end(), path);
+                if (queued == queue_.end())
+                    continue; // already being generated
+                queue_.erase(queued);
+            }
+
+            queue_.push_front(path);
+            pending_.insert(path);
+        }
+    }
+
+    start_workers();
+}
+
+void ThumbnailService::clear_queue() {
+    QMutexLocker lock(&mutex_);
+    for (const QString &path : queue_)
+        pending_.remove(path);
+    queue_.clear();
+}
+
+void ThumbnailService::start_workers() {
+    QMutexLocker lock(&mutex_);
+    while (workers_ < pool_.maxThreadCount() &&
+           workers_ < static_cast<int>(queue_.size())) {
+        workers_++;
+        pool_.start([this] { run_worker(); });
+    }
+}
+
+// workers drain the shared queue instead of owning a path each, so a
+// request() made mid-scroll reorders work that has not started yet
+void ThumbnailService::run_worker() {
+    while (true) {
+        QString path;
+        {
+            QMutexLocker lock(&mutex_);
+            if (queue_.empty()) {
+                workers_--;
+                return;
+            }
+            path = queue_.front();
+            queue_.pop_front();
+        }
+
+        QImage image = generate(path);
+
+        // QPixmap belongs to the ui thread
+        QMetaObject::invokeMethod(
+            this, [this, path, image] { on_generated(path, image); },
+            Qt::QueuedConnection);
+    }
+}
+
+QImage ThumbnailService::generate(const QString &path) const {
+    setman::materials::preprocess_options options;
+    options.long_edge = edge_;
+    options.pixel_budget = std::nullopt;
+    options.grayscale = false;
+    // cels are usually transparent
+    options.encoding = setman::materials::image_encoding::png;
+
+    auto result = preprocessor_.process(path.toStdString(), options);
+    if (!result.has_value())
+        return {};
+
+    QImageReader reader(QString::fromStdString(result->file.string()));
+    reader.setAutoTransform(true);
+    return reader.read();
+}
+
+void ThumbnailService::on_generated(const QString &path, const QImage &image) {
+    {
+        QMutexLocker lock(&mutex_);
+        pending_.remove(path);
+    }
+
+    if (image.isNull()) {
+        failed_.insert(path);
+        return;
+    }
+
+    auto *pixmap = new QPixmap(QPixmap::fromImage(image));
+    const int cost =
+        std::max<qint64>(1, qint64(pixmap->width()) * pixmap->height() *
+                                pixmap->depth() / 8 / 1024);
+    QPixmap copy = *pixmap;
+    pixmaps_.insert(path, pixmap, cost);
+    emit thumbnail_ready(path, copy);
+}
@@ -0,0 +1,61 @@
+// thumbnail service
+// generates previews on a worker pool, cached on disk and in memory
+
+#pragma once
+
+#include "materials/image_preprocessor.hpp"
+#include <QCache>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QPixmap>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <deque>
+#include <filesystem>
+
+class ThumbnailService : public QObject {
+    Q_OBJECT
+
+  public:
+    // thumbnails fit an edge x edge square. the disk cache is keyed by the
+    // file's content hash and the edge, so renamed or copied files reuse it
+    ThumbnailService(const std::filesystem::path &cache_directory, int edge,
+                     QObject *parent = nullptr);
+    ~ThumbnailService();
+
+    int edge() const { return edge_; }
+
+    // never touches the disk; a null pixmap means not in memory
+    QPixmap cached(const QString &path);
+
+    // queues the paths ahead of everything already waiting, in order, so
+    // whatever is on screen right now is decoded first
+    void request(const QStringList &paths);
+
+    // forgets everything that has not started yet
+    void clear_queue();
+
+  signals:
+    void thumbnail_ready(const QString &path, const QPixmap &pixmap);
+
+  private:
+    void start_workers();
+    void run_worker();
+    QImage generate(const QString &path) const;
+    void on_generated(const QString &path, const QImage &image);
+
+    setman::materials::ImagePreprocessor preprocessor_;
+    int edge_;
+
+    QThreadPool pool_;
+    QCache<QString, QPixmap> pixmaps_; // cost in KiB
+    QSet<QString> failed_;
+
+    QMutex mutex_; // guards everything below
+    std::deque<QString> queue_;
+    QSet<QString> pending_; // queued or being generated
+    int workers_ = 0;
+};
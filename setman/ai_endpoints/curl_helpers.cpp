@@ -1,51 +1,64 @@
 #include "curl_helpers.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace setman::ai::curl_helpers
 {
 
-size_t write_callback(void *contents, size_t size, size_t nmemb,
-                      std::string *userp)
+//
+// RequestBody
+//
+
+RequestBody &RequestBody::append(std::string fragment)
 {
-    size_t total_size = size * nmemb;
-    userp->append(static_cast<char *>(contents), total_size);
-    return total_size;
+    size_t length = fragment.size();
+    segments_.push_back({std::move(fragment), nullptr, nullptr, length});
+    size_ += length;
+    return *this;
 }
 
-http_response post_json(CURL *curl, const std::string &url, const json &payload,
-                        struct curl_slist *headers)
+RequestBody &RequestBody::append(const data_stream &stream)
 {
-    http_response result;
-    std::string payload_str = payload.dump();
-
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload_str.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, payload_str.size());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &result.body);
-
-    CURLcode res = curl_easy_perform(curl);
-
-    if (res != CURLE_OK) {
-        result.error = curl_easy_strerror(res);
-        result.http_code = 0;
-        return result;
-    }
-
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &result.http_code);
-    return result;
+    segments_.push_back({{}, stream.open, stream.open(), stream.size});
+    size_ += stream.size;
+    return *this;
 }
 
-struct curl_slist *add_json_header(struct curl_slist *headers)
+size_t RequestBody::read(char *buffer, size_t size)
 {
-    return curl_slist_append(headers, "Content-Type: application/json");
+    size_t written = 0;
+    while (written < size && current_ < segments_.size()) {
+        segment &part = segments_[current_];
+        size_t wanted = std::min(size - written, part.size - part.offset);
+
+        size_t produced = wanted;
+        if (part.source)
+            produced = part.source(buffer + written, wanted);
+        else
+            std::memcpy(buffer + written, part.text.data() + part.offset,
+                        wanted);
+
+        written += produced;
+        part.offset += produced;
+        if (part.offset == part.size) {
+            current_++;
+        } else if (produced == 0) {
+            // a stream that ends early would leave curl waiting on bytes
+            // it was promised
+            return CURL_READFUNC_ABORT;
+        }
+    }
+    return written;
 }
 
-struct curl_slist *add_bearer_auth(struct curl_slist *headers,
-                                   const std::string &token)
+void RequestBody::rewind()
 {
-    std::string auth_header = "Authorization: Bearer " + token;
-    return curl_slist_append(headers, auth_header.c_str());
+    for (auto &part : segments_) {
+        if (part.open && part.offset > 0)
+            part.source = part.open();
+        part.offset = 0;
+    }
+    current_ = 0;
 }
 
 } // namespace setman::ai::curl_helpers
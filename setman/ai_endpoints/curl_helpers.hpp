@@ -1,10 +1,9 @@
 #pragma once
 
 #include <curl/curl.h>
-#include <nlohmann/json.hpp>
+#include <functional>
 #include <string>
-
-using nlohmann::json;
+#include <vector>
 
 namespace setman::ai::curl_helpers
 {
@@ -15,15 +14,58 @@ struct http_response {
     std::string error;
 };
 
-size_t write_callback(void *contents, size_t size, size_t nmemb,
-                      std::string *userp);
+// fills up to size bytes of buffer and returns how many it wrote
+using body_source = std::function<size_t(char *buffer, size_t size)>;
+
+// a body whose bytes are produced while it is sent. size must be exact, so
+// curl can announce it up front instead of chunking.
+struct data_stream {
+    size_t size;
+    std::function<body_source()> open; // a fresh reader for every send
+};
+
+// wraps any copyable cursor with size() and read(buffer, size). every send
+// reads from its own copy, so the original stays at the start.
+template <typename Cursor> data_stream stream_from(Cursor cursor)
+{
+    size_t size = cursor.size();
+    return {size, [cursor = std::move(cursor)]() -> body_source {
+                return [reader = cursor](char *buffer, size_t size) mutable {
+                    return reader.read(buffer, size);
+                };
+            }};
+}
+
+// a request body spliced together from pre-serialized fragments and
+// streams, handed to curl piece by piece so no part of it is ever copied
+// into one contiguous payload
+class RequestBody
+{
+  public:
+    RequestBody &append(std::string fragment);
+    RequestBody &append(const data_stream &stream);
+
+    size_t size() const { return size_; }
 
-http_response post_json(CURL *curl, const std::string &url, const json &payload,
-                        struct curl_slist *headers);
+    // curl read callback target
+    size_t read(char *buffer, size_t size);
 
-struct curl_slist *add_json_header(struct curl_slist *headers = nullptr);
+    // back to the first byte, with fresh readers for the streams, for when
+    // curl sends the body again on another connection
+    void rewind();
 
-struct curl_slist *add_bearer_auth(struct curl_slist *headers,
-                                   const std::string &token);
+  private:
+    struct segment {
+        std::string text;
+        std::function<body_source()> open; // empty for text
+        body_source source;
+        size_t size;
+        size_t offset = 0;
+    };
+
+    std::vector<segment> segments_;
+    size_t current_ = 0;
+    size_t size_ = 0;
+};
 
 } // namespace setman::ai::curl_helpers
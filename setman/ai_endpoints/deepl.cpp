@@ -1,34 +1,27 @@
 #include "deepl.hpp"
 #include "curl_helpers.hpp"
+#include "json_fields.hpp"
+#include "json_writer.hpp"
 #include <curl/curl.h>
 
 namespace setman::ai
 {
 
-std::unique_ptr<DeepLClient> new_deepl_client(const std::string &key)
+std::unique_ptr<DeepLClient>
+new_deepl_client(const std::string &key, std::shared_ptr<Transport> transport)
 {
-    CURL *curl = curl_easy_init();
-    if (!curl)
+    if (!transport)
         return nullptr;
 
-    return std::make_unique<DeepLClient>(key, curl);
+    return std::make_unique<DeepLClient>(key, std::move(transport));
 }
 
-DeepLClient::DeepLClient(const std::string &api_key, CURL *curl)
-    : api_key_(api_key), curl_(curl), headers_(nullptr)
+DeepLClient::DeepLClient(const std::string &api_key,
+                         std::shared_ptr<Transport> transport)
+    : api_key_(api_key), transport_(std::move(transport)),
+      headers_({"Content-Type: application/json",
+                "Authorization: DeepL-Auth-Key " + api_key_})
 {
-    headers_ = curl_helpers::add_json_header(headers_);
-    std::string auth = "Authorization: DeepL-Auth-Key " + api_key_;
-    headers_ = curl_slist_append(headers_, auth.c_str());
-
-    curl_easy_setopt(curl_, CURLOPT_TIMEOUT, 120L);
-    curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, 30L);
-}
-
-DeepLClient::~DeepLClient()
-{
-    if (headers_)
-        curl_slist_free_all(headers_);
 }
 
 deepl_request &deepl_request::set_source_lang(const std::string &langcode)
@@ -68,110 +61,241 @@ deepl_request &deepl_request::set_model(deepl_model mdl)
     return *this;
 }
 
-json deepl_request::to_json() const
+static const char *model_name(deepl_model model)
 {
-    json payload;
+    switch (model) {
+    case deepl_model::latency_optimized:
+        return "latency_optimized";
+    case deepl_model::quality_optimized:
+        return "quality_optimized";
+    case deepl_model::prefer_quality_optimized:
+        return "prefer_quality_optimized";
+    }
+    return "";
+}
 
-    payload["text"] = texts;
-    payload["target_lang"] = target_lang;
+std::string deepl_request::serialize() const
+{
+    size_t size = 128 + target_lang.size() + context.value_or("").size();
+    for (const auto &text : texts)
+        size += text.size() + 8;
+
+    JsonWriter out(size);
+    out.begin_object().field("context", context);
+    if (model)
+        out.field("model_type", model_name(*model));
+    out.field("source_lang", source_lang)
+        .field("target_lang", target_lang)
+        .field("text", texts)
+        .end_object();
+    return out.take();
+}
 
-    if (source_lang)
-        payload["source_lang"] = *source_lang;
+deepl_response DeepLClient::translate(const deepl_request &req)
+{
+    return translate_async(req).get();
+}
 
-    if (context)
-        payload["context"] = *context;
+// deepl bills characters, not bytes
+static double characters_in(const std::vector<std::string> &texts)
+{
+    size_t count = 0;
+    for (const auto &text : texts) {
+        for (unsigned char c : text)
+            count += (c & 0xC0) != 0x80;
+    }
+    return static_cast<double>(count);
+}
 
-    if (model) {
-        switch (*model) {
-        case deepl_model::latency_optimized:
-            payload["model_type"] = "latency_optimized";
-            break;
-        case deepl_model::quality_optimized:
-            payload["model_type"] = "quality_optimized";
-            break;
-        case deepl_model::prefer_quality_optimized:
-            payload["model_type"] = "prefer_quality_optimized";
-            break;
+void DeepLClient::translate(const deepl_request &req, callback done,
+                            const call_options &options)
+{
+    http_request http{.url = req.endpoint,
+                      .headers = headers_,
+                      .body = req.serialize(),
+                      .options = options,
+                      .cost = {.characters = characters_in(req.texts)}};
+
+    std::string key;
+    if (cache_ && options.use_cache) {
+        key = fingerprint(http.url, http.body);
+        if (auto body = cache_->get(key)) {
+            done(deepl_response::parse(*body, 200,
+                                       options.keep_raw_json));
+            return;
         }
     }
 
-    return payload;
+    // completions run on the transport's own thread, so a plain pointer
+    // to it stays valid there
+    transport_->submit(
+        std::move(http),
+        [done = std::move(done), cache = cache_, key,
+         keep_raw = options.keep_raw_json,
+         transport = transport_.get()](curl_helpers::http_response r) {
+            auto response = deepl_response::from_http(r, keep_raw);
+            if (cache && !key.empty() && response.valid)
+                cache->put(key, std::move(r.body));
+            transport->recycle(std::move(r.body));
+            done(std::move(response));
+        });
 }
 
-deepl_response DeepLClient::translate(const deepl_request &req)
+std::future<deepl_response>
+DeepLClient::translate_async(const deepl_request &req,
+                             const call_options &options)
 {
-    std::string url = "https://api.deepl.com/v2/translate";
-
-    auto http_resp = curl_helpers::post_json(curl_, url, req.to_json(), headers_);
+    return as_future<deepl_response>(
+        [&](callback done) { translate(req, std::move(done), options); });
+}
 
-    if (!http_resp.error.empty()) {
+deepl_response
+deepl_response::from_http(const curl_helpers::http_response &http,
+                          bool keep_raw)
+{
+    if (!http.error.empty()) {
         return {.content = {},
                 .valid = false,
-                .error = "[CURL ERROR] " + http_resp.error,
+                .error = "[CURL ERROR] " + http.error,
                 .raw_json = ""};
     }
 
-    return deepl_response::parse(http_resp.body, http_resp.http_code);
+    return parse(http.body, http.http_code, keep_raw);
 }
 
-deepl_response deepl_response::parse(const std::string &raw, long http_code)
+// billed_characters comes per translation when asked for, and is summed
+class DeepLFields : public JsonFieldReader
 {
-    deepl_response result;
-    result.raw_json = raw;
-    result.valid = false;
+  public:
+    explicit DeepLFields(deepl_response &result) : result_(result) {}
 
-    if (http_code != 200) {
-        result.error = "[HTTP CODE " + std::to_string(http_code) + "]";
-        return result;
-    }
+    // why the document does not make a response, if it does not
+    std::optional<std::string> problem() const;
 
-    json parsed;
-    try {
-        parsed = json::parse(raw);
-    } catch (json::exception &e) {
-        result.error = std::string("[JSON ERROR] ") + e.what();
-        return result;
-    }
+  private:
+    enum class text_state { missing, string, other };
 
-    if (!parsed.contains("translations")) {
-        result.error = "[DEEPL] Missing 'translations' field in response";
-        return result;
-    }
+    size_t current_translation();
 
-    const auto &translations = parsed["translations"];
-    if (!translations.is_array() || translations.empty()) {
-        result.error = "[DEEPL] 'translations' field is empty or not an array";
-        return result;
-    }
+    void on_begin(bool array) override;
+    void on_string(std::string &value) override;
+    void on_integer(int64_t value) override;
+    void on_other() override { wrong_type(); }
 
-    for (size_t i = 0; i < translations.size(); i++) {
-        const auto &translation = translations[i];
+    void wrong_type();
 
-        if (!translation.contains("text")) {
-            result.error = "[DEEPL] Translation at index " +
-                           std::to_string(i) + " missing 'text' field";
-            return result;
-        }
+    deepl_response &result_;
+    bool has_translations_ = false;
+    bool translations_array_ = false;
+    std::vector<text_state> texts_;
+};
 
-        if (!translation["text"].is_string()) {
-            result.error = "[DEEPL] Translation 'text' at index " +
-                           std::to_string(i) + " is not a string";
-            return result;
-        }
+// every element of translations takes a slot, objects or not, so one
+// that is not an object is reported as missing its text
+size_t DeepLFields::current_translation()
+{
+    if (index(1) >= texts_.size()) {
+        texts_.resize(index(1) + 1, text_state::missing);
+        result_.content.resize(index(1) + 1);
+    }
+    return index(1);
+}
 
-        result.content.push_back(translation["text"].get<std::string>());
+// translations that are not an array, an element of them that is not an
+// object, or a text that is not a string
+void DeepLFields::wrong_type()
+{
+    if (at({"translations"}))
+        has_translations_ = true;
+    else if (at({"translations", "#"}))
+        current_translation();
+    else if (at({"translations", "#", "text"}))
+        texts_[current_translation()] = text_state::other;
+}
+
+void DeepLFields::on_begin(bool array)
+{
+    if (at({"translations"})) {
+        has_translations_ = true;
+        translations_array_ = array;
+    } else if (at({"translations", "#"})) {
+        current_translation();
+    } else {
+        wrong_type();
     }
+}
 
-    if (parsed.contains("billed_characters") &&
-        parsed["billed_characters"].is_number_integer()) {
-        result.billed_characters = parsed["billed_characters"].get<int>();
+void DeepLFields::on_string(std::string &value)
+{
+    if (at({"translations", "#", "text"})) {
+        const size_t i = current_translation();
+        result_.content[i] = std::move(value);
+        texts_[i] = text_state::string;
+    } else if (at({"model_type_used"}) ||
+               at({"translations", "#", "model_type_used"})) {
+        result_.model_type_used = std::move(value);
+    } else {
+        wrong_type();
     }
+}
+
+void DeepLFields::on_integer(int64_t value)
+{
+    if (at({"billed_characters"})) {
+        result_.billed_characters = static_cast<int>(value);
+    } else if (at({"translations", "#", "billed_characters"})) {
+        result_.billed_characters =
+            result_.billed_characters.value_or(0) + static_cast<int>(value);
+    } else {
+        wrong_type();
+    }
+}
 
-    if (parsed.contains("model_type_used") &&
-        parsed["model_type_used"].is_string()) {
-        result.model_type_used = parsed["model_type_used"].get<std::string>();
+std::optional<std::string> DeepLFields::problem() const
+{
+    if (!has_translations_)
+        return "[DEEPL] Missing 'translations' field in response";
+    if (!translations_array_ || texts_.empty())
+        return "[DEEPL] 'translations' field is empty or not an array";
+
+    for (size_t i = 0; i < texts_.size(); i++) {
+        if (texts_[i] == text_state::missing)
+            return "[DEEPL] Translation at index " + std::to_string(i) +
+                   " missing 'text' field";
+        if (texts_[i] == text_state::other)
+            return "[DEEPL] Translation 'text' at index " +
+                   std::to_string(i) + " is not a string";
     }
+    return std::nullopt;
+}
+
+deepl_response deepl_response::parse(std::string_view raw, long http_code,
+                                     bool keep_raw)
+{
+    deepl_response result;
+    result.http_code = http_code;
+    result.valid = false;
 
+    // failures keep the body either way; it is all there is to go on
+    auto fail = [&](std::string error) {
+        result.error = std::move(error);
+        result.raw_json = raw;
+        result.content.clear();
+        return std::move(result);
+    };
+
+    if (http_code != 200)
+        return fail("[HTTP CODE " + std::to_string(http_code) + "]");
+
+    DeepLFields fields(result);
+    std::string error;
+    if (!fields.read(raw, error))
+        return fail("[JSON ERROR] " + error);
+    if (auto problem = fields.problem())
+        return fail(std::move(*problem));
+
+    if (keep_raw)
+        result.raw_json = raw;
     result.valid = true;
     return result;
 }
@@ -1,10 +1,14 @@
 #pragma once
 
-#include <curl/curl.h>
+#include "response_cache.hpp"
+#include "transport.hpp"
+#include <functional>
+#include <future>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using nlohmann::json;
@@ -19,6 +23,8 @@ enum class deepl_model {
 };
 
 struct deepl_request {
+    // api-free.deepl.com for free plan keys, or a local mock server
+    std::string endpoint = "https://api.deepl.com/v2/translate";
     std::vector<std::string> texts;
     std::string target_lang;
     std::optional<std::string> source_lang;
@@ -43,7 +49,8 @@ struct deepl_request {
     deepl_request &set_context(const std::string &ctx);
     deepl_request &set_model(deepl_model mdl);
 
-    json to_json() const;
+    // the body, keys sorted as nlohmann::json would have them
+    std::string serialize() const;
 };
 
 struct deepl_response {
@@ -51,29 +58,56 @@ struct deepl_response {
     bool valid;
     std::string error;
     std::string raw_json;
+    long http_code = 0; // 0 when the request never got an answer
 
     std::optional<int> billed_characters;
     std::optional<std::string> model_type_used;
 
-    static deepl_response parse(const std::string &raw, long http_code);
+    // raw_json is only filled for successful responses when asked to
+    static deepl_response
+    parse(std::string_view raw, long http_code, bool keep_raw = false);
+    static deepl_response
+    from_http(const curl_helpers::http_response &http, bool keep_raw = false);
 };
 
 class DeepLClient
 {
   public:
-    DeepLClient(const std::string &api_key, CURL *curl);
-    ~DeepLClient();
+    DeepLClient(const std::string &api_key,
+                std::shared_ptr<Transport> transport);
 
-    deepl_response translate(const deepl_request &req);
+    using callback = std::function<void(deepl_response)>;
+
+    // blocks until the response arrives
+    deepl_response translate(const deepl_request &request);
+
+    // return at once. callbacks run on the transport thread, so anything
+    // slow in them holds up every other request
+    void translate(const deepl_request &request, callback done,
+                   const call_options &options = {});
+    std::future<deepl_response>
+    translate_async(const deepl_request &request,
+                    const call_options &options = {});
 
     void set_api_key(const std::string &key) { api_key_ = key; }
 
+    // successful responses are remembered and answered from it until they
+    // expire, unless a call opts out. hits complete on the calling thread.
+    void set_cache(std::shared_ptr<ResponseCache> cache)
+    {
+        cache_ = std::move(cache);
+    }
+
   private:
     std::string api_key_;
-    CURL *curl_;
-    struct curl_slist *headers_;
+    std::shared_ptr<Transport> transport_;
+    std::vector<std::string> headers_;
+    std::shared_ptr<ResponseCache> cache_;
 };
 
-std::unique_ptr<DeepLClient> new_deepl_client(const std::string &key);
+// null when no transport could be created
+std::unique_ptr<DeepLClient>
+new_deepl_client(const std::string &key,
+                 std::shared_ptr<Transport> transport = shared_transport());
 
 } // namespace setman::ai
@@ -0,0 +1,479 @@
+#include "file_uploads.hpp"
+#include "google.hpp"
+#include "json_fields.hpp"
+#include "json_writer.hpp"
+#include "materials/base64.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <random>
+#include <xxhash.h>
+
+namespace setman::ai
+{
+
+//
+// base64
+//
+
+static size_t b64_padding(char second_last, char last)
+{
+    return (last == '=') + (second_last == '=');
+}
+
+// the bytes behind a base64 stream, decoded as they are read. every copy
+// opens the stream afresh on its first read.
+class Base64Decoding
+{
+  public:
+    Base64Decoding(curl_helpers::data_stream encoded, size_t size)
+        : encoded_(std::move(encoded)), size_(size)
+    {
+    }
+
+    size_t size() const { return size_; }
+
+    size_t read(char *buffer, size_t size)
+    {
+        if (!reader_)
+            reader_ = encoded_.open();
+
+        size_t written = 0;
+        while (written < size) {
+            if (at_ < decoded_.size()) {
+                size_t n = std::min(size - written, decoded_.size() - at_);
+                std::copy_n(decoded_.data() + at_, n, buffer + written);
+                at_ += n;
+                written += n;
+                continue;
+            }
+
+            // anything but whole quads waits for the next read
+            size_t held = held_.size();
+            held_.resize(64 * 1024);
+            size_t read = (*reader_)(held_.data() + held, held_.size() - held);
+            held_.resize(held + read);
+            if (read == 0)
+                break; // short or broken; curl fails the upload on the size
+
+            size_t whole = held_.size() / 4 * 4;
+            decoded_.resize(materials::b64_decoded_size(whole));
+            at_ = 0;
+            auto decoded = materials::b64_decode(
+                held_.data(), whole,
+                reinterpret_cast<unsigned char *>(decoded_.data()));
+            if (!decoded) {
+                decoded_.clear();
+                break;
+            }
+            decoded_.resize(*decoded);
+            held_.erase(0, whole);
+        }
+        return written;
+    }
+
+  private:
+    curl_helpers::data_stream encoded_;
+    size_t size_;
+    std::optional<curl_helpers::body_source> reader_;
+    std::string held_;
+    std::string decoded_;
+    size_t at_ = 0;
+};
+
+//
+// preparing requests
+//
+
+// an inline image large enough to be worth an upload
+struct FileUploads::candidate {
+    size_t part; // index into the request's parts
+    const content *source;
+    std::string hash;
+    size_t inline_bytes; // base64
+    size_t bytes;        // decoded
+};
+
+static size_t inline_size(const content &part)
+{
+    return part.stream ? part.stream->size : part.data.size();
+}
+
+static std::string to_hex(XXH128_hash_t hash)
+{
+    char text[33];
+    std::snprintf(text, sizeof(text), "%016llx%016llx",
+                  static_cast<unsigned long long>(hash.high64),
+                  static_cast<unsigned long long>(hash.low64));
+    return text;
+}
+
+// hashes the base64, reading a stream once through. the mime type goes in
+// too, since it is uploaded with the bytes.
+static void inspect(const content &part, std::string &hash, size_t &bytes)
+{
+    XXH3_state_t *state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    XXH3_128bits_update(state, part.mime_type.data(), part.mime_type.size());
+    XXH3_128bits_update(state, "", 1);
+
+    char tail[2] = {0, 0};
+    auto update = [&](const char *data, size_t size) {
+        XXH3_128bits_update(state, data, size);
+        if (size >= 2) {
+            tail[0] = data[size - 2];
+            tail[1] = data[size - 1];
+        } else if (size == 1) {
+            tail[0] = tail[1];
+            tail[1] = data[0];
+        }
+    };
+
+    if (part.stream) {
+        auto read = part.stream->open();
+        std::array<char, 64 * 1024> buffer;
+        while (size_t n = read(buffer.data(), buffer.size()))
+            update(buffer.data(), n);
+    } else {
+        update(part.data.data(), part.data.size());
+    }
+
+    size_t encoded = inline_size(part);
+    bytes = encoded / 4 * 3 - std::min(encoded / 4 * 3,
+                                       b64_padding(tail[0], tail[1]));
+    hash = to_hex(XXH3_128bits_digest(state));
+    XXH3_freeState(state);
+}
+
+static void reference(content &part, const uploaded_file &file)
+{
+    part.part_type = content_type::file_uri;
+    part.data = file.uri;
+    if (!file.mime_type.empty())
+        part.mime_type = file.mime_type;
+    part.stream.reset();
+}
+
+// a request waiting for uploads. it goes out once the last of them is
+// through, whether they worked or not.
+struct pending_upload {
+    std::mutex mutex;
+    google_request request;
+    std::shared_ptr<const google_request> original;
+    size_t outstanding = 1; // the preparing thread holds one itself
+    size_t referenced = 0;
+    FileUploads::prepared ready;
+
+    void resolve(std::optional<size_t> part,
+                 const std::optional<uploaded_file> &file)
+    {
+        std::unique_lock lock(mutex);
+        if (part && file) {
+            reference(request.parts[*part], *file);
+            referenced++;
+        }
+        if (--outstanding > 0)
+            return;
+        lock.unlock();
+
+        ready(request, referenced ? original : nullptr);
+    }
+};
+
+void FileUploads::prepare(const google_request &request,
+                          const std::string &api_key, Transport &transport,
+                          const call_options &options, prepared ready)
+{
+    size_t inline_total = 0;
+    std::vector<candidate> images;
+    for (size_t i = 0; i < request.parts.size(); i++) {
+        const content &part = request.parts[i];
+        if (part.part_type != content_type::inline_image)
+            continue;
+        size_t size = inline_size(part);
+        inline_total += size;
+        if (size >= options_.min_bytes)
+            images.push_back({i, &part, {}, size, 0});
+    }
+    if (images.empty()) {
+        ready(request, nullptr);
+        return;
+    }
+
+    for (auto &image : images)
+        inspect(*image.source, image.hash, image.bytes);
+
+    // uploads already under way may finish any moment; they wait for the
+    // request to be copied below
+    auto pending = std::make_shared<pending_upload>();
+    std::unique_lock filling(pending->mutex);
+
+    const bool oversized = inline_total > options_.max_inline_bytes;
+    const auto usable_until =
+        std::chrono::system_clock::now() + options_.expiry_margin;
+    const auto now = std::chrono::steady_clock::now();
+
+    std::vector<std::pair<size_t, uploaded_file>> found;
+    std::vector<const candidate *> starting;
+    {
+        std::lock_guard lock(mutex_);
+        for (const auto &image : images) {
+            if (auto it = files_.find(image.hash); it != files_.end()) {
+                if (it->second.expires > usable_until) {
+                    found.emplace_back(image.part, it->second);
+                    stats_.references++;
+                    stats_.bytes_saved += image.inline_bytes;
+                    continue;
+                }
+                files_.erase(it);
+            }
+
+            if (count_use(image.hash, now) < options_.min_uses && !oversized)
+                continue;
+
+            // registered under the lock, so no upload can finish unseen
+            auto [waiting, first] = uploading_.try_emplace(image.hash);
+            if (first)
+                starting.push_back(&image);
+            pending->outstanding++;
+            waiting->second.push_back(
+                [pending, part = image.part](
+                    const std::optional<uploaded_file> &file) {
+                    pending->resolve(part, file);
+                });
+        }
+    }
+
+    // nothing to rewrite, so nothing to copy
+    if (found.empty() && pending->outstanding == 1) {
+        filling.unlock();
+        ready(request, nullptr);
+        return;
+    }
+
+    pending->original = std::make_shared<const google_request>(request);
+    pending->request = request;
+    pending->ready = std::move(ready);
+    for (const auto &[part, file] : found)
+        reference(pending->request.parts[part], file);
+    pending->referenced = found.size();
+    filling.unlock();
+
+    for (const auto *image : starting)
+        upload(*image, api_key, transport, options);
+    pending->resolve(std::nullopt, std::nullopt);
+}
+
+//
+// uploading
+//
+
+class FileFields : public JsonFieldReader
+{
+  public:
+    explicit FileFields(uploaded_file &file) : file_(file) {}
+
+    std::string state;
+    std::string expiration;
+
+  private:
+    // the upload answers {"file": {...}}, a lookup with the file itself
+    bool field(std::string_view name) const
+    {
+        return at({"file", name}) || at({name});
+    }
+
+    void on_string(std::string &value) override
+    {
+        if (field("name"))
+            file_.name = std::move(value);
+        else if (field("uri"))
+            file_.uri = std::move(value);
+        else if (field("mimeType"))
+            file_.mime_type = std::move(value);
+        else if (field("state"))
+            state = std::move(value);
+        else if (field("expirationTime"))
+            expiration = std::move(value);
+    }
+
+    uploaded_file &file_;
+};
+
+// "2025-01-03T12:00:00.123456Z"; files are kept for 48 hours, which is
+// what is assumed when the time is missing or unreadable
+static std::chrono::system_clock::time_point
+expiry_of(const std::string &text)
+{
+    using namespace std::chrono;
+    int year, month, day, hour, minute, second;
+    if (std::sscanf(text.c_str(), "%d-%d-%dT%d:%d:%d", &year, &month, &day,
+                    &hour, &minute, &second) != 6)
+        return system_clock::now() + hours(48);
+
+    year_month_day date{std::chrono::year(year),
+                        std::chrono::month(unsigned(month)),
+                        std::chrono::day(unsigned(day))};
+    if (!date.ok())
+        return system_clock::now() + hours(48);
+    return sys_days(date) + hours(hour) + minutes(minute) + seconds(second);
+}
+
+static std::optional<uploaded_file>
+read_upload(const curl_helpers::http_response &http)
+{
+    if (!http.error.empty() || http.http_code < 200 || http.http_code >= 300)
+        return std::nullopt;
+
+    uploaded_file file;
+    FileFields fields(file);
+    std::string error;
+    if (!fields.read(http.body, error) || file.uri.empty())
+        return std::nullopt;
+    // images are usable at once; anything still processing is not yet
+    if (!fields.state.empty() && fields.state != "ACTIVE")
+        return std::nullopt;
+
+    file.expires = expiry_of(fields.expiration);
+    return file;
+}
+
+static std::string boundary()
+{
+    static thread_local std::mt19937_64 random{std::random_device{}()};
+    char text[40];
+    std::snprintf(text, sizeof(text), "setman-%016llx%016llx",
+                  static_cast<unsigned long long>(random()),
+                  static_cast<unsigned long long>(random()));
+    return text;
+}
+
+// one multipart request: the file's metadata, then its bytes
+void FileUploads::upload(const candidate &image, const std::string &api_key,
+                         Transport &transport, const call_options &options)
+{
+    const content &part = *image.source;
+    const std::string separator = boundary();
+
+    JsonWriter metadata(96);
+    metadata.begin_object()
+        .key("file")
+        .begin_object()
+        .field("display_name", "setman-" + image.hash)
+        .end_object()
+        .end_object();
+
+    curl_helpers::RequestBody body;
+    body.append("--" + separator +
+                "\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n" +
+                metadata.take() + "\r\n--" + separator +
+                "\r\nContent-Type: " + part.mime_type + "\r\n\r\n");
+    if (part.stream) {
+        body.append(curl_helpers::stream_from(
+            Base64Decoding(*part.stream, image.bytes)));
+    } else {
+        std::string bytes(materials::b64_decoded_size(part.data.size()), '\0');
+        auto decoded = materials::b64_decode(
+            part.data.data(), part.data.size(),
+            reinterpret_cast<unsigned char *>(bytes.data()));
+        if (!decoded) {
+            finish_upload(image.hash, std::nullopt, 0, 0);
+            return;
+        }
+        bytes.resize(*decoded);
+        body.append(std::move(bytes));
+    }
+    body.append("\r\n--" + separator + "--\r\n");
+
+    http_request http{
+        .url = options_.endpoint + "?key=" + api_key,
+        .headers = {"X-Goog-Upload-Protocol: multipart",
+                    "Content-Type: multipart/related; boundary=" + separator},
+        .stream = std::move(body),
+        .options = {.cancel = options.cancel, .deadline = options.deadline}};
+
+    transport.submit(
+        std::move(http),
+        [self = shared_from_this(), hash = image.hash, bytes = image.bytes,
+         inline_bytes = image.inline_bytes](curl_helpers::http_response r) {
+            self->finish_upload(hash, read_upload(r), bytes, inline_bytes);
+        });
+}
+
+void FileUploads::finish_upload(const std::string &hash,
+                                std::optional<uploaded_file> file,
+                                size_t bytes, size_t inline_bytes)
+{
+    std::vector<waiter> waiting;
+    {
+        std::lock_guard lock(mutex_);
+        if (auto it = uploading_.find(hash); it != uploading_.end()) {
+            waiting = std::move(it->second);
+            uploading_.erase(it);
+        }
+
+        if (file) {
+            // expired uploads go as new ones come in, not only when an
+            // image that had one is sent again
+            const auto usable_until =
+                std::chrono::system_clock::now() + options_.expiry_margin;
+            std::erase_if(files_, [&](const auto &entry) {
+                return entry.second.expires <= usable_until;
+            });
+            files_[hash] = *file;
+            stats_.uploads++;
+            stats_.bytes_uploaded += bytes;
+            stats_.references += waiting.size();
+            stats_.bytes_saved += waiting.size() * inline_bytes;
+        } else {
+            // counted afresh, so a failure is not retried on every send
+            uses_.erase(hash);
+            stats_.failed_uploads++;
+        }
+    }
+
+    for (auto &wake : waiting)
+        wake(file);
+}
+
+// an image not sent again within the window starts counting over, and
+// the counts of such images are dropped whenever the table has doubled
+size_t FileUploads::count_use(const std::string &hash,
+                              std::chrono::steady_clock::time_point now)
+{
+    if (uses_.size() >= prune_uses_at_ && !uses_.contains(hash)) {
+        std::erase_if(uses_, [&](const auto &entry) {
+            return now - entry.second.last > options_.use_window;
+        });
+        prune_uses_at_ = std::max(min_prune_uses, uses_.size() * 2);
+    }
+
+    use_count &use = uses_[hash];
+    if (use.count > 0 && now - use.last > options_.use_window)
+        use.count = 0;
+    use.last = now;
+    return ++use.count;
+}
+
+void FileUploads::forget(const std::string &uri)
+{
+    std::lock_guard lock(mutex_);
+    std::erase_if(files_,
+                  [&](const auto &entry) { return entry.second.uri == uri; });
+}
+
+std::optional<uploaded_file> FileUploads::find(const std::string &hash) const
+{
+    std::lock_guard lock(mutex_);
+    if (auto it = files_.find(hash); it != files_.end())
+        return it->second;
+    return std::nullopt;
+}
+
+FileUploads::stats FileUploads::statistics() const
+{
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+} // namespace setman::ai
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "curl_helpers.hpp"
+#include "transport.hpp"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace setman::ai
+{
+
+struct google_request;
+
+struct file_upload_options {
+    // "?key=" and the api key are appended
+    std::string endpoint =
+        "https://generativelanguage.googleapis.com/upload/v1beta/files";
+    // smaller images, in base64, stay inline: another round trip costs
+    // more than sending them again
+    size_t min_bytes = 64 * 1024;
+    // how many times an image is sent before it is uploaded. 1 uploads
+    // everything large enough, even if it is never asked about again.
+    size_t min_uses = 2;
+    // sends of an image further apart than this are not counted together
+    std::chrono::minutes use_window{60};
+    // requests carrying more inline data than this upload all of it
+    // regardless; gemini refuses requests over 20 MB
+    size_t max_inline_bytes = 16 << 20;
+    // uploads are no longer referenced this long before they expire, so
+    // none runs out while a request is on its way
+    std::chrono::minutes expiry_margin{10};
+};
+
+struct uploaded_file {
+    std::string name; // "files/..."
+    std::string uri;
+    std::string mime_type;
+    std::chrono::system_clock::time_point expires;
+};
+
+// uploads the inline images of google requests through the gemini files
+// api and has later requests carrying the same image reference the upload
+// instead of sending it again. images are known by a hash of their base64,
+// so the same sheet read from disk twice is still one upload; the upload
+// itself is the decoded bytes, a quarter smaller. thread safe; owned by a
+// shared_ptr, which uploads in flight hold on to.
+class FileUploads : public std::enable_shared_from_this<FileUploads>
+{
+  public:
+    explicit FileUploads(file_upload_options options = {})
+        : options_(std::move(options))
+    {
+    }
+
+    // `original` is null when nothing was rewritten
+    using prepared =
+        std::function<void(const google_request &request,
+                           std::shared_ptr<const google_request> original)>;
+
+    // hands `ready` the request to send, with every inline image that has
+    // an upload, or that is worth one now, referenced by its uri. images
+    // that fail to upload stay inline. `ready` runs on this thread when
+    // nothing has to be uploaded first, on the transport thread otherwise.
+    void prepare(const google_request &request, const std::string &api_key,
+                 Transport &transport, const call_options &options,
+                 prepared ready);
+
+    // after the server has said the file is gone
+    void forget(const std::string &uri);
+
+    std::optional<uploaded_file> find(const std::string &hash) const;
+
+    struct stats {
+        size_t uploads = 0;
+        size_t failed_uploads = 0;
+        size_t references = 0; // inline images sent as a uri instead
+        size_t bytes_uploaded = 0;
+        size_t bytes_saved = 0; // base64 left out of requests
+    };
+    stats statistics() const;
+
+  private:
+    struct candidate;
+    using waiter = std::function<void(const std::optional<uploaded_file> &)>;
+
+    void upload(const candidate &image, const std::string &api_key,
+                Transport &transport, const call_options &options);
+    void finish_upload(const std::string &hash,
+                       std::optional<uploaded_file> file, size_t bytes,
+                       size_t inline_bytes);
+    size_t count_use(const std::string &hash,
+                     std::chrono::steady_clock::time_point now);
+
+    struct use_count {
+        size_t count = 0;
+        std::chrono::steady_clock::time_point last;
+    };
+    static constexpr size_t min_prune_uses = 1024;
+
+    file_upload_options options_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, uploaded_file> files_; // by hash
+    std::unordered_map<std::string, use_count> uses_; // by hash
+    size_t prune_uses_at_ = min_prune_uses;
+    std::unordered_map<std::string, std::vector<waiter>> uploading_;
+    stats stats_;
+};
+
+} // namespace setman::ai
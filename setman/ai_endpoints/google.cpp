@@ -1,29 +1,26 @@
 #include "google.hpp"
 #include "curl_helpers.hpp"
+#include "json_fields.hpp"
+#include "json_writer.hpp"
 #include <curl/curl.h>
 
 namespace setman::ai
 {
 
-std::unique_ptr<GoogleClient> new_google_client(const std::string &key)
+std::unique_ptr<GoogleClient>
+new_google_client(const std::string &key, std::shared_ptr<Transport> transport)
 {
-    CURL *curl = curl_easy_init();
-    if (!curl)
+    if (!transport)
         return nullptr;
 
-    return std::make_unique<GoogleClient>(key, curl);
+    return std::make_unique<GoogleClient>(key, std::move(transport));
 }
 
-GoogleClient::GoogleClient(const std::string &api_key, CURL *curl)
-    : api_key_(api_key), curl_(curl), headers_(nullptr)
+GoogleClient::GoogleClient(const std::string &api_key,
+                           std::shared_ptr<Transport> transport)
+    : api_key_(api_key), transport_(std::move(transport)),
+      headers_({"Content-Type: application/json"})
 {
-    headers_ = curl_helpers::add_json_header(headers_);
-}
-
-GoogleClient::~GoogleClient()
-{
-    if (headers_)
-        curl_slist_free_all(headers_);
 }
 
 google_request &google_request::add_text(const std::string &text)
@@ -47,6 +44,18 @@ google_request::add_inline_image(const std::string &base64_data,
     return *this;
 }
 
+google_request &
+google_request::add_inline_image(curl_helpers::data_stream base64_stream,
+                                 const std::string &mime_type)
+{
+    content part;
+    part.part_type = content_type::inline_image;
+    part.stream = std::move(base64_stream);
+    part.mime_type = mime_type;
+    parts.push_back(part);
+    return *this;
+}
+
 google_request &google_request::add_file_uri(const std::string &file_uri,
                                              const std::string &mime_type)
 {
@@ -102,187 +111,471 @@ google_request &google_request::set_candidate_count(int count)
     return *this;
 }
 
-json google_request::to_json() const
+google_request &
+google_request::set_response_mime_type(const std::string &mime_type)
 {
-    json payload;
+    response_mime_type = mime_type;
+    return *this;
+}
+
+google_request &google_request::set_response_schema(const std::string &schema)
+{
+    response_schema = schema;
+    return *this;
+}
 
-    json parts_array = json::array();
+bool google_request::is_streamed() const
+{
     for (const auto &part : parts) {
-        json part_obj;
+        if (part.stream)
+            return true;
+    }
+    return false;
+}
+
+// with a body, the document written so far goes into it at each streamed
+// part, followed by the stream in place of the data. without one streamed
+// data is left empty. what is left of the document is returned.
+static std::string write_request(const google_request &req,
+                                 curl_helpers::RequestBody *body)
+{
+    size_t size = 256;
+    for (const auto &part : req.parts)
+        size += part.text_content.size() + part.data.size() + 64;
+
+    JsonWriter out(size);
+    out.begin_object().key("contents").begin_array().begin_object();
 
+    out.key("parts").begin_array();
+    for (const auto &part : req.parts) {
+        out.begin_object();
         switch (part.part_type) {
         case content_type::text:
-            part_obj["text"] = part.text_content;
+            out.field("text", part.text_content);
             break;
 
         case content_type::inline_image:
-            part_obj["inline_data"] = {{"mime_type", part.mime_type},
-                                       {"data", part.data}};
+            out.key("inline_data").begin_object().key("data");
+            if (!part.stream) {
+                out.value(part.data);
+            } else if (!body) {
+                out.value("");
+            } else {
+                body->append(out.take_open_string());
+                body->append(*part.stream);
+            }
+            out.field("mime_type", part.mime_type).end_object();
             break;
 
         case content_type::file_uri:
-            part_obj["file_data"] = {{"mime_type", part.mime_type},
-                                     {"file_uri", part.data}};
+            out.key("file_data")
+                .begin_object()
+                .field("file_uri", part.data)
+                .field("mime_type", part.mime_type)
+                .end_object();
             break;
         }
-
-        parts_array.push_back(part_obj);
+        out.end_object();
+    }
+    out.end_array().end_object().end_array();
+
+    bool configured = req.temperature || req.max_tokens || req.top_p ||
+                      req.top_k || req.candidate_count ||
+                      !req.stop_sequences.empty() ||
+                      req.response_mime_type || req.response_schema;
+    if (configured) {
+        out.key("generationConfig")
+            .begin_object()
+            .field("candidateCount", req.candidate_count)
+            .field("maxOutputTokens", req.max_tokens)
+            .field("responseMimeType", req.response_mime_type);
+        if (req.response_schema)
+            out.key("responseSchema").literal(*req.response_schema);
+        if (!req.stop_sequences.empty())
+            out.field("stopSequences", req.stop_sequences);
+        out.field("temperature", req.temperature)
+            .field("topK", req.top_k)
+            .field("topP", req.top_p)
+            .end_object();
     }
 
-    payload["contents"] = json::array();
-    payload["contents"].push_back({{"parts", parts_array}});
-
-    json gen_config;
-    if (temperature.has_value())
-        gen_config["temperature"] = *temperature;
-    if (max_tokens.has_value())
-        gen_config["maxOutputTokens"] = *max_tokens;
-    if (top_p.has_value())
-        gen_config["topP"] = *top_p;
-    if (top_k.has_value())
-        gen_config["topK"] = *top_k;
-    if (candidate_count.has_value())
-        gen_config["candidateCount"] = *candidate_count;
-    if (!stop_sequences.empty())
-        gen_config["stopSequences"] = stop_sequences;
-
-    if (!gen_config.empty())
-        payload["generationConfig"] = gen_config;
-
-    if (!safety_settings.empty()) {
-        json safety_array = json::array();
-        for (const auto &setting : safety_settings) {
-            safety_array.push_back({{"category", setting.category},
-                                    {"threshold", setting.threshold}});
+    if (!req.safety_settings.empty()) {
+        out.key("safetySettings").begin_array();
+        for (const auto &setting : req.safety_settings) {
+            out.begin_object()
+                .field("category", setting.category)
+                .field("threshold", setting.threshold)
+                .end_object();
         }
-        payload["safetySettings"] = safety_array;
+        out.end_array();
     }
 
-    return payload;
+    out.end_object();
+    return out.take();
 }
 
-google_response GoogleClient::send(const google_request &req)
+curl_helpers::RequestBody google_request::to_body() const
 {
-    std::string url =
-        req.endpoint + req.model + ":generateContent?key=" + api_key_;
-
-    auto http_resp =
-        curl_helpers::post_json(curl_, url, req.to_json(), headers_);
-
-    if (!http_resp.error.empty()) {
-        return {.content = {},
-                .valid = false,
-                .error = "[CURL ERROR] " + http_resp.error,
-                .raw_json = ""};
-    }
+    curl_helpers::RequestBody body;
+    body.append(write_request(*this, &body));
+    return body;
+}
 
-    return google_response::parse(http_resp.body, http_resp.http_code);
+std::string google_request::serialize() const
+{
+    return write_request(*this, nullptr);
 }
 
-google_response google_response::parse(const std::string &raw, long http_code)
+google_response GoogleClient::send(const google_request &req)
 {
-    google_response result;
-    result.raw_json = raw;
-    result.valid = false;
+    return send_async(req).get();
+}
 
-    if (http_code != 200) {
-        result.error = "[HTTP CODE " + std::to_string(http_code) + "]";
-        return result;
-    }
+// what sending takes from the client, copied so a request that waited
+// for an upload goes out the same way later on the transport thread
+struct google_sender {
+    Transport *transport;
+    std::string api_key;
+    std::vector<std::string> headers;
+    std::shared_ptr<ResponseCache> cache;
+};
+
+// gemini counts an image as 258 tokens, or that per tile of a large one,
+// which its size in base64 does not tell
+static constexpr double image_tokens = 258;
 
-    json parsed;
-    try {
-        parsed = json::parse(raw);
-    } catch (json::exception &e) {
-        result.error = std::string("[JSON ERROR] ") + e.what();
-        return result;
+static request_cost cost_of(const google_request &req)
+{
+    size_t text = 0;
+    double images = 0;
+    for (const auto &part : req.parts) {
+        if (part.part_type == content_type::text)
+            text += part.text_content.size();
+        else
+            images += image_tokens;
     }
+    return {.tokens =
+                estimated_tokens(text) + images + req.max_tokens.value_or(0)};
+}
 
-    if (parsed.contains("promptFeedback")) {
-        const auto &feedback = parsed["promptFeedback"];
-        if (feedback.contains("blockReason")) {
-            result.prompt_feedback = feedback["blockReason"].get<std::string>();
-            result.error =
-                "[GOOGLE] Prompt blocked: " + *result.prompt_feedback;
-            return result;
+static void post(const google_sender &via, const google_request &req,
+                 GoogleClient::callback done, const call_options &options)
+{
+    std::string url =
+        req.endpoint + req.model + ":generateContent?key=" + via.api_key;
+
+    // gemini's limits are per model
+    http_request http{.url = url,
+                      .headers = via.headers,
+                      .options = options,
+                      .rate_key = std::string(host_of(req.endpoint)) + "/" +
+                                  req.model,
+                      .cost = cost_of(req)};
+    if (req.is_streamed())
+        http.stream = req.to_body();
+    else
+        http.body = req.serialize();
+
+    std::string key;
+    if (via.cache && options.use_cache) {
+        // a copy reads its streams from the start without disturbing them
+        key = http.stream ? fingerprint(url, *http.stream)
+                          : fingerprint(url, http.body);
+        if (auto body = via.cache->get(key)) {
+            done(google_response::parse(*body, 200,
+                                        options.keep_raw_json));
+            return;
         }
     }
 
-    if (!parsed.contains("candidates")) {
-        result.error = "[GOOGLE] Missing 'candidates' field in response";
-        return result;
+    // completions run on the transport's own thread, so a plain pointer
+    // to it stays valid there
+    via.transport->submit(
+        std::move(http),
+        [done = std::move(done), cache = via.cache, key,
+         keep_raw = options.keep_raw_json,
+         transport = via.transport](curl_helpers::http_response r) {
+            auto response = google_response::from_http(r, keep_raw);
+            if (cache && !key.empty() && response.valid)
+                cache->put(key, std::move(r.body));
+            transport->recycle(std::move(r.body));
+            done(std::move(response));
+        });
+}
+
+// the status and message of an error body
+class ErrorFields : public JsonFieldReader
+{
+  public:
+    std::string status;
+    std::string message;
+
+  private:
+    void on_string(std::string &value) override
+    {
+        if (at({"error", "status"}))
+            status = std::move(value);
+        else if (at({"error", "message"}))
+            message = std::move(value);
     }
+};
+
+// the uploads among `uris` a refusal says are gone. the files api answers
+// PERMISSION_DENIED for files that expired or were deleted and NOT_FOUND
+// for ones it never heard of, and names the file either way; any other
+// refusal is about the request itself and is not retried.
+static std::vector<std::string>
+missing_files(const google_response &response,
+              const std::vector<std::string> &uris)
+{
+    if (response.http_code != 403 && response.http_code != 404)
+        return {};
+
+    ErrorFields fields;
+    std::string error;
+    if (!fields.read(response.raw_json, error) ||
+        (fields.status != "PERMISSION_DENIED" && fields.status != "NOT_FOUND"))
+        return {};
+
+    std::vector<std::string> missing;
+    for (const auto &uri : uris) {
+        std::string_view id(uri);
+        id.remove_prefix(id.rfind('/') + 1);
+        if (!id.empty() && fields.message.find(id) != std::string::npos)
+            missing.push_back(uri);
+    }
+    return missing;
+}
 
-    const auto &candidates = parsed["candidates"];
-    if (!candidates.is_array() || candidates.empty()) {
-        result.error = "[GOOGLE] 'candidates' field is empty or not an array";
-        return result;
+void GoogleClient::send(const google_request &req, callback done,
+                        const call_options &options)
+{
+    google_sender via{transport_.get(), api_key_, headers_, cache_};
+    if (!uploads_) {
+        post(via, req, std::move(done), options);
+        return;
     }
 
-    for (size_t i = 0; i < candidates.size(); i++) {
-        const auto &candidate = candidates[i];
+    uploads_->prepare(
+        req, api_key_, *transport_, options,
+        [via, done = std::move(done), options, uploads = uploads_](
+            const google_request &ready,
+            std::shared_ptr<const google_request> original) mutable {
+            if (!original) {
+                post(via, ready, std::move(done), options);
+                return;
+            }
 
-        if (i == 0 && candidate.contains("finishReason")) {
-            result.finish_reason = candidate["finishReason"].get<std::string>();
-        }
+            std::vector<std::string> uris;
+            for (const auto &part : ready.parts) {
+                if (part.part_type == content_type::file_uri)
+                    uris.push_back(part.data);
+            }
 
-        if (i == 0 && candidate.contains("safetyRatings")) {
-            const auto &ratings = candidate["safetyRatings"];
-            if (ratings.is_array()) {
-                for (const auto &rating : ratings) {
-                    if (rating.contains("category") &&
-                        rating.contains("probability")) {
-                        result.safety_ratings.push_back(
-                            {rating["category"].get<std::string>(),
-                             rating["probability"].get<std::string>()});
-                    }
+            // an upload that is gone is sent inline again, once
+            auto retry_inline = [via, done = std::move(done), options,
+                                 uploads, original, uris = std::move(uris)](
+                                    google_response response) mutable {
+                auto missing = missing_files(response, uris);
+                if (missing.empty()) {
+                    done(std::move(response));
+                    return;
                 }
-            }
-        }
+                for (const auto &uri : missing)
+                    uploads->forget(uri);
+                post(via, *original, std::move(done), options);
+            };
+            post(via, ready, std::move(retry_inline), options);
+        });
+}
 
-        if (!candidate.contains("content") ||
-            !candidate["content"].contains("parts")) {
-            result.error = "[GOOGLE] Candidate missing content or parts";
-            return result;
-        }
+std::future<google_response>
+GoogleClient::send_async(const google_request &req, const call_options &options)
+{
+    return as_future<google_response>(
+        [&](callback done) { send(req, std::move(done), options); });
+}
 
-        const auto &parts = candidate["content"]["parts"];
-        if (!parts.is_array()) {
-            result.error = "[GOOGLE] Parts is not an array";
-            return result;
-        }
+google_response
+google_response::from_http(const curl_helpers::http_response &http,
+                           bool keep_raw)
+{
+    if (!http.error.empty()) {
+        return {.content = {},
+                .valid = false,
+                .error = "[CURL ERROR] " + http.error,
+                .raw_json = ""};
+    }
 
-        std::string full_text;
-        for (const auto &part : parts) {
-            if (part.contains("text")) {
-                full_text += part["text"].get<std::string>();
-            }
-        }
+    return parse(http.body, http.http_code, keep_raw);
+}
 
-        if (!full_text.empty()) {
-            result.content.push_back(full_text);
-        }
+class GoogleFields : public JsonFieldReader
+{
+  public:
+    explicit GoogleFields(google_response &result) : result_(result) {}
+
+    std::optional<std::string> problem();
+
+  private:
+    struct candidate {
+        bool has_parts = false;
+        bool parts_array = false;
+        std::string text;
+    };
+
+    candidate &current_candidate();
+
+    void on_begin(bool array) override;
+    void on_end(bool array) override;
+    void on_string(std::string &value) override;
+    void on_integer(int64_t value) override;
+    void on_other() override;
+    void wrong_type();
+
+    google_response &result_;
+    std::optional<std::string> block_reason_;
+    bool has_candidates_ = false;
+    bool candidates_array_ = false;
+    std::vector<candidate> candidates_;
+    safety_rating rating_;
+    bool has_category_ = false;
+    bool has_probability_ = false;
+};
+
+// every element of candidates takes a slot, objects or not, so one that
+// is not an object is reported as missing its parts
+GoogleFields::candidate &GoogleFields::current_candidate()
+{
+    if (index(1) >= candidates_.size())
+        candidates_.resize(index(1) + 1);
+    return candidates_[index(1)];
+}
+
+void GoogleFields::on_begin(bool array)
+{
+    if (at({"candidates"})) {
+        has_candidates_ = true;
+        candidates_array_ = array;
+    } else if (at({"candidates", "#"})) {
+        current_candidate();
+    } else if (at({"candidates", "#", "content", "parts"})) {
+        current_candidate().has_parts = true;
+        current_candidate().parts_array = array;
+    } else if (at({"candidates", "#", "safetyRatings", "#"})) {
+        has_category_ = has_probability_ = false;
     }
+}
 
-    if (parsed.contains("usageMetadata")) {
-        const auto &usage = parsed["usageMetadata"];
+void GoogleFields::on_end(bool array)
+{
+    if (at({"candidates", "#", "safetyRatings", "#"}) && index(1) == 0 &&
+        has_category_ && has_probability_)
+        result_.safety_ratings.push_back(std::move(rating_));
+}
 
-        if (usage.contains("promptTokenCount") &&
-            usage["promptTokenCount"].is_number_integer()) {
-            result.prompt_tokens = usage["promptTokenCount"].get<int>();
-        }
+void GoogleFields::on_string(std::string &value)
+{
+    if (at({"candidates", "#", "content", "parts", "#", "text"})) {
+        auto &text = current_candidate().text;
+        if (text.empty())
+            text = std::move(value);
+        else
+            text += value;
+    } else if (at({"candidates", "#", "finishReason"})) {
+        if (index(1) == 0)
+            result_.finish_reason = std::move(value);
+    } else if (at({"candidates", "#", "safetyRatings", "#", "category"})) {
+        rating_.category = std::move(value);
+        has_category_ = true;
+    } else if (at({"candidates", "#", "safetyRatings", "#", "probability"})) {
+        rating_.probability = std::move(value);
+        has_probability_ = true;
+    } else if (at({"promptFeedback", "blockReason"})) {
+        block_reason_ = std::move(value);
+    } else {
+        wrong_type();
+    }
+}
 
-        if (usage.contains("candidatesTokenCount") &&
-            usage["candidatesTokenCount"].is_number_integer()) {
-            result.candidates_tokens = usage["candidatesTokenCount"].get<int>();
-        }
+void GoogleFields::on_integer(int64_t value)
+{
+    if (at({"usageMetadata", "promptTokenCount"}))
+        result_.prompt_tokens = static_cast<int>(value);
+    else if (at({"usageMetadata", "candidatesTokenCount"}))
+        result_.candidates_tokens = static_cast<int>(value);
+    else if (at({"usageMetadata", "totalTokenCount"}))
+        result_.total_tokens = static_cast<int>(value);
+    else
+        wrong_type();
+}
 
-        if (usage.contains("totalTokenCount") &&
-            usage["totalTokenCount"].is_number_integer()) {
-            result.total_tokens = usage["totalTokenCount"].get<int>();
-        }
+void GoogleFields::on_other() { wrong_type(); }
+
+// candidates or parts that are not arrays, or a candidate that is not an
+// object
+void GoogleFields::wrong_type()
+{
+    if (at({"candidates"}))
+        has_candidates_ = true;
+    else if (at({"candidates", "#"}))
+        current_candidate();
+    else if (at({"candidates", "#", "content", "parts"}))
+        current_candidate().has_parts = true;
+}
+
+// moves the candidates' text into the response once they all check out
+std::optional<std::string> GoogleFields::problem()
+{
+    if (block_reason_) {
+        result_.prompt_feedback = block_reason_;
+        return "[GOOGLE] Prompt blocked: " + *block_reason_;
+    }
+    if (!has_candidates_)
+        return "[GOOGLE] Missing 'candidates' field in response";
+    if (!candidates_array_ || candidates_.empty())
+        return "[GOOGLE] 'candidates' field is empty or not an array";
+
+    for (const auto &c : candidates_) {
+        if (!c.has_parts)
+            return "[GOOGLE] Candidate missing content or parts";
+        if (!c.parts_array)
+            return "[GOOGLE] Parts is not an array";
     }
 
+    for (auto &c : candidates_) {
+        if (!c.text.empty())
+            result_.content.push_back(std::move(c.text));
+    }
+    return std::nullopt;
+}
+
+google_response google_response::parse(std::string_view raw, long http_code,
+                                       bool keep_raw)
+{
+    google_response result;
+    result.http_code = http_code;
+    result.valid = false;
+
+    // failures keep the body either way; it is all there is to go on
+    auto fail = [&](std::string error) {
+        result.error = std::move(error);
+        result.raw_json = raw;
+        return std::move(result);
+    };
+
+    if (http_code != 200)
+        return fail("[HTTP CODE " + std::to_string(http_code) + "]");
+
+    GoogleFields fields(result);
+    std::string error;
+    if (!fields.read(raw, error))
+        return fail("[JSON ERROR] " + error);
+    if (auto problem = fields.problem())
+        return fail(std::move(*problem));
+
+    if (keep_raw)
+        result.raw_json = raw;
     result.valid = true;
     return result;
 }
@@ -1,9 +1,16 @@
 #pragma once
 
-#include <curl/curl.h>
+#include "curl_helpers.hpp"
+#include "file_uploads.hpp"
+#include "response_cache.hpp"
+#include "transport.hpp"
+#include <functional>
+#include <future>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using nlohmann::json;
@@ -18,6 +25,7 @@ struct content {
     std::string text_content;
     std::string mime_type;
     std::string data;
+    std::optional<curl_helpers::data_stream> stream; // sent instead of data
 };
 
 struct safety_setting {
@@ -42,10 +50,17 @@ struct google_request {
     std::optional<int> top_k;
     std::optional<int> candidate_count;
     std::vector<std::string> stop_sequences;
+    // "application/json" asks for json output, shaped by response_schema
+    // when given, itself json in gemini's openapi subset
+    std::optional<std::string> response_mime_type;
+    std::optional<std::string> response_schema;
 
     google_request &add_text(const std::string &text);
     google_request &add_inline_image(const std::string &base64_data,
                                      const std::string &mime_type = "image/jpeg");
+    // base64 produced while the request is sent, e.g. by B64Stream
+    google_request &add_inline_image(curl_helpers::data_stream base64_stream,
+                                     const std::string &mime_type = "image/jpeg");
     google_request &add_file_uri(const std::string &file_uri,
                                  const std::string &mime_type = "image/jpeg");
     google_request &add_safety_setting(const std::string &category,
@@ -56,8 +71,14 @@ struct google_request {
     google_request &set_top_p(double p);
     google_request &set_top_k(int k);
     google_request &set_candidate_count(int count);
-
-    json to_json() const;
+    google_request &set_response_mime_type(const std::string &mime_type);
+    google_request &set_response_schema(const std::string &schema);
+
+    // streamed parts serialize as empty data; to_body() has the streams
+    // read in their place
+    std::string serialize() const;
+    curl_helpers::RequestBody to_body() const;
+    bool is_streamed() const;
 };
 
 struct google_response {
@@ -65,6 +86,7 @@ struct google_response {
     bool valid;
     std::string error;
     std::string raw_json;
+    long http_code = 0; // 0 when the request never got an answer
 
     std::optional<std::string> prompt_feedback;
     std::optional<std::string> finish_reason;
@@ -73,25 +95,60 @@ struct google_response {
     std::optional<int> candidates_tokens;
     std::optional<int> total_tokens;
 
-    static google_response parse(const std::string &raw, long http_code);
+    // raw_json is only filled for successful responses when asked to
+    static google_response
+    parse(std::string_view raw, long http_code, bool keep_raw = false);
+    static google_response
+    from_http(const curl_helpers::http_response &http, bool keep_raw = false);
 };
 
 class GoogleClient
 {
   public:
-    GoogleClient(const std::string &api_key, CURL *curl);
-    ~GoogleClient();
+    GoogleClient(const std::string &api_key,
+                 std::shared_ptr<Transport> transport);
+
+    using callback = std::function<void(google_response)>;
 
+    // blocks until the response arrives
     google_response send(const google_request &request);
 
+    // return at once. callbacks run on the transport thread, so anything
+    // slow in them holds up every other request
+    void send(const google_request &request, callback done,
+              const call_options &options = {});
+    std::future<google_response>
+    send_async(const google_request &request,
+               const call_options &options = {});
+
     void set_api_key(const std::string &key) { api_key_ = key; }
 
+    // successful responses are remembered and answered from it until they
+    // expire, unless a call opts out. hits complete on the calling thread.
+    void set_cache(std::shared_ptr<ResponseCache> cache)
+    {
+        cache_ = std::move(cache);
+    }
+
+    // inline images sent again and again are uploaded once and referenced
+    // from then on. a request whose file the server no longer has is sent
+    // once more with the image inline.
+    void set_file_uploads(std::shared_ptr<FileUploads> uploads)
+    {
+        uploads_ = std::move(uploads);
+    }
+
   private:
     std::string api_key_;
-    CURL *curl_;
-    struct curl_slist *headers_;
+    std::shared_ptr<Transport> transport_;
+    std::vector<std::string> headers_;
+    std::shared_ptr<ResponseCache> cache_;
+    std::shared_ptr<FileUploads> uploads_;
 };
 
-std::unique_ptr<GoogleClient> new_google_client(const std::string &key);
+// null when no transport could be created
+std::unique_ptr<GoogleClient>
+new_google_client(const std::string &key,
+                  std::shared_ptr<Transport> transport = shared_transport());
 
 } // namespace setman::ai
@@ -0,0 +1,131 @@
+#include "json_fields.hpp"
+
+namespace setman::ai
+{
+
+bool JsonFieldReader::read(std::string_view text, std::string &error)
+{
+    depth_ = 0;
+    error_.clear();
+    if (json::sax_parse(text.begin(), text.end(), this))
+        return true;
+    error = error_.empty() ? "unreadable json" : error_;
+    return false;
+}
+
+bool JsonFieldReader::at(std::initializer_list<std::string_view> pattern) const
+{
+    if (pattern.size() != depth_)
+        return false;
+
+    size_t level = 0;
+    for (std::string_view part : pattern) {
+        const step &s = path_[level++];
+        if (s.array ? part != "#" : part != s.key)
+            return false;
+    }
+    return true;
+}
+
+// a value inside an array takes the next index before anything sees it
+void JsonFieldReader::element()
+{
+    if (depth_ > 0 && path_[depth_ - 1].array) {
+        step &s = path_[depth_ - 1];
+        s.index = s.next++;
+    }
+}
+
+bool JsonFieldReader::begin(bool array)
+{
+    element();
+    on_begin(array);
+
+    if (depth_ == path_.size())
+        path_.emplace_back();
+    step &s = path_[depth_++];
+    s.array = array;
+    s.index = 0;
+    s.next = 0;
+    s.key.clear();
+    return true;
+}
+
+bool JsonFieldReader::end()
+{
+    bool array = path_[--depth_].array;
+    on_end(array);
+    return true;
+}
+
+bool JsonFieldReader::null()
+{
+    element();
+    on_other();
+    return true;
+}
+
+bool JsonFieldReader::boolean(bool)
+{
+    element();
+    on_other();
+    return true;
+}
+
+bool JsonFieldReader::number_integer(number_integer_t value)
+{
+    element();
+    on_integer(value);
+    return true;
+}
+
+bool JsonFieldReader::number_unsigned(number_unsigned_t value)
+{
+    element();
+    on_integer(static_cast<int64_t>(value));
+    return true;
+}
+
+bool JsonFieldReader::number_float(number_float_t, const string_t &)
+{
+    element();
+    on_other();
+    return true;
+}
+
+bool JsonFieldReader::string(string_t &value)
+{
+    element();
+    on_string(value);
+    return true;
+}
+
+bool JsonFieldReader::binary(binary_t &)
+{
+    element();
+    on_other();
+    return true;
+}
+
+bool JsonFieldReader::start_object(std::size_t) { return begin(false); }
+
+bool JsonFieldReader::key(string_t &value)
+{
+    path_[depth_ - 1].key.assign(value);
+    return true;
+}
+
+bool JsonFieldReader::end_object() { return end(); }
+
+bool JsonFieldReader::start_array(std::size_t) { return begin(true); }
+
+bool JsonFieldReader::end_array() { return end(); }
+
+bool JsonFieldReader::parse_error(std::size_t, const std::string &,
+                                  const nlohmann::detail::exception &ex)
+{
+    error_ = ex.what();
+    return false;
+}
+
+} // namespace setman::ai
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using nlohmann::json;
+
+namespace setman::ai
+{
+
+// reads a json document as a stream of events instead of building it,
+// keeping track of where each value sits. subclasses pick out the fields
+// they read by path and let everything else pass by; strings they keep
+// can be moved out of the event.
+class JsonFieldReader : public nlohmann::json_sax<json>
+{
+  public:
+    // false, with `error` set, when the text is not json
+    bool read(std::string_view text, std::string &error);
+
+    // the sax interface read() drives
+    bool null() override;
+    bool boolean(bool value) override;
+    bool number_integer(number_integer_t value) override;
+    bool number_unsigned(number_unsigned_t value) override;
+    bool number_float(number_float_t value, const string_t &text) override;
+    bool string(string_t &value) override;
+    bool binary(binary_t &value) override;
+    bool start_object(std::size_t elements) override;
+    bool key(string_t &value) override;
+    bool end_object() override;
+    bool start_array(std::size_t elements) override;
+    bool end_array() override;
+    bool parse_error(std::size_t position, const std::string &token,
+                     const nlohmann::detail::exception &ex) override;
+
+  protected:
+    // whether the current value sits at `pattern`, a list of object keys
+    // in which "#" stands for any array index
+    bool at(std::initializer_list<std::string_view> pattern) const;
+    // the array index at `level` of the path, 0 being the outermost
+    size_t index(size_t level) const { return path_[level].index; }
+
+    virtual void on_string(std::string &value) {}
+    virtual void on_integer(int64_t value) {}
+    // null, booleans and floats
+    virtual void on_other() {}
+    // an object or array starts or ends at the current path
+    virtual void on_begin(bool array) {}
+    virtual void on_end(bool array) {}
+
+  private:
+    struct step {
+        bool array;
+        size_t index;
+        size_t next; // arrays: the index of the element to come
+        std::string key;
+    };
+
+    void element();
+    bool begin(bool array);
+    bool end();
+
+    // steps past depth_ are kept, so their keys' buffers are reused
+    std::vector<step> path_;
+    size_t depth_ = 0;
+    std::string error_;
+};
+
+} // namespace setman::ai
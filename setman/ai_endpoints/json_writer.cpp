@@ -0,0 +1,294 @@
+#include "json_writer.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace setman::ai
+{
+
+// whether none of eight bytes needs escaping or utf-8 checking: no
+// control characters, quotes, backslashes or bytes above 0x7F. a false
+// "no" after a real hit is harmless, the bytes are looked at one by one.
+static bool plain(const char *bytes)
+{
+    constexpr uint64_t ones = 0x0101010101010101ULL;
+    constexpr uint64_t highs = 0x8080808080808080ULL;
+
+    uint64_t x;
+    std::memcpy(&x, bytes, sizeof(x));
+    auto zero_byte = [&](uint64_t v) { return (v - ones) & ~v & highs; };
+
+    uint64_t special = (x & highs) | ((x - ones * 0x20) & ~x & highs) |
+                       zero_byte(x ^ (ones * '"')) |
+                       zero_byte(x ^ (ones * '\\'));
+    return special == 0;
+}
+
+// the length of the utf-8 sequence at `at`, or 0 if it is not a valid one
+static size_t sequence_length(std::string_view text, size_t at)
+{
+    auto byte = [&](size_t i) {
+        return at + i < text.size() ? static_cast<unsigned char>(text[at + i])
+                                    : 0;
+    };
+    auto continuation = [&](size_t i, unsigned char low = 0x80,
+                            unsigned char high = 0xBF) {
+        unsigned char c = byte(i);
+        return c >= low && c <= high;
+    };
+
+    unsigned char lead = byte(0);
+    if (lead >= 0xC2 && lead <= 0xDF)
+        return continuation(1) ? 2 : 0;
+    if (lead >= 0xE0 && lead <= 0xEF) {
+        // no overlong forms, no surrogates
+        bool second = lead == 0xE0   ? continuation(1, 0xA0)
+                      : lead == 0xED ? continuation(1, 0x80, 0x9F)
+                                     : continuation(1);
+        return second && continuation(2) ? 3 : 0;
+    }
+    if (lead >= 0xF0 && lead <= 0xF4) {
+        bool second = lead == 0xF0   ? continuation(1, 0x90)
+                      : lead == 0xF4 ? continuation(1, 0x80, 0x8F)
+                                     : continuation(1);
+        return second && continuation(2) && continuation(3) ? 4 : 0;
+    }
+    return 0;
+}
+
+static void write_string(std::string &out, std::string_view text)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+
+    out.push_back('"');
+    size_t run = 0; // the start of bytes that go out unchanged
+    size_t i = 0;
+    while (i < text.size()) {
+        if (i + 8 <= text.size() && plain(text.data() + i)) {
+            i += 8;
+            continue;
+        }
+
+        auto c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+            i++;
+            continue;
+        }
+        if (c >= 0x80) {
+            if (size_t length = sequence_length(text, i)) {
+                i += length;
+                continue;
+            }
+        }
+
+        out.append(text.substr(run, i - run));
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\b':
+            out += "\\b";
+            break;
+        case '\f':
+            out += "\\f";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c >= 0x80) {
+                out += "\xEF\xBF\xBD";
+            } else {
+                out += "\\u00";
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 0xF]);
+            }
+        }
+        run = ++i;
+    }
+    out.append(text.substr(run));
+    out.push_back('"');
+}
+
+void JsonWriter::separate()
+{
+    if (after_key_) {
+        after_key_ = false;
+        return;
+    }
+    if (first_.empty())
+        return;
+    if (first_.back())
+        first_.back() = false;
+    else
+        out_.push_back(',');
+}
+
+JsonWriter &JsonWriter::begin_object()
+{
+    separate();
+    out_.push_back('{');
+    first_.push_back(true);
+    return *this;
+}
+
+JsonWriter &JsonWriter::end_object()
+{
+    first_.pop_back();
+    out_.push_back('}');
+    return *this;
+}
+
+JsonWriter &JsonWriter::begin_array()
+{
+    separate();
+    out_.push_back('[');
+    first_.push_back(true);
+    return *this;
+}
+
+JsonWriter &JsonWriter::end_array()
+{
+    first_.pop_back();
+    out_.push_back(']');
+    return *this;
+}
+
+JsonWriter &JsonWriter::key(std::string_view name)
+{
+    separate();
+    write_string(out_, name);
+    out_.push_back(':');
+    after_key_ = true;
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(std::string_view text)
+{
+    separate();
+    write_string(out_, text);
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(bool flag)
+{
+    separate();
+    out_ += flag ? "true" : "false";
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(int64_t number)
+{
+    separate();
+    char buffer[24];
+    auto end = std::to_chars(buffer, buffer + sizeof(buffer), number).ptr;
+    out_.append(buffer, end);
+    return *this;
+}
+
+// the shortest digits that read back the same, laid out like
+// nlohmann::json does: plain decimals for exponents from -4 to 14, with
+// ".0" on whole numbers, and e+XX or e-XX outside them
+static void write_double(std::string &out, double number)
+{
+    if (std::signbit(number)) {
+        out.push_back('-');
+        number = -number;
+    }
+    if (number == 0) {
+        out += "0.0";
+        return;
+    }
+
+    // d[.ddd]e±x
+    char buffer[32];
+    auto end = std::to_chars(buffer, buffer + sizeof(buffer), number,
+                             std::chars_format::scientific)
+                   .ptr;
+    std::string_view text(buffer, end - buffer);
+    size_t e = text.find('e');
+    std::string digits(1, text[0]);
+    if (e > 1)
+        digits.append(text.substr(2, e - 2));
+
+    const char *exponent_at = buffer + e + 1;
+    if (*exponent_at == '+')
+        exponent_at++;
+    int exponent = 0;
+    std::from_chars(exponent_at, end, exponent);
+
+    // where the decimal point goes, counted in digits
+    const int k = static_cast<int>(digits.size());
+    const int n = exponent + 1;
+    if (k <= n && n <= 15) {
+        out += digits;
+        out.append(n - k, '0');
+        out += ".0";
+    } else if (0 < n && n <= 15) {
+        out.append(digits, 0, n);
+        out.push_back('.');
+        out.append(digits, n);
+    } else if (-4 < n && n <= 0) {
+        out += "0.";
+        out.append(-n, '0');
+        out += digits;
+    } else {
+        out.push_back(digits[0]);
+        if (k > 1) {
+            out.push_back('.');
+            out.append(digits, 1);
+        }
+        out.push_back('e');
+        out.push_back(n - 1 < 0 ? '-' : '+');
+        int magnitude = std::abs(n - 1);
+        if (magnitude < 10)
+            out.push_back('0');
+        out += std::to_string(magnitude);
+    }
+}
+
+JsonWriter &JsonWriter::value(double number)
+{
+    separate();
+    if (std::isfinite(number))
+        write_double(out_, number);
+    else
+        out_ += "null";
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(const std::vector<std::string> &texts)
+{
+    begin_array();
+    for (const auto &text : texts)
+        value(text);
+    return end_array();
+}
+
+JsonWriter &JsonWriter::literal(std::string_view text)
+{
+    separate();
+    out_ += text;
+    return *this;
+}
+
+std::string JsonWriter::take_open_string()
+{
+    separate();
+    out_.push_back('"');
+    std::string before = take();
+    out_ = "\"";
+    return before;
+}
+
+} // namespace setman::ai
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace setman::ai
+{
+
+// writes json text straight into a string, with no document in between.
+// keys go out in the order they are written: request writers use sorted
+// order, which is how nlohmann::json serializes objects, so bodies and
+// the cache fingerprints taken of them stay what they were. strings are
+// escaped the way nlohmann does it, except that invalid utf-8 becomes
+// U+FFFD instead of throwing. doubles get the shortest digits that read
+// back the same, where nlohmann once in a while has one digit more.
+class JsonWriter
+{
+  public:
+    explicit JsonWriter(size_t reserve = 0) { out_.reserve(reserve); }
+
+    JsonWriter &begin_object();
+    JsonWriter &end_object();
+    JsonWriter &begin_array();
+    JsonWriter &end_array();
+    JsonWriter &key(std::string_view name);
+
+    JsonWriter &value(std::string_view text);
+    JsonWriter &value(const char *text)
+    {
+        return value(std::string_view(text));
+    }
+    JsonWriter &value(bool flag);
+    JsonWriter &value(int number) { return value(int64_t(number)); }
+    JsonWriter &value(int64_t number);
+    JsonWriter &value(double number);
+    JsonWriter &value(const std::vector<std::string> &texts);
+    // a value that is json text already, written as it is
+    JsonWriter &literal(std::string_view text);
+
+    template <typename T> JsonWriter &field(std::string_view name, const T &v)
+    {
+        key(name);
+        return value(v);
+    }
+    // nothing at all for an empty optional
+    template <typename T>
+    JsonWriter &field(std::string_view name, const std::optional<T> &v)
+    {
+        if (v)
+            field(name, *v);
+        return *this;
+    }
+
+    // starts a string value whose contents come from elsewhere: returns
+    // the text up to and including its opening quote, and the writer
+    // carries on after the closing one
+    std::string take_open_string();
+
+    // the text so far, leaving the writer empty to carry on after it
+    std::string take()
+    {
+        std::string text = std::move(out_);
+        out_.clear();
+        return text;
+    }
+
+  private:
+    void separate();
+
+    std::string out_;
+    std::vector<bool> first_; // per open container, nothing written yet
+    bool after_key_ = false;
+};
+
+} // namespace setman::ai
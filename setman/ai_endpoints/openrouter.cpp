@@ -1,30 +1,29 @@
 #include "openrouter.hpp"
 #include "curl_helpers.hpp"
+#include "json_fields.hpp"
+#include "json_writer.hpp"
+#include "sse.hpp"
 #include <curl/curl.h>
 
 namespace setman::ai
 {
 
-std::unique_ptr<OpenRouterClient> new_openrouter_client(const std::string &key)
+std::unique_ptr<OpenRouterClient>
+new_openrouter_client(const std::string &key,
+                      std::shared_ptr<Transport> transport)
 {
-    CURL *curl = curl_easy_init();
-    if (!curl)
+    if (!transport)
         return nullptr;
 
-    return std::make_unique<OpenRouterClient>(key, curl);
+    return std::make_unique<OpenRouterClient>(key, std::move(transport));
 }
 
-OpenRouterClient::OpenRouterClient(const std::string &api_key, CURL *curl)
-    : api_key_(api_key), curl_(curl), headers_(nullptr)
+OpenRouterClient::OpenRouterClient(const std::string &api_key,
+                                   std::shared_ptr<Transport> transport)
+    : api_key_(api_key), transport_(std::move(transport)),
+      headers_({"Content-Type: application/json",
+                "Authorization: Bearer " + api_key_})
 {
-    headers_ = curl_helpers::add_json_header(headers_);
-    headers_ = curl_helpers::add_bearer_auth(headers_, api_key_);
-}
-
-OpenRouterClient::~OpenRouterClient()
-{
-    if (headers_)
-        curl_slist_free_all(headers_);
 }
 
 openrouter_request &openrouter_request::add_message(role r,
@@ -102,158 +101,559 @@ openrouter_request &openrouter_request::set_provider_order(
     return *this;
 }
 
-json openrouter_request::to_json() const
+static const char *role_name(role r)
 {
-    json payload;
-
-    if (models.has_value() && !models->empty()) {
-        payload["models"] = *models;
-    } else if (!model.empty()) {
-        payload["model"] = model;
+    switch (r) {
+    case role::system:
+        return "system";
+    case role::user:
+        return "user";
+    case role::assistant:
+        return "assistant";
+    case role::tool:
+        return "tool";
     }
+    return "";
+}
+
+std::string openrouter_request::serialize() const
+{
+    size_t size = 256 + model.size();
+    for (const auto &msg : messages)
+        size += msg.content.size() + 48;
 
-    json messages_array = json::array();
+    JsonWriter out(size);
+    out.begin_object()
+        .field("frequency_penalty", frequency_penalty)
+        .field("max_tokens", max_tokens);
+
+    out.key("messages").begin_array();
     for (const auto &msg : messages) {
-        json msg_obj;
-        switch (msg.role) {
-        case role::system:
-            msg_obj["role"] = "system";
-            break;
-        case role::user:
-            msg_obj["role"] = "user";
-            break;
-        case role::assistant:
-            msg_obj["role"] = "assistant";
-            break;
-        case role::tool:
-            msg_obj["role"] = "tool";
-            break;
-        }
-        msg_obj["content"] = msg.content;
-        messages_array.push_back(msg_obj);
+        out.begin_object()
+            .field("content", msg.content)
+            .field("role", role_name(msg.role))
+            .end_object();
     }
-    payload["messages"] = messages_array;
-
-    if (temperature.has_value())
-        payload["temperature"] = *temperature;
-    if (max_tokens.has_value())
-        payload["max_tokens"] = *max_tokens;
-    if (top_p.has_value())
-        payload["top_p"] = *top_p;
-    if (top_k.has_value())
-        payload["top_k"] = *top_k;
-    if (frequency_penalty.has_value())
-        payload["frequency_penalty"] = *frequency_penalty;
-    if (presence_penalty.has_value())
-        payload["presence_penalty"] = *presence_penalty;
-
+    out.end_array();
+
+    // a list of models replaces the single one
+    bool listed = models.has_value() && !models->empty();
+    if (!listed && !model.empty())
+        out.field("model", model);
+    if (listed)
+        out.field("models", *models);
+
+    out.field("presence_penalty", presence_penalty);
+    if (provider_order) {
+        out.key("provider")
+            .begin_object()
+            .field("order", *provider_order)
+            .end_object();
+    }
+    out.field("route", route);
     if (!stop_sequences.empty())
-        payload["stop"] = stop_sequences;
-
+        out.field("stop", stop_sequences);
     if (stream)
-        payload["stream"] = true;
+        out.field("stream", true);
+    out.field("temperature", temperature)
+        .field("top_k", top_k)
+        .field("top_p", top_p)
+        .end_object();
+    return out.take();
+}
 
-    if (route.has_value())
-        payload["route"] = *route;
-    if (provider_order.has_value())
-        payload["provider"] = {{"order", *provider_order}};
+openrouter_response OpenRouterClient::chat(const openrouter_request &req)
+{
+    return chat_async(req).get();
+}
 
-    return payload;
+// openrouter limits every model on its own
+static void pace(http_request &http, const openrouter_request &req)
+{
+    http.rate_key = std::string(host_of(req.endpoint)) + "/" + req.model;
+    http.cost.tokens =
+        estimated_tokens(http.body.size()) + req.max_tokens.value_or(0);
 }
 
-openrouter_response OpenRouterClient::chat(const openrouter_request &req)
+void OpenRouterClient::chat(const openrouter_request &req, callback done,
+                            const call_options &options)
 {
-    auto http_resp =
-        curl_helpers::post_json(curl_, req.endpoint, req.to_json(), headers_);
+    // a streamed body is no single json document for parse()
+    if (req.stream) {
+        chat_stream(req, {}, std::move(done), options);
+        return;
+    }
 
-    if (!http_resp.error.empty()) {
-        return {.content = {},
-                .valid = false,
-                .error = "[CURL ERROR] " + http_resp.error,
-                .raw_json = ""};
+    http_request http{.url = req.endpoint,
+                      .headers = headers_,
+                      .body = req.serialize(),
+                      .options = options};
+    pace(http, req);
+
+    std::string key;
+    if (cache_ && options.use_cache) {
+        key = fingerprint(http.url, http.body);
+        if (auto body = cache_->get(key)) {
+            done(openrouter_response::parse(*body, 200,
+                                            options.keep_raw_json));
+            return;
+        }
     }
 
-    return openrouter_response::parse(http_resp.body, http_resp.http_code);
+    // completions run on the transport's own thread, so a plain pointer
+    // to it stays valid there
+    transport_->submit(
+        std::move(http),
+        [done = std::move(done), cache = cache_, key,
+         keep_raw = options.keep_raw_json,
+         transport = transport_.get()](curl_helpers::http_response r) {
+            auto response = openrouter_response::from_http(r, keep_raw);
+            if (cache && !key.empty() && response.valid)
+                cache->put(key, std::move(r.body));
+            transport->recycle(std::move(r.body));
+            done(std::move(response));
+        });
 }
 
-openrouter_response openrouter_response::parse(const std::string &raw,
-                                               long http_code)
+std::future<openrouter_response>
+OpenRouterClient::chat_async(const openrouter_request &req,
+                             const call_options &options)
 {
-    openrouter_response result;
-    result.raw_json = raw;
-    result.valid = false;
+    return as_future<openrouter_response>(
+        [&](callback done) { chat(req, std::move(done), options); });
+}
+
+// the response a non-streamed request would have received, for the cache
+static std::string assembled_json(const openrouter_response &response)
+{
+    json choices = json::array();
+    for (const auto &content : response.content)
+        choices.push_back({{"message", {{"role", "assistant"},
+                                        {"content", content}}}});
+    if (response.finish_reason)
+        choices[0]["finish_reason"] = *response.finish_reason;
+
+    json payload = {{"choices", std::move(choices)}};
+    if (response.model_used)
+        payload["model"] = *response.model_used;
+
+    json usage = json::object();
+    if (response.prompt_tokens)
+        usage["prompt_tokens"] = *response.prompt_tokens;
+    if (response.completion_tokens)
+        usage["completion_tokens"] = *response.completion_tokens;
+    if (response.total_tokens)
+        usage["total_tokens"] = *response.total_tokens;
+    if (!usage.empty())
+        payload["usage"] = std::move(usage);
+
+    return payload.dump();
+}
+
+// the fields of one stream chunk, applied once it has been read whole: a
+// chunk carrying an error changes nothing else, and a choice's index may
+// come after its delta
+class DeltaFields : public JsonFieldReader
+{
+  public:
+    struct choice {
+        std::optional<size_t> index;
+        std::optional<std::string> content;
+        std::optional<std::string> finish_reason;
+    };
+
+    void reset();
+
+    bool has_error = false;
+    std::optional<std::string> error_message;
+    std::optional<std::string> model;
+    std::vector<choice> choices; // in the order they came
+    std::optional<int> prompt_tokens;
+    std::optional<int> completion_tokens;
+    std::optional<int> total_tokens;
+
+  private:
+    choice &current_choice();
+
+    void on_begin(bool array) override;
+    void on_string(std::string &value) override;
+    void on_integer(int64_t value) override;
+    void on_other() override;
+};
+
+void DeltaFields::reset()
+{
+    has_error = false;
+    error_message.reset();
+    model.reset();
+    choices.clear();
+    prompt_tokens.reset();
+    completion_tokens.reset();
+    total_tokens.reset();
+}
+
+DeltaFields::choice &DeltaFields::current_choice()
+{
+    if (index(1) >= choices.size())
+        choices.resize(index(1) + 1);
+    return choices[index(1)];
+}
 
-    if (http_code != 200) {
-        result.error = "[HTTP CODE " + std::to_string(http_code) + "]";
-        return result;
+void DeltaFields::on_begin(bool array)
+{
+    if (at({"error"}))
+        has_error = true;
+    else if (at({"choices", "#"}))
+        current_choice();
+}
+
+void DeltaFields::on_string(std::string &value)
+{
+    if (at({"choices", "#", "delta", "content"})) {
+        current_choice().content = std::move(value);
+    } else if (at({"choices", "#", "finish_reason"})) {
+        current_choice().finish_reason = std::move(value);
+    } else if (at({"model"})) {
+        model = std::move(value);
+    } else if (at({"error", "message"})) {
+        error_message = std::move(value);
+    } else if (at({"error"})) {
+        has_error = true;
+        error_message = std::move(value);
     }
+}
 
-    json parsed;
-    try {
-        parsed = json::parse(raw);
-    } catch (json::exception &e) {
-        result.error = std::string("[JSON ERROR] ") + e.what();
-        return result;
+void DeltaFields::on_integer(int64_t value)
+{
+    if (at({"choices", "#", "index"})) {
+        if (value >= 0)
+            current_choice().index = static_cast<size_t>(value);
+    } else if (at({"usage", "prompt_tokens"})) {
+        prompt_tokens = static_cast<int>(value);
+    } else if (at({"usage", "completion_tokens"})) {
+        completion_tokens = static_cast<int>(value);
+    } else if (at({"usage", "total_tokens"})) {
+        total_tokens = static_cast<int>(value);
+    } else if (at({"error"})) {
+        has_error = true;
     }
+}
 
-    if (parsed.contains("model") && parsed["model"].is_string()) {
-        result.model_used = parsed["model"].get<std::string>();
+void DeltaFields::on_other()
+{
+    if (at({"error"}))
+        has_error = true;
+}
+
+// builds a response from the chunks of a stream, each shaped like a whole
+// response with a delta where the message would be. the last ones carry
+// finish_reason and usage, and "[DONE]" ends the stream.
+class StreamAssembler
+{
+  public:
+    StreamAssembler(OpenRouterClient::token_callback on_token, bool keep_raw)
+        : on_token_(std::move(on_token)), keep_raw_(keep_raw),
+          parser_([this](std::string_view data) { event(data); })
+    {
+        result_.valid = false;
     }
 
-    if (!parsed.contains("choices")) {
-        result.error = "[OPENROUTER] Missing 'choices' field in response";
-        return result;
+    void feed(std::string_view chunk) { parser_.feed(chunk); }
+    openrouter_response finish(const curl_helpers::http_response &http);
+
+  private:
+    void event(std::string_view data);
+
+    OpenRouterClient::token_callback on_token_;
+    bool keep_raw_;
+    SseParser parser_;
+    DeltaFields fields_; // reused, so its buffers are
+    openrouter_response result_;
+    std::string error_;
+    bool done_ = false;
+};
+
+void StreamAssembler::event(std::string_view data)
+{
+    if (data == "[DONE]") {
+        done_ = true;
+        return;
     }
 
-    const auto &choices = parsed["choices"];
-    if (!choices.is_array() || choices.empty()) {
-        result.error = "[OPENROUTER] 'choices' field is empty or not an array";
-        return result;
+    fields_.reset();
+    std::string error;
+    if (!fields_.read(data, error)) {
+        error_ = "[JSON ERROR] unreadable stream chunk";
+        return;
     }
 
-    for (size_t i = 0; i < choices.size(); i++) {
-        const auto &choice = choices[i];
+    // errors after the first byte cannot change the status code anymore,
+    // so they arrive as a chunk of their own
+    if (fields_.has_error) {
+        error_ = "[OPENROUTER] " +
+                 fields_.error_message.value_or(std::string(data));
+        return;
+    }
 
-        if (!choice.contains("message")) {
-            result.error = "[OPENROUTER] Choice at index " +
-                           std::to_string(i) + " missing 'message' field";
-            return result;
-        }
+    if (fields_.model)
+        result_.model_used = std::move(*fields_.model);
+
+    for (size_t i = 0; i < fields_.choices.size(); i++) {
+        auto &choice = fields_.choices[i];
+        size_t index = choice.index.value_or(i);
+        if (index >= result_.content.size())
+            result_.content.resize(index + 1);
 
-        const auto &msg = choice["message"];
-        if (!msg.contains("content") || !msg["content"].is_string()) {
-            result.error = "[OPENROUTER] Message at index " +
-                           std::to_string(i) + " missing or invalid 'content'";
-            return result;
+        if (choice.content) {
+            const std::string &piece = *choice.content;
+            result_.content[index] += piece;
+            if (index == 0 && on_token_ && !piece.empty())
+                on_token_(piece);
         }
 
-        result.content.push_back(msg["content"].get<std::string>());
+        if (index == 0 && choice.finish_reason)
+            result_.finish_reason = std::move(*choice.finish_reason);
+    }
+
+    if (fields_.prompt_tokens)
+        result_.prompt_tokens = fields_.prompt_tokens;
+    if (fields_.completion_tokens)
+        result_.completion_tokens = fields_.completion_tokens;
+    if (fields_.total_tokens)
+        result_.total_tokens = fields_.total_tokens;
+}
+
+openrouter_response
+StreamAssembler::finish(const curl_helpers::http_response &http)
+{
+    // error statuses are collected whole by the transport
+    if (http.error.empty() && http.http_code != 200)
+        return openrouter_response::parse(http.body, http.http_code);
+
+    parser_.finish();
+    openrouter_response result = std::move(result_);
+    result.http_code = http.http_code;
+
+    if (!http.error.empty())
+        result.error = "[CURL ERROR] " + http.error;
+    else if (!error_.empty())
+        result.error = error_;
+    else if (!done_ && !result.finish_reason)
+        result.error = "[OPENROUTER] stream ended before the completion did";
+    else if (result.content.empty())
+        result.error = "[OPENROUTER] stream carried no choices";
+    else
+        result.valid = true;
+
+    if (result.valid && keep_raw_)
+        result.raw_json = assembled_json(result);
+    return result;
+}
 
-        if (i == 0 && choice.contains("finish_reason") &&
-            choice["finish_reason"].is_string()) {
-            result.finish_reason = choice["finish_reason"].get<std::string>();
+void OpenRouterClient::chat_stream(const openrouter_request &req,
+                                   token_callback on_token, callback done,
+                                   const call_options &options)
+{
+    openrouter_request streamed = req;
+    streamed.stream = true;
+
+    http_request http{.url = req.endpoint,
+                      .headers = headers_,
+                      .body = streamed.serialize(),
+                      .options = options};
+    pace(http, req);
+
+    std::string key;
+    if (cache_ && options.use_cache) {
+        key = fingerprint(http.url, http.body);
+        if (auto body = cache_->get(key)) {
+            auto response =
+                openrouter_response::parse(*body, 200, options.keep_raw_json);
+            if (on_token && response.valid)
+                on_token(response.content.front());
+            done(std::move(response));
+            return;
         }
     }
 
-    if (parsed.contains("usage")) {
-        const auto &usage = parsed["usage"];
+    auto assembler = std::make_shared<StreamAssembler>(
+        std::move(on_token), options.keep_raw_json);
+    http.on_data = [assembler](std::string_view chunk) {
+        assembler->feed(chunk);
+        return true;
+    };
+
+    transport_->submit(
+        std::move(http), [assembler, done = std::move(done), cache = cache_,
+                          key](curl_helpers::http_response r) {
+            auto response = assembler->finish(r);
+            if (cache && !key.empty() && response.valid)
+                cache->put(key, assembled_json(response));
+            done(std::move(response));
+        });
+}
 
-        if (usage.contains("prompt_tokens") &&
-            usage["prompt_tokens"].is_number_integer()) {
-            result.prompt_tokens = usage["prompt_tokens"].get<int>();
-        }
+std::future<openrouter_response>
+OpenRouterClient::chat_stream_async(const openrouter_request &req,
+                                    token_callback on_token,
+                                    const call_options &options)
+{
+    return as_future<openrouter_response>([&](callback done) {
+        chat_stream(req, std::move(on_token), std::move(done), options);
+    });
+}
 
-        if (usage.contains("completion_tokens") &&
-            usage["completion_tokens"].is_number_integer()) {
-            result.completion_tokens = usage["completion_tokens"].get<int>();
-        }
+openrouter_response
+openrouter_response::from_http(const curl_helpers::http_response &http,
+                               bool keep_raw)
+{
+    if (!http.error.empty()) {
+        return {.content = {},
+                .valid = false,
+                .error = "[CURL ERROR] " + http.error,
+                .raw_json = ""};
+    }
 
-        if (usage.contains("total_tokens") &&
-            usage["total_tokens"].is_number_integer()) {
-            result.total_tokens = usage["total_tokens"].get<int>();
-        }
+    return parse(http.body, http.http_code, keep_raw);
+}
+
+class OpenRouterFields : public JsonFieldReader
+{
+  public:
+    explicit OpenRouterFields(openrouter_response &result) : result_(result)
+    {
+    }
+
+    std::optional<std::string> problem();
+
+  private:
+    struct choice {
+        bool has_message = false;
+        std::optional<std::string> content;
+    };
+
+    choice &current_choice();
+
+    void on_begin(bool array) override;
+    void on_string(std::string &value) override;
+    void on_integer(int64_t value) override;
+    void on_other() override;
+    void wrong_type();
+
+    openrouter_response &result_;
+    bool has_choices_ = false;
+    bool choices_array_ = false;
+    std::vector<choice> choices_;
+};
+
+// every element of choices takes a slot, objects or not, so one that is
+// not an object is reported as missing its message
+OpenRouterFields::choice &OpenRouterFields::current_choice()
+{
+    if (index(1) >= choices_.size())
+        choices_.resize(index(1) + 1);
+    return choices_[index(1)];
+}
+
+void OpenRouterFields::on_begin(bool array)
+{
+    if (at({"choices"})) {
+        has_choices_ = true;
+        choices_array_ = array;
+    } else if (at({"choices", "#"})) {
+        current_choice();
+    } else if (at({"choices", "#", "message"})) {
+        current_choice().has_message = true;
+    }
+}
+
+void OpenRouterFields::on_string(std::string &value)
+{
+    if (at({"choices", "#", "message", "content"})) {
+        current_choice().content = std::move(value);
+    } else if (at({"choices", "#", "finish_reason"})) {
+        if (index(1) == 0)
+            result_.finish_reason = std::move(value);
+    } else if (at({"model"})) {
+        result_.model_used = std::move(value);
+    } else {
+        wrong_type();
     }
+}
+
+void OpenRouterFields::on_integer(int64_t value)
+{
+    if (at({"usage", "prompt_tokens"}))
+        result_.prompt_tokens = static_cast<int>(value);
+    else if (at({"usage", "completion_tokens"}))
+        result_.completion_tokens = static_cast<int>(value);
+    else if (at({"usage", "total_tokens"}))
+        result_.total_tokens = static_cast<int>(value);
+    else
+        wrong_type();
+}
+
+void OpenRouterFields::on_other() { wrong_type(); }
+
+// choices that are not an array, a choice that is not an object, or a
+// message that is not one and so has no content
+void OpenRouterFields::wrong_type()
+{
+    if (at({"choices"}))
+        has_choices_ = true;
+    else if (at({"choices", "#"}))
+        current_choice();
+    else if (at({"choices", "#", "message"}))
+        current_choice().has_message = true;
+}
+
+std::optional<std::string> OpenRouterFields::problem()
+{
+    if (!has_choices_)
+        return "[OPENROUTER] Missing 'choices' field in response";
+    if (!choices_array_ || choices_.empty())
+        return "[OPENROUTER] 'choices' field is empty or not an array";
+
+    for (size_t i = 0; i < choices_.size(); i++) {
+        if (!choices_[i].has_message)
+            return "[OPENROUTER] Choice at index " + std::to_string(i) +
+                   " missing 'message' field";
+        if (!choices_[i].content)
+            return "[OPENROUTER] Message at index " + std::to_string(i) +
+                   " missing or invalid 'content'";
+    }
+
+    for (auto &c : choices_)
+        result_.content.push_back(std::move(*c.content));
+    return std::nullopt;
+}
+
+openrouter_response openrouter_response::parse(std::string_view raw,
+                                               long http_code, bool keep_raw)
+{
+    openrouter_response result;
+    result.http_code = http_code;
+    result.valid = false;
 
+    // failures keep the body either way; it is all there is to go on
+    auto fail = [&](std::string error) {
+        result.error = std::move(error);
+        result.raw_json = raw;
+        return std::move(result);
+    };
+
+    if (http_code != 200)
+        return fail("[HTTP CODE " + std::to_string(http_code) + "]");
+
+    OpenRouterFields fields(result);
+    std::string error;
+    if (!fields.read(raw, error))
+        return fail("[JSON ERROR] " + error);
+    if (auto problem = fields.problem())
+        return fail(std::move(*problem));
+
+    if (keep_raw)
+        result.raw_json = raw;
     result.valid = true;
     return result;
 }
@@ -1,9 +1,14 @@
 #pragma once
 
-#include <curl/curl.h>
+#include "response_cache.hpp"
+#include "transport.hpp"
+#include <functional>
+#include <future>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using nlohmann::json;
@@ -53,7 +58,8 @@ struct openrouter_request {
     openrouter_request &
     set_provider_order(const std::vector<std::string> &providers);
 
-    json to_json() const;
+    // the body, keys sorted as nlohmann::json would have them
+    std::string serialize() const;
 };
 
 struct openrouter_response {
@@ -61,6 +67,7 @@ struct openrouter_response {
     bool valid;
     std::string error;
     std::string raw_json;
+    long http_code = 0; // 0 when the request never got an answer
 
     std::optional<int> prompt_tokens;
     std::optional<int> completion_tokens;
@@ -68,25 +75,67 @@ struct openrouter_response {
     std::optional<std::string> model_used;
     std::optional<std::string> finish_reason;
 
-    static openrouter_response parse(const std::string &raw, long http_code);
+    // raw_json is only filled for successful responses when asked to
+    static openrouter_response
+    parse(std::string_view raw, long http_code, bool keep_raw = false);
+    static openrouter_response
+    from_http(const curl_helpers::http_response &http, bool keep_raw = false);
 };
 
 class OpenRouterClient
 {
   public:
-    OpenRouterClient(const std::string &api_key, CURL *curl);
-    ~OpenRouterClient();
+    OpenRouterClient(const std::string &api_key,
+                     std::shared_ptr<Transport> transport);
 
+    using callback = std::function<void(openrouter_response)>;
+    using token_callback = std::function<void(std::string_view token)>;
+
+    // blocks until the response arrives
     openrouter_response chat(const openrouter_request &request);
 
+    // return at once. callbacks run on the transport thread, so anything
+    // slow in them holds up every other request
+    void chat(const openrouter_request &request, callback done,
+              const call_options &options = {});
+    std::future<openrouter_response>
+    chat_async(const openrouter_request &request,
+               const call_options &options = {});
+
+    // streams the completion over server-sent events, whether or not the
+    // request asked for it. on_token gets each piece of the first choice
+    // as it arrives; done gets the assembled response, usage and
+    // finish_reason included, once the stream ends. both run on the
+    // transport thread. a cancelled stream completes with what arrived so
+    // far, marked invalid. cached responses arrive as a single token.
+    void chat_stream(const openrouter_request &request,
+                     token_callback on_token, callback done,
+                     const call_options &options = {});
+    std::future<openrouter_response>
+    chat_stream_async(const openrouter_request &request,
+                      token_callback on_token,
+                      const call_options &options = {});
+
     void set_api_key(const std::string &key) { api_key_ = key; }
 
+    // successful responses are remembered and answered from it until they
+    // expire, unless a call opts out. hits complete on the calling thread.
+    void set_cache(std::shared_ptr<ResponseCache> cache)
+    {
+        cache_ = std::move(cache);
+    }
+
   private:
     std::string api_key_;
-    CURL *curl_;
-    struct curl_slist *headers_;
+    std::shared_ptr<Transport> transport_;
+    std::vector<std::string> headers_;
+    std::shared_ptr<ResponseCache> cache_;
 };
 
-std::unique_ptr<OpenRouterClient> new_openrouter_client(const std::string &key);
+// null when no transport could be created
+std::unique_ptr<OpenRouterClient>
+new_openrouter_client(
+    const std::string &key,
+    std::shared_ptr<Transport> transport = shared_transport());
 
 } // namespace setman::ai
@@ -0,0 +1,365 @@
+#include "rate_control.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <curl/curl.h>
+#include <string_view>
+
+namespace setman::ai
+{
+
+using clock = RateController::clock;
+
+// the short and the long view of latency. the short one rising well above
+// the long one is the server queueing; the long one lets a mix of small
+// and large requests average out instead of reading as queueing.
+static constexpr double short_weight = 0.2;
+static constexpr double long_weight = 0.02;
+
+// a bucket holds a second's worth of its quota. servers count theirs over
+// windows of their own, which a larger burst could overrun, and a steady
+// pace gets as much through.
+static constexpr double burst_minutes = 1.0 / 60;
+// of the rate learned, or the first time of what got through, what is
+// kept after a 429
+static constexpr double learned_backoff = 0.9;
+
+static std::optional<double> number(std::string_view text)
+{
+    double value;
+    auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || end != text.data() + text.size())
+        return std::nullopt;
+    return value;
+}
+
+static clock::time_point from_unix(double seconds, clock::time_point now)
+{
+    auto left = std::chrono::duration<double>(seconds) -
+                std::chrono::system_clock::now().time_since_epoch();
+    return now + std::chrono::duration_cast<clock::duration>(left);
+}
+
+// x-ratelimit-reset-* come as go durations ("6m0s", "1.5s", "20ms"),
+// seconds from now, or a unix time in seconds or milliseconds
+static std::optional<clock::time_point> reset_time(std::string_view value,
+                                                   clock::time_point now)
+{
+    if (auto plain = number(value)) {
+        if (*plain > 1e12)
+            return from_unix(*plain / 1000, now);
+        if (*plain > 1e9)
+            return from_unix(*plain, now);
+        return now + std::chrono::duration_cast<clock::duration>(
+                         std::chrono::duration<double>(*plain));
+    }
+
+    double seconds = 0;
+    while (!value.empty()) {
+        size_t digits = 0;
+        while (digits < value.size() &&
+               (std::isdigit(static_cast<unsigned char>(value[digits])) ||
+                value[digits] == '.'))
+            ++digits;
+        auto amount = number(value.substr(0, digits));
+        if (!amount)
+            return std::nullopt;
+        value.remove_prefix(digits);
+
+        size_t letters = 0;
+        while (letters < value.size() &&
+               std::isalpha(static_cast<unsigned char>(value[letters])))
+            ++letters;
+        std::string_view unit = value.substr(0, letters);
+        value.remove_prefix(letters);
+
+        if (unit == "h")
+            seconds += *amount * 3600;
+        else if (unit == "m")
+            seconds += *amount * 60;
+        else if (unit == "s")
+            seconds += *amount;
+        else if (unit == "ms")
+            seconds += *amount / 1000;
+        else
+            return std::nullopt;
+    }
+    return now + std::chrono::duration_cast<clock::duration>(
+                     std::chrono::duration<double>(seconds));
+}
+
+// seconds, or an HTTP date
+static std::optional<clock::time_point> retry_time(const std::string &value,
+                                                   clock::time_point now)
+{
+    if (auto seconds = number(value))
+        return now + std::chrono::duration_cast<clock::duration>(
+                         std::chrono::duration<double>(*seconds));
+    time_t date = curl_getdate(value.c_str(), nullptr);
+    if (date < 0)
+        return std::nullopt;
+    return from_unix(static_cast<double>(date), now);
+}
+
+double RateController::bucket::capacity() const
+{
+    return std::max(1.0, per_minute * burst_minutes);
+}
+
+// one that has never been drawn from starts full. the server's count
+// says nothing once its window has reset.
+void RateController::bucket::refill(clock::time_point now)
+{
+    if (remaining && now >= reset)
+        remaining.reset();
+    if (per_minute <= 0)
+        return;
+
+    if (updated == clock::time_point{}) {
+        level = capacity();
+    } else {
+        std::chrono::duration<double, std::ratio<60>> elapsed = now - updated;
+        level = std::min(capacity(), level + elapsed.count() * per_minute);
+    }
+    updated = now;
+}
+
+// a request costing more than the bucket holds goes once it is full and
+// leaves it in debt, rather than never. one costing more than the server
+// has left waits for its window to reset.
+clock::time_point RateController::bucket::ready_at(double amount,
+                                                   clock::time_point now) const
+{
+    auto earliest = now;
+    if (remaining && *remaining < std::max(amount, 1.0))
+        earliest = reset;
+
+    const double need = std::min(amount, capacity());
+    if (per_minute <= 0 || level >= need)
+        return earliest;
+
+    std::chrono::duration<double, std::ratio<60>> wait((need - level) /
+                                                       per_minute);
+    return std::max(earliest,
+                    now + std::chrono::ceil<clock::duration>(wait));
+}
+
+void RateController::bucket::take(double amount)
+{
+    if (per_minute > 0)
+        level -= amount;
+    if (remaining)
+        *remaining -= amount;
+}
+
+RateController::RateController(const rate_limits &limits)
+    : limit_(static_cast<double>(limits.initial_concurrency))
+{
+    configure(limits);
+}
+
+void RateController::configure(const rate_limits &limits)
+{
+    limits_ = limits;
+    limits_.min_concurrency = std::max<size_t>(1, limits_.min_concurrency);
+    limits_.max_concurrency =
+        std::max(limits_.min_concurrency, limits_.max_concurrency);
+    limit_ = std::clamp(limit_, double(limits_.min_concurrency),
+                        double(limits_.max_concurrency));
+
+    learn(learned_);
+    tokens_.per_minute = limits_.tokens_per_minute;
+    characters_.per_minute = limits_.characters_per_minute;
+}
+
+std::optional<clock::time_point>
+RateController::ready_at(const request_cost &cost, clock::time_point now)
+{
+    if (in_flight_ >= std::floor(limit_))
+        return std::nullopt;
+
+    requests_.refill(now);
+    tokens_.refill(now);
+    characters_.refill(now);
+    return std::max({now, paused_until_, requests_.ready_at(1, now),
+                     tokens_.ready_at(cost.tokens, now),
+                     characters_.ready_at(cost.characters, now)});
+}
+
+void RateController::start(const request_cost &cost, clock::time_point now)
+{
+    requests_.refill(now);
+    tokens_.refill(now);
+    characters_.refill(now);
+    requests_.take(1);
+    tokens_.take(cost.tokens);
+    characters_.take(cost.characters);
+    ++in_flight_;
+    ++started_;
+}
+
+void RateController::abandon()
+{
+    if (in_flight_ > 0)
+        --in_flight_;
+    --started_;
+}
+
+void RateController::finish(const rate_outcome &outcome,
+                            clock::time_point now)
+{
+    if (in_flight_ > 0)
+        --in_flight_;
+    const bool told_when = read_headers(outcome, now);
+    // a request sent before the last cut was sent at the old pace, and
+    // says nothing about the new one. the cuts it would make have been.
+    const bool fresh = outcome.started >= last_cut_;
+
+    if (outcome.http_code == 429) {
+        ++rate_limited_;
+        if (!fresh)
+            return;
+        if (!told_when) {
+            pause_ = pause_.count() == 0
+                         ? limits_.rate_limited_pause
+                         : std::min(pause_ * 2, limits_.max_rate_limited_pause);
+            paused_until_ = std::max(paused_until_, now + pause_);
+
+            // the first rate is what got through over the last minute, or
+            // what there is of one
+            if (learned_ > 0) {
+                learn(learned_ * learned_backoff);
+            } else if (answered_.size() > 1) {
+                std::chrono::duration<double, std::ratio<60>> span =
+                    now - answered_.front();
+                learn(learned_backoff * double(answered_.size()) /
+                      std::max(span.count(), 1.0 / 60));
+            }
+        }
+        decrease(limits_.error_backoff, now);
+        return;
+    }
+    if (outcome.failed || outcome.http_code >= 500) {
+        ++errors_;
+        if (fresh)
+            decrease(limits_.error_backoff, now);
+        return;
+    }
+    // a refused request says nothing about load, and comes back fast
+    if (outcome.http_code / 100 != 2)
+        return;
+    pause_ = std::chrono::milliseconds(0);
+    answered_.push_back(now);
+    while (now - answered_.front() > std::chrono::minutes(1))
+        answered_.pop_front();
+    if (learned_ > 0)
+        learn(learned_ + 1);
+
+    const double sample =
+        std::chrono::duration<double, std::micro>(now - outcome.started)
+            .count();
+    if (smoothed_ == 0) {
+        smoothed_ = usual_ = sample;
+    } else {
+        smoothed_ += (sample - smoothed_) * short_weight;
+        usual_ += (sample - usual_) * long_weight;
+    }
+    if (smoothed_ > usual_ * limits_.latency_tolerance) {
+        if (fresh)
+            decrease(limits_.latency_backoff, now);
+        return;
+    }
+
+    // an idle endpoint would otherwise raise its limit without ever
+    // having tried it
+    if (in_flight_ + 1 < limit_ / 2)
+        return;
+    limit_ += slow_start_ ? 1 : 1 / limit_;
+    limit_ = std::min(limit_, double(limits_.max_concurrency));
+}
+
+// whether there was a Retry-After
+bool RateController::read_headers(const rate_outcome &outcome,
+                                  clock::time_point now)
+{
+    bool retry_after = false;
+    struct announcement {
+        std::optional<double> remaining;
+        std::optional<clock::time_point> reset;
+    } requests, tokens;
+
+    for (const auto &[name, value] : outcome.headers) {
+        if (name == "retry-after") {
+            if (auto until = retry_time(value, now)) {
+                paused_until_ = std::max(paused_until_, *until);
+                retry_after = true;
+            }
+            continue;
+        }
+
+        // x-ratelimit-remaining, or x-ratelimit-remaining-requests and
+        // -tokens, and the same of -reset
+        std::string_view field(name);
+        if (!field.starts_with("x-ratelimit-"))
+            continue;
+        field.remove_prefix(sizeof "x-ratelimit-" - 1);
+        announcement *into = &requests;
+        if (field.ends_with("-tokens")) {
+            into = &tokens;
+            field.remove_suffix(sizeof "-tokens" - 1);
+        } else if (field.ends_with("-requests")) {
+            field.remove_suffix(sizeof "-requests" - 1);
+        }
+
+        if (field == "remaining")
+            into->remaining = number(value);
+        else if (field == "reset")
+            into->reset = reset_time(value, now);
+    }
+
+    // the limit itself comes without its window, which providers count
+    // differently, so it is left alone; what remains until when is the
+    // whole of it. requests sent since are taken off as they go.
+    auto apply = [now](bucket &to, const announcement &from) {
+        if (!from.remaining || !from.reset || *from.reset <= now)
+            return;
+        to.remaining = *from.remaining;
+        to.reset = *from.reset;
+    };
+    apply(requests_, requests);
+    apply(tokens_, tokens);
+    return retry_after;
+}
+
+void RateController::decrease(double factor, clock::time_point now)
+{
+    slow_start_ = false;
+    limit_ = std::max(double(limits_.min_concurrency), limit_ * factor);
+    last_cut_ = now;
+}
+
+// the configured rate stays the most
+void RateController::learn(double per_minute)
+{
+    learned_ = per_minute;
+    const double configured = limits_.requests_per_minute;
+    requests_.per_minute = configured > 0 && learned_ > 0
+                               ? std::min(configured, learned_)
+                               : std::max(configured, learned_);
+}
+
+rate_stats RateController::statistics() const
+{
+    return {.concurrency = limit_,
+            .requests_per_minute = requests_.per_minute,
+            .in_flight = in_flight_,
+            .started = started_,
+            .rate_limited = rate_limited_,
+            .errors = errors_,
+            .latency = std::chrono::milliseconds(
+                std::llround(smoothed_ / 1000))};
+}
+
+} // namespace setman::ai
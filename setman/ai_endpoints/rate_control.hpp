@@ -0,0 +1,148 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace setman::ai
+{
+
+// what a request spends of a provider's quotas, as far as the client can
+// tell before sending it. every request also counts as one request.
+struct request_cost {
+    double tokens = 0;     // the prompt, estimated, and the reply allowed
+    double characters = 0; // text billed by the character, as deepl does
+};
+
+// tokens are estimated at four bytes of text each. japanese runs closer
+// to three, and the reply allowed for usually outweighs the error.
+constexpr double estimated_tokens(size_t text_bytes)
+{
+    return static_cast<double>(text_bytes) / 4;
+}
+
+// the limits of one endpoint. rates are per minute; 0 leaves that quota
+// to the server's rate limit headers, where it sends any. a server that
+// sends none has its rate in requests learned from its 429s.
+struct rate_limits {
+    double requests_per_minute = 0;
+    double tokens_per_minute = 0;
+    double characters_per_minute = 0;
+
+    // requests in flight. the limit starts at initial_concurrency and
+    // doubles every round trip until the first sign of trouble, then
+    // grows by one a round trip and is cut back on errors and queueing
+    size_t initial_concurrency = 4;
+    size_t min_concurrency = 1;
+    size_t max_concurrency = 64;
+
+    // the server counts as queueing requests once the smoothed time they
+    // take is this many times its usual
+    double latency_tolerance = 2.0;
+    // the limit is multiplied by error_backoff on 429s, 5xx and failed
+    // connections, and by latency_backoff on queueing
+    double error_backoff = 0.5;
+    double latency_backoff = 0.9;
+    // nothing more is sent this long after a 429 without a Retry-After,
+    // twice as long each time requests sent after it are refused again,
+    // up to the max, until one gets through
+    std::chrono::milliseconds rate_limited_pause{250};
+    std::chrono::milliseconds max_rate_limited_pause{30'000};
+};
+
+// how a request went, as far as pacing the next ones goes
+struct rate_outcome {
+    long http_code = 0; // 0 when there was no answer
+    // no answer, for reasons of the server or the network. cancelled
+    // requests are neither failed nor answered.
+    bool failed = false;
+    std::chrono::steady_clock::time_point started;
+    // "retry-after" and "x-ratelimit-*", names in lower case
+    std::vector<std::pair<std::string, std::string>> headers;
+};
+
+struct rate_stats {
+    double concurrency = 0; // the limit on requests in flight
+    double requests_per_minute = 0; // configured or learned, 0: none
+    size_t in_flight = 0;
+    size_t waiting = 0; // held back, counted by the transport
+    size_t started = 0;
+    size_t rate_limited = 0; // 429s
+    size_t errors = 0;       // 5xx and failed connections
+    std::chrono::milliseconds latency{0}; // smoothed, start to finish
+};
+
+// paces the requests to one endpoint. token buckets for requests, tokens
+// and characters hold back what a configured quota cannot take yet, and
+// what the server's rate limit headers say remains of its own is spent
+// no faster. an AIMD limit on requests in flight finds the most the
+// endpoint serves without errors or queueing. not thread safe; the
+// transport drives it from its own thread.
+class RateController
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    explicit RateController(const rate_limits &limits = {});
+
+    // the concurrency limit and the buckets' levels carry over
+    void configure(const rate_limits &limits);
+
+    // when a request costing `cost` may start: `now` or later. nullopt
+    // while the concurrency limit is reached, until a request finishes.
+    std::optional<clock::time_point> ready_at(const request_cost &cost,
+                                              clock::time_point now);
+    void start(const request_cost &cost, clock::time_point now);
+    // a request that was started here but never sent
+    void abandon();
+    void finish(const rate_outcome &outcome, clock::time_point now);
+
+    rate_stats statistics() const;
+
+  private:
+    struct bucket {
+        double per_minute = 0; // configured, 0: none
+        double level = 0;
+        clock::time_point updated;
+        // what the server last said remains, until its window resets
+        std::optional<double> remaining;
+        clock::time_point reset;
+
+        double capacity() const;
+        void refill(clock::time_point now);
+        clock::time_point ready_at(double amount,
+                                   clock::time_point now) const;
+        void take(double amount);
+    };
+
+    bool read_headers(const rate_outcome &outcome, clock::time_point now);
+    void decrease(double factor, clock::time_point now);
+    void learn(double per_minute);
+
+    rate_limits limits_;
+    bucket requests_, tokens_, characters_;
+
+    double limit_;
+    bool slow_start_ = true;
+    size_t in_flight_ = 0;
+    clock::time_point paused_until_;
+    std::chrono::milliseconds pause_{0}; // the last without a Retry-After
+    clock::time_point last_cut_;
+
+    double smoothed_ = 0; // microseconds, start to finish
+    double usual_ = 0;
+
+    // requests a minute a server without headers takes, 0 until it has
+    // refused one. it grows by one with every request answered and is cut
+    // back when the server refuses again.
+    double learned_ = 0;
+    std::deque<clock::time_point> answered_; // over the last minute
+
+    size_t started_ = 0, rate_limited_ = 0, errors_ = 0;
+};
+
+} // namespace setman::ai
@@ -0,0 +1,143 @@
+#include "response_cache.hpp"
+#include <array>
+#include <xxhash.h>
+
+namespace setman::ai
+{
+
+// query strings carry api keys, which must neither end up in the database
+// nor make two keys' identical requests miss each other
+static std::string_view without_query(std::string_view url)
+{
+    return url.substr(0, url.find('?'));
+}
+
+static std::string to_hex(XXH128_hash_t hash)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+
+    std::string hex(32, '0');
+    for (int i = 0; i < 16; i++) {
+        hex[15 - i] = digits[(hash.high64 >> (i * 4)) & 0xF];
+        hex[31 - i] = digits[(hash.low64 >> (i * 4)) & 0xF];
+    }
+    return hex;
+}
+
+// the url is length-prefixed so no split of url and body can collide
+// with another
+static void add_url(XXH3_state_t *state, std::string_view url)
+{
+    url = without_query(url);
+    uint64_t length = url.size();
+    XXH3_128bits_update(state, &length, sizeof(length));
+    XXH3_128bits_update(state, url.data(), url.size());
+}
+
+std::string fingerprint(std::string_view url, std::string_view body)
+{
+    XXH3_state_t *state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    add_url(state, url);
+    XXH3_128bits_update(state, body.data(), body.size());
+    std::string key = to_hex(XXH3_128bits_digest(state));
+    XXH3_freeState(state);
+    return key;
+}
+
+std::string fingerprint(std::string_view url, curl_helpers::RequestBody body)
+{
+    XXH3_state_t *state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    add_url(state, url);
+
+    std::array<char, 64 * 1024> buffer;
+    while (size_t read = body.read(buffer.data(), buffer.size()))
+        XXH3_128bits_update(state, buffer.data(), read);
+
+    std::string key = to_hex(XXH3_128bits_digest(state));
+    XXH3_freeState(state);
+    return key;
+}
+
+ResponseCache::ResponseCache(cache_options options,
+                             std::shared_ptr<ResponseStore> store)
+    : options_(options), store_(std::move(store))
+{
+}
+
+std::optional<std::string> ResponseCache::get(const std::string &key)
+{
+    const auto not_before = clock::now() - options_.ttl;
+
+    {
+        std::lock_guard lock(mutex_);
+        if (auto it = index_.find(key); it != index_.end()) {
+            auto entry = it->second;
+            if (entry->created >= not_before) {
+                recent_.splice(recent_.begin(), recent_, entry);
+                stats_.memory_hits++;
+                return entry->body;
+            }
+            stats_.memory_bytes -= entry->body.size();
+            index_.erase(it);
+            recent_.erase(entry);
+        }
+    }
+
+    // outside the lock: a store read may touch the disk
+    std::optional<stored_response> stored;
+    if (store_)
+        stored = store_->load(key, not_before);
+
+    std::lock_guard lock(mutex_);
+    if (!stored) {
+        stats_.misses++;
+        return std::nullopt;
+    }
+
+    stats_.store_hits++;
+    remember(key, stored->body, stored->created);
+    return std::move(stored->body);
+}
+
+void ResponseCache::put(const std::string &key, std::string body)
+{
+    if (store_)
+        store_->store(key, body);
+
+    std::lock_guard lock(mutex_);
+    remember(key, std::move(body), clock::now());
+}
+
+void ResponseCache::remember(const std::string &key, std::string body,
+                             clock::time_point created)
+{
+    if (body.size() > options_.memory_bytes)
+        return;
+
+    if (auto it = index_.find(key); it != index_.end()) {
+        stats_.memory_bytes -= it->second->body.size();
+        recent_.erase(it->second);
+        index_.erase(it);
+    }
+
+    stats_.memory_bytes += body.size();
+    recent_.push_front({key, std::move(body), created});
+    index_.emplace(recent_.front().key, recent_.begin());
+
+    while (stats_.memory_bytes > options_.memory_bytes) {
+        const entry &oldest = recent_.back();
+        stats_.memory_bytes -= oldest.body.size();
+        index_.erase(oldest.key);
+        recent_.pop_back();
+    }
+}
+
+ResponseCache::stats ResponseCache::statistics() const
+{
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+} // namespace setman::ai
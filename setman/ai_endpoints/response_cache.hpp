@@ -0,0 +1,94 @@
+#pragma once
+
+#include "curl_helpers.hpp"
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace setman::ai
+{
+
+// 128 bit XXH3 of everything that decides the answer: the endpoint without
+// its api key, and the request body. bodies are serialized from sorted json
+// objects, so equal requests always produce the same bytes; streamed image
+// parts are hashed as they would be uploaded.
+std::string fingerprint(std::string_view url, std::string_view body);
+std::string fingerprint(std::string_view url, curl_helpers::RequestBody body);
+
+struct stored_response {
+    std::string body;
+    std::chrono::system_clock::time_point created;
+};
+
+// a cold tier behind the in-memory one, e.g. the project database.
+// called from any thread, including the transport's, so store() must not
+// block on disk.
+class ResponseStore
+{
+  public:
+    virtual ~ResponseStore() = default;
+
+    // nothing if the key is unknown or was stored before `not_before`
+    virtual std::optional<stored_response>
+    load(const std::string &key,
+         std::chrono::system_clock::time_point not_before) = 0;
+    virtual void store(const std::string &key, const std::string &body) = 0;
+};
+
+struct cache_options {
+    size_t memory_bytes = 64 << 20; // hot tier budget, bodies only
+    std::chrono::seconds ttl = std::chrono::days(30);
+};
+
+// successful response bodies by request fingerprint. lookups try the
+// least recently used memory tier first, then the store; store hits are
+// promoted. clients consult it when handed one with set_cache().
+class ResponseCache
+{
+  public:
+    explicit ResponseCache(cache_options options = {},
+                           std::shared_ptr<ResponseStore> store = nullptr);
+
+    ResponseCache(const ResponseCache &) = delete;
+    ResponseCache &operator=(const ResponseCache &) = delete;
+
+    std::optional<std::string> get(const std::string &key);
+    void put(const std::string &key, std::string body);
+
+    struct stats {
+        size_t memory_hits = 0;
+        size_t store_hits = 0;
+        size_t misses = 0;
+        size_t memory_bytes = 0;
+    };
+    stats statistics() const;
+
+  private:
+    using clock = std::chrono::system_clock;
+
+    struct entry {
+        std::string key;
+        std::string body;
+        clock::time_point created;
+    };
+
+    // caller holds mutex_
+    void remember(const std::string &key, std::string body,
+                  clock::time_point created);
+
+    cache_options options_;
+    std::shared_ptr<ResponseStore> store_;
+
+    mutable std::mutex mutex_;
+    std::list<entry> recent_; // most recently used first
+    std::unordered_map<std::string_view, std::list<entry>::iterator> index_;
+    stats stats_;
+};
+
+} // namespace setman::ai
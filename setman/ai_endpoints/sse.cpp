@@ -0,0 +1,78 @@
+#include "sse.hpp"
+
+namespace setman::ai
+{
+
+void SseParser::feed(std::string_view chunk)
+{
+    if (skip_newline_ && !chunk.empty() && chunk.front() == '\n')
+        chunk.remove_prefix(1);
+    skip_newline_ = false;
+
+    while (!chunk.empty()) {
+        size_t end = chunk.find_first_of("\r\n");
+        if (end == std::string_view::npos) {
+            partial_.append(chunk);
+            return;
+        }
+
+        if (partial_.empty()) {
+            line(chunk.substr(0, end));
+        } else {
+            partial_.append(chunk.substr(0, end));
+            line(partial_);
+            partial_.clear();
+        }
+
+        // lines end in \r\n, \n or a lone \r
+        if (chunk[end] == '\r') {
+            if (end + 1 == chunk.size())
+                skip_newline_ = true;
+            else if (chunk[end + 1] == '\n')
+                end++;
+        }
+        chunk.remove_prefix(end + 1);
+    }
+}
+
+void SseParser::finish()
+{
+    if (!partial_.empty()) {
+        std::string last = std::move(partial_);
+        partial_.clear();
+        line(last);
+    }
+    line({});
+}
+
+void SseParser::line(std::string_view text)
+{
+    if (text.empty()) {
+        if (has_data_)
+            on_event_(data_);
+        data_.clear();
+        has_data_ = false;
+        return;
+    }
+    if (text.front() == ':')
+        return;
+
+    size_t colon = text.find(':');
+    std::string_view field = text.substr(0, colon);
+    if (field != "data")
+        return;
+
+    std::string_view value;
+    if (colon != std::string_view::npos) {
+        value = text.substr(colon + 1);
+        if (!value.empty() && value.front() == ' ')
+            value.remove_prefix(1);
+    }
+
+    if (has_data_)
+        data_.push_back('\n');
+    data_.append(value);
+    has_data_ = true;
+}
+
+} // namespace setman::ai
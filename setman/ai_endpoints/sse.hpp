@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace setman::ai
+{
+
+// splits a text/event-stream body into events as its bytes arrive, in
+// chunks cut anywhere. only the data field is kept: the lines of one event
+// are joined by newlines and handed over once the blank line ending it is
+// seen. comments, like the keep-alives OpenRouter sends while a model is
+// still thinking, are skipped.
+class SseParser
+{
+  public:
+    using event_callback = std::function<void(std::string_view data)>;
+
+    explicit SseParser(event_callback on_event)
+        : on_event_(std::move(on_event))
+    {
+    }
+
+    void feed(std::string_view chunk);
+    // dispatches an event the stream ended without terminating
+    void finish();
+
+  private:
+    void line(std::string_view text);
+
+    event_callback on_event_;
+    std::string partial_; // an unterminated line from the previous chunk
+    std::string data_;
+    bool has_data_ = false;
+    bool skip_newline_ = false; // a chunk ended between \r and \n
+};
+
+} // namespace setman::ai
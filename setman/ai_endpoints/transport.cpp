@@ -0,0 +1,559 @@
+#include "transport.hpp"
+#include <algorithm>
+#include <cctype>
+
+namespace setman::ai
+{
+
+struct Transport::transfer {
+    http_request request;
+    completion done;
+    curl_helpers::http_response response;
+    std::string rate_key;
+    std::chrono::steady_clock::time_point started;
+    std::vector<std::pair<std::string, std::string>> rate_headers;
+    struct curl_slist *headers = nullptr;
+    Transport *owner = nullptr;
+    CURL *easy = nullptr;
+    bool stopped = false; // on_data asked to stop
+    bool sized = false;   // the body buffer has been taken
+};
+
+// buffers kept for reuse, and the largest one worth keeping. responses
+// are mostly a few KiB of json, and the odd huge one is not worth holding
+// on to.
+static constexpr size_t pooled_buffers = 16;
+static constexpr size_t pooled_capacity = 4 << 20;
+// no more is reserved up front whatever Content-Length says
+static constexpr size_t max_reserve = 64 << 20;
+
+static void fail(Transport::completion &done,
+                 curl_helpers::http_response &response, const char *why)
+{
+    response.error = why;
+    response.http_code = 0;
+    done(std::move(response));
+}
+
+static size_t read_stream(char *buffer, size_t size, size_t nitems,
+                          void *userdata)
+{
+    auto *body = static_cast<curl_helpers::RequestBody *>(userdata);
+    return body->read(buffer, size * nitems);
+}
+
+// curl sends the body again when a reused connection turns out to have
+// been closed, and only ever from the start
+static int seek_stream(void *userdata, curl_off_t offset, int origin)
+{
+    if (offset != 0 || origin != SEEK_SET)
+        return CURL_SEEKFUNC_CANTSEEK;
+    static_cast<curl_helpers::RequestBody *>(userdata)->rewind();
+    return CURL_SEEKFUNC_OK;
+}
+
+std::string_view host_of(std::string_view url)
+{
+    if (auto scheme = url.find("://"); scheme != std::string_view::npos)
+        url.remove_prefix(scheme + 3);
+    return url.substr(0, url.find_first_of("/?#"));
+}
+
+std::shared_ptr<Transport> Transport::create(const transport_options &options)
+{
+    static std::once_flag initialized;
+    std::call_once(initialized,
+                   [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    auto transport = std::shared_ptr<Transport>(new Transport(options));
+    if (!transport->multi_ || !transport->share_)
+        return nullptr;
+
+    transport->thread_ = std::thread([t = transport.get()] { t->run(); });
+    return transport;
+}
+
+Transport::Transport(const transport_options &options)
+    : options_(options), multi_(curl_multi_init()), share_(curl_share_init())
+{
+    if (multi_) {
+        curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                          options_.max_host_connections);
+        curl_multi_setopt(multi_, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          options_.max_total_connections);
+        curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS,
+                          options_.max_cached_connections);
+    }
+
+    // only ever touched from the transport thread, so it needs no locks
+    if (share_) {
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+}
+
+Transport::~Transport()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    if (multi_)
+        curl_multi_wakeup(multi_);
+    if (thread_.joinable())
+        thread_.join();
+
+    for (CURL *easy : idle_handles_)
+        curl_easy_cleanup(easy);
+    if (share_)
+        curl_share_cleanup(share_);
+    if (multi_)
+        curl_multi_cleanup(multi_);
+}
+
+void Transport::submit(http_request request, completion done)
+{
+    auto job = std::make_unique<transfer>();
+    job->request = std::move(request);
+    job->done = std::move(done);
+
+    {
+        std::lock_guard lock(mutex_);
+        if (!stopping_) {
+            incoming_.push_back(std::move(job));
+            job = nullptr;
+        }
+    }
+
+    if (job) {
+        fail(job->done, job->response, "transport is shutting down");
+        return;
+    }
+    curl_multi_wakeup(multi_);
+}
+
+void Transport::set_rate_limits(const std::string &key,
+                                const rate_limits &limits)
+{
+    {
+        std::lock_guard lock(mutex_);
+        new_limits_.emplace_back(key, limits);
+    }
+    curl_multi_wakeup(multi_);
+}
+
+std::optional<rate_stats>
+Transport::rate_statistics(const std::string &key) const
+{
+    std::lock_guard lock(stats_mutex_);
+    auto found = stats_.find(key);
+    if (found == stats_.end())
+        return std::nullopt;
+    return found->second;
+}
+
+std::future<curl_helpers::http_response>
+Transport::submit(http_request request)
+{
+    return as_future<curl_helpers::http_response>([&](completion done) {
+        submit(std::move(request), std::move(done));
+    });
+}
+
+curl_helpers::http_response Transport::perform(http_request request)
+{
+    return submit(std::move(request)).get();
+}
+
+Transport::endpoint &Transport::endpoint_for(const std::string &key)
+{
+    auto found = endpoints_.find(key);
+    if (found == endpoints_.end())
+        found = endpoints_
+                    .try_emplace(key, RateController(options_.limits))
+                    .first;
+    return found->second;
+}
+
+// starts whatever the rate controllers let go, and says when the next
+// request held back for a quota may go
+std::optional<std::chrono::steady_clock::time_point> Transport::dispatch()
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::optional<std::chrono::steady_clock::time_point> next;
+
+    for (auto &[key, point] : endpoints_) {
+        // a request waiting for its turn can still be cancelled or run
+        // out of time
+        for (auto it = point.waiting.begin(); it != point.waiting.end();) {
+            const call_options &options = (*it)->request.options;
+            const char *why = nullptr;
+            if (options.cancel.cancelled())
+                why = "cancelled";
+            else if (options.deadline && now >= *options.deadline)
+                why = "deadline exceeded";
+            if (!why) {
+                ++it;
+                continue;
+            }
+            fail((*it)->done, (*it)->response, why);
+            it = point.waiting.erase(it);
+        }
+
+        while (!point.waiting.empty()) {
+            const request_cost &cost = point.waiting.front()->request.cost;
+            auto ready = point.controller.ready_at(cost, now);
+            if (!ready)
+                break;
+            if (*ready > now) {
+                next = next ? std::min(*next, *ready) : *ready;
+                break;
+            }
+
+            auto job = std::move(point.waiting.front());
+            point.waiting.pop_front();
+            point.controller.start(cost, now);
+            job->started = now;
+            if (!start(job))
+                point.controller.abandon();
+        }
+    }
+
+    std::lock_guard lock(stats_mutex_);
+    for (auto &[key, point] : endpoints_) {
+        rate_stats stats = point.controller.statistics();
+        stats.waiting = point.waiting.size();
+        stats_[key] = stats;
+    }
+    return next;
+}
+
+// false when the request failed before it was sent
+bool Transport::start(std::unique_ptr<transfer> &job)
+{
+    CURL *easy;
+    if (!idle_handles_.empty()) {
+        easy = idle_handles_.back();
+        idle_handles_.pop_back();
+    } else {
+        easy = curl_easy_init();
+    }
+
+    if (!easy) {
+        fail(job->done, job->response, "failed to create a curl handle");
+        return false;
+    }
+
+    http_request &request = job->request;
+
+    // a streamed transfer has no total timeout (0 to curl) but the deadline
+    auto timeout = request.on_data ? std::chrono::milliseconds(0)
+                                   : request.timeout;
+    if (request.options.deadline) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            *request.options.deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            idle_handles_.push_back(easy);
+            fail(job->done, job->response, "deadline exceeded");
+            return false;
+        }
+        timeout = timeout.count() ? std::min(timeout, left) : left;
+    }
+    if (request.options.cancel.cancelled()) {
+        idle_handles_.push_back(easy);
+        fail(job->done, job->response, "cancelled");
+        return false;
+    }
+
+    for (const auto &header : request.headers)
+        job->headers = curl_slist_append(job->headers, header.c_str());
+
+    curl_easy_setopt(easy, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_SHARE, share_);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+                     options_.http2 ? CURL_HTTP_VERSION_2TLS
+                                    : CURL_HTTP_VERSION_1_1);
+    // wait for a connection that can multiplex rather than open another
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS,
+                     static_cast<long>(timeout.count()));
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS,
+                     static_cast<long>(request.connect_timeout.count()));
+    if (request.on_data) {
+        curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME,
+                         static_cast<long>(request.stall_timeout.count()));
+    }
+
+    curl_easy_setopt(easy, CURLOPT_POST, 1L);
+    if (request.stream) {
+        // an empty Expect skips the 100-continue round trip
+        job->headers = curl_slist_append(job->headers, "Expect:");
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, nullptr);
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                         static_cast<curl_off_t>(request.stream->size()));
+        curl_easy_setopt(easy, CURLOPT_READFUNCTION, read_stream);
+        curl_easy_setopt(easy, CURLOPT_READDATA, &*request.stream);
+        curl_easy_setopt(easy, CURLOPT_SEEKFUNCTION, seek_stream);
+        curl_easy_setopt(easy, CURLOPT_SEEKDATA, &*request.stream);
+    } else {
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request.body.data());
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                         static_cast<curl_off_t>(request.body.size()));
+    }
+
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, job->headers);
+    job->owner = this;
+    job->easy = easy;
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, receive);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, job.get());
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, job.get());
+
+    // the multi handle owns nothing of ours; the job rides along on the
+    // easy handle until it finishes
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, job.get());
+    curl_multi_add_handle(multi_, easy);
+    active_.push_back(easy);
+    job.release();
+    return true;
+}
+
+// checks for cancellation on every chunk as well, so a streamed response
+// stops at once rather than at the next poll
+size_t Transport::receive(char *data, size_t size, size_t count,
+                          void *userdata)
+{
+    auto *job = static_cast<transfer *>(userdata);
+    const size_t bytes = size * count;
+    if (job->request.options.cancel.cancelled())
+        return 0;
+
+    if (job->request.on_data) {
+        long code = 0;
+        curl_easy_getinfo(job->easy, CURLINFO_RESPONSE_CODE, &code);
+        // error bodies are collected as usual, for the error message
+        if (code / 100 == 2) {
+            if (job->request.on_data({data, bytes}))
+                return bytes;
+            job->stopped = true;
+            return 0;
+        }
+    }
+
+    if (!job->sized) {
+        job->sized = true;
+        curl_off_t length = -1;
+        curl_easy_getinfo(job->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                          &length);
+        size_t expected = length > 0 ? static_cast<size_t>(length) : bytes;
+        job->response.body =
+            job->owner->take_buffer(std::min(expected, max_reserve));
+    }
+
+    job->response.body.append(data, bytes);
+    return bytes;
+}
+
+// keeps the headers the rate controller reads. a status line, of a final
+// response after a 100 Continue, starts over.
+size_t Transport::header(char *data, size_t size, size_t count,
+                         void *userdata)
+{
+    auto *job = static_cast<transfer *>(userdata);
+    const size_t bytes = size * count;
+    std::string_view line(data, bytes);
+
+    if (line.starts_with("HTTP/")) {
+        job->rate_headers.clear();
+        return bytes;
+    }
+    // most are not wanted, which the first letter mostly tells
+    const char first = line.empty() ? 0 : static_cast<char>(line[0] | 0x20);
+    const size_t colon = line.find(':');
+    if ((first != 'r' && first != 'x') || colon == std::string_view::npos)
+        return bytes;
+
+    std::string name(line.substr(0, colon));
+    for (char &c : name)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (name != "retry-after" && !name.starts_with("x-ratelimit-"))
+        return bytes;
+
+    std::string_view value = line.substr(colon + 1);
+    const size_t from = value.find_first_not_of(" \t");
+    const size_t to = value.find_last_not_of(" \t\r\n");
+    value = from == std::string_view::npos
+                ? std::string_view()
+                : value.substr(from, to - from + 1);
+    job->rate_headers.emplace_back(std::move(name), value);
+    return bytes;
+}
+
+// the smallest pooled buffer that fits, or else the largest to grow
+std::string Transport::take_buffer(size_t size)
+{
+    std::string buffer;
+    {
+        std::lock_guard lock(pool_mutex_);
+        auto fit = pool_.end(), grow = pool_.end();
+        for (auto it = pool_.begin(); it != pool_.end(); ++it) {
+            if (it->capacity() >= size) {
+                if (fit == pool_.end() || it->capacity() < fit->capacity())
+                    fit = it;
+            } else if (grow == pool_.end() ||
+                       it->capacity() > grow->capacity()) {
+                grow = it;
+            }
+        }
+        auto best = fit != pool_.end() ? fit : grow;
+        if (best != pool_.end()) {
+            std::swap(*best, pool_.back());
+            buffer = std::move(pool_.back());
+            pool_.pop_back();
+        }
+    }
+
+    buffer.clear();
+    buffer.reserve(size);
+    return buffer;
+}
+
+void Transport::recycle(std::string buffer)
+{
+    if (buffer.capacity() == 0 || buffer.capacity() > pooled_capacity)
+        return;
+
+    std::lock_guard lock(pool_mutex_);
+    if (pool_.size() < pooled_buffers)
+        pool_.push_back(std::move(buffer));
+}
+
+void Transport::finish(CURL *easy, CURLcode result, const char *why)
+{
+    transfer *raw = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &raw);
+    std::unique_ptr<transfer> job(raw);
+
+    if (result == CURLE_WRITE_ERROR && !why) {
+        if (job->request.options.cancel.cancelled())
+            why = "cancelled";
+        else if (job->stopped)
+            why = "stopped by the receiver";
+    }
+
+    const auto &deadline = job->request.options.deadline;
+    if (result == CURLE_OPERATION_TIMEDOUT && deadline &&
+        std::chrono::steady_clock::now() >= *deadline)
+        why = "deadline exceeded";
+
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE,
+                          &job->response.http_code);
+    } else {
+        job->response.error = why ? why : curl_easy_strerror(result);
+        job->response.http_code = 0;
+    }
+
+    // cancelled, stopped and out of time say nothing about the server
+    rate_outcome outcome{.http_code = job->response.http_code,
+                         .failed = result != CURLE_OK && !why,
+                         .started = job->started,
+                         .headers = std::move(job->rate_headers)};
+    if (auto found = endpoints_.find(job->rate_key); found != endpoints_.end())
+        found->second.controller.finish(outcome,
+                                        std::chrono::steady_clock::now());
+
+    curl_multi_remove_handle(multi_, easy);
+    std::erase(active_, easy);
+    curl_slist_free_all(job->headers);
+
+    // a reset handle keeps its connection-independent caches, which is
+    // cheaper than a fresh one
+    curl_easy_reset(easy);
+    idle_handles_.push_back(easy);
+
+    job->done(std::move(job->response));
+}
+
+void Transport::run()
+{
+    while (true) {
+        std::deque<std::unique_ptr<transfer>> arrived;
+        std::vector<std::pair<std::string, rate_limits>> limits;
+        bool stopping;
+        {
+            std::lock_guard lock(mutex_);
+            arrived.swap(incoming_);
+            limits.swap(new_limits_);
+            stopping = stopping_;
+        }
+
+        if (stopping) {
+            for (auto &job : arrived)
+                fail(job->done, job->response, "transport is shutting down");
+            break;
+        }
+
+        for (auto &[key, limit] : limits)
+            endpoint_for(key).controller.configure(limit);
+        for (auto &job : arrived) {
+            const http_request &request = job->request;
+            job->rate_key = request.rate_key.empty()
+                                ? std::string(host_of(request.url))
+                                : request.rate_key;
+            endpoint_for(job->rate_key).waiting.push_back(std::move(job));
+        }
+
+        int running = 0;
+        curl_multi_perform(multi_, &running);
+
+        int queued;
+        while (CURLMsg *message = curl_multi_info_read(multi_, &queued)) {
+            if (message->msg == CURLMSG_DONE)
+                finish(message->easy_handle, message->data.result);
+        }
+
+        for (size_t i = active_.size(); i-- > 0;) {
+            transfer *job = nullptr;
+            curl_easy_getinfo(active_[i], CURLINFO_PRIVATE, &job);
+            if (job->request.options.cancel.cancelled())
+                finish(active_[i], CURLE_ABORTED_BY_CALLBACK, "cancelled");
+        }
+
+        // handles added here are driven by the next perform; the poll
+        // returns at once for them
+        auto next = dispatch();
+
+        // woken early by submit() and the destructor. cancellation has no
+        // wakeup of its own, so in-flight requests are checked this often
+        int timeout = active_.empty() ? 1000 : 100;
+        if (next) {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+                *next - std::chrono::steady_clock::now());
+            timeout = std::clamp(static_cast<int>(wait.count()), 0, timeout);
+        }
+        curl_multi_poll(multi_, nullptr, 0, timeout, nullptr);
+    }
+
+    // whatever is still in flight fails instead of leaving its caller
+    // waiting forever
+    while (!active_.empty())
+        finish(active_.back(), CURLE_ABORTED_BY_CALLBACK,
+               "transport is shutting down");
+    for (auto &[key, point] : endpoints_) {
+        for (auto &job : point.waiting)
+            fail(job->done, job->response, "transport is shutting down");
+    }
+}
+
+std::shared_ptr<Transport> shared_transport()
+{
+    static std::shared_ptr<Transport> transport = Transport::create();
+    return transport;
+}
+
+} // namespace setman::ai
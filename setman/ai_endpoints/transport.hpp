@@ -0,0 +1,188 @@
+#pragma once
+
+#include "curl_helpers.hpp"
+#include "rate_control.hpp"
+#include <atomic>
+#include <chrono>
+#include <curl/curl.h>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace setman::ai
+{
+
+// shared by every copy: cancelling one cancels the request it was handed
+// to, which then completes with an error within a poll interval
+class CancelToken
+{
+  public:
+    CancelToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() const { cancelled_->store(true); }
+    bool cancelled() const { return cancelled_->load(); }
+
+  private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// what a caller can attach to any request, whichever client sends it
+struct call_options {
+    CancelToken cancel;
+    // covers the whole call, time spent waiting for a connection included
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    // whether a client with a response cache may answer from it
+    bool use_cache = true;
+    // whether a successful response keeps its body in raw_json. failed
+    // ones always do.
+    bool keep_raw_json = false;
+};
+
+// adapts a call taking a completion callback into one returning a future
+template <typename Response, typename Start>
+std::future<Response> as_future(Start &&start)
+{
+    auto promise = std::make_shared<std::promise<Response>>();
+    auto future = promise->get_future();
+    start([promise](Response response) {
+        promise->set_value(std::move(response));
+    });
+    return future;
+}
+
+struct http_request {
+    std::string url;
+    std::vector<std::string> headers; // "Name: value"
+    std::string body;                 // POSTed unless stream is set
+    std::optional<curl_helpers::RequestBody> stream;
+
+    // when set, a 2xx response body is handed over here as it arrives
+    // instead of being collected. runs on the transport thread; returning
+    // false stops the transfer.
+    std::function<bool(std::string_view chunk)> on_data;
+
+    // the whole transfer. a streamed one (on_data) runs for as long as the
+    // answer takes, within the deadline, and is only given up once it has
+    // moved less than a byte a second for stall_timeout; servers keep
+    // their streams alive with comments while a model thinks.
+    std::chrono::milliseconds timeout{std::chrono::seconds(120)};
+    std::chrono::seconds stall_timeout{60};
+    std::chrono::milliseconds connect_timeout{std::chrono::seconds(30)};
+
+    call_options options;
+
+    // requests with the same key are paced by one rate controller. empty:
+    // the url's host. clients key by model where limits are per model.
+    std::string rate_key;
+    request_cost cost;
+};
+
+// "api.deepl.com" of "https://api.deepl.com/v2/translate"
+std::string_view host_of(std::string_view url);
+
+struct transport_options {
+    // connections per host. over HTTP/2 each one carries many requests at
+    // once, so a few are plenty
+    long max_host_connections = 4;
+    long max_total_connections = 16;
+    // idle connections kept open for reuse
+    long max_cached_connections = 16;
+
+    // for plain-http mock servers, which only speak HTTP/1.1 without
+    // negotiating an upgrade
+    bool http2 = true;
+
+    // for every rate key not given limits of its own
+    rate_limits limits;
+};
+
+// one curl_multi handle driven by its own thread. every client submitting
+// through the same Transport shares its connection pool, DNS cache and
+// TLS sessions, and requests to one host are multiplexed over HTTP/2
+// instead of each opening its own connection.
+//
+// requests wait in a queue per rate key until its RateController lets
+// them go, so a bulk job submits everything at once and goes out at the
+// most the provider takes, whichever client it came through.
+class Transport
+{
+  public:
+    using completion = std::function<void(curl_helpers::http_response)>;
+
+    static std::shared_ptr<Transport>
+    create(const transport_options &options = {});
+    ~Transport();
+
+    Transport(const Transport &) = delete;
+    Transport &operator=(const Transport &) = delete;
+
+    // `done` runs on the transport thread, so it must not block
+    void submit(http_request request, completion done);
+    std::future<curl_helpers::http_response> submit(http_request request);
+
+    // blocks the calling thread until the response arrives
+    curl_helpers::http_response perform(http_request request);
+
+    // response bodies are allocated up front from Content-Length, in
+    // buffers drawn from a pool. hand a body back once it is parsed and
+    // the next response reuses its allocation. any thread.
+    void recycle(std::string buffer);
+
+    // any thread. takes effect for requests not yet sent.
+    void set_rate_limits(const std::string &key, const rate_limits &limits);
+    std::optional<rate_stats> rate_statistics(const std::string &key) const;
+
+  private:
+    struct transfer;
+    struct endpoint {
+        RateController controller;
+        std::deque<std::unique_ptr<transfer>> waiting;
+    };
+
+    explicit Transport(const transport_options &options);
+
+    void run();
+    endpoint &endpoint_for(const std::string &key);
+    std::optional<std::chrono::steady_clock::time_point> dispatch();
+    bool start(std::unique_ptr<transfer> &job);
+    void finish(CURL *easy, CURLcode result, const char *why = nullptr);
+    static size_t receive(char *data, size_t size, size_t count,
+                          void *userdata);
+    static size_t header(char *data, size_t size, size_t count,
+                         void *userdata);
+    std::string take_buffer(size_t size);
+
+    transport_options options_;
+    CURLM *multi_;
+    CURLSH *share_;
+
+    std::mutex mutex_; // guards incoming_, new_limits_ and stopping_
+    std::deque<std::unique_ptr<transfer>> incoming_;
+    std::vector<std::pair<std::string, rate_limits>> new_limits_;
+    bool stopping_ = false;
+
+    mutable std::mutex stats_mutex_;
+    std::unordered_map<std::string, rate_stats> stats_;
+
+    std::mutex pool_mutex_;
+    std::vector<std::string> pool_;
+
+    // transport thread only
+    std::vector<CURL *> active_;
+    std::vector<CURL *> idle_handles_;
+    std::unordered_map<std::string, endpoint> endpoints_;
+    std::thread thread_;
+};
+
+// the transport every client uses unless it is handed its own
+std::shared_ptr<Transport> shared_transport();
+
+} // namespace setman::ai
@@ -0,0 +1,97 @@
+// BoundedQueue
+// blocking multi-producer multi-consumer queue with a fixed capacity
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace setman
+{
+
+// pushing into a full queue blocks until a consumer makes room, so a fast
+// stage can never run more than `capacity` items ahead of a slow one.
+// close() wakes everyone: pushes fail from then on, and pops drain what
+// is left before returning nullopt.
+template <typename T> class BoundedQueue
+{
+  public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(std::max<size_t>(1, capacity))
+    {
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    // false once the queue is closed; the value is dropped
+    bool push(T value)
+    {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock,
+                       [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+
+        items_.push_back(std::move(value));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    std::optional<T> pop()
+    {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        return take(lock);
+    }
+
+    // nullopt on timeout as well as once closed and drained
+    std::optional<T> pop_until(std::chrono::steady_clock::time_point until)
+    {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait_until(lock, until,
+                              [&] { return closed_ || !items_.empty(); });
+        return take(lock);
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard lock(mutex_);
+            closed_ = true;
+        }
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    size_t capacity() const { return capacity_; }
+
+  private:
+    std::optional<T> take(std::unique_lock<std::mutex> &lock)
+    {
+        if (items_.empty())
+            return std::nullopt;
+
+        std::optional<T> value(std::move(items_.front()));
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return value;
+    }
+
+    const size_t capacity_;
+
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+} // namespace setman
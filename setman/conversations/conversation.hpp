@@ -56,6 +56,7 @@ class Conversation
         {
             return translation_;
         }
+        language translated_language() const { return translated_language_; }
         void new_translation(const std::string &content, language language);
         void clear_translation();
 
@@ -118,6 +119,10 @@ class Conversation
     ~Conversation() = default;
 
     const std::vector<Message> &history() const { return history_; }
+    VecSubrange<Message> messages()
+    {
+        return {history_.begin(), history_.end()};
+    }
 
     ConstVecSubrange<Message> last(size_t number) const;
     Message &last() { return history_.back(); }
@@ -1,17 +1,70 @@
 // Database
 // implementation
 #include "database.hpp"
+#include "journal.hpp"
+
+// posix
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+// std
+#include <fstream>
+#include <span>
 
 namespace setman
 {
 
-Database::Database(const path &location) : database_(nullptr)
+static void bind_text(sqlite3_stmt *stmt, int index, const std::string &text)
+{
+    sqlite3_bind_text(stmt, index, text.c_str(), text.size(), SQLITE_STATIC);
+}
+
+static Error exec(sqlite3 *db, const char *sql)
+{
+    char *err_msg = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        std::string error = err_msg ? err_msg : sqlite3_errmsg(db);
+        sqlite3_free(err_msg);
+        return {Code::database_error, error};
+    }
+    return Code::success;
+}
+
+static Error step_once(sqlite3 *db, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE)
+        return {Code::database_error, sqlite3_errmsg(db)};
+    return Code::success;
+}
+
+static sqlite3 *open_connection(const std::filesystem::path &location)
 {
-    sqlite3_open(location.c_str(), &database_);
+    sqlite3 *connection = nullptr;
+    sqlite3_open(location.c_str(), &connection);
+    return connection;
+}
+
+Database::Database(const path &location)
+    : database_(open_connection(location)), statements_(database_),
+      recorder_(database_, default_sync_policies())
+{
+    // WAL lets the read pool keep snapshots open while this connection writes
+    exec(database_, "PRAGMA journal_mode = WAL");
+    exec(database_, "PRAGMA synchronous = NORMAL");
+    sqlite3_busy_timeout(database_, busy_timeout_ms);
 }
 
 Database::~Database()
 {
+    // anything written outside apply() would otherwise die with the session
+    if (!recorder_.empty())
+        stash_changes();
+    recorder_.stop();
+    statements_.clear();
     if (database_)
         sqlite3_close(database_);
 }
@@ -19,6 +72,15 @@ Database::~Database()
 Error Database::init_schema()
 {
     const char *schema = R"(
+          CREATE TABLE IF NOT EXISTS meta (
+              key TEXT PRIMARY KEY,
+              value INTEGER
+          );
+
+          -- bumped by every commit so caches built from the database, such
+          -- as project snapshots, can tell when they are stale
+          INSERT OR IGNORE INTO meta (key, value) VALUES ('generation', 0);
+
           CREATE TABLE IF NOT EXISTS companies (
               uuid TEXT PRIMARY KEY,
               name TEXT NOT NULL
@@ -29,7 +91,7 @@ Error Database::init_schema()
               parent_company_uuid TEXT,
               name TEXT NOT NULL,
               naming_convention TEXT,
-              FOREIGN KEY(company_uuid) REFERENCES companies(uuid)
+              FOREIGN KEY(parent_company_uuid) REFERENCES companies(uuid)
           );
 
           CREATE TABLE IF NOT EXISTS episodes (
@@ -39,7 +101,7 @@ Error Database::init_schema()
               location TEXT,
               up_folder TEXT,
               cels_folder TEXT,
-              FOREIGN KEY(series_uuid) REFERENCES series(uuid)
+              FOREIGN KEY(parent_series_uuid) REFERENCES series(uuid)
           );
 
           CREATE TABLE IF NOT EXISTS materials (
@@ -48,14 +110,115 @@ Error Database::init_schema()
               type TEXT,
               parent_uuid TEXT,
               path TEXT,
-              FOREIGN KEY(episode_uuid) REFERENCES episodes(uuid)
+              notes TEXT,
+              alias TEXT,
+              FOREIGN KEY(parent_episode_uuid) REFERENCES episodes(uuid),
+              FOREIGN KEY(parent_uuid) REFERENCES materials(uuid)
           );
 
           CREATE TABLE IF NOT EXISTS tags (
-              material_uuid TEXT,
-              tag TEXT,
+              material_uuid TEXT NOT NULL,
+              tag TEXT NOT NULL,
+              PRIMARY KEY(material_uuid, tag),
+              FOREIGN KEY(material_uuid) REFERENCES materials(uuid)
+          ) WITHOUT ROWID;
+
+          -- history rows never change once written, so the whole row is
+          -- the key. that also lets sync tell a known entry from a new one.
+          CREATE TABLE IF NOT EXISTS cut_history (
+              cut_uuid TEXT NOT NULL,
+              status TEXT NOT NULL,
+              time INTEGER NOT NULL,
+              PRIMARY KEY(cut_uuid, time, status),
+              FOREIGN KEY(cut_uuid) REFERENCES materials(uuid)
+          ) WITHOUT ROWID;
+
+          -- the latest history entry per cut
+          CREATE TABLE IF NOT EXISTS cut_status (
+              cut_uuid TEXT PRIMARY KEY,
+              status TEXT NOT NULL,
+              time INTEGER NOT NULL,
+              FOREIGN KEY(cut_uuid) REFERENCES materials(uuid)
+          );
+
+          CREATE TABLE IF NOT EXISTS ocr_results (
+              material_uuid TEXT PRIMARY KEY,
+              model TEXT,
+              text TEXT NOT NULL,
+              time INTEGER,
+              FOREIGN KEY(material_uuid) REFERENCES materials(uuid)
+          );
+
+          -- content hash, size and mtime of each material's file as of the
+          -- last scan. mtimes mean nothing on another workstation, so this
+          -- table is not synced; each side rebuilds it when it scans.
+          CREATE TABLE IF NOT EXISTS file_identities (
+              material_uuid TEXT PRIMARY KEY,
+              hash TEXT NOT NULL,
+              size INTEGER NOT NULL,
+              mtime INTEGER NOT NULL,
+              dhash INTEGER,
+              FOREIGN KEY(material_uuid) REFERENCES materials(uuid)
+          );
+
+          -- progress of bulk ocr runs, so an interrupted run resumes where
+          -- it stopped. local bookkeeping like file_identities, not synced.
+          CREATE TABLE IF NOT EXISTS ocr_jobs (
+              material_uuid TEXT PRIMARY KEY,
+              hash TEXT,
+              state TEXT NOT NULL,
+              attempts INTEGER NOT NULL DEFAULT 0,
+              error TEXT,
+              time INTEGER,
               FOREIGN KEY(material_uuid) REFERENCES materials(uuid)
           );
+
+          -- ai responses by request fingerprint, so repeating a request
+          -- costs nothing. a local cache, not synced.
+          CREATE TABLE IF NOT EXISTS response_cache (
+              key TEXT PRIMARY KEY,
+              body TEXT NOT NULL,
+              size INTEGER NOT NULL,
+              created INTEGER NOT NULL,
+              accessed INTEGER NOT NULL
+          );
+
+          -- covering indexes for the common access paths. tags are already
+          -- clustered by material through their primary key.
+
+          CREATE INDEX IF NOT EXISTS series_by_company
+              ON series(parent_company_uuid, uuid);
+          CREATE INDEX IF NOT EXISTS episodes_by_series
+              ON episodes(parent_series_uuid, number, uuid);
+          CREATE INDEX IF NOT EXISTS materials_by_episode
+              ON materials(parent_episode_uuid, type, uuid);
+          CREATE INDEX IF NOT EXISTS materials_by_parent
+              ON materials(parent_uuid, uuid);
+          CREATE INDEX IF NOT EXISTS tags_by_tag
+              ON tags(tag, material_uuid);
+          CREATE INDEX IF NOT EXISTS file_identities_by_hash
+              ON file_identities(hash, size, material_uuid);
+          CREATE INDEX IF NOT EXISTS response_cache_by_access
+              ON response_cache(accessed, size);
+
+          -- full text search. rowids mirror materials.rowid. trigram
+          -- tokenizing copes with japanese text that has no word breaks.
+
+          CREATE VIRTUAL TABLE IF NOT EXISTS material_search USING fts5(
+              material_uuid UNINDEXED,
+              episode_uuid UNINDEXED,
+              notes,
+              alias,
+              tags,
+              ocr,
+              tokenize = 'trigram'
+          );
+
+          -- changesets recorded by each commit, waiting to be exported
+          CREATE TABLE IF NOT EXISTS sync_outbox (
+              id INTEGER PRIMARY KEY,
+              changes BLOB NOT NULL
+          );
       )";
 
     char *err_msg;
@@ -69,4 +232,555 @@ Error Database::init_schema()
     return Code::success;
 }
 
+std::expected<uint64_t, Error> Database::generation()
+{
+    sqlite3_stmt *stmt =
+        statements_.get("SELECT value FROM meta WHERE key = 'generation'");
+    if (!stmt)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(database_)));
+
+    int rc = sqlite3_step(stmt);
+    uint64_t value =
+        rc == SQLITE_ROW ? static_cast<uint64_t>(sqlite3_column_int64(stmt, 0))
+                         : 0;
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(database_)));
+    return value;
+}
+
+//
+// incremental saves
+//
+
+Error Database::apply(const journal_batch &batch)
+{
+    return apply(std::span<const journal_batch>(&batch, 1));
+}
+
+Error Database::apply(std::span<const journal_batch> batches)
+{
+    bool has_rows = false;
+    for (const auto &batch : batches)
+        has_rows = has_rows || !batch.empty();
+    if (!has_rows)
+        return Code::success;
+
+    if (Error err = exec(database_, "BEGIN IMMEDIATE"); !err)
+        return err;
+
+    // batches are written in order so a later batch wins over an earlier one
+    for (const auto &batch : batches) {
+        if (Error err = write_rows(batch); !err) {
+            exec(database_, "ROLLBACK");
+            return err;
+        }
+    }
+
+    // the changes go into the outbox in the same transaction that made
+    // them, so a crash can never lose a committed edit from the next sync
+    if (Error err = stash_changes(); !err) {
+        exec(database_, "ROLLBACK");
+        return err;
+    }
+
+    if (Error err = bump_generation(); !err) {
+        exec(database_, "ROLLBACK");
+        return err;
+    }
+
+    if (Error err = exec(database_, "COMMIT"); !err) {
+        exec(database_, "ROLLBACK");
+        return err;
+    }
+
+    return Code::success;
+}
+
+Error Database::bump_generation()
+{
+    sqlite3_stmt *stmt = statements_.get(
+        "UPDATE meta SET value = value + 1 WHERE key = 'generation'");
+    return step_once(database_, stmt);
+}
+
+// rebuilds one material's search row from its stored notes, alias, tags
+// and ocr text
+static constexpr char unindex_material[] =
+    "DELETE FROM material_search "
+    "WHERE rowid = (SELECT rowid FROM materials WHERE uuid = ?)";
+
+static constexpr char index_material[] =
+    "INSERT INTO material_search "
+    "(rowid, material_uuid, episode_uuid, notes, alias, tags, ocr) "
+    "SELECT m.rowid, m.uuid, m.parent_episode_uuid, m.notes, m.alias, "
+    "(SELECT group_concat(t.tag, ' ') FROM tags t "
+    "WHERE t.material_uuid = m.uuid), "
+    "(SELECT o.text FROM ocr_results o WHERE o.material_uuid = m.uuid) "
+    "FROM materials m WHERE m.uuid = ?";
+
+Error Database::reindex_material(const std::string &uuid)
+{
+    for (const char *sql : {unindex_material, index_material}) {
+        sqlite3_stmt *stmt = statements_.get(sql);
+        bind_text(stmt, 1, uuid);
+        if (Error err = step_once(database_, stmt); !err)
+            return err;
+    }
+    return Code::success;
+}
+
+Error Database::write_rows(const journal_batch &batch)
+{
+    static constexpr char upsert_episode[] =
+        "INSERT INTO episodes "
+        "(uuid, parent_series_uuid, number, location, up_folder, cels_folder) "
+        "VALUES (?, ?, ?, ?, ?, ?) "
+        "ON CONFLICT(uuid) DO UPDATE SET "
+        "parent_series_uuid = excluded.parent_series_uuid, "
+        "number = excluded.number, location = excluded.location, "
+        "up_folder = excluded.up_folder, cels_folder = excluded.cels_folder";
+
+    static constexpr char upsert_material[] =
+        "INSERT INTO materials "
+        "(uuid, parent_episode_uuid, type, parent_uuid, path, notes, alias) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?) "
+        "ON CONFLICT(uuid) DO UPDATE SET "
+        "parent_episode_uuid = excluded.parent_episode_uuid, "
+        "type = excluded.type, parent_uuid = excluded.parent_uuid, "
+        "path = excluded.path, notes = excluded.notes, alias = excluded.alias";
+
+    if (!batch.episodes.empty()) {
+        sqlite3_stmt *stmt = statements_.get(upsert_episode);
+        for (const auto &row : batch.episodes) {
+            bind_text(stmt, 1, row.uuid);
+            bind_text(stmt, 2, row.series_uuid);
+            sqlite3_bind_int(stmt, 3, row.number);
+            bind_text(stmt, 4, row.location);
+            bind_text(stmt, 5, row.up_folder);
+            bind_text(stmt, 6, row.cels_folder);
+            if (Error err = step_once(database_, stmt); !err)
+                return err;
+        }
+    }
+
+    if (!batch.materials.empty()) {
+        sqlite3_stmt *stmt = statements_.get(upsert_material);
+        sqlite3_stmt *clear_tags =
+            statements_.get("DELETE FROM tags WHERE material_uuid = ?");
+        sqlite3_stmt *insert_tag = statements_.get(
+            "INSERT OR IGNORE INTO tags (material_uuid, tag) VALUES (?, ?)");
+        sqlite3_stmt *upsert_identity = statements_.get(
+            "INSERT INTO file_identities "
+            "(material_uuid, hash, size, mtime, dhash) "
+            "VALUES (?, ?, ?, ?, ?) "
+            "ON CONFLICT(material_uuid) DO UPDATE SET "
+            "hash = excluded.hash, size = excluded.size, "
+            "mtime = excluded.mtime, dhash = excluded.dhash");
+        sqlite3_stmt *clear_identity = statements_.get(
+            "DELETE FROM file_identities WHERE material_uuid = ?");
+
+        for (const auto &row : batch.materials) {
+            bind_text(stmt, 1, row.uuid);
+            bind_text(stmt, 2, row.episode_uuid);
+            bind_text(stmt, 3, row.type);
+            if (row.parent_uuid)
+                bind_text(stmt, 4, *row.parent_uuid);
+            else
+                sqlite3_bind_null(stmt, 4);
+            bind_text(stmt, 5, row.path);
+            bind_text(stmt, 6, row.notes);
+            bind_text(stmt, 7, row.alias);
+            if (Error err = step_once(database_, stmt); !err)
+                return err;
+
+            bind_text(clear_tags, 1, row.uuid);
+            if (Error err = step_once(database_, clear_tags); !err)
+                return err;
+
+            for (const auto &tag : row.tags) {
+                bind_text(insert_tag, 1, row.uuid);
+                bind_text(insert_tag, 2, tag);
+                if (Error err = step_once(database_, insert_tag); !err)
+                    return err;
+            }
+
+            if (row.identity) {
+                // bound without a copy, so it has to outlive the step
+                std::string hash = row.identity->hash.to_string();
+                bind_text(upsert_identity, 1, row.uuid);
+                bind_text(upsert_identity, 2, hash);
+                sqlite3_bind_int64(upsert_identity, 3,
+                                   static_cast<int64_t>(row.identity->size));
+                sqlite3_bind_int64(upsert_identity, 4, row.identity->mtime);
+                if (row.identity->dhash)
+                    sqlite3_bind_int64(
+                        upsert_identity, 5,
+                        static_cast<int64_t>(*row.identity->dhash));
+                else
+                    sqlite3_bind_null(upsert_identity, 5);
+                if (Error err = step_once(database_, upsert_identity); !err)
+                    return err;
+            } else {
+                bind_text(clear_identity, 1, row.uuid);
+                if (Error err = step_once(database_, clear_identity); !err)
+                    return err;
+            }
+
+            if (Error err = reindex_material(row.uuid); !err)
+                return err;
+        }
+    }
+
+    if (!batch.ocr_results.empty()) {
+        sqlite3_stmt *stmt = statements_.get(
+            "INSERT INTO ocr_results (material_uuid, model, text, time) "
+            "VALUES (?, ?, ?, ?) "
+            "ON CONFLICT(material_uuid) DO UPDATE SET "
+            "model = excluded.model, text = excluded.text, "
+            "time = excluded.time");
+        for (const auto &row : batch.ocr_results) {
+            bind_text(stmt, 1, row.material_uuid);
+            bind_text(stmt, 2, row.model);
+            bind_text(stmt, 3, row.text);
+            sqlite3_bind_int64(stmt, 4, row.time);
+            if (Error err = step_once(database_, stmt); !err)
+                return err;
+
+            if (Error err = reindex_material(row.material_uuid); !err)
+                return err;
+        }
+    }
+
+    if (!batch.statuses.empty()) {
+        sqlite3_stmt *history = statements_.get(
+            "INSERT OR IGNORE INTO cut_history (cut_uuid, status, time) "
+            "VALUES (?, ?, ?)");
+        sqlite3_stmt *latest = statements_.get(
+            "INSERT INTO cut_status (cut_uuid, status, time) VALUES (?, ?, ?) "
+            "ON CONFLICT(cut_uuid) DO UPDATE SET "
+            "status = excluded.status, time = excluded.time "
+            "WHERE excluded.time >= cut_status.time");
+        for (const auto &row : batch.statuses) {
+            for (sqlite3_stmt *stmt : {history, latest}) {
+                bind_text(stmt, 1, row.cut_uuid);
+                bind_text(stmt, 2, row.status);
+                sqlite3_bind_int64(stmt, 3, row.time);
+                if (Error err = step_once(database_, stmt); !err)
+                    return err;
+            }
+        }
+    }
+
+    if (!batch.erased_materials.empty()) {
+        sqlite3_stmt *clear_tags =
+            statements_.get("DELETE FROM tags WHERE material_uuid = ?");
+        sqlite3_stmt *clear_history =
+            statements_.get("DELETE FROM cut_history WHERE cut_uuid = ?");
+        sqlite3_stmt *clear_status =
+            statements_.get("DELETE FROM cut_status WHERE cut_uuid = ?");
+        sqlite3_stmt *clear_ocr =
+            statements_.get("DELETE FROM ocr_results WHERE material_uuid = ?");
+        sqlite3_stmt *clear_identity = statements_.get(
+            "DELETE FROM file_identities WHERE material_uuid = ?");
+        sqlite3_stmt *clear_ocr_job =
+            statements_.get("DELETE FROM ocr_jobs WHERE material_uuid = ?");
+        sqlite3_stmt *unindex = statements_.get(unindex_material);
+        sqlite3_stmt *stmt =
+            statements_.get("DELETE FROM materials WHERE uuid = ?");
+        for (const auto &uuid : batch.erased_materials) {
+            for (sqlite3_stmt *s :
+                 {unindex, clear_tags, clear_history, clear_status, clear_ocr,
+                  clear_identity, clear_ocr_job, stmt}) {
+                bind_text(s, 1, uuid);
+                if (Error err = step_once(database_, s); !err)
+                    return err;
+            }
+        }
+    }
+
+    return Code::success;
+}
+
+Error Database::flush(ChangeJournal &journal)
+{
+    last_flush_ = std::chrono::steady_clock::now();
+
+    // the journal holds on to what failed, and the next flush retries it
+    Error result = apply(journal.snapshot());
+    if (result)
+        journal.commit();
+    return result;
+}
+
+Error Database::autosave(ChangeJournal &journal)
+{
+    if (journal.empty())
+        return Code::success;
+
+    bool due = std::chrono::steady_clock::now() - last_flush_ >=
+               autosave_interval_;
+    if (!due && journal.pending() < autosave_threshold_)
+        return Code::success;
+
+    return flush(journal);
+}
+
+//
+// ocr and search
+//
+
+Error Database::save_ocr_result(const std::string &material_uuid,
+                                const std::string &model,
+                                const std::string &text)
+{
+    auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+
+    journal_batch batch;
+    batch.ocr_results.push_back(
+        {material_uuid, model, text,
+         std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch)
+             .count()});
+    return apply(batch);
+}
+
+std::expected<std::vector<search_hit>, Error>
+Database::search(const search_query &query)
+{
+    return search_materials(database_, statements_, query);
+}
+
+//
+// file identities
+//
+
+std::expected<std::vector<duplicate_group>, Error>
+Database::duplicates(const std::optional<std::string> &episode_uuid)
+{
+    return find_duplicates(database_, statements_, episode_uuid);
+}
+
+std::expected<std::unordered_map<std::string, materials::file_identity>, Error>
+Database::file_identities(const std::string &episode_uuid)
+{
+    return stored_identities(database_, statements_, episode_uuid);
+}
+
+//
+// sync
+//
+
+Error Database::stash_changes()
+{
+    if (recorder_.empty())
+        return Code::success;
+
+    auto changes = recorder_.take();
+    if (!changes)
+        return changes.error();
+
+    sqlite3_stmt *stmt =
+        statements_.get("INSERT INTO sync_outbox (changes) VALUES (?)");
+    if (!stmt)
+        return {Code::database_error, sqlite3_errmsg(database_)};
+    sqlite3_bind_blob(stmt, 1, changes->data(), changes->size(),
+                      SQLITE_STATIC);
+    return step_once(database_, stmt);
+}
+
+// collects the outbox up to and including the returned id
+static std::expected<std::pair<changeset, int64_t>, Error>
+read_outbox(sqlite3 *db, StatementCache &statements)
+{
+    sqlite3_stmt *stmt =
+        statements.get("SELECT id, changes FROM sync_outbox ORDER BY id");
+    if (!stmt)
+        return std::unexpected(Error(Code::database_error, sqlite3_errmsg(db)));
+
+    std::vector<changeset> parts;
+    int64_t last_id = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        last_id = sqlite3_column_int64(stmt, 0);
+        auto data =
+            static_cast<const unsigned char *>(sqlite3_column_blob(stmt, 1));
+        parts.emplace_back(data, data + sqlite3_column_bytes(stmt, 1));
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+        return std::unexpected(Error(Code::database_error, sqlite3_errmsg(db)));
+
+    auto combined = combine_changesets(parts);
+    if (!combined)
+        return std::unexpected(combined.error());
+    return std::pair{std::move(*combined), last_id};
+}
+
+std::expected<changeset, Error> Database::pending_changeset()
+{
+    if (!recorder_.empty()) {
+        if (Error err = exec(database_, "BEGIN IMMEDIATE"); !err)
+            return std::unexpected(err);
+        if (Error err = stash_changes(); !err) {
+            exec(database_, "ROLLBACK");
+            return std::unexpected(err);
+        }
+        if (Error err = exec(database_, "COMMIT"); !err) {
+            exec(database_, "ROLLBACK");
+            return std::unexpected(err);
+        }
+    }
+
+    auto outbox = read_outbox(database_, statements_);
+    if (!outbox)
+        return std::unexpected(outbox.error());
+    return std::move(outbox->first);
+}
+
+static Error fsync_directory(const std::filesystem::path &directory)
+{
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return {Code::file_open_failed, directory.string()};
+    int rc;
+    while ((rc = ::fsync(fd)) < 0 && errno == EINTR) {
+    }
+    ::close(fd);
+    if (rc < 0)
+        return {Code::file_write_failed, directory.string()};
+    return Code::success;
+}
+
+// writes `bytes` to a temporary next to `file`, renames it into place and
+// syncs the file and then its directory, so once this returns the file
+// survives a crash or a power cut
+static Error write_durably(const std::filesystem::path &file,
+                           std::span<const unsigned char> bytes)
+{
+    std::filesystem::path temporary = file;
+    temporary += ".tmp";
+
+    int fd = ::open(temporary.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return {Code::file_open_failed, temporary.string()};
+
+    size_t written = 0;
+    while (written < bytes.size()) {
+        ssize_t n = ::write(fd, bytes.data() + written, bytes.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ::close(fd);
+            return {Code::file_write_failed, temporary.string()};
+        }
+        written += static_cast<size_t>(n);
+    }
+    int rc;
+    while ((rc = ::fsync(fd)) < 0 && errno == EINTR) {
+    }
+    if (::close(fd) < 0 || rc < 0)
+        return {Code::file_write_failed, temporary.string()};
+
+    std::error_code ec;
+    std::filesystem::rename(temporary, file, ec);
+    if (ec)
+        return {Code::file_write_failed, ec.message()};
+
+    // the rename is only durable once the directory entry is
+    std::filesystem::path directory = file.parent_path();
+    if (directory.empty())
+        directory = ".";
+    return fsync_directory(directory);
+}
+
+Error Database::export_changeset(const path &file)
+{
+    // stashes whatever the session still holds
+    if (auto pending = pending_changeset(); !pending)
+        return pending.error();
+
+    auto outbox = read_outbox(database_, statements_);
+    if (!outbox)
+        return outbox.error();
+    const auto &[changes, last_id] = *outbox;
+
+    // the outbox may hold the only copy of these changes, so it is only
+    // cleared once the file is on disk
+    if (Error err = write_durably(file, changes); !err)
+        return err;
+
+    // commits made since the outbox was read stay for the next export
+    sqlite3_stmt *stmt =
+        statements_.get("DELETE FROM sync_outbox WHERE id <= ?");
+    sqlite3_bind_int64(stmt, 1, last_id);
+    return step_once(database_, stmt);
+}
+
+std::expected<sync_report, Error>
+Database::apply_changeset(std::span<const unsigned char> changes,
+                          const sync_policies &policies)
+{
+    auto materials = changed_materials(changes);
+    if (!materials)
+        return std::unexpected(materials.error());
+
+    if (Error err = exec(database_, "BEGIN IMMEDIATE"); !err)
+        return std::unexpected(err);
+
+    recorder_.pause();
+    auto fail = [&](Error err) -> std::expected<sync_report, Error> {
+        exec(database_, "ROLLBACK");
+        recorder_.resume();
+        return std::unexpected(err);
+    };
+
+    // search rows are derived locally and keyed by the local rowid, so they
+    // are dropped before the material rows move and rebuilt afterwards
+    sqlite3_stmt *unindex = statements_.get(unindex_material);
+    for (const auto &uuid : *materials) {
+        bind_text(unindex, 1, uuid);
+        if (Error err = step_once(database_, unindex); !err)
+            return fail(err);
+    }
+
+    auto report = setman::apply_changeset(database_, changes, policies);
+    if (!report)
+        return fail(report.error());
+
+    sqlite3_stmt *index = statements_.get(index_material);
+    for (const auto &uuid : *materials) {
+        bind_text(index, 1, uuid);
+        if (Error err = step_once(database_, index); !err)
+            return fail(err);
+    }
+
+    if (Error err = bump_generation(); !err)
+        return fail(err);
+
+    if (Error err = exec(database_, "COMMIT"); !err)
+        return fail(err);
+
+    recorder_.resume();
+    return report;
+}
+
+std::expected<sync_report, Error>
+Database::import_changeset(const path &file, const sync_policies &policies)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        return std::unexpected(Error(Code::file_open_failed, file.string()));
+
+    changeset changes((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+    if (in.bad())
+        return std::unexpected(Error(Code::file_read_failed, file.string()));
+
+    return apply_changeset(changes, policies);
+}
+
 } // namespace setman
@@ -5,9 +5,21 @@
 // sqlite
 #include <sqlite3.h>
 // setman
+#include "duplicates.hpp"
 #include "error.hpp"
+#include "search.hpp"
+#include "statement_cache.hpp"
+#include "sync.hpp"
 // std
+#include <chrono>
+#include <cstdint>
+#include <expected>
 #include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
 // boost
 #include <boost/uuid/uuid.hpp>
 
@@ -23,6 +35,8 @@ class Company;
 class Series;
 class Episode;
 class Conversation;
+class ChangeJournal;
+struct journal_batch;
 
 class Database
 {
@@ -31,14 +45,100 @@ class Database
     Database(const path &location);
     ~Database();
 
+    static constexpr int busy_timeout_ms = 5000;
+
     Error save_company(const Company &company);
     Error save_series(const Series &series);
     Error save_episode(const Episode &episode);
     Error init_schema();
 
+    // incremented by every successful commit
+    std::expected<uint64_t, Error> generation();
+
+    //
+    // incremental saves
+    //
+
+    // writes a batch as UPSERTs and DELETEs in one transaction
+    Error apply(const journal_batch &batch);
+
+    // group commit: every batch, in order, inside a single transaction
+    Error apply(std::span<const journal_batch> batches);
+
+    // applies everything pending in the journal, which is cleared only once
+    // the transaction commits
+    Error flush(ChangeJournal &journal);
+
+    // flushes only when the autosave interval has elapsed or enough changes
+    // have piled up, so it is cheap to call after every edit
+    Error autosave(ChangeJournal &journal);
+
+    void set_autosave_interval(std::chrono::milliseconds interval)
+    {
+        autosave_interval_ = interval;
+    }
+    void set_autosave_threshold(size_t pending) { autosave_threshold_ = pending; }
+
+    //
+    // ocr and search
+    //
+
+    Error save_ocr_result(const std::string &material_uuid,
+                          const std::string &model, const std::string &text);
+
+    std::expected<std::vector<search_hit>, Error>
+    search(const search_query &query);
+
+    //
+    // file identities
+    //
+
+    // written along with their materials; see
+    // Episode::refresh_file_identities
+    std::expected<std::vector<duplicate_group>, Error>
+    duplicates(const std::optional<std::string> &episode_uuid = std::nullopt);
+
+    std::expected<std::unordered_map<std::string, materials::file_identity>,
+                  Error>
+    file_identities(const std::string &episode_uuid);
+
+    //
+    // sync
+    //
+
+    // every commit records what it changed into an outbox that survives
+    // restarts. exporting hands over all of it as one merged changeset.
+    std::expected<changeset, Error> pending_changeset();
+
+    // writes the pending changeset to a file and only then empties the
+    // outbox, so a failed export loses nothing
+    Error export_changeset(const path &file);
+
+    // applies another database's changeset in one transaction. applied rows
+    // are not recorded again, so two workstations never ping-pong edits.
+    std::expected<sync_report, Error>
+    apply_changeset(std::span<const unsigned char> changes,
+                    const sync_policies &policies = default_sync_policies());
+    std::expected<sync_report, Error>
+    import_changeset(const path &file,
+                     const sync_policies &policies = default_sync_policies());
+
     sqlite3 *handle() const { return database_; }
+    StatementCache &statements() { return statements_; }
+
   private:
+    Error write_rows(const journal_batch &batch);
+    Error reindex_material(const std::string &uuid);
+    Error bump_generation();
+    Error stash_changes();
+
     sqlite3 *database_;
+    StatementCache statements_;
+    ChangeRecorder recorder_;
+
+    std::chrono::milliseconds autosave_interval_{std::chrono::seconds(5)};
+    size_t autosave_threshold_ = 256;
+    std::chrono::steady_clock::time_point last_flush_;
 };
 
 } // namespace setman
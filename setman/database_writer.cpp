@@ -0,0 +1,146 @@
+// DatabaseWriter
+// implementation
+#include "database_writer.hpp"
+
+// std
+#include <algorithm>
+#include <vector>
+
+namespace setman
+{
+
+// how long a group that failed to commit waits before it is tried again
+static constexpr std::chrono::milliseconds first_retry{100};
+static constexpr std::chrono::milliseconds max_retry{5000};
+
+DatabaseWriter::DatabaseWriter(const path &location) : database_(location)
+{
+    // before the thread takes the connection over
+    if (Error err = database_.init_schema(); !err)
+        last_error_.emplace(err);
+    thread_ = std::jthread([this](std::stop_token stop) { run(stop); });
+}
+
+DatabaseWriter::~DatabaseWriter()
+{
+    thread_.request_stop();
+    wake_.release();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void DatabaseWriter::push(job entry)
+{
+    queue_.push(std::move(entry));
+    wake_.release();
+}
+
+void DatabaseWriter::enqueue(journal_batch batch)
+{
+    if (batch.empty())
+        return;
+    push({std::move(batch), std::nullopt});
+}
+
+std::future<Error> DatabaseWriter::submit(journal_batch batch)
+{
+    std::promise<Error> done;
+    auto result = done.get_future();
+    push({std::move(batch), std::move(done)});
+    return result;
+}
+
+std::future<Error> DatabaseWriter::flush() { return submit({}); }
+
+void DatabaseWriter::autosave(ChangeJournal &journal)
+{
+    if (!journal.empty())
+        enqueue(journal.drain());
+}
+
+std::optional<Error> DatabaseWriter::take_error()
+{
+    std::lock_guard lock(error_mutex_);
+    std::optional<Error> err;
+    if (last_error_)
+        err.emplace(*last_error_);
+    last_error_.reset();
+    return err;
+}
+
+void DatabaseWriter::run(std::stop_token stop)
+{
+    // a group that fails to commit stays at the front, in order, and is
+    // tried again with whatever arrived since, so later snapshots of the
+    // same rows still land on top of it
+    std::vector<journal_batch> group;
+    std::vector<std::promise<Error>> waiting;
+    std::chrono::milliseconds backoff{0};
+    std::chrono::steady_clock::time_point retry_at;
+
+    while (true) {
+        if (!group.empty()) {
+            while (!stop.stop_requested() &&
+                   std::chrono::steady_clock::now() < retry_at)
+                wake_.try_acquire_until(retry_at);
+        } else if (!stop.stop_requested() && queue_.empty()) {
+            // wakes can be spent without taking the work they announced,
+            // while a full group or a retry waits
+            wake_.acquire();
+        }
+
+        // once something arrives, keep collecting until the latency budget
+        // runs out, the group is full, or somebody is waiting on a commit
+        bool stopping = stop.stop_requested();
+        bool commit_now = stopping || !group.empty();
+        auto deadline =
+            std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(max_latency_.load(std::memory_order_relaxed));
+        size_t limit = max_group_.load(std::memory_order_relaxed);
+
+        for (size_t taken = 0; taken < limit;) {
+            auto entry = queue_.pop();
+            if (!entry) {
+                if (commit_now || !wake_.try_acquire_until(deadline))
+                    break;
+                continue;
+            }
+
+            group.push_back(std::move(entry->batch));
+            taken++;
+            if (entry->done) {
+                waiting.push_back(std::move(*entry->done));
+                commit_now = true;
+            }
+        }
+
+        if (!group.empty()) {
+            Error result = database_.apply(group);
+            if (result) {
+                group.clear();
+                backoff = std::chrono::milliseconds(0);
+            } else {
+                std::lock_guard lock(error_mutex_);
+                last_error_.reset();
+                last_error_.emplace(result);
+
+                backoff = backoff.count() == 0
+                              ? first_retry
+                              : std::min(backoff * 2, max_retry);
+                retry_at = std::chrono::steady_clock::now() + backoff;
+            }
+
+            // waiters hear of the failure; their rows are retried all the
+            // same
+            for (auto &done : waiting)
+                done.set_value(result);
+            waiting.clear();
+        }
+
+        // what still fails once everything queued has been tried is lost
+        if (stopping && queue_.empty())
+            return;
+    }
+}
+
+} // namespace setman
@@ -0,0 +1,89 @@
+// DatabaseWriter
+// write-behind thread that owns the write connection
+#pragma once
+
+// setman
+#include "database.hpp"
+#include "error.hpp"
+#include "journal.hpp"
+#include "mpsc_queue.hpp"
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <thread>
+
+namespace setman
+{
+
+class DatabaseWriter
+{
+  public:
+    using path = std::filesystem::path;
+
+    DatabaseWriter(const path &location);
+    // commits everything still queued before returning, with one last try
+    // for a group that failed
+    ~DatabaseWriter();
+
+    DatabaseWriter(const DatabaseWriter &) = delete;
+    DatabaseWriter &operator=(const DatabaseWriter &) = delete;
+
+    // fire and forget. never blocks on sqlite.
+    void enqueue(journal_batch batch);
+
+    // resolves once the batch's group commit has finished
+    std::future<Error> submit(journal_batch batch);
+
+    // resolves once everything enqueued before it is durable
+    std::future<Error> flush();
+
+    // drains the journal on the calling thread and hands the rows over
+    void autosave(ChangeJournal &journal);
+
+    // how long the writer waits for more work before committing a group,
+    // and how many batches a single commit may hold
+    void set_max_latency(std::chrono::milliseconds latency)
+    {
+        max_latency_.store(latency.count(), std::memory_order_relaxed);
+    }
+    void set_max_group(size_t batches)
+    {
+        max_group_.store(std::max<size_t>(1, batches),
+                         std::memory_order_relaxed);
+    }
+
+    // the last group commit failure, if any. cleared when read. a group
+    // that fails is retried, after a backoff, ahead of what comes next.
+    std::optional<Error> take_error();
+
+  private:
+    struct job {
+        journal_batch batch;
+        std::optional<std::promise<Error>> done;
+    };
+
+    void run(std::stop_token stop);
+    void push(job entry);
+
+    Database database_;
+
+    MpscQueue<job> queue_;
+    std::counting_semaphore<> wake_{0};
+
+    std::atomic<long long> max_latency_{20};
+    std::atomic<size_t> max_group_{64};
+
+    std::mutex error_mutex_;
+    std::optional<Error> last_error_;
+
+    std::jthread thread_;
+};
+
+} // namespace setman
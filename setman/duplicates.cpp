@@ -0,0 +1,110 @@
+// duplicates
+// implementation
+#include "duplicates.hpp"
+#include "statement_cache.hpp"
+
+namespace setman
+{
+
+static std::string column_text(sqlite3_stmt *stmt, int index)
+{
+    const unsigned char *text = sqlite3_column_text(stmt, index);
+    return text ? std::string(reinterpret_cast<const char *>(text))
+                : std::string();
+}
+
+std::expected<std::vector<duplicate_group>, Error>
+find_duplicates(sqlite3 *connection, StatementCache &statements,
+                const std::optional<std::string> &episode_uuid)
+{
+    // the size is compared too, so a hash collision alone never pairs two
+    // files. rows arrive grouped, which is all the folding below needs.
+    static constexpr char sql[] =
+        "WITH scoped AS ("
+        "    SELECT f.material_uuid, f.hash, f.size FROM file_identities f "
+        "    JOIN materials m ON m.uuid = f.material_uuid "
+        "    WHERE ?1 IS NULL OR m.parent_episode_uuid = ?1) "
+        "SELECT s.hash, s.size, s.material_uuid FROM scoped s "
+        "JOIN (SELECT hash, size FROM scoped GROUP BY hash, size "
+        "      HAVING count(*) > 1) d "
+        "ON d.hash = s.hash AND d.size = s.size "
+        "ORDER BY s.size DESC, s.hash, s.material_uuid";
+
+    sqlite3_stmt *stmt = statements.get(sql);
+    if (!stmt)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(connection)));
+
+    if (episode_uuid)
+        sqlite3_bind_text(stmt, 1, episode_uuid->c_str(),
+                          episode_uuid->size(), SQLITE_STATIC);
+    else
+        sqlite3_bind_null(stmt, 1);
+
+    std::vector<duplicate_group> groups;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto hash = materials::content_hash::from_string(column_text(stmt, 0));
+        if (!hash)
+            continue;
+        auto size = static_cast<uint64_t>(sqlite3_column_int64(stmt, 1));
+
+        if (groups.empty() || groups.back().hash != *hash ||
+            groups.back().size != size)
+            groups.push_back({*hash, size, {}});
+        groups.back().material_uuids.push_back(column_text(stmt, 2));
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(connection)));
+
+    return groups;
+}
+
+std::expected<std::unordered_map<std::string, materials::file_identity>, Error>
+stored_identities(sqlite3 *connection, StatementCache &statements,
+                  const std::string &episode_uuid)
+{
+    static constexpr char sql[] =
+        "SELECT f.material_uuid, f.hash, f.size, f.mtime, f.dhash "
+        "FROM file_identities f JOIN materials m ON m.uuid = f.material_uuid "
+        "WHERE m.parent_episode_uuid = ?";
+
+    sqlite3_stmt *stmt = statements.get(sql);
+    if (!stmt)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(connection)));
+
+    sqlite3_bind_text(stmt, 1, episode_uuid.c_str(), episode_uuid.size(),
+                      SQLITE_STATIC);
+
+    std::unordered_map<std::string, materials::file_identity> identities;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto hash = materials::content_hash::from_string(column_text(stmt, 1));
+        if (!hash)
+            continue;
+
+        materials::file_identity identity{
+            .hash = *hash,
+            .size = static_cast<uint64_t>(sqlite3_column_int64(stmt, 2)),
+            .mtime = sqlite3_column_int64(stmt, 3),
+            .dhash = std::nullopt};
+        if (sqlite3_column_type(stmt, 4) != SQLITE_NULL)
+            identity.dhash =
+                static_cast<uint64_t>(sqlite3_column_int64(stmt, 4));
+
+        identities.emplace(column_text(stmt, 0), identity);
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(connection)));
+
+    return identities;
+}
+
+} // namespace setman
@@ -0,0 +1,40 @@
+// duplicates
+// stored file identities and the files that share content
+#pragma once
+
+// sqlite
+#include <sqlite3.h>
+
+// setman
+#include "error.hpp"
+#include "materials/content_hash.hpp"
+
+// std
+#include <expected>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace setman
+{
+
+class StatementCache;
+
+// materials whose files have identical contents, largest files first
+struct duplicate_group {
+    materials::content_hash hash;
+    uint64_t size;
+    std::vector<std::string> material_uuids;
+};
+
+std::expected<std::vector<duplicate_group>, Error>
+find_duplicates(sqlite3 *connection, StatementCache &statements,
+                const std::optional<std::string> &episode_uuid = std::nullopt);
+
+// identities recorded for an episode's materials, by material uuid
+std::expected<std::unordered_map<std::string, materials::file_identity>, Error>
+stored_identities(sqlite3 *connection, StatementCache &statements,
+                  const std::string &episode_uuid);
+
+} // namespace setman
@@ -11,9 +11,10 @@
 #include "error.hpp"
 #include "series.hpp"
 #include "database.hpp"
+#include "database_writer.hpp"
 
-//sqlite
-#include <sqlite3.h>
+// std
+#include <algorithm>
 
 namespace setman
 {
@@ -39,31 +40,33 @@ Episode::Episode(const Series *series, const fs::path &location,
 
 Error Episode::save(Database &db) const
 {
-    const char *sql =
-        "INSERT OR REPLACE INTO episodes "
-        "(uuid, series_uuid, number, location, up_folder, cels_folder) "
-        "VALUES (?, ?, ?, ?, ?, ?)";
+    journal_.touch(this);
+    return db.flush(journal_);
+}
 
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(db.handle(), sql, -1, &stmt, nullptr);
+std::future<Error> Episode::save(DatabaseWriter &writer) const
+{
+    journal_.touch(this);
+    return writer.submit(journal_.drain());
+}
 
-    std::string uuid_str = boost::uuids::to_string(uuid_);
-    std::string series_uuid_str = boost::uuids::to_string(series_->uuid());
+//
+// dirty tracking
+//
 
-    sqlite3_bind_text(stmt, 1, uuid_str.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, series_uuid_str.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 3, number_);
-    sqlite3_bind_text(stmt, 4, location_.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 5, up_folder_.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 6, cels_folder_.c_str(), -1, SQLITE_TRANSIENT);
+void Episode::renumber(const int num)
+{
+    number_ = num;
+    mark_dirty();
+}
 
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
-        return {Code::database_error, "Failed to save episode"};
-    }
+void Episode::mark_dirty()
+{
+    if (dirty_)
+        return;
 
-    sqlite3_finalize(stmt);
-    return Code::success;
+    dirty_ = true;
+    journal_.touch(this);
 }
 
 //
@@ -72,11 +75,38 @@ Error Episode::save(Database &db) const
 
 void Episode::add_cut(std::unique_ptr<materials::Cut> new_cut)
 {
+    new_cut->mark_dirty();
     active_cuts_.push_back(std::move(new_cut));
 }
 
 void Episode::reserve_active_cuts(size_t n) { active_cuts_.reserve(n); }
 
+template <typename T>
+static bool remove_from(std::vector<std::unique_ptr<T>> &entries,
+                        const boost::uuids::uuid &uuid, ChangeJournal &journal)
+{
+    auto it = std::find_if(entries.begin(), entries.end(),
+                           [&](const auto &entry) {
+                               return entry->uuid() == uuid;
+                           });
+    if (it == entries.end())
+        return false;
+
+    journal.erase(it->get());
+    entries.erase(it);
+    return true;
+}
+
+bool Episode::remove_cut(const boost::uuids::uuid &uuid)
+{
+    if (remove_from(active_cuts_, uuid, journal_) ||
+        remove_from(archived_cuts_, uuid, journal_)) {
+        refresh_tags();
+        return true;
+    }
+    return false;
+}
+
 std::vector<materials::Cut *> Episode::find_cut(const int number) const
 {
     std::vector<materials::Cut *> matches{};
@@ -167,11 +197,86 @@ Episode::find_material(const boost::uuids::uuid &mat_uuid) const
 
 void Episode::add_material(std::unique_ptr<materials::GenericMaterial> new_mat)
 {
+    new_mat->mark_dirty();
     materials_.push_back(std::move(new_mat));
 }
 
 void Episode::reserve_materials(size_t n) { materials_.reserve(n); }
 
+bool Episode::remove_material(const boost::uuids::uuid &mat_uuid)
+{
+    if (!remove_from(materials_, mat_uuid, journal_))
+        return false;
+
+    refresh_tags();
+    return true;
+}
+
+//
+// file identities
+//
+
+static void collect_files(materials::GenericMaterial *material,
+                          std::vector<materials::GenericMaterial *> &files)
+{
+    if (!material->is_directory()) {
+        files.push_back(material);
+        return;
+    }
+
+    auto *folder = static_cast<materials::Folder *>(material);
+    for (const auto &child : folder->children())
+        collect_files(child.get(), files);
+}
+
+std::vector<materials::GenericMaterial *> Episode::files() const
+{
+    std::vector<materials::GenericMaterial *> files;
+    for (const auto &material : materials_)
+        collect_files(material.get(), files);
+    for (const auto &cut : active_cuts_)
+        collect_files(cut.get(), files);
+    for (const auto &cut : archived_cuts_)
+        collect_files(cut.get(), files);
+    return files;
+}
+
+size_t Episode::refresh_file_identities(unsigned threads)
+{
+    auto files = this->files();
+
+    std::vector<materials::identify_job> jobs;
+    jobs.reserve(files.size());
+    for (const auto *file : files)
+        jobs.push_back({file->file(), file->identity()});
+
+    auto results = materials::identify_files(jobs, threads);
+
+    // missing or unreadable files keep whatever they had
+    size_t changed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!results[i] || files[i]->identity() == *results[i])
+            continue;
+        files[i]->new_identity(*results[i]);
+        changed++;
+    }
+    return changed;
+}
+
+Error Episode::restore_file_identities(Database &db)
+{
+    auto stored = db.file_identities(boost::uuids::to_string(uuid_));
+    if (!stored)
+        return stored.error();
+
+    for (auto *file : files()) {
+        auto it = stored->find(boost::uuids::to_string(file->uuid()));
+        if (it != stored->end())
+            file->restore_identity(it->second);
+    }
+    return Code::success;
+}
+
 //
 // tags
 //
@@ -6,6 +6,9 @@
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
 
+// setman
+#include "journal.hpp"
+
 // std
 #include <filesystem>
 #include <memory>
@@ -14,6 +17,7 @@
 #include <unordered_set>
 #include <vector>
 #include <expected>
+#include <future>
 
 namespace fs = std::filesystem;
 
@@ -31,6 +35,7 @@ class Company;
 class Error;
 class Series;
 class Database;
+class DatabaseWriter;
 
 class Episode
 {
@@ -45,6 +50,7 @@ class Episode
     //
 
     Error save(Database& database) const;
+    std::future<Error> save(DatabaseWriter &writer) const;
     static std::expected<std::unique_ptr<Episode>, Error> load(Database& db);
 
     //
@@ -65,7 +71,17 @@ class Episode
     // setters
     //
 
-    void renumber(const int num) { number_ = num; }
+    void renumber(const int num);
+
+    //
+    // dirty tracking
+    //
+
+    ChangeJournal &journal() const { return journal_; }
+
+    constexpr bool is_dirty() const { return dirty_; }
+    void mark_dirty();
+    void mark_clean() const { dirty_ = false; }
 
     //
     // cuts
@@ -82,6 +98,9 @@ class Episode
 
     void add_cut(std::unique_ptr<materials::Cut> new_cut);
     void reserve_active_cuts(size_t n);
+    // active or archived, with everything in it. the next save deletes it
+    // from the database. false when there is no such cut.
+    bool remove_cut(const boost::uuids::uuid &uuid);
 
     std::vector<materials::Cut *> find_cut(const int number) const;
     materials::Cut *find_cut(const boost::uuids::uuid &) const;
@@ -109,6 +128,21 @@ class Episode
 
     void add_material(std::unique_ptr<materials::GenericMaterial> new_mat);
     void reserve_materials(size_t n);
+    bool remove_material(const boost::uuids::uuid &mat_uuid);
+
+    // file identities
+
+    // every file material, the contents of cuts and folders included
+    std::vector<materials::GenericMaterial *> files() const;
+
+    // hashes every file material, cuts' contents included, on `threads`
+    // workers (0: one per core). files whose size and mtime still match
+    // their identity are not read. returns how many identities changed.
+    size_t refresh_file_identities(unsigned threads = 0);
+
+    // picks up identities saved by an earlier session, so the next
+    // refresh only rehashes what changed since
+    Error restore_file_identities(Database &db);
 
     // tags
 
@@ -155,6 +189,9 @@ class Episode
     std::vector<std::unique_ptr<materials::Element>> elements_;
 
     const boost::uuids::uuid uuid_;
+
+    mutable ChangeJournal journal_;
+    mutable bool dirty_ = false;
 };
 
 std::unique_ptr<Episode> create_project_from(const fs::path &path);
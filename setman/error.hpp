@@ -36,6 +36,12 @@ enum class Code {
 
     database_error,
 
+    snapshot_invalid,
+    snapshot_stale,
+
+    image_decode_failed,
+    image_encode_failed,
+
     generic,
 };
 
@@ -91,6 +97,19 @@ constexpr std::string_view to_message(enum Code code)
     case Code::folder_already_exists:
         return "Folder already exists";
 
+    case Code::database_error:
+        return "Database operation failed";
+
+    case Code::snapshot_invalid:
+        return "Project snapshot is corrupt or from another version";
+    case Code::snapshot_stale:
+        return "Project snapshot is older than the database";
+
+    case Code::image_decode_failed:
+        return "Failed to decode image";
+    case Code::image_encode_failed:
+        return "Failed to encode image";
+
     case Code::generic:
         return "Generic error";
 
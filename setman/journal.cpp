@@ -0,0 +1,153 @@
+// ChangeJournal
+// implementation
+#include "journal.hpp"
+
+// setman
+#include "episode.hpp"
+#include "materials/cut.hpp"
+#include "materials/material.hpp"
+#include "series.hpp"
+
+// boost
+#include <boost/uuid/uuid_io.hpp>
+
+// std
+#include <chrono>
+
+namespace setman
+{
+
+//
+// journal_batch
+//
+
+size_t journal_batch::size() const
+{
+    return episodes.size() + materials.size() + erased_materials.size() +
+           statuses.size() + ocr_results.size();
+}
+
+//
+// ChangeJournal
+//
+
+void ChangeJournal::touch(const Episode *episode)
+{
+    episodes_[episode->uuid()] = {change::upsert, episode};
+}
+
+void ChangeJournal::touch(const materials::GenericMaterial *material)
+{
+    materials_[material->uuid()] = {change::upsert, material};
+}
+
+void ChangeJournal::erase(const materials::GenericMaterial *material)
+{
+    materials_[material->uuid()] = {change::erase, nullptr};
+    if (!material->is_directory())
+        return;
+
+    auto *folder = static_cast<const materials::Folder *>(material);
+    for (const auto &child : folder->children())
+        erase(child.get());
+}
+
+void ChangeJournal::record_status(const materials::Cut &cut,
+                                  const materials::progress_entry &entry)
+{
+    auto since_epoch = entry.time_updated.time_since_epoch();
+    statuses_.push_back(
+        {boost::uuids::to_string(cut.uuid()),
+         std::string(materials::to_string(entry.status)),
+         std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch)
+             .count()});
+}
+
+size_t ChangeJournal::pending() const
+{
+    return episodes_.size() + materials_.size() + statuses_.size();
+}
+
+static episode_row row_of(const Episode &episode)
+{
+    return {.uuid = boost::uuids::to_string(episode.uuid()),
+            .series_uuid = episode.series()
+                               ? boost::uuids::to_string(
+                                     episode.series()->uuid())
+                               : std::string(),
+            .number = episode.number(),
+            .location = episode.root().string(),
+            .up_folder = episode.up_folder().string(),
+            .cels_folder = episode.cels_folder().string()};
+}
+
+static material_row row_of(const materials::GenericMaterial &material)
+{
+    material_row row{
+        .uuid = boost::uuids::to_string(material.uuid()),
+        .episode_uuid = material.episode()
+                            ? boost::uuids::to_string(material.episode()->uuid())
+                            : std::string(),
+        .type = std::string(materials::to_string(material.type())),
+        .parent_uuid = std::nullopt,
+        .path = material.file().string(),
+        .notes = material.notes(),
+        .alias = material.alias(),
+        .tags = {material.tags().begin(), material.tags().end()},
+        .identity = material.identity()};
+
+    if (material.parent())
+        row.parent_uuid = boost::uuids::to_string(material.parent()->uuid());
+
+    return row;
+}
+
+journal_batch ChangeJournal::snapshot() const
+{
+    journal_batch batch;
+    batch.episodes.reserve(episodes_.size());
+    batch.materials.reserve(materials_.size());
+
+    for (const auto &[uuid, pending] : episodes_)
+        batch.episodes.push_back(row_of(*pending.entity));
+
+    for (const auto &[uuid, pending] : materials_) {
+        if (pending.op == change::erase) {
+            batch.erased_materials.push_back(boost::uuids::to_string(uuid));
+            continue;
+        }
+        batch.materials.push_back(row_of(*pending.entity));
+    }
+
+    batch.statuses = statuses_;
+    return batch;
+}
+
+void ChangeJournal::commit()
+{
+    for (const auto &[uuid, pending] : episodes_)
+        pending.entity->mark_clean();
+
+    for (const auto &[uuid, pending] : materials_) {
+        if (pending.op != change::erase)
+            pending.entity->mark_clean();
+    }
+
+    clear();
+}
+
+journal_batch ChangeJournal::drain()
+{
+    journal_batch batch = snapshot();
+    commit();
+    return batch;
+}
+
+void ChangeJournal::clear()
+{
+    episodes_.clear();
+    materials_.clear();
+    statuses_.clear();
+}
+
+} // namespace setman
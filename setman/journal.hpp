@@ -0,0 +1,136 @@
+// ChangeJournal
+// in-memory record of entities changed since the last save
+#pragma once
+
+// boost
+#include <boost/functional/hash.hpp>
+#include <boost/uuid/uuid.hpp>
+
+// setman
+#include "materials/content_hash.hpp"
+
+// std
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace setman
+{
+
+namespace materials
+{
+class GenericMaterial;
+class Cut;
+struct progress_entry;
+} // namespace materials
+
+class Episode;
+
+enum class change {
+    upsert,
+    erase,
+};
+
+//
+// rows
+//
+
+// rows are snapshots of the pending changes, so a batch can be written
+// without touching the live object graph
+
+struct episode_row {
+    std::string uuid;
+    std::string series_uuid;
+    int number;
+    std::string location;
+    std::string up_folder;
+    std::string cels_folder;
+};
+
+struct material_row {
+    std::string uuid;
+    std::string episode_uuid;
+    std::string type;
+    std::optional<std::string> parent_uuid;
+    std::string path;
+    std::string notes;
+    std::string alias;
+    std::vector<std::string> tags;
+    std::optional<materials::file_identity> identity;
+};
+
+struct status_row {
+    std::string cut_uuid;
+    std::string status;
+    int64_t time; // ms since epoch
+};
+
+// not produced by the journal; ocr results are handed in by whoever ran the
+// request and ride along in the same batches
+struct ocr_row {
+    std::string material_uuid;
+    std::string model;
+    std::string text;
+    int64_t time; // ms since epoch
+};
+
+struct journal_batch {
+    std::vector<episode_row> episodes;
+    std::vector<material_row> materials;
+    std::vector<std::string> erased_materials;
+    std::vector<status_row> statuses;
+    std::vector<ocr_row> ocr_results;
+
+    bool empty() const { return size() == 0; }
+    size_t size() const;
+};
+
+//
+// journal
+//
+
+class ChangeJournal
+{
+  public:
+    // entities hand themselves in when they first become dirty. pointers are
+    // non-owning: erase() a material before destroying it. erasing a folder
+    // erases its contents with it.
+    void touch(const Episode *episode);
+    void touch(const materials::GenericMaterial *material);
+    void erase(const materials::GenericMaterial *material);
+    void record_status(const materials::Cut &cut,
+                       const materials::progress_entry &entry);
+
+    size_t pending() const;
+    bool empty() const { return pending() == 0; }
+
+    // every pending change as rows. the journal keeps them until commit(),
+    // so a batch that fails to write is still pending for the next save.
+    journal_batch snapshot() const;
+    // forgets what is pending and clears the dirty flags. call it once the
+    // snapshot is written, before anything changes again.
+    void commit();
+    // snapshot() and commit() at once, for a batch handed to an owner that
+    // sees it written
+    journal_batch drain();
+    void clear();
+
+  private:
+    template <typename T> struct pending_change {
+        change op;
+        const T *entity;
+    };
+
+    template <typename T>
+    using change_map =
+        std::unordered_map<boost::uuids::uuid, pending_change<T>,
+                           boost::hash<boost::uuids::uuid>>;
+
+    change_map<Episode> episodes_;
+    change_map<materials::GenericMaterial> materials_;
+    std::vector<status_row> statuses_;
+};
+
+} // namespace setman
@@ -0,0 +1,517 @@
+// base64
+
+#include "base64.hpp"
+#include "error.hpp"
+#include "mapped_file.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SETMAN_B64_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define SETMAN_B64_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace setman::materials
+{
+
+//
+// scalar
+//
+
+static constexpr char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static constexpr uint8_t invalid = 0xFF;
+
+static constexpr std::array<uint8_t, 256> decode_table = [] {
+    std::array<uint8_t, 256> table{};
+    table.fill(invalid);
+    for (uint8_t i = 0; i < 64; i++)
+        table[static_cast<unsigned char>(alphabet[i])] = i;
+    return table;
+}();
+
+// encodes whole triples only; the caller pads the tail
+static void encode_scalar(const unsigned char *in, size_t len, char *out)
+{
+    for (size_t i = 0; i + 3 <= len; i += 3, out += 4) {
+        const uint32_t triple = (static_cast<uint32_t>(in[i]) << 16) |
+                                (static_cast<uint32_t>(in[i + 1]) << 8) |
+                                static_cast<uint32_t>(in[i + 2]);
+        out[0] = alphabet[(triple >> 18) & 0x3F];
+        out[1] = alphabet[(triple >> 12) & 0x3F];
+        out[2] = alphabet[(triple >> 6) & 0x3F];
+        out[3] = alphabet[triple & 0x3F];
+    }
+}
+
+// decodes whole unpadded quads only. false on any invalid character.
+static bool decode_scalar(const char *in, size_t len, unsigned char *out)
+{
+    for (size_t i = 0; i + 4 <= len; i += 4, out += 3) {
+        const uint8_t a = decode_table[static_cast<unsigned char>(in[i])];
+        const uint8_t b = decode_table[static_cast<unsigned char>(in[i + 1])];
+        const uint8_t c = decode_table[static_cast<unsigned char>(in[i + 2])];
+        const uint8_t d = decode_table[static_cast<unsigned char>(in[i + 3])];
+        if ((a | b | c | d) & 0xC0)
+            return false;
+        const uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = static_cast<unsigned char>(triple >> 16);
+        out[1] = static_cast<unsigned char>(triple >> 8);
+        out[2] = static_cast<unsigned char>(triple);
+    }
+    return true;
+}
+
+//
+// kernels
+//
+
+// a kernel consumes as much of the input as it can in whole blocks and
+// returns how much that was. the scalar path finishes the rest. encoders
+// read a few bytes past each block and decoders store a few bytes past
+// each block, so both stop early enough for that to stay in bounds.
+
+using encode_kernel = size_t (*)(const unsigned char *, size_t, char *);
+using decode_kernel = size_t (*)(const char *, size_t, unsigned char *,
+                                 bool &);
+
+static size_t encode_none(const unsigned char *, size_t, char *) { return 0; }
+static size_t decode_none(const char *, size_t, unsigned char *, bool &)
+{
+    return 0;
+}
+
+#ifdef SETMAN_B64_X86
+
+// both x86 kernels follow Wojciech Muła's pshufb based scheme: shuffle the
+// input so every output byte's six bits sit in one 16 bit lane, shift them
+// into place with multiplies, then map 0..63 to ascii through a small
+// table of per-range offsets.
+
+__attribute__((target("ssse3"))) static inline __m128i
+encode_lanes_128(__m128i in)
+{
+    in = _mm_shuffle_epi8(
+        in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+
+    __m128i shift = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    shift = _mm_or_si128(shift, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i offsets = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, shift), indices);
+}
+
+__attribute__((target("ssse3"))) static size_t
+encode_ssse3(const unsigned char *in, size_t len, char *out)
+{
+    // 12 bytes in, 16 out, 16 loaded
+    size_t done = 0;
+    for (; done + 16 <= len; done += 12, out += 16) {
+        const __m128i block =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                         encode_lanes_128(block));
+    }
+    return done;
+}
+
+__attribute__((target("avx2"))) static size_t
+encode_avx2(const unsigned char *in, size_t len, char *out)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3,
+        5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    // 24 bytes in as two 12 byte lanes, 32 out, 28 loaded
+    size_t done = 0;
+    for (; done + 28 <= len; done += 24, out += 32) {
+        const __m128i lo =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+        const __m128i hi =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done + 12));
+        __m256i block =
+            _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+        block = _mm256_shuffle_epi8(block, shuffle);
+        const __m256i t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 =
+            _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i shift = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        shift = _mm256_or_si256(shift,
+                                _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        const __m256i ascii =
+            _mm256_add_epi8(_mm256_shuffle_epi8(offsets, shift), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), ascii);
+    }
+    return done;
+}
+
+// decoding validates through two nibble lookups whose AND is non-zero only
+// for characters outside the alphabet, then adds a per-range offset and
+// packs four six bit values into three bytes with multiply-adds.
+
+__attribute__((target("ssse3"))) static size_t
+decode_ssse3(const char *in, size_t len, unsigned char *out, bool &valid)
+{
+    const __m128i lut_lo =
+        _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                      0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi =
+        _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10,
+                      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                       -1, -1, -1, -1);
+
+    // 16 characters in, 12 bytes out, 16 stored. the last 8 characters
+    // are left so the overshoot lands on bytes they will overwrite.
+    size_t done = 0;
+    for (; done + 24 <= len; done += 16, out += 12) {
+        const __m128i chars =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+        const __m128i hi_nibbles =
+            _mm_and_si128(_mm_srli_epi32(chars, 4), nibble);
+        const __m128i lo_nibbles = _mm_and_si128(chars, nibble);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m128i bad = _mm_and_si128(lo, hi);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) !=
+            0xFFFF) {
+            valid = false;
+            return done;
+        }
+
+        const __m128i roll = _mm_shuffle_epi8(
+            lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(chars, slash), hi_nibbles));
+        const __m128i values = _mm_add_epi8(chars, roll);
+
+        const __m128i pairs =
+            _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        const __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                         _mm_shuffle_epi8(quads, pack));
+    }
+    return done;
+}
+
+__attribute__((target("avx2"))) static size_t
+decode_avx2(const char *in, size_t len, unsigned char *out, bool &valid)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+        0x1B, 0x1B, 0x1B, 0x1A, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4,
+        -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5,
+        4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    // 32 characters in, 24 bytes out, 32 stored. 16 characters are left
+    // over so the 8 byte overshoot stays inside the output.
+    size_t done = 0;
+    for (; done + 48 <= len; done += 32, out += 24) {
+        const __m256i chars =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + done));
+        const __m256i hi_nibbles =
+            _mm256_and_si256(_mm256_srli_epi32(chars, 4), nibble);
+        const __m256i lo_nibbles = _mm256_and_si256(chars, nibble);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            valid = false;
+            return done;
+        }
+
+        const __m256i roll = _mm256_shuffle_epi8(
+            lut_roll,
+            _mm256_add_epi8(_mm256_cmpeq_epi8(chars, slash), hi_nibbles));
+        const __m256i values = _mm256_add_epi8(chars, roll);
+
+        const __m256i pairs =
+            _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        const __m256i quads =
+            _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        const __m256i bytes = _mm256_permutevar8x32_epi32(
+            _mm256_shuffle_epi8(quads, pack), join);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), bytes);
+    }
+    return done;
+}
+
+#endif // SETMAN_B64_X86
+
+#ifdef SETMAN_B64_NEON
+
+// neon's structured loads split bytes by position for free, so these work
+// on 48 byte / 64 character blocks with plain shifts and table lookups.
+
+static size_t encode_neon(const unsigned char *in, size_t len, char *out)
+{
+    uint8x16x4_t table;
+    for (int i = 0; i < 4; i++)
+        table.val[i] = vld1q_u8(
+            reinterpret_cast<const uint8_t *>(alphabet) + i * 16);
+    const uint8x16_t mask = vdupq_n_u8(0x3F);
+
+    size_t done = 0;
+    for (; done + 48 <= len; done += 48, out += 64) {
+        const uint8x16x3_t bytes = vld3q_u8(in + done);
+        uint8x16x4_t indices;
+        indices.val[0] = vshrq_n_u8(bytes.val[0], 2);
+        indices.val[1] = vandq_u8(
+            vorrq_u8(vshlq_n_u8(bytes.val[0], 4), vshrq_n_u8(bytes.val[1], 4)),
+            mask);
+        indices.val[2] = vandq_u8(
+            vorrq_u8(vshlq_n_u8(bytes.val[1], 2), vshrq_n_u8(bytes.val[2], 6)),
+            mask);
+        indices.val[3] = vandq_u8(bytes.val[2], mask);
+
+        uint8x16x4_t ascii;
+        for (int i = 0; i < 4; i++)
+            ascii.val[i] = vqtbl4q_u8(table, indices.val[i]);
+        vst4q_u8(reinterpret_cast<uint8_t *>(out), ascii);
+    }
+    return done;
+}
+
+static size_t decode_neon(const char *in, size_t len, unsigned char *out,
+                          bool &valid)
+{
+    // ascii 0..127 in two 64 byte tables. characters past 127 miss both
+    // lookups and read as zero, so they are caught by their high bit.
+    uint8x16x4_t low, high;
+    for (int i = 0; i < 4; i++) {
+        low.val[i] = vld1q_u8(decode_table.data() + i * 16);
+        high.val[i] = vld1q_u8(decode_table.data() + 64 + i * 16);
+    }
+    const uint8x16_t sixty_four = vdupq_n_u8(64);
+
+    // the last quad may hold padding, so it is always left to the tail
+    size_t done = 0;
+    for (; done + 68 <= len; done += 64, out += 48) {
+        const uint8x16x4_t chars =
+            vld4q_u8(reinterpret_cast<const uint8_t *>(in + done));
+
+        uint8x16x4_t values;
+        uint8x16_t bad = vdupq_n_u8(0);
+        for (int i = 0; i < 4; i++) {
+            values.val[i] = vqtbx4q_u8(
+                vqtbl4q_u8(low, chars.val[i]), high,
+                vsubq_u8(chars.val[i], sixty_four));
+            bad = vorrq_u8(bad, vorrq_u8(values.val[i], chars.val[i]));
+        }
+        // invalid characters decode to 0xFF and characters past 127 carry
+        // their own high bit, so bit 7 anywhere means a bad block
+        if (vmaxvq_u8(vandq_u8(bad, vdupq_n_u8(0x80))) != 0) {
+            valid = false;
+            return done;
+        }
+
+        uint8x16x3_t bytes;
+        bytes.val[0] = vorrq_u8(vshlq_n_u8(values.val[0], 2),
+                                vshrq_n_u8(values.val[1], 4));
+        bytes.val[1] = vorrq_u8(vshlq_n_u8(values.val[1], 4),
+                                vshrq_n_u8(values.val[2], 2));
+        bytes.val[2] = vorrq_u8(vshlq_n_u8(values.val[2], 6), values.val[3]);
+        vst3q_u8(out, bytes);
+    }
+    return done;
+}
+
+#endif // SETMAN_B64_NEON
+
+//
+// dispatch
+//
+
+struct kernels {
+    encode_kernel encode;
+    decode_kernel decode;
+    std::string_view name;
+};
+
+static kernels select_kernels()
+{
+#ifdef SETMAN_B64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {encode_avx2, decode_avx2, "avx2"};
+    if (__builtin_cpu_supports("ssse3"))
+        return {encode_ssse3, decode_ssse3, "ssse3"};
+#endif
+#ifdef SETMAN_B64_NEON
+    return {encode_neon, decode_neon, "neon"}; // always present on aarch64
+#endif
+    return {encode_none, decode_none, "scalar"};
+}
+
+static const kernels &active_kernels()
+{
+    static const kernels selected = select_kernels();
+    return selected;
+}
+
+//
+// api
+//
+
+void b64_encode(const unsigned char *in, size_t len, char *out)
+{
+    const size_t vectorized = active_kernels().encode(in, len, out);
+    const size_t whole = len / 3 * 3;
+    encode_scalar(in + vectorized, whole - vectorized,
+                  out + vectorized / 3 * 4);
+
+    out += whole / 3 * 4;
+    const size_t remainder = len - whole;
+    if (remainder == 1) {
+        const uint32_t triple = static_cast<uint32_t>(in[whole]) << 16;
+        out[0] = alphabet[(triple >> 18) & 0x3F];
+        out[1] = alphabet[(triple >> 12) & 0x3F];
+        out[2] = '=';
+        out[3] = '=';
+    } else if (remainder == 2) {
+        const uint32_t triple = (static_cast<uint32_t>(in[whole]) << 16) |
+                                (static_cast<uint32_t>(in[whole + 1]) << 8);
+        out[0] = alphabet[(triple >> 18) & 0x3F];
+        out[1] = alphabet[(triple >> 12) & 0x3F];
+        out[2] = alphabet[(triple >> 6) & 0x3F];
+        out[3] = '=';
+    }
+}
+
+std::optional<size_t> b64_decode(const char *in, size_t len,
+                                 unsigned char *out)
+{
+    if (len % 4 != 0)
+        return std::nullopt;
+    if (len == 0)
+        return 0;
+
+    size_t padding = 0;
+    if (in[len - 1] == '=')
+        padding = in[len - 2] == '=' ? 2 : 1;
+
+    bool valid = true;
+    const size_t vectorized = active_kernels().decode(in, len, out, valid);
+    if (!valid)
+        return std::nullopt;
+
+    // everything but the last quad, which may carry padding
+    const size_t body = len - 4;
+    if (!decode_scalar(in + vectorized, body - vectorized,
+                       out + vectorized / 4 * 3))
+        return std::nullopt;
+
+    char last[4];
+    std::memcpy(last, in + body, 4);
+    for (size_t i = 4 - padding; i < 4; i++)
+        last[i] = 'A';
+    unsigned char tail[3];
+    if (!decode_scalar(last, 4, tail))
+        return std::nullopt;
+
+    // bits hidden under the padding must be zero for the encoding to be
+    // canonical
+    if ((padding == 1 && tail[2] != 0) || (padding == 2 && tail[1] != 0))
+        return std::nullopt;
+
+    const size_t written = body / 4 * 3 + 3 - padding;
+    std::memcpy(out + body / 4 * 3, tail, 3 - padding);
+    return written;
+}
+
+std::expected<std::vector<unsigned char>, Error>
+b64_to_bytes(std::string_view b64)
+{
+    std::vector<unsigned char> bytes(b64_decoded_size(b64.size()));
+    auto written = b64_decode(b64.data(), b64.size(), bytes.data());
+    if (!written)
+        return std::unexpected(Error(Code::parse_failed, "Invalid base64"));
+
+    bytes.resize(*written);
+    return bytes;
+}
+
+std::string_view b64_implementation() { return active_kernels().name; }
+
+//
+// B64Stream
+//
+
+std::expected<B64Stream, Error>
+B64Stream::open(const std::filesystem::path &path)
+{
+    auto file = MappedFile::open(path, MappedFile::access::sequential);
+    if (!file)
+        return std::unexpected(file.error());
+
+    return B64Stream(std::make_shared<const MappedFile>(std::move(*file)));
+}
+
+size_t B64Stream::size() const { return b64_encoded_size(file_->size()); }
+
+size_t B64Stream::read(char *buffer, size_t size)
+{
+    size_t written = 0;
+    while (carry_offset_ < carry_size_ && written < size)
+        buffer[written++] = carry_[carry_offset_++];
+
+    // whole triples go straight into curl's buffer
+    const size_t remaining = file_->size() - offset_;
+    const size_t triples = std::min((size - written) / 4, remaining / 3);
+    b64_encode(file_->data() + offset_, triples * 3, buffer + written);
+    offset_ += triples * 3;
+    written += triples * 4;
+
+    // the padded tail, or a triple split across two reads, goes through
+    // the carry
+    if (written < size && offset_ < file_->size()) {
+        const size_t take = std::min<size_t>(3, file_->size() - offset_);
+        b64_encode(file_->data() + offset_, take, carry_);
+        offset_ += take;
+        carry_size_ = 4;
+        carry_offset_ = 0;
+        while (carry_offset_ < carry_size_ && written < size)
+            buffer[written++] = carry_[carry_offset_++];
+    }
+
+    return written;
+}
+
+} // namespace setman::materials
@@ -0,0 +1,79 @@
+// base64
+// vectorized base64 encoding and decoding with runtime cpu dispatch
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace setman
+{
+
+class Error;
+
+namespace materials
+{
+
+constexpr size_t b64_encoded_size(size_t len) { return (len + 2) / 3 * 4; }
+
+// an upper bound; padding makes the real size up to two bytes smaller
+constexpr size_t b64_decoded_size(size_t len) { return len / 4 * 3; }
+
+// writes exactly b64_encoded_size(len) characters, padding included.
+// out must have room for all of them; nothing else is written.
+void b64_encode(const unsigned char *in, size_t len, char *out);
+
+// decodes padded standard base64 into out, which must have room for
+// b64_decoded_size(len) bytes. returns the number of bytes written, or
+// nothing if the input is not valid base64.
+std::optional<size_t> b64_decode(const char *in, size_t len,
+                                 unsigned char *out);
+
+std::expected<std::vector<unsigned char>, Error>
+b64_to_bytes(std::string_view b64);
+
+// the kernel picked for this cpu: "avx2", "ssse3", "neon" or "scalar"
+std::string_view b64_implementation();
+
+//
+// streaming
+//
+
+class MappedFile;
+
+// base64 of a file, encoded straight out of a read-only mapping as it is
+// read, so a multi-megabyte upload never exists as a string. copies share
+// the mapping and each keep their own position.
+class B64Stream
+{
+  public:
+    static std::expected<B64Stream, Error>
+    open(const std::filesystem::path &path);
+    B64Stream(std::shared_ptr<const MappedFile> file) : file_(std::move(file))
+    {
+    }
+
+    // encoded length, padding included
+    size_t size() const;
+
+    // fills up to size characters of buffer, 0 once everything was read
+    size_t read(char *buffer, size_t size);
+
+  private:
+    std::shared_ptr<const MappedFile> file_;
+    size_t offset_ = 0; // bytes of the file already encoded
+
+    // a quad that did not fit into the previous buffer
+    char carry_[4] = {};
+    uint8_t carry_size_ = 0;
+    uint8_t carry_offset_ = 0;
+};
+
+} // namespace materials
+} // namespace setman
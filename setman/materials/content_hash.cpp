@@ -0,0 +1,137 @@
+// content hash
+
+#include "content_hash.hpp"
+#include "error.hpp"
+#include "mapped_file.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <sys/stat.h>
+#include <thread>
+#include <xxhash.h>
+
+namespace setman::materials
+{
+
+std::string content_hash::to_string() const
+{
+    static constexpr char digits[] = "0123456789abcdef";
+
+    std::string hex(32, '0');
+    for (int i = 0; i < 16; i++) {
+        hex[15 - i] = digits[(high >> (i * 4)) & 0xF];
+        hex[31 - i] = digits[(low >> (i * 4)) & 0xF];
+    }
+    return hex;
+}
+
+std::optional<content_hash> content_hash::from_string(std::string_view hex)
+{
+    if (hex.size() != 32)
+        return std::nullopt;
+
+    content_hash hash;
+    for (size_t i = 0; i < 32; i++) {
+        char c = hex[i];
+        uint64_t nibble;
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            nibble = c - 'A' + 10;
+        else
+            return std::nullopt;
+
+        uint64_t &half = i < 16 ? hash.high : hash.low;
+        half = (half << 4) | nibble;
+    }
+    return hash;
+}
+
+content_hash hash_bytes(std::span<const unsigned char> bytes)
+{
+    XXH128_hash_t digest = XXH3_128bits(bytes.data(), bytes.size());
+    return {digest.high64, digest.low64};
+}
+
+std::expected<content_hash, Error> hash_file(const std::filesystem::path &path)
+{
+    auto file = MappedFile::open(path, MappedFile::access::sequential);
+    if (!file)
+        return std::unexpected(file.error());
+
+    return hash_bytes(file->bytes());
+}
+
+//
+// identities
+//
+
+std::expected<file_identity, Error>
+identify_file(const std::filesystem::path &path,
+              const std::optional<file_identity> &previous)
+{
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0)
+        return std::unexpected(errno == ENOENT
+                                   ? Error(Code::file_doesnt_exist)
+                                   : Error(Code::file_size_count_failed));
+
+    file_identity identity;
+    identity.size = static_cast<uint64_t>(info.st_size);
+    identity.mtime = int64_t(info.st_mtim.tv_sec) * 1'000'000'000 +
+                     info.st_mtim.tv_nsec;
+
+    if (previous && previous->size == identity.size &&
+        previous->mtime == identity.mtime)
+        return *previous;
+
+    // the stat is taken first: a file rewritten while it is being hashed
+    // ends up with a newer mtime than the one recorded, and is hashed
+    // again next time
+    auto hash = hash_file(path);
+    if (!hash)
+        return std::unexpected(hash.error());
+
+    identity.hash = *hash;
+    if (previous && previous->hash == identity.hash)
+        identity.dhash = previous->dhash; // touched, not changed
+    return identity;
+}
+
+std::vector<std::expected<file_identity, Error>>
+identify_files(std::span<const identify_job> jobs, unsigned threads)
+{
+    // Error is not assignable, so each worker constructs its result in place
+    std::vector<std::optional<std::expected<file_identity, Error>>> slots(
+        jobs.size());
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned>(
+        std::min<size_t>(threads, std::max<size_t>(1, jobs.size())));
+
+    // workers claim the next job from a shared counter, so one huge file
+    // never holds up the rest of a slice
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i = next++; i < jobs.size(); i = next++)
+            slots[i].emplace(identify_file(jobs[i].path, jobs[i].previous));
+    };
+
+    {
+        std::vector<std::jthread> workers;
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back(work);
+        work();
+    }
+
+    std::vector<std::expected<file_identity, Error>> results;
+    results.reserve(slots.size());
+    for (auto &slot : slots)
+        results.push_back(std::move(*slot));
+    return results;
+}
+
+} // namespace setman::materials
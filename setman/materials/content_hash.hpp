@@ -0,0 +1,70 @@
+// content hash
+// 128 bit XXH3 digests of file contents, used as cache keys
+
+#pragma once
+
+#include <compare>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace setman
+{
+
+class Error;
+
+namespace materials
+{
+
+struct content_hash {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    // 32 lowercase hex digits, stable across runs and machines
+    std::string to_string() const;
+    static std::optional<content_hash> from_string(std::string_view hex);
+
+    auto operator<=>(const content_hash &) const = default;
+};
+
+content_hash hash_bytes(std::span<const unsigned char> bytes);
+
+// hashes through a sequential mapping, so the file is never copied
+std::expected<content_hash, Error> hash_file(const std::filesystem::path &path);
+
+// what a file looked like when it was hashed. size and mtime cost one stat,
+// so a file is only read again once either of them has moved.
+struct file_identity {
+    content_hash hash;
+    uint64_t size = 0;
+    int64_t mtime = 0; // ns since epoch
+
+    // images only, filled in by whoever decodes them; it depends on the
+    // contents alone, so it is kept for as long as the hash is
+    std::optional<uint64_t> dhash;
+
+    bool operator==(const file_identity &) const = default;
+};
+
+// hands back `previous` untouched when the stat still matches it
+std::expected<file_identity, Error>
+identify_file(const std::filesystem::path &path,
+              const std::optional<file_identity> &previous = std::nullopt);
+
+struct identify_job {
+    std::filesystem::path path;
+    std::optional<file_identity> previous;
+};
+
+// identify_file over a pool of worker threads; 0 uses one per core.
+// results line up with jobs.
+std::vector<std::expected<file_identity, Error>>
+identify_files(std::span<const identify_job> jobs, unsigned threads = 0);
+
+} // namespace materials
+} // namespace setman
@@ -5,6 +5,7 @@
 #include <chrono>
 
 #include "episode.hpp"
+#include "journal.hpp"
 #include "series.hpp"
 
 namespace setman::materials
@@ -63,6 +64,9 @@ cut_id Cut::identifier() const
 void Cut::mark(const enum status new_status)
 {
     history_.push_back({new_status, std::chrono::system_clock::now()});
+    if (episode_)
+        episode_->journal().record_status(*this, history_.back());
+    mark_dirty();
 }
 
 bool Cut::matches(const Cut &other) const
@@ -71,10 +75,36 @@ bool Cut::matches(const Cut &other) const
            number() == other.number();
 }
 
+// another cut claiming the same scene and number of the episode
+bool Cut::conflicts(const Cut &other) const
+{
+    return this != &other && matches(other);
+}
+
 //
 // functions
 //
 
+std::string_view to_string(enum status status)
+{
+    switch (status) {
+    case status::not_started:
+        return "not_started";
+    case status::started:
+        return "started";
+    case status::in_progress:
+        return "in_progress";
+    case status::finishing:
+        return "finishing";
+    case status::done:
+        return "done";
+    case status::up:
+        return "up";
+    default:
+        return "null";
+    }
+}
+
 std::expected<std::unique_ptr<Cut>, Error> build_from(setman::Episode *episode,
                                                       const fs::path &pathtocut)
 {
@@ -4,10 +4,12 @@
 
 #include "material.hpp"
 #include "error.hpp"
+#include <chrono>
 #include <expected>
 #include <filesystem>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -34,6 +36,8 @@ enum class status {
     null,
 };
 
+std::string_view to_string(enum status status);
+
 struct progress_entry {
     const status status;
     const std::chrono::system_clock::time_point time_updated;
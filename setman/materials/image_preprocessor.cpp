@@ -0,0 +1,198 @@
+// ImagePreprocessor
+
+#include "image_preprocessor.hpp"
+#include "content_hash.hpp"
+#include "error.hpp"
+#include "material.hpp"
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace setman::materials
+{
+
+std::string_view mime_type_of(image_encoding encoding)
+{
+    switch (encoding) {
+    case image_encoding::jpeg:
+        return "image/jpeg";
+    case image_encoding::webp:
+        return "image/webp";
+    case image_encoding::png:
+        return "image/png";
+    }
+    return "application/octet-stream";
+}
+
+static const char *format_of(image_encoding encoding)
+{
+    switch (encoding) {
+    case image_encoding::jpeg:
+        return "jpeg";
+    case image_encoding::webp:
+        return "webp";
+    case image_encoding::png:
+        return "png";
+    }
+    return "jpeg";
+}
+
+static std::optional<std::string> mime_type_of_file(const fs::path &path)
+{
+    auto ext = file_extension_of(path);
+    if (!ext)
+        return std::nullopt;
+    if (*ext == "jpg" || *ext == "jpeg")
+        return "image/jpeg";
+    if (*ext == "png")
+        return "image/png";
+    if (*ext == "webp")
+        return "image/webp";
+    return std::nullopt;
+}
+
+// the largest size inside both limits with the source's aspect ratio
+static QSize fitted_size(QSize source, const preprocess_options &options)
+{
+    double scale = 1.0;
+    const int long_edge = std::max(source.width(), source.height());
+    if (options.long_edge && long_edge > *options.long_edge)
+        scale = std::min(scale, double(*options.long_edge) / long_edge);
+
+    const double pixels = double(source.width()) * source.height();
+    if (options.pixel_budget && pixels > *options.pixel_budget)
+        scale = std::min(scale, std::sqrt(*options.pixel_budget / pixels));
+
+    if (scale >= 1.0)
+        return source;
+    return {std::max(1, int(source.width() * scale)),
+            std::max(1, int(source.height() * scale))};
+}
+
+// every option that changes the output is part of its name
+static std::string cache_name(const content_hash &hash,
+                              const preprocess_options &options)
+{
+    std::string name = hash.to_string();
+    name += "-e" + std::to_string(options.long_edge.value_or(0));
+    name += "-p" + std::to_string(options.pixel_budget.value_or(0));
+    name += options.grayscale ? "-g" : "-c";
+    name += "-q" + std::to_string(options.quality);
+    name += ".";
+    name += format_of(options.encoding);
+    return name;
+}
+
+ImagePreprocessor::ImagePreprocessor(const fs::path &cache_directory)
+    : cache_directory_(cache_directory)
+{
+}
+
+std::expected<preprocessed_image, Error>
+ImagePreprocessor::process(const fs::path &source,
+                           const preprocess_options &options) const
+{
+    auto hash = hash_file(source);
+    if (!hash)
+        return std::unexpected(hash.error());
+
+    return process(source, *hash, options);
+}
+
+std::expected<preprocessed_image, Error>
+ImagePreprocessor::process(const fs::path &source, const content_hash &hash,
+                           const preprocess_options &options) const
+{
+    const fs::path cached = cache_directory_ / cache_name(hash, options);
+    const std::string mime_type(mime_type_of(options.encoding));
+
+    QImageReader reader(QString::fromStdString(source.string()));
+    reader.setAutoTransform(true);
+    const QSize original = reader.size();
+    if (!original.isValid())
+        return std::unexpected(Error(Code::image_decode_failed,
+                                     reader.errorString().toStdString()));
+    const QSize target = fitted_size(original, options);
+
+    // a small, already compressed source can come out of re-encoding
+    // bigger. the result is cached anyway so the check stays cheap, but
+    // the source is what gets sent.
+    auto choose = [&](QSize encoded, bool from_cache) {
+        std::error_code ec;
+        auto source_type = mime_type_of_file(source);
+        if (target == original && !options.grayscale && source_type &&
+            fs::file_size(source, ec) <= fs::file_size(cached, ec))
+            return preprocessed_image{source, *source_type, original.width(),
+                                      original.height(), from_cache};
+        return preprocessed_image{cached, mime_type, encoded.width(),
+                                  encoded.height(), from_cache};
+    };
+
+    std::error_code ec;
+    if (fs::exists(cached, ec)) {
+        QImageReader previous(QString::fromStdString(cached.string()));
+        QSize size = previous.size();
+        if (size.isValid())
+            return choose(size, true);
+    }
+
+    // decoders that support it (jpeg among them) skip straight to a
+    // fraction of the size, which is where most of the time goes on a
+    // 600 dpi scan. Qt finishes with its vectorized smooth scaler.
+    if (target != original)
+        reader.setScaledSize(target);
+
+    QImage image = reader.read();
+    if (image.isNull())
+        return std::unexpected(Error(Code::image_decode_failed,
+                                     reader.errorString().toStdString()));
+
+    if (options.grayscale)
+        image = image.convertToFormat(QImage::Format_Grayscale8);
+    else if (options.encoding == image_encoding::jpeg &&
+             image.hasAlphaChannel())
+        image = image.convertToFormat(QImage::Format_RGB32);
+
+    fs::create_directories(cache_directory_, ec);
+    // identical files can be processed by two threads at once; each
+    // writes its own temporary and the last rename wins
+    static std::atomic<unsigned> counter{0};
+    fs::path temporary = cached;
+    temporary += ".tmp" + std::to_string(counter++);
+
+    QImageWriter writer(QString::fromStdString(temporary.string()),
+                        format_of(options.encoding));
+    if (options.encoding != image_encoding::png)
+        writer.setQuality(std::clamp(options.quality, 0, 100));
+    if (!writer.write(image)) {
+        fs::remove(temporary, ec);
+        return std::unexpected(Error(Code::image_encode_failed,
+                                     writer.errorString().toStdString()));
+    }
+
+    fs::rename(temporary, cached, ec);
+    if (ec)
+        return std::unexpected(Error(Code::file_write_failed, ec.message()));
+
+    return choose(image.size(), false);
+}
+
+ocr_preprocessor ocr_preprocessor_for(const ImagePreprocessor &preprocessor,
+                                      const preprocess_options &options)
+{
+    return [preprocessor, options](
+               const fs::path &source,
+               const std::optional<content_hash> &hash)
+               -> std::expected<ocr_upload, Error> {
+        auto prepared = hash ? preprocessor.process(source, *hash, options)
+                             : preprocessor.process(source, options);
+        if (!prepared)
+            return std::unexpected(prepared.error());
+        return ocr_upload{prepared->file, prepared->mime_type};
+    };
+}
+
+} // namespace setman::materials
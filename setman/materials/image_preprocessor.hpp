@@ -0,0 +1,83 @@
+// ImagePreprocessor
+// shrinks and re-encodes images before they are uploaded for ocr
+
+#pragma once
+
+#include "content_hash.hpp"
+#include "ocr_pipeline.hpp"
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace setman
+{
+
+class Error;
+
+namespace materials
+{
+
+enum class image_encoding {
+    jpeg,
+    webp,
+    png,
+};
+
+struct preprocess_options {
+    // the output fits both limits; images already inside them keep their
+    // size. nullopt lifts a limit.
+    std::optional<int> long_edge = 2048;
+    std::optional<int64_t> pixel_budget = 4'000'000;
+
+    bool grayscale = true; // ocr gains nothing from colour
+    image_encoding encoding = image_encoding::jpeg;
+    int quality = 85; // 0-100, ignored for png
+};
+
+struct preprocessed_image {
+    std::filesystem::path file; // in the cache, or the source itself
+    std::string mime_type;
+    int width;
+    int height;
+    bool from_cache;
+};
+
+// results are cached on disk under the source's content hash and the
+// options, so re-running ocr on an unchanged scan never decodes it again
+class ImagePreprocessor
+{
+  public:
+    ImagePreprocessor(const std::filesystem::path &cache_directory);
+
+    // when re-encoding would not make the file smaller, the source is
+    // handed back untouched
+    std::expected<preprocessed_image, Error>
+    process(const std::filesystem::path &source,
+            const preprocess_options &options = {}) const;
+
+    // skips hashing the source when its material's file identity is
+    // already known to be current
+    std::expected<preprocessed_image, Error>
+    process(const std::filesystem::path &source, const content_hash &hash,
+            const preprocess_options &options = {}) const;
+
+    const std::filesystem::path &cache_directory() const
+    {
+        return cache_directory_;
+    }
+
+  private:
+    std::filesystem::path cache_directory_;
+};
+
+std::string_view mime_type_of(image_encoding encoding);
+
+// adapts a preprocessor for OcrPipeline, which cannot link against Qt
+ocr_preprocessor ocr_preprocessor_for(const ImagePreprocessor &preprocessor,
+                                      const preprocess_options &options = {});
+
+} // namespace materials
+} // namespace setman
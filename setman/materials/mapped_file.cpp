@@ -0,0 +1,120 @@
+// MappedFile
+
+#include "mapped_file.hpp"
+#include "error.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace setman::materials
+{
+
+// reads until end of file rather than trusting st_size, which is zero for
+// procfs and meaningless for pipes
+static bool read_all(int fd, size_t size_hint, std::vector<unsigned char> &out)
+{
+    out.clear();
+    out.reserve(size_hint ? size_hint + 1 : 4096);
+
+    size_t used = 0;
+    while (true) {
+        if (used == out.capacity())
+            out.reserve(out.capacity() * 2);
+        out.resize(out.capacity());
+
+        ssize_t got = ::read(fd, out.data() + used, out.size() - used);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return false;
+        if (got == 0)
+            break;
+        used += static_cast<size_t>(got);
+    }
+
+    out.resize(used);
+    return true;
+}
+
+std::expected<MappedFile, Error>
+MappedFile::open(const std::filesystem::path &path, access hint)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return std::unexpected(errno == ENOENT ? Error(Code::file_doesnt_exist)
+                                               : Error(Code::file_open_failed));
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return std::unexpected(Error(Code::file_size_count_failed));
+    }
+    if (S_ISDIR(info.st_mode)) {
+        ::close(fd);
+        return std::unexpected(Error(Code::file_not_valid));
+    }
+
+    MappedFile file;
+    const size_t size = static_cast<size_t>(info.st_size);
+
+    if (S_ISREG(info.st_mode) && size >= map_threshold) {
+        void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, size, hint == access::sequential ? MADV_SEQUENTIAL
+                                                           : MADV_RANDOM);
+            ::close(fd);
+            file.data_ = static_cast<const unsigned char *>(data);
+            file.size_ = size;
+            file.mapped_ = true;
+            return file;
+        }
+        // some network and fuse filesystems refuse mappings; read instead
+    }
+
+    bool ok = read_all(fd, size, file.buffer_);
+    ::close(fd);
+    if (!ok)
+        return std::unexpected(Error(Code::file_read_failed));
+
+    file.data_ = file.buffer_.data();
+    file.size_ = file.buffer_.size();
+    return file;
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)),
+      mapped_(std::exchange(other.mapped_, false)),
+      buffer_(std::move(other.buffer_))
+{
+    // a moved vector keeps its heap block, so data_ stays valid
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        mapped_ = std::exchange(other.mapped_, false);
+        buffer_ = std::move(other.buffer_);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() { release(); }
+
+void MappedFile::release()
+{
+    if (mapped_ && data_)
+        munmap(const_cast<unsigned char *>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+    buffer_.clear();
+}
+
+} // namespace setman::materials
@@ -0,0 +1,67 @@
+// MappedFile
+// read-only view of a whole file, memory mapped where that pays off
+
+#pragma once
+
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace setman
+{
+
+class Error;
+
+namespace materials
+{
+
+class MappedFile
+{
+  public:
+    enum class access {
+        sequential, // read once front to back: uploads, hashing
+        random,     // jumped around in: headers, snapshots
+    };
+
+    // files below this are read into a buffer; a mapping costs more than
+    // copying a few pages
+    static constexpr size_t map_threshold = 64 * 1024;
+
+    // falls back to buffered reads for small files, for files whose size
+    // is not known up front (pipes, procfs) and wherever mmap is refused
+    static std::expected<MappedFile, Error>
+    open(const std::filesystem::path &path, access hint = access::sequential);
+
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const unsigned char *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool is_mapped() const { return mapped_; }
+
+    std::span<const unsigned char> bytes() const { return {data_, size_}; }
+    std::string_view text() const
+    {
+        return {reinterpret_cast<const char *>(data_), size_};
+    }
+
+  private:
+    MappedFile() = default;
+    void release();
+
+    const unsigned char *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<unsigned char> buffer_; // backs data_ when not mapped
+};
+
+} // namespace materials
+} // namespace setman
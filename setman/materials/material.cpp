@@ -1,7 +1,10 @@
 // materials
 
 #include "material.hpp"
+#include "episode.hpp"
 #include "error.hpp"
+#include "journal.hpp"
+#include "mapped_file.hpp"
 #include <array>
 #include <cstddef>
 #include <cstring>
@@ -80,6 +83,38 @@ bool GenericMaterial::file_writable() const
     }
     return is_writable_;
 }
+
+void GenericMaterial::new_notes(const std::string &notes)
+{
+    notes_ = notes;
+    mark_dirty();
+}
+
+void GenericMaterial::new_alias(const std::string &alias)
+{
+    alias_ = alias;
+    mark_dirty();
+}
+
+void GenericMaterial::new_identity(const file_identity &identity)
+{
+    if (identity_ == identity)
+        return;
+
+    identity_ = identity;
+    mark_dirty();
+}
+
+void GenericMaterial::mark_dirty()
+{
+    if (dirty_)
+        return;
+
+    dirty_ = true;
+    if (episode_)
+        episode_->journal().touch(this);
+}
+
 std::error_code GenericMaterial::move_to(const fs::path &parentfolder)
 {
     // caller needs to verify the validity of the target path
@@ -91,6 +126,7 @@ std::error_code GenericMaterial::move_to(const fs::path &parentfolder)
 
     file_ = dest;
     invalidate_cache(); // always invalidate after operation
+    mark_dirty();
 
     return std::error_code(); // success
 }
@@ -115,6 +151,11 @@ std::expected<std::vector<unsigned char>, Error> File::to_bytes() const
     return materials::file_to_bytes(file_);
 }
 
+std::expected<MappedFile, Error> File::map() const
+{
+    return MappedFile::open(file_);
+}
+
 std::expected<std::string, Error> File::to_b64() const
 {
     return materials::file_to_b64(file_);
@@ -137,6 +178,8 @@ Folder::Folder(const setman::Episode *parent_episode, const fs::path &path,
 
 void Folder::add_child(std::unique_ptr<GenericMaterial> child)
 {
+    child->parent_ = this;
+    child->mark_dirty();
     children_.push_back(std::move(child));
 }
 
@@ -154,6 +197,36 @@ GenericMaterial *Folder::find_child(const boost::uuids::uuid &uuid)
 // function
 //
 
+std::string_view to_string(enum material type)
+{
+    switch (type) {
+    case material::cut_folder:
+        return "cut_folder";
+    case material::cut_cels_folder:
+        return "cut_cels_folder";
+    case material::cut_file:
+        return "cut_file";
+    case material::keyframe:
+        return "keyframe";
+    case material::clipstudio:
+        return "clipstudio";
+    case material::pureref:
+        return "pureref";
+    case material::notes:
+        return "notes";
+    case material::folder:
+        return "folder";
+    case material::file:
+        return "file";
+    case material::reference:
+        return "reference";
+    case material::other:
+        return "other";
+    default:
+        return "null";
+    }
+}
+
 std::pair<std::regex, std::vector<std::string>>
 build_regex(const std::string &naming_convention)
 {
@@ -207,15 +280,15 @@ std::expected<bool, Error> is_image(const fs::path &path)
         return std::unexpected(Error(Code::file_not_valid));
     }
 
-    // Open file and read first 16 bytes for magic number detection
-    std::ifstream file(path, std::ios::binary);
+    // Map the file and look at the first 16 bytes for magic numbers. Only
+    // the first page is ever touched, however large the file is.
+    auto file = MappedFile::open(path, MappedFile::access::random);
     if (!file) {
         return std::unexpected(Error(Code::file_read_failed));
     }
 
-    std::array<unsigned char, 16> header{};
-    file.read(reinterpret_cast<char *>(header.data()), header.size());
-    const std::streamsize bytes_read = file.gcount();
+    const unsigned char *header = file->data();
+    const size_t bytes_read = file->size();
 
     if (bytes_read < 4) {
         return false; // Not enough bytes to check
@@ -234,8 +307,8 @@ std::expected<bool, Error> is_image(const fs::path &path)
     }
 
     // GIF: GIF87a or GIF89a
-    if (bytes_read >= 6 && (std::memcmp(header.data(), "GIF87a", 6) == 0 ||
-                            std::memcmp(header.data(), "GIF89a", 6) == 0)) {
+    if (bytes_read >= 6 && (std::memcmp(header, "GIF87a", 6) == 0 ||
+                            std::memcmp(header, "GIF89a", 6) == 0)) {
         return true;
     }
 
@@ -305,44 +378,16 @@ std::expected<size_t, Error> file_size_of(const fs::path &path)
 
 std::string bytes_to_b64(const unsigned char *bytes, size_t len)
 {
-    static constexpr char alphabet[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     if (len == 0) {
         return {};
     }
 
     std::string output;
-    output.reserve(((len + 2) / 3) * 4);
-
-    size_t i = 0;
-    const size_t fullchunks = len / 3 * 3;
-
-    for (; i < fullchunks; i += 3) {
-        const uint32_t triple = (static_cast<uint32_t>(bytes[i]) << 16) |
-                                (static_cast<uint32_t>(bytes[i + 1]) << 8) |
-                                static_cast<uint32_t>(bytes[i + 2]);
-        output.push_back(alphabet[(triple >> 18) & 0x3F]);
-        output.push_back(alphabet[(triple >> 12) & 0x3F]);
-        output.push_back(alphabet[(triple >> 6) & 0x3F]);
-        output.push_back(alphabet[triple & 0x3F]);
-    }
-
-    const size_t remainder = len - i;
-    if (remainder == 1) {
-        const uint32_t triple = static_cast<uint32_t>(bytes[i]) << 16;
-        output.push_back(alphabet[(triple >> 18) & 0x3F]);
-        output.push_back(alphabet[(triple >> 12) & 0x3F]);
-        output.push_back('=');
-        output.push_back('=');
-    } else if (remainder == 2) {
-        const uint32_t triple = (static_cast<uint32_t>(bytes[i]) << 16) |
-                                (static_cast<uint32_t>(bytes[i + 1]) << 8);
-        output.push_back(alphabet[(triple >> 18) & 0x3F]);
-        output.push_back(alphabet[(triple >> 12) & 0x3F]);
-        output.push_back(alphabet[(triple >> 6) & 0x3F]);
-        output.push_back('=');
-    }
-
+    output.resize_and_overwrite(b64_encoded_size(len),
+                                [&](char *buffer, size_t size) {
+                                    b64_encode(bytes, len, buffer);
+                                    return size;
+                                });
     return output;
 }
 
@@ -357,26 +402,14 @@ std::string bytes_to_b64(const std::vector<unsigned char> &bytes)
 std::expected<std::vector<unsigned char>, Error>
 file_to_bytes(const fs::path &path)
 {
-    std::vector<unsigned char> buffer;
-    std::ifstream ifs(path, std::ios::binary);
-    if (!ifs) {
-        return std::unexpected(Code::file_open_failed);
-    }
-
-    ifs.seekg(0, std::ios::end);
-    std::streamsize size = ifs.tellg();
-    if (size < 0) {
-        return std::unexpected(Code::file_size_count_failed);
+    auto file = MappedFile::open(path);
+    if (!file) {
+        return std::unexpected(file.error());
     }
-    ifs.seekg(0, std::ios::beg);
 
-    buffer.resize(static_cast<size_t>(size));
-    if (size > 0) {
-        if (!ifs.read(reinterpret_cast<char *>(buffer.data()), size)) {
-            return std::unexpected(Code::file_read_failed);
-        }
-    }
-    return buffer;
+    // one copy out of the page cache, with no zero fill ahead of it
+    return std::vector<unsigned char>(file->data(),
+                                      file->data() + file->size());
 }
 
 std::expected<std::string, Error> file_to_b64(const fs::path &path)
@@ -388,11 +421,23 @@ std::expected<std::string, Error> file_to_b64(const fs::path &path)
         return std::unexpected(
             Error(Code::file_not_valid, "File not an image."));
 
-    auto bytes = file_to_bytes(path);
-    if (!bytes.has_value())
-        return std::unexpected(bytes.error());
+    auto file = MappedFile::open(path);
+    if (!file.has_value())
+        return std::unexpected(file.error());
+
+    return bytes_to_b64(file->data(), file->size());
+}
+
+std::expected<B64Stream, Error> file_to_b64_stream(const fs::path &path)
+{
+    auto check = is_image(path);
+    if (!check.has_value())
+        return std::unexpected(check.error());
+    if (check.value() == false)
+        return std::unexpected(
+            Error(Code::file_not_valid, "File not an image."));
 
-    return bytes_to_b64(bytes.value_or(std::vector<unsigned char>({})));
+    return B64Stream::open(path);
 }
 
 std::expected<std::pair<int, int>, Error>
@@ -407,15 +452,14 @@ image_dimensions_of(const fs::path &path)
             Error(Code::file_not_valid, "File not an image."));
 
     // Read first bytes to determine dimensions
-    std::ifstream file(path, std::ios::binary);
+    auto file = MappedFile::open(path, MappedFile::access::random);
     if (!file)
-        return std::unexpected(Error(Code::file_open_failed));
+        return std::unexpected(file.error());
 
-    std::array<unsigned char, 24> header{};
-    file.read(reinterpret_cast<char *>(header.data()), header.size());
-    const std::streamsize bytes_read = file.gcount();
+    const unsigned char *header = file->data();
+    const size_t bytes_read = file->size();
 
-    if (bytes_read < 24)
+    if (bytes_read < 26)
         return std::unexpected(
             Error(Code::file_read_failed,
                   "Not enough bytes to read image dimensions"));
@@ -439,8 +483,8 @@ image_dimensions_of(const fs::path &path)
     }
 
     // GIF: width at bytes 6-7, height at 8-9 (little-endian)
-    else if ((std::memcmp(header.data(), "GIF87a", 6) == 0 ||
-              std::memcmp(header.data(), "GIF89a", 6) == 0)) {
+    else if ((std::memcmp(header, "GIF87a", 6) == 0 ||
+              std::memcmp(header, "GIF89a", 6) == 0)) {
         w = header[6] | (header[7] << 8);
         h = header[8] | (header[9] << 8);
     }
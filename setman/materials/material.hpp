@@ -7,10 +7,15 @@
 #include <expected>
 #include <filesystem>
 #include <memory>
+#include <optional>
 #include <regex>
 #include <string>
+#include <string_view>
 #include <unordered_set>
 #include <vector>
+#include "base64.hpp"
+#include "content_hash.hpp"
+#include "mapped_file.hpp"
 #include "uuid.hpp"
 
 namespace fs = std::filesystem;
@@ -73,6 +78,8 @@ inline boost::uuids::uuid generate_uuid()
     return setman::generate_uuid();
 }
 
+std::string_view to_string(enum material type);
+
 std::pair<std::regex, std::vector<std::string>>
 build_regex(const std::string &naming_convention);
 
@@ -88,6 +95,7 @@ std::expected<std::vector<unsigned char>, Error>
 file_to_bytes(const fs::path &path);
 
 std::expected<std::string, Error> file_to_b64(const fs::path &path);
+std::expected<B64Stream, Error> file_to_b64_stream(const fs::path &path);
 
 Error check_if_valid(const fs::path &path,
                      bool write_permission_required = false);
@@ -112,6 +120,7 @@ class GenericMaterial
 
     constexpr material type() const { return type_; }
     constexpr const setman::Episode *episode() const { return episode_; }
+    constexpr const Folder *parent() const { return parent_; }
     constexpr const fs::path &file() const { return file_; }
     constexpr const std::string &notes() const { return notes_; }
     constexpr const std::string &alias() const { return alias_; }
@@ -126,13 +135,35 @@ class GenericMaterial
     bool file_readable() const;
     bool file_writable() const;
 
-    void new_notes(const std::string &notes) { notes_ = notes; }
-    void new_alias(const std::string &alias) { alias_ = alias; }
+    void new_notes(const std::string &notes);
+    void new_alias(const std::string &alias);
+
+    // content hash, size and mtime as of the last scan. only files have
+    // one; see Episode::refresh_file_identities
+    constexpr const std::optional<file_identity> &identity() const
+    {
+        return identity_;
+    }
+    void new_identity(const file_identity &identity);
+    // for identities read back from the database, which are not changes
+    void restore_identity(const file_identity &identity)
+    {
+        identity_ = identity;
+    }
+
+    // dirty tracking
+
+    constexpr bool is_dirty() const { return dirty_; }
+    void mark_dirty();
+    void mark_clean() const { dirty_ = false; }
 
   protected:
+    friend class Folder;
+
     std::string notes_;
     std::string alias_;
     const setman::Episode *episode_;
+    const Folder *parent_ = nullptr;
     enum material type_;
     fs::path file_;
 
@@ -145,6 +176,7 @@ class GenericMaterial
     void invalidate_cache() const { cache_valid_ = false; }
 
     std::unordered_set<std::string> tags_;
+    std::optional<file_identity> identity_;
 
   private:
     const boost::uuids::uuid uuid_;
@@ -153,6 +185,8 @@ class GenericMaterial
     mutable bool file_exists_;
     mutable bool is_readable_;
     mutable bool is_writable_;
+
+    mutable bool dirty_ = false;
 };
 
 class File : public GenericMaterial
@@ -162,6 +196,9 @@ class File : public GenericMaterial
 
     std::expected<std::vector<unsigned char>, Error> to_bytes() const;
     std::expected<std::string, Error> to_b64() const;
+
+    // the contents without copying them; prefer this for large files
+    std::expected<MappedFile, Error> map() const;
     std::optional<std::string> extension() const;
 
     File(const setman::Episode *episode, const fs::path &path,
@@ -0,0 +1,120 @@
+// perceptual hash
+
+#include "perceptual_hash.hpp"
+#include <algorithm>
+
+namespace setman::materials
+{
+
+uint64_t dhash(std::span<const uint8_t, dhash_width * dhash_height> pixels)
+{
+    uint64_t hash = 0;
+    int bit = 0;
+    for (int y = 0; y < dhash_height; y++) {
+        const uint8_t *row = pixels.data() + y * dhash_width;
+        for (int x = 0; x < dhash_width - 1; x++, bit++) {
+            if (row[x] > row[x + 1])
+                hash |= uint64_t(1) << bit;
+        }
+    }
+    return hash;
+}
+
+void PerceptualIndex::insert(const boost::uuids::uuid &material, uint64_t hash)
+{
+    hashes_.push_back(hash);
+    materials_.push_back(material);
+    built_ = false;
+}
+
+void PerceptualIndex::clear()
+{
+    hashes_.clear();
+    materials_.clear();
+    for (auto &t : tables_) {
+        t.offsets.clear();
+        t.entries.clear();
+    }
+    built_ = false;
+}
+
+void PerceptualIndex::build() const
+{
+    constexpr size_t values = size_t(1) << block_bits;
+
+    for (int block = 0; block < blocks; block++) {
+        table &t = tables_[block];
+        t.offsets.assign(values + 1, 0);
+        t.entries.resize(hashes_.size());
+
+        for (uint64_t hash : hashes_)
+            t.offsets[block_of(hash, block) + 1]++;
+        for (size_t v = 0; v < values; v++)
+            t.offsets[v + 1] += t.offsets[v];
+
+        std::vector<uint32_t> cursor(t.offsets.begin(), t.offsets.end() - 1);
+        for (uint32_t i = 0; i < hashes_.size(); i++)
+            t.entries[cursor[block_of(hashes_[i], block)]++] = i;
+    }
+
+    built_ = true;
+}
+
+// every block value within `radius` bits of `value`, flipping bits in
+// increasing order so each value is visited once
+void PerceptualIndex::probe(int block, uint16_t value, int radius,
+                            int from_bit,
+                            std::vector<uint32_t> &candidates) const
+{
+    const table &t = tables_[block];
+    candidates.insert(candidates.end(), t.entries.begin() + t.offsets[value],
+                      t.entries.begin() + t.offsets[value + 1]);
+
+    if (radius == 0)
+        return;
+    for (int bit = from_bit; bit < block_bits; bit++)
+        probe(block, value ^ uint16_t(1u << bit), radius - 1, bit + 1,
+              candidates);
+}
+
+std::vector<PerceptualIndex::match>
+PerceptualIndex::within(uint64_t hash, int max_distance) const
+{
+    std::vector<match> matches;
+    if (max_distance < 0 || hashes_.empty())
+        return matches;
+
+    auto consider = [&](uint32_t i) {
+        int distance = hamming_distance(hash, hashes_[i]);
+        if (distance <= max_distance)
+            matches.push_back({materials_[i], hashes_[i], distance});
+    };
+
+    const int radius = max_distance / blocks;
+    if (radius > max_probe_radius) {
+        for (uint32_t i = 0; i < hashes_.size(); i++)
+            consider(i);
+    } else {
+        if (!built_)
+            build();
+
+        std::vector<uint32_t> candidates;
+        for (int block = 0; block < blocks; block++)
+            probe(block, block_of(hash, block), radius, 0, candidates);
+
+        // a close hash usually matches on several blocks
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                         candidates.end());
+        for (uint32_t i : candidates)
+            consider(i);
+    }
+
+    std::sort(matches.begin(), matches.end(),
+              [](const match &a, const match &b) {
+                  return a.distance < b.distance;
+              });
+    return matches;
+}
+
+} // namespace setman::materials
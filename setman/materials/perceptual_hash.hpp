@@ -0,0 +1,84 @@
+// perceptual hash
+// 64 bit difference hashes and an index answering hamming range queries
+
+#pragma once
+
+#include <array>
+#include <bit>
+#include <boost/uuid/uuid.hpp>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace setman
+{
+namespace materials
+{
+
+// a 9x8 grayscale thumbnail, row major
+inline constexpr int dhash_width = 9;
+inline constexpr int dhash_height = 8;
+
+// one bit per horizontally adjacent pair: set when the brightness drops.
+// rescans and re-exports of one drawing land a few bits apart.
+uint64_t dhash(std::span<const uint8_t, dhash_width * dhash_height> pixels);
+
+constexpr int hamming_distance(uint64_t a, uint64_t b)
+{
+    return std::popcount(a ^ b);
+}
+
+// multi-index hashing: the hash is cut into four 16 bit blocks, each with
+// a table over every possible block value. two hashes within distance k
+// agree to within k / 4 bits on at least one block, so a query probes the
+// block values that close to its own and only checks what they hold.
+class PerceptualIndex
+{
+  public:
+    struct match {
+        boost::uuids::uuid material;
+        uint64_t hash;
+        int distance;
+    };
+
+    void insert(const boost::uuids::uuid &material, uint64_t hash);
+    void clear();
+
+    size_t size() const { return hashes_.size(); }
+    bool empty() const { return hashes_.empty(); }
+
+    // closest first. the tables are rebuilt on the first query after an
+    // insert, so load everything before querying.
+    std::vector<match> within(uint64_t hash, int max_distance) const;
+
+  private:
+    static constexpr int blocks = 4;
+    static constexpr int block_bits = 16;
+    // radius 4 would mean 2517 probes per block, and past that checking
+    // every hash is cheaper
+    static constexpr int max_probe_radius = 3;
+
+    static uint16_t block_of(uint64_t hash, int block)
+    {
+        return static_cast<uint16_t>(hash >> (block * block_bits));
+    }
+
+    void build() const;
+    void probe(int block, uint16_t value, int radius, int from_bit,
+               std::vector<uint32_t> &candidates) const;
+
+    std::vector<uint64_t> hashes_;
+    std::vector<boost::uuids::uuid> materials_;
+
+    // per block, entries sorted by block value with offsets into them:
+    // the counting sort of a compressed sparse row table
+    struct table {
+        std::vector<uint32_t> offsets; // 2^16 + 1
+        std::vector<uint32_t> entries;
+    };
+    mutable std::array<table, blocks> tables_;
+    mutable bool built_ = false;
+};
+
+} // namespace materials
+} // namespace setman
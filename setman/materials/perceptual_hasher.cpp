@@ -0,0 +1,107 @@
+// perceptual hasher
+
+#include "perceptual_hasher.hpp"
+#include "episode.hpp"
+#include "error.hpp"
+#include "image.hpp"
+#include "perceptual_hash.hpp"
+#include <QImage>
+#include <QImageReader>
+#include <QPainter>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace setman::materials
+{
+
+// decoding at a few times the hash size keeps the smooth downscale below
+// averaging out the grain, without paying for the full image
+static constexpr int decode_edge = 64;
+
+std::expected<uint64_t, Error>
+perceptual_hash_of(const std::filesystem::path &image)
+{
+    QImageReader reader(QString::fromStdString(image.string()));
+    reader.setAutoTransform(true);
+
+    QSize size = reader.size();
+    if (size.isValid() && (size.width() > decode_edge * 4 ||
+                           size.height() > decode_edge * 4)) {
+        size.scale(decode_edge * 4, decode_edge * 4, Qt::KeepAspectRatio);
+        reader.setScaledSize(size);
+    }
+
+    QImage decoded = reader.read();
+    if (decoded.isNull())
+        return std::unexpected(Error(Code::image_decode_failed,
+                                     reader.errorString().toStdString()));
+
+    // transparent areas of a cel count as white, like the paper under it
+    if (decoded.hasAlphaChannel()) {
+        QImage flat(decoded.size(), QImage::Format_RGB32);
+        flat.fill(Qt::white);
+        QPainter(&flat).drawImage(0, 0, decoded);
+        decoded = flat;
+    }
+
+    QImage gray = decoded
+                      .scaled(dhash_width, dhash_height, Qt::IgnoreAspectRatio,
+                              Qt::SmoothTransformation)
+                      .convertToFormat(QImage::Format_Grayscale8);
+
+    std::array<uint8_t, dhash_width * dhash_height> pixels;
+    for (int y = 0; y < dhash_height; y++)
+        std::copy_n(gray.constScanLine(y), dhash_width,
+                    pixels.begin() + y * dhash_width);
+
+    return dhash(pixels);
+}
+
+size_t refresh_perceptual_hashes(Episode &episode, unsigned threads)
+{
+    std::vector<GenericMaterial *> images;
+    for (auto *file : episode.files()) {
+        const auto &identity = file->identity();
+        if (identity && !identity->dhash && dynamic_cast<Image *>(file))
+            images.push_back(file);
+    }
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned>(
+        std::min<size_t>(threads, std::max<size_t>(1, images.size())));
+
+    std::vector<std::optional<uint64_t>> hashes(images.size());
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i = next++; i < images.size(); i = next++) {
+            if (auto hash = perceptual_hash_of(images[i]->file()))
+                hashes[i] = *hash;
+        }
+    };
+
+    {
+        std::vector<std::jthread> workers;
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back(work);
+        work();
+    }
+
+    // identities are only touched back on the calling thread
+    size_t hashed = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (!hashes[i])
+            continue;
+        file_identity identity = *images[i]->identity();
+        identity.dhash = hashes[i];
+        images[i]->new_identity(identity);
+        hashed++;
+    }
+    return hashed;
+}
+
+} // namespace setman::materials
@@ -0,0 +1,29 @@
+// perceptual hasher
+// decodes images to fill in the dhash of their file identities
+
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+
+namespace setman
+{
+
+class Episode;
+class Error;
+
+namespace materials
+{
+
+std::expected<uint64_t, Error>
+perceptual_hash_of(const std::filesystem::path &image);
+
+// every image in the episode whose identity has no dhash yet is decoded,
+// on `threads` workers (0: one per core). run it after
+// Episode::refresh_file_identities, which drops the dhash of any file whose
+// contents changed. returns how many images were hashed.
+size_t refresh_perceptual_hashes(Episode &episode, unsigned threads = 0);
+
+} // namespace materials
+} // namespace setman
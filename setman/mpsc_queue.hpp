@@ -0,0 +1,71 @@
+// MpscQueue
+// unbounded lock-free multi-producer single-consumer queue
+#pragma once
+
+// std
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace setman
+{
+
+// Vyukov-style linked queue. push() is wait-free for producers; pop() must
+// only ever be called from one consumer thread. A push that is still
+// linking its node can be briefly invisible to pop(), so consumers should
+// pair the queue with a wakeup signal raised after push() returns.
+template <typename T> class MpscQueue
+{
+  public:
+    MpscQueue() : head_(new node), tail_(head_.load()) {}
+
+    ~MpscQueue()
+    {
+        while (pop())
+            ;
+        delete tail_;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value)
+    {
+        node *entry = new node;
+        entry->value.emplace(std::move(value));
+
+        node *prev = head_.exchange(entry, std::memory_order_acq_rel);
+        prev->next.store(entry, std::memory_order_release);
+    }
+
+    std::optional<T> pop()
+    {
+        node *tail = tail_;
+        node *next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return std::nullopt;
+
+        std::optional<T> value = std::move(next->value);
+        next->value.reset();
+
+        tail_ = next;
+        delete tail;
+        return value;
+    }
+
+    bool empty() const
+    {
+        return tail_->next.load(std::memory_order_acquire) == nullptr;
+    }
+
+  private:
+    struct node {
+        std::atomic<node *> next{nullptr};
+        std::optional<T> value;
+    };
+
+    alignas(64) std::atomic<node *> head_;
+    alignas(64) node *tail_;
+};
+
+} // namespace setman
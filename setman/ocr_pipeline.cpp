@@ -0,0 +1,622 @@
+// OcrPipeline
+// implementation
+#include "ocr_pipeline.hpp"
+#include "ai_endpoints/google.hpp"
+#include "database.hpp"
+#include "episode.hpp"
+#include "materials/image.hpp"
+
+// std
+#include <algorithm>
+#include <utility>
+#include <thread>
+#include <unordered_map>
+
+// boost
+#include <boost/uuid/uuid_io.hpp>
+
+namespace setman
+{
+
+// an image ready to be sent, kept so a batch can be split up again
+struct OcrPipeline::image_part {
+    const target *source;
+    ai::curl_helpers::data_stream stream; // base64
+    std::string mime_type;
+};
+
+struct OcrPipeline::job {
+    std::vector<image_part> images; // more than one: a batch
+    ai::google_request request; // its images are re-read for every attempt
+    int attempts = 0;
+    std::chrono::steady_clock::time_point retry_at;
+
+    // what is left of a batch that came back unreadable, read one image
+    // at a time on the request slot the batch held
+    std::vector<image_part> queued;
+};
+
+struct OcrPipeline::outcome {
+    std::unique_ptr<job> entry;
+    // a response when the request went out, holding a request slot;
+    // otherwise why it never got that far
+    std::optional<ai::google_response> response;
+    std::string error;
+};
+
+//
+// ocr_jobs
+//
+
+static Error exec(sqlite3 *db, const char *sql)
+{
+    char *err_msg = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        std::string error = err_msg ? err_msg : sqlite3_errmsg(db);
+        sqlite3_free(err_msg);
+        return {Code::database_error, error};
+    }
+    return Code::success;
+}
+
+static int64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// material uuid -> the content hash it was read at, empty if unknown
+static std::expected<std::unordered_map<std::string, std::string>, Error>
+finished_jobs(Database &database)
+{
+    sqlite3_stmt *stmt = database.statements().get(
+        "SELECT material_uuid, ifnull(hash, '') FROM ocr_jobs "
+        "WHERE state = 'done'");
+    if (!stmt)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(database.handle())));
+
+    std::unordered_map<std::string, std::string> finished;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        finished.emplace(
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(database.handle())));
+    return finished;
+}
+
+static Error step_once(sqlite3 *db, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE)
+        return {Code::database_error, sqlite3_errmsg(db)};
+    return Code::success;
+}
+
+static void bind_text(sqlite3_stmt *stmt, int index, const std::string &text)
+{
+    sqlite3_bind_text(stmt, index, text.data(), static_cast<int>(text.size()),
+                      SQLITE_STATIC);
+}
+
+template <typename Target>
+static Error mark_pending(Database &database, std::span<const Target> targets)
+{
+    static constexpr char upsert[] =
+        "INSERT INTO ocr_jobs (material_uuid, hash, state, attempts, time) "
+        "VALUES (?, ?, 'pending', 0, ?) "
+        "ON CONFLICT(material_uuid) DO UPDATE SET "
+        "hash = excluded.hash, state = 'pending', attempts = 0, "
+        "error = NULL, time = excluded.time";
+
+    sqlite3 *db = database.handle();
+    sqlite3_stmt *stmt = database.statements().get(upsert);
+    if (!stmt)
+        return {Code::database_error, sqlite3_errmsg(db)};
+
+    if (Error err = exec(db, "BEGIN IMMEDIATE"); !err)
+        return err;
+
+    const int64_t time = now_ms();
+    for (const auto &target : targets) {
+        // bound with SQLITE_STATIC, so it has to outlive the step
+        std::string hash = target.hash ? target.hash->to_string() : "";
+        bind_text(stmt, 1, target.uuid);
+        if (target.hash)
+            bind_text(stmt, 2, hash);
+        else
+            sqlite3_bind_null(stmt, 2);
+        sqlite3_bind_int64(stmt, 3, time);
+
+        if (Error err = step_once(db, stmt); !err) {
+            exec(db, "ROLLBACK");
+            return err;
+        }
+    }
+
+    return exec(db, "COMMIT");
+}
+
+static Error mark_finished(Database &database, const std::string &uuid,
+                           bool done, int attempts, const std::string &error)
+{
+    static constexpr char update[] =
+        "UPDATE ocr_jobs SET state = ?, attempts = ?, error = ?, time = ? "
+        "WHERE material_uuid = ?";
+
+    sqlite3_stmt *stmt = database.statements().get(update);
+    if (!stmt)
+        return {Code::database_error, sqlite3_errmsg(database.handle())};
+
+    sqlite3_bind_text(stmt, 1, done ? "done" : "failed", -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, attempts);
+    if (done)
+        sqlite3_bind_null(stmt, 3);
+    else
+        bind_text(stmt, 3, error);
+    sqlite3_bind_int64(stmt, 4, now_ms());
+    bind_text(stmt, 5, uuid);
+    return step_once(database.handle(), stmt);
+}
+
+//
+// stages
+//
+
+static std::string mime_type_for(const std::filesystem::path &file)
+{
+    auto ext = materials::file_extension_of(file);
+    if (ext == "png")
+        return "image/png";
+    if (ext == "webp")
+        return "image/webp";
+    return "image/jpeg";
+}
+
+// rate limits and server trouble pass; a transport error, status 0, is
+// as likely to be a dropped connection as anything else
+static bool worth_retrying(const ai::google_response &response)
+{
+    return response.http_code == 0 || response.http_code == 429 ||
+           response.http_code >= 500;
+}
+
+static std::string text_of(const ai::google_response &response)
+{
+    std::string text;
+    for (const auto &part : response.content) {
+        if (!text.empty())
+            text += '\n';
+        text += part;
+    }
+    return text;
+}
+
+// what a batch reply has to look like, images counted from 1
+static constexpr char batch_schema[] =
+    R"({"type":"ARRAY","items":{"type":"OBJECT","properties":{)"
+    R"("image":{"type":"INTEGER"},"text":{"type":"STRING"}},)"
+    R"("required":["image","text"]}})";
+
+// a batch reply split up by image. images it says nothing about are
+// nullopt, so are all of them when it is not the json asked for.
+static std::vector<std::optional<std::string>>
+split_batch(std::string_view reply, size_t count)
+{
+    std::vector<std::optional<std::string>> texts(count);
+
+    // json mode has no fences, but models slip into them now and then
+    if (auto open = reply.find("```"); open != std::string_view::npos) {
+        size_t start = reply.find('\n', open);
+        size_t close = reply.rfind("```");
+        if (start != std::string_view::npos && close > start)
+            reply = reply.substr(start + 1, close - start - 1);
+    }
+
+    json parsed = json::parse(reply, nullptr, false);
+    if (!parsed.is_array())
+        return texts;
+
+    for (const auto &entry : parsed) {
+        if (!entry.is_object())
+            continue;
+        auto image = entry.find("image");
+        auto text = entry.find("text");
+        if (image == entry.end() || text == entry.end() ||
+            !image->is_number_integer() || !text->is_string())
+            continue;
+
+        int64_t number = image->get<int64_t>();
+        if (number >= 1 && static_cast<size_t>(number) <= count)
+            texts[number - 1] = text->get<std::string>();
+    }
+    return texts;
+}
+
+OcrPipeline::OcrPipeline(Database &database, ai::GoogleClient &client,
+                         ocr_options options)
+    : database_(database), client_(client), options_(std::move(options))
+{
+    options_.max_in_flight = std::max<size_t>(1, options_.max_in_flight);
+    options_.max_attempts = std::max(1, options_.max_attempts);
+}
+
+OcrPipeline::~OcrPipeline() = default;
+
+void OcrPipeline::cancel()
+{
+    cancelled_ = true;
+    cancel_.cancel();
+}
+
+std::expected<ocr_report, Error> OcrPipeline::run(const Episode &episode)
+{
+    std::vector<const materials::Image *> images;
+    for (const auto *file : episode.files()) {
+        if (const auto *image = dynamic_cast<const materials::Image *>(file))
+            images.push_back(image);
+    }
+    return run(images);
+}
+
+std::expected<ocr_report, Error>
+OcrPipeline::run(std::span<const materials::Image *const> images)
+{
+    ocr_report report;
+    report.requested = images.size();
+
+    //
+    // discover
+    //
+
+    auto finished = finished_jobs(database_);
+    if (!finished)
+        return std::unexpected(finished.error());
+
+    std::vector<target> targets;
+    targets.reserve(images.size());
+    for (const auto *image : images) {
+        target t{image->uuid(), boost::uuids::to_string(image->uuid()),
+                 image->file(), std::nullopt};
+        if (const auto &identity = image->identity())
+            t.hash = identity->hash;
+
+        // a file that changed since it was read is read again
+        auto done = finished->find(t.uuid);
+        if (!options_.redo_finished && done != finished->end() &&
+            (done->second.empty() || !t.hash ||
+             done->second == t.hash->to_string())) {
+            report.skipped++;
+            continue;
+        }
+        targets.push_back(std::move(t));
+    }
+
+    if (Error err = mark_pending(database_, std::span<const target>(targets));
+        !err)
+        return std::unexpected(err);
+
+    if (targets.empty() || cancelled_) {
+        report.cancelled = cancelled_;
+        return report;
+    }
+
+    unsigned threads = options_.prepare_threads;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned>(std::min<size_t>(threads, targets.size()));
+
+    // at most max_in_flight responses and one unsent job per worker are
+    // ever waiting, so pushing an outcome never blocks; the transport
+    // thread delivering responses must not
+    targets_ = std::make_unique<BoundedQueue<const target *>>(
+        options_.queue_capacity);
+    outcomes_ = std::make_unique<BoundedQueue<outcome>>(
+        options_.max_in_flight + threads);
+    slots_ = std::make_unique<std::counting_semaphore<>>(
+        static_cast<std::ptrdiff_t>(options_.max_in_flight));
+
+    std::optional<Error> fatal;
+    std::vector<std::unique_ptr<job>> waiting; // backing off before a retry
+    size_t remaining = targets.size();
+
+    // finishes the image at `index` of the job
+    auto settle = [&](const job &entry, size_t index, bool done,
+                      const std::string &error) {
+        const target &source = *entry.images[index].source;
+        if (done)
+            report.succeeded++;
+        else
+            report.failed.push_back({source.material, error});
+        remaining--;
+
+        if (Error err = mark_finished(database_, source.uuid, done,
+                                      entry.attempts, error);
+            !err && !fatal) {
+            fatal.emplace(err);
+            cancel();
+        }
+        if (progress_)
+            progress_(report);
+    };
+
+    auto store = [&](const job &entry, size_t index, const std::string &text) {
+        if (Error err = database_.save_ocr_result(
+                entry.images[index].source->uuid, options_.model, text);
+            !err) {
+            remaining--;
+            fatal.emplace(err);
+            cancel();
+            return;
+        }
+        settle(entry, index, true, {});
+    };
+
+    {
+        std::jthread feeder([&] { feed(targets); });
+        std::vector<std::jthread> workers;
+        for (unsigned i = 0; i < threads; i++)
+            workers.emplace_back([this] { prepare(); });
+
+        //
+        // parse and persist
+        //
+
+        while (remaining > 0) {
+            std::optional<outcome> next;
+            if (waiting.empty() || cancelled_) {
+                next = outcomes_->pop();
+            } else {
+                auto due = std::min_element(
+                    waiting.begin(), waiting.end(),
+                    [](const auto &a, const auto &b) {
+                        return a->retry_at < b->retry_at;
+                    });
+                // cancel() has no way to wake this, so it is checked on
+                // the side while retries sit out their backoff
+                next = outcomes_->pop_until(
+                    std::min((*due)->retry_at,
+                             std::chrono::steady_clock::now() +
+                                 std::chrono::milliseconds(100)));
+            }
+
+            if (next) {
+                std::unique_ptr<job> entry = std::move(next->entry);
+                const auto &images = entry->images;
+                const bool sent = next->response.has_value();
+                const ai::google_response *response =
+                    sent ? &*next->response : nullptr;
+                const bool abandoned = cancelled_;
+                if (sent)
+                    report.requests++;
+
+                if (abandoned) {
+                    // left pending for the next run
+                    remaining -= images.size() + entry->queued.size();
+                } else if (!sent) {
+                    for (size_t i = 0; i < images.size(); i++)
+                        settle(*entry, i, false, next->error);
+                } else if (response->valid && images.size() == 1) {
+                    store(*entry, 0, text_of(*response));
+                } else if (response->valid) {
+                    auto texts = split_batch(text_of(*response), images.size());
+                    for (size_t i = 0; i < images.size(); i++) {
+                        if (texts[i])
+                            store(*entry, i, *texts[i]);
+                        else
+                            entry->queued.push_back(images[i]);
+                    }
+                    report.fallbacks += entry->queued.size();
+                } else if (worth_retrying(*response) &&
+                           entry->attempts < options_.max_attempts) {
+                    // keeps its slot, so a rate limited run slows down
+                    // instead of queueing more requests behind the limit
+                    entry->retry_at = std::chrono::steady_clock::now() +
+                                      backoff(entry->attempts);
+                    report.retries++;
+                    waiting.push_back(std::move(entry));
+                } else if (images.size() > 1 && response->http_code == 400) {
+                    // too much together, perhaps; each may do on its own
+                    entry->queued = images;
+                    report.fallbacks += images.size();
+                } else {
+                    for (size_t i = 0; i < images.size(); i++)
+                        settle(*entry, i, false, response->error);
+                }
+
+                if (entry && !cancelled_ && !entry->queued.empty()) {
+                    entry->images = {entry->queued.front()};
+                    entry->queued.erase(entry->queued.begin());
+                    entry->request = request_for(entry->images);
+                    entry->attempts = 0;
+                    entry->retry_at = std::chrono::steady_clock::now();
+                    waiting.push_back(std::move(entry));
+                } else if (entry) {
+                    // left pending, when a failure just now cancelled
+                    if (!abandoned)
+                        remaining -= entry->queued.size();
+                    if (sent)
+                        slots_->release();
+                }
+            }
+
+            // retries that are due, or all of them once cancelled
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = waiting.begin(); it != waiting.end();) {
+                if (cancelled_) {
+                    slots_->release();
+                    remaining -= (*it)->images.size() + (*it)->queued.size();
+                } else if ((*it)->retry_at <= now) {
+                    send(std::move(*it));
+                } else {
+                    ++it;
+                    continue;
+                }
+                it = waiting.erase(it);
+            }
+        }
+    }
+
+    targets_.reset();
+    outcomes_.reset();
+    slots_.reset();
+
+    if (fatal)
+        return std::unexpected(*fatal);
+    report.cancelled = cancelled_;
+    return report;
+}
+
+// discover: hands targets over no faster than the workers take them
+void OcrPipeline::feed(std::span<const target> targets)
+{
+    for (const auto &t : targets) {
+        if (!targets_->push(&t))
+            break;
+    }
+    targets_->close();
+}
+
+// probe, preprocess and base64, then batch up small images if asked to
+void OcrPipeline::prepare()
+{
+    std::vector<image_part> batch;
+
+    while (auto next = targets_->pop()) {
+        const target &t = **next;
+
+        auto give_up = [&](std::string why) {
+            auto entry = std::make_unique<job>();
+            entry->images.push_back({&t, {}, {}});
+            outcomes_->push({std::move(entry), std::nullopt, std::move(why)});
+        };
+
+        if (cancelled_) {
+            give_up("cancelled");
+            continue;
+        }
+
+        auto is_image = materials::is_image(t.file);
+        if (!is_image) {
+            give_up(is_image.error().message());
+            continue;
+        }
+        if (!*is_image) {
+            give_up(t.file.string() + " is not an image");
+            continue;
+        }
+
+        // the original still reads fine when it cannot be shrunk
+        ocr_upload upload{t.file, mime_type_for(t.file)};
+        if (options_.preprocess) {
+            if (auto shrunk = options_.preprocess(t.file, t.hash))
+                upload = std::move(*shrunk);
+        }
+
+        auto stream = materials::file_to_b64_stream(upload.file);
+        if (!stream) {
+            give_up(stream.error().message());
+            continue;
+        }
+
+        // encoded from the mapped file while curl sends it
+        image_part image{&t, ai::curl_helpers::stream_from(*stream),
+                         upload.mime_type};
+        if (options_.batch_size <= 1 ||
+            image.stream.size > options_.batch_image_bytes) {
+            dispatch({std::move(image)});
+            continue;
+        }
+
+        batch.push_back(std::move(image));
+        if (batch.size() >= options_.batch_size)
+            dispatch(std::exchange(batch, {}));
+    }
+
+    if (!batch.empty())
+        dispatch(std::move(batch));
+}
+
+// sends once a slot is free
+void OcrPipeline::dispatch(std::vector<image_part> images)
+{
+    auto entry = std::make_unique<job>();
+    entry->images = std::move(images);
+    entry->request = request_for(entry->images);
+
+    slots_->acquire();
+    if (cancelled_) {
+        slots_->release();
+        outcomes_->push({std::move(entry), std::nullopt, "cancelled"});
+        return;
+    }
+    send(std::move(entry));
+}
+
+// a batch numbers its images and asks for json back
+ai::google_request
+OcrPipeline::request_for(const std::vector<image_part> &images) const
+{
+    ai::google_request request;
+    request.set_model(options_.model);
+    if (!options_.endpoint.empty())
+        request.endpoint = options_.endpoint;
+
+    if (images.size() == 1) {
+        request.add_inline_image(images.front().stream,
+                                 images.front().mime_type);
+        request.add_text(options_.prompt);
+        return request;
+    }
+
+    for (size_t i = 0; i < images.size(); i++) {
+        request.add_text("Image " + std::to_string(i + 1) + ":");
+        request.add_inline_image(images[i].stream, images[i].mime_type);
+    }
+    request.add_text(options_.batch_prompt);
+    request.set_response_mime_type("application/json")
+        .set_response_schema(batch_schema);
+    return request;
+}
+
+void OcrPipeline::send(std::unique_ptr<job> entry)
+{
+    entry->attempts++;
+
+    // std::function needs a copyable callback, so the job travels as a
+    // raw pointer; the transport always completes a request exactly once
+    job *raw = entry.release();
+    client_.send(
+        raw->request,
+        [this, raw](ai::google_response response) {
+            outcomes_->push(
+                {std::unique_ptr<job>(raw), std::move(response), {}});
+        },
+        {.cancel = cancel_,
+         .deadline =
+             std::chrono::steady_clock::now() + options_.request_timeout});
+}
+
+// equal jitter: half the exponential delay is fixed, half random, so
+// retries stay spread out without ever coming back immediately
+std::chrono::milliseconds OcrPipeline::backoff(int attempts)
+{
+    const int64_t base = options_.initial_backoff.count();
+    const int64_t cap = options_.max_backoff.count();
+    const int64_t delay =
+        std::min(cap, base << std::min(attempts - 1, 20));
+
+    std::uniform_int_distribution<int64_t> spread(0, delay / 2);
+    return std::chrono::milliseconds(delay - delay / 2 + spread(jitter_));
+}
+
+} // namespace setman
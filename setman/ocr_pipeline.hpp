@@ -0,0 +1,195 @@
+// OcrPipeline
+// runs ocr over many images at once and stores what comes back
+#pragma once
+
+// setman
+#include "ai_endpoints/transport.hpp"
+#include "bounded_queue.hpp"
+#include "error.hpp"
+#include "materials/content_hash.hpp"
+
+// std
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <semaphore>
+#include <span>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/uuid/uuid.hpp>
+
+namespace setman
+{
+
+namespace ai
+{
+class GoogleClient;
+struct google_request;
+}
+
+namespace materials
+{
+class Image;
+}
+
+class Database;
+class Episode;
+
+// what actually gets uploaded for an image
+struct ocr_upload {
+    std::filesystem::path file;
+    std::string mime_type;
+};
+
+// shrinks an image before upload. the core libraries cannot decode images,
+// so the application hands one in; see materials::ocr_preprocessor_for.
+// `hash` is the source's content hash when its file identity is current.
+using ocr_preprocessor = std::function<std::expected<ocr_upload, Error>(
+    const std::filesystem::path &source,
+    const std::optional<materials::content_hash> &hash)>;
+
+struct ocr_options {
+    std::string model = "gemini-2.0-flash-exp";
+    // empty: the client's default. pointed at a mock server in testing.
+    std::string endpoint;
+    std::string prompt = "Please extract all visible text in this image. "
+                         "Provide this text in a structured format";
+
+    // empty: images are uploaded as they are
+    ocr_preprocessor preprocess;
+
+    // images of up to batch_image_bytes, in base64, go batch_size to a
+    // request, each after its number, and the reply is json with the text
+    // of every image. a rate limit counted in requests then reads that
+    // many times as many images a minute. images the reply leaves out, or
+    // all of them when it cannot be read, are sent again on their own.
+    // 1 sends every image on its own.
+    size_t batch_size = 1;
+    size_t batch_image_bytes = 512 * 1024;
+    std::string batch_prompt =
+        "Please extract all visible text in each of the numbered images "
+        "above. Give every image's text, in a structured format, in the "
+        "entry with that image's number.";
+
+    unsigned prepare_threads = 0; // 0: one per core
+    size_t queue_capacity = 16;   // images read ahead of the workers
+
+    // requests handed to the transport and not yet answered. how many of
+    // them are on the wire is up to its rate control, which holds the rest
+    // back; they wait on request_timeout meanwhile, so this should not be
+    // more than a rate limit in requests lets through in that time.
+    size_t max_in_flight = 16;
+
+    // 429s, 5xx and transport errors are retried after an exponential
+    // backoff with jitter, so a rate limited batch does not come back in
+    // lockstep. other failures are final.
+    int max_attempts = 5;
+    std::chrono::milliseconds initial_backoff{500};
+    std::chrono::milliseconds max_backoff{30'000};
+    std::chrono::milliseconds request_timeout{120'000};
+
+    // images already read by an earlier run are skipped unless this is set
+    bool redo_finished = false;
+};
+
+struct ocr_failure {
+    boost::uuids::uuid material;
+    std::string error;
+};
+
+struct ocr_report {
+    size_t requested = 0;
+    size_t skipped = 0; // finished by an earlier run
+    size_t succeeded = 0;
+    size_t retries = 0;
+    size_t requests = 0;  // sent and answered, retries included
+    size_t fallbacks = 0; // batched images sent again on their own
+    std::vector<ocr_failure> failed;
+    bool cancelled = false;
+
+    size_t finished() const { return skipped + succeeded + failed.size(); }
+};
+
+// discover -> probe -> preprocess -> base64 -> request -> parse -> persist.
+// with batching on, small images are grouped into shared requests there.
+//
+// a feeder thread hands images to a pool of workers through a bounded
+// queue. workers probe, preprocess and encode them, then wait for one of
+// max_in_flight request slots before sending. the thread calling run()
+// persists responses, schedules retries and frees the slots, so every
+// stage is held back by the one after it.
+//
+// progress lives in the ocr_jobs table. an image is marked done right
+// after its text is stored, and a run that is interrupted, by a crash or
+// by cancel(), leaves the rest pending for the next run to pick up.
+class OcrPipeline
+{
+  public:
+    OcrPipeline(Database &database, ai::GoogleClient &client,
+                ocr_options options = {});
+    ~OcrPipeline();
+
+    OcrPipeline(const OcrPipeline &) = delete;
+    OcrPipeline &operator=(const OcrPipeline &) = delete;
+
+    // blocks until every image has been read or has failed for good.
+    // the database is only touched from the calling thread.
+    std::expected<ocr_report, Error>
+    run(std::span<const materials::Image *const> images);
+
+    // every image in the episode, keyframes and references alike
+    std::expected<ocr_report, Error> run(const Episode &episode);
+
+    // from any thread. requests in flight are abandoned and run() returns
+    // with what has been stored so far. a cancelled pipeline stays so.
+    void cancel();
+
+    // called on run()'s thread after every image that finishes
+    void on_progress(std::function<void(const ocr_report &)> progress)
+    {
+        progress_ = std::move(progress);
+    }
+
+  private:
+    struct target {
+        boost::uuids::uuid material;
+        std::string uuid; // as stored
+        std::filesystem::path file;
+        std::optional<materials::content_hash> hash;
+    };
+    struct image_part;
+    struct job;
+    struct outcome;
+
+    void feed(std::span<const target> targets);
+    void prepare();
+    void dispatch(std::vector<image_part> images);
+    ai::google_request request_for(const std::vector<image_part> &images) const;
+    void send(std::unique_ptr<job> entry);
+    std::chrono::milliseconds backoff(int attempts);
+
+    Database &database_;
+    ai::GoogleClient &client_;
+    ocr_options options_;
+    std::function<void(const ocr_report &)> progress_;
+
+    ai::CancelToken cancel_;
+    std::atomic<bool> cancelled_{false};
+
+    // set up by each run()
+    std::unique_ptr<BoundedQueue<const target *>> targets_;
+    std::unique_ptr<BoundedQueue<outcome>> outcomes_;
+    std::unique_ptr<std::counting_semaphore<>> slots_;
+
+    std::minstd_rand jitter_{std::random_device{}()};
+};
+
+} // namespace setman
@@ -0,0 +1,128 @@
+// ReadPool
+// implementation
+#include "read_pool.hpp"
+#include "database.hpp"
+
+// std
+#include <algorithm>
+
+namespace setman
+{
+
+//
+// ReadPool
+//
+
+std::expected<std::unique_ptr<ReadPool>, Error>
+ReadPool::open(const path &location, size_t connections)
+{
+    std::unique_ptr<ReadPool> pool(new ReadPool());
+
+    for (size_t i = 0; i < std::max<size_t>(connections, 1); i++) {
+        sqlite3 *handle = nullptr;
+        int rc = sqlite3_open_v2(location.c_str(), &handle,
+                                 SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                                 nullptr);
+        if (rc != SQLITE_OK) {
+            std::string error = handle ? sqlite3_errmsg(handle)
+                                       : sqlite3_errstr(rc);
+            sqlite3_close(handle);
+            return std::unexpected(Error(Code::database_error, error));
+        }
+
+        sqlite3_busy_timeout(handle, Database::busy_timeout_ms);
+
+        pool->connections_.push_back(std::make_unique<connection>(handle));
+        pool->idle_.push_back(pool->connections_.back().get());
+    }
+
+    return pool;
+}
+
+ReadPool::~ReadPool()
+{
+    // every snapshot must have been returned by now
+    for (auto &conn : connections_) {
+        conn->statements.clear();
+        sqlite3_close(conn->handle);
+    }
+}
+
+ReadPool::Snapshot ReadPool::acquire()
+{
+    std::unique_lock lock(mutex_);
+    available_.wait(lock, [this] { return !idle_.empty(); });
+
+    connection *conn = idle_.back();
+    idle_.pop_back();
+    lock.unlock();
+
+    return lease(conn);
+}
+
+std::optional<ReadPool::Snapshot> ReadPool::try_acquire()
+{
+    std::unique_lock lock(mutex_);
+    if (idle_.empty())
+        return std::nullopt;
+
+    connection *conn = idle_.back();
+    idle_.pop_back();
+    lock.unlock();
+
+    return lease(conn);
+}
+
+ReadPool::Snapshot ReadPool::lease(connection *conn)
+{
+    // a deferred BEGIN only pins the WAL snapshot on the first read, so
+    // touch the schema straight away
+    sqlite3_exec(conn->handle, "BEGIN", nullptr, nullptr, nullptr);
+    sqlite3_exec(conn->handle, "SELECT 1 FROM sqlite_schema LIMIT 1", nullptr,
+                 nullptr, nullptr);
+    return Snapshot(this, conn);
+}
+
+void ReadPool::release(connection *conn)
+{
+    conn->statements.reset_all();
+    sqlite3_exec(conn->handle, "COMMIT", nullptr, nullptr, nullptr);
+
+    {
+        std::lock_guard lock(mutex_);
+        idle_.push_back(conn);
+    }
+    available_.notify_one();
+}
+
+//
+// ReadPool::Snapshot
+//
+
+ReadPool::Snapshot::Snapshot(ReadPool *pool, connection *conn)
+    : pool_(pool), conn_(conn)
+{
+}
+
+ReadPool::Snapshot::Snapshot(Snapshot &&other) noexcept
+    : pool_(other.pool_), conn_(other.conn_)
+{
+    other.conn_ = nullptr;
+}
+
+ReadPool::Snapshot::~Snapshot()
+{
+    if (conn_)
+        pool_->release(conn_);
+}
+
+sqlite3 *ReadPool::Snapshot::handle() const { return conn_->handle; }
+
+sqlite3_stmt *ReadPool::Snapshot::prepare(std::string_view sql)
+{
+    return conn_->statements.get(sql);
+}
+
+StatementCache &ReadPool::Snapshot::statements() { return conn_->statements; }
+
+} // namespace setman
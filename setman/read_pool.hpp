@@ -0,0 +1,91 @@
+// ReadPool
+// read-only sqlite connections handing out WAL snapshots to worker threads
+#pragma once
+
+// sqlite
+#include <sqlite3.h>
+
+// setman
+#include "error.hpp"
+#include "statement_cache.hpp"
+
+// std
+#include <condition_variable>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace setman
+{
+
+class ReadPool
+{
+  private:
+    struct connection;
+
+  public:
+    using path = std::filesystem::path;
+
+    // a leased connection with an open read transaction. every query made
+    // through it sees the database as it was when the snapshot was taken,
+    // no matter what the writer commits meanwhile.
+    class Snapshot
+    {
+      public:
+        Snapshot(Snapshot &&other) noexcept;
+        Snapshot &operator=(Snapshot &&) = delete;
+        ~Snapshot();
+
+        sqlite3 *handle() const;
+
+        // cached per connection; reset with cleared bindings
+        sqlite3_stmt *prepare(std::string_view sql);
+        StatementCache &statements();
+
+      private:
+        friend class ReadPool;
+        Snapshot(ReadPool *pool, connection *conn);
+
+        ReadPool *pool_;
+        connection *conn_;
+    };
+
+    static std::expected<std::unique_ptr<ReadPool>, Error>
+    open(const path &location, size_t connections = 4);
+
+    ~ReadPool();
+
+    ReadPool(const ReadPool &) = delete;
+    ReadPool &operator=(const ReadPool &) = delete;
+
+    // blocks until a connection is free
+    Snapshot acquire();
+    std::optional<Snapshot> try_acquire();
+
+    size_t size() const { return connections_.size(); }
+
+  private:
+    struct connection {
+        sqlite3 *handle;
+        StatementCache statements;
+
+        connection(sqlite3 *db) : handle(db), statements(db) {}
+    };
+
+    ReadPool() = default;
+
+    Snapshot lease(connection *conn);
+    void release(connection *conn);
+
+    std::vector<std::unique_ptr<connection>> connections_;
+    std::vector<connection *> idle_;
+
+    std::mutex mutex_;
+    std::condition_variable available_;
+};
+
+} // namespace setman
@@ -0,0 +1,255 @@
+// DatabaseResponseStore
+// implementation
+#include "response_store.hpp"
+
+// std
+#include <vector>
+
+namespace setman
+{
+
+static Error exec(sqlite3 *db, const char *sql)
+{
+    char *err_msg = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        std::string error = err_msg ? err_msg : sqlite3_errmsg(db);
+        sqlite3_free(err_msg);
+        return {Code::database_error, error};
+    }
+    return Code::success;
+}
+
+static Error step_once(sqlite3 *db, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE)
+        return {Code::database_error, sqlite3_errmsg(db)};
+    return Code::success;
+}
+
+static void bind_text(sqlite3_stmt *stmt, int index, const std::string &text)
+{
+    sqlite3_bind_text(stmt, index, text.data(), static_cast<int>(text.size()),
+                      SQLITE_STATIC);
+}
+
+static int64_t to_ms(std::chrono::system_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               time.time_since_epoch())
+        .count();
+}
+
+DatabaseResponseStore::DatabaseResponseStore(const path &location,
+                                             size_t max_bytes)
+    : database_(location), max_bytes_(max_bytes)
+{
+    sqlite3_stmt *stmt = database_.statements().get(
+        "SELECT total(size) FROM response_cache");
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+        bytes_ = static_cast<size_t>(sqlite3_column_int64(stmt, 0));
+    if (stmt)
+        sqlite3_reset(stmt);
+
+    thread_ = std::jthread([this](std::stop_token stop) { run(stop); });
+}
+
+DatabaseResponseStore::~DatabaseResponseStore()
+{
+    thread_.request_stop();
+    wake_.release();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+std::optional<ai::stored_response>
+DatabaseResponseStore::load(const std::string &key,
+                            std::chrono::system_clock::time_point not_before)
+{
+    std::optional<ai::stored_response> found;
+    {
+        std::lock_guard lock(mutex_);
+        sqlite3_stmt *stmt = database_.statements().get(
+            "SELECT body, created FROM response_cache "
+            "WHERE key = ? AND created >= ?");
+        if (!stmt)
+            return std::nullopt;
+
+        bind_text(stmt, 1, key);
+        sqlite3_bind_int64(stmt, 2, to_ms(not_before));
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const auto *body =
+                static_cast<const char *>(sqlite3_column_blob(stmt, 0));
+            found.emplace(
+                std::string(body, sqlite3_column_bytes(stmt, 0)),
+                std::chrono::system_clock::time_point(
+                    std::chrono::milliseconds(sqlite3_column_int64(stmt, 1))));
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+
+    // expired rows are left to be overwritten or evicted
+    if (found) {
+        queue_.push({key, std::nullopt,
+                     to_ms(std::chrono::system_clock::now())});
+        wake_.release();
+    }
+    return found;
+}
+
+void DatabaseResponseStore::store(const std::string &key,
+                                  const std::string &body)
+{
+    queue_.push({key, body, to_ms(std::chrono::system_clock::now())});
+    wake_.release();
+}
+
+void DatabaseResponseStore::run(std::stop_token stop)
+{
+    std::vector<write> group;
+
+    while (true) {
+        if (!stop.stop_requested())
+            wake_.acquire();
+        bool stopping = stop.stop_requested();
+
+        while (auto entry = queue_.pop())
+            group.push_back(std::move(*entry));
+
+        // nowhere to report to; a response that failed to persist is only
+        // fetched again
+        if (!group.empty()) {
+            write_group(group);
+            group.clear();
+        }
+        if (bytes_ > max_bytes_)
+            evict();
+
+        if (stopping && queue_.empty())
+            return;
+    }
+}
+
+Error DatabaseResponseStore::write_group(std::vector<write> &group)
+{
+    static constexpr char upsert[] =
+        "INSERT INTO response_cache (key, body, size, created, accessed) "
+        "VALUES (?1, ?2, ?3, ?4, ?4) "
+        "ON CONFLICT(key) DO UPDATE SET body = excluded.body, "
+        "size = excluded.size, created = excluded.created, "
+        "accessed = excluded.accessed";
+    static constexpr char touch[] =
+        "UPDATE response_cache SET accessed = max(accessed, ?) WHERE key = ?";
+    static constexpr char size_of[] =
+        "SELECT size FROM response_cache WHERE key = ?";
+
+    std::lock_guard lock(mutex_);
+    sqlite3 *db = database_.handle();
+    auto &statements = database_.statements();
+
+    if (Error err = exec(db, "BEGIN IMMEDIATE"); !err)
+        return err;
+
+    // the running total follows replaced rows too. it is only moved once
+    // the transaction commits; a rolled back group leaves the table as it
+    // was.
+    size_t added = 0, replaced = 0;
+
+    auto write_one = [&](const write &entry) -> Error {
+        if (entry.body) {
+            sqlite3_stmt *previous = statements.get(size_of);
+            bind_text(previous, 1, entry.key);
+            if (sqlite3_step(previous) == SQLITE_ROW)
+                replaced += sqlite3_column_int64(previous, 0);
+            sqlite3_reset(previous);
+            sqlite3_clear_bindings(previous);
+
+            sqlite3_stmt *stmt = statements.get(upsert);
+            bind_text(stmt, 1, entry.key);
+            bind_text(stmt, 2, *entry.body);
+            sqlite3_bind_int64(stmt, 3, entry.body->size());
+            sqlite3_bind_int64(stmt, 4, entry.time);
+            if (Error err = step_once(db, stmt); !err)
+                return err;
+            added += entry.body->size();
+            return Code::success;
+        }
+
+        sqlite3_stmt *stmt = statements.get(touch);
+        sqlite3_bind_int64(stmt, 1, entry.time);
+        bind_text(stmt, 2, entry.key);
+        return step_once(db, stmt);
+    };
+
+    for (const auto &entry : group) {
+        if (Error err = write_one(entry); !err) {
+            exec(db, "ROLLBACK");
+            return err;
+        }
+    }
+
+    if (Error err = exec(db, "COMMIT"); !err) {
+        exec(db, "ROLLBACK");
+        return err;
+    }
+    bytes_ -= std::min(bytes_, replaced);
+    bytes_ += added;
+    return Code::success;
+}
+
+// trims to 90% of the budget, so the next few stores do not each evict
+Error DatabaseResponseStore::evict()
+{
+    static constexpr char oldest[] =
+        "SELECT key, size FROM response_cache ORDER BY accessed LIMIT 64";
+    static constexpr char erase[] = "DELETE FROM response_cache WHERE key = ?";
+
+    std::lock_guard lock(mutex_);
+    sqlite3 *db = database_.handle();
+    auto &statements = database_.statements();
+
+    if (Error err = exec(db, "BEGIN IMMEDIATE"); !err)
+        return err;
+
+    const size_t target = max_bytes_ / 10 * 9;
+    size_t remaining = bytes_; // bytes_ once this commits
+    while (remaining > target) {
+        std::vector<std::pair<std::string, size_t>> victims;
+        sqlite3_stmt *stmt = statements.get(oldest);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            victims.emplace_back(
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                static_cast<size_t>(sqlite3_column_int64(stmt, 1)));
+        }
+        sqlite3_reset(stmt);
+
+        if (victims.empty()) {
+            remaining = 0;
+            break;
+        }
+
+        sqlite3_stmt *remove = statements.get(erase);
+        for (const auto &[key, size] : victims) {
+            if (remaining <= target)
+                break;
+            bind_text(remove, 1, key);
+            if (Error err = step_once(db, remove); !err) {
+                exec(db, "ROLLBACK");
+                return err;
+            }
+            remaining -= std::min(remaining, size);
+        }
+    }
+
+    if (Error err = exec(db, "COMMIT"); !err) {
+        exec(db, "ROLLBACK");
+        return err;
+    }
+    bytes_ = remaining;
+    return Code::success;
+}
+
+} // namespace setman
@@ -0,0 +1,65 @@
+// DatabaseResponseStore
+// keeps ai responses in the project database between sessions
+#pragma once
+
+// setman
+#include "ai_endpoints/response_cache.hpp"
+#include "database.hpp"
+#include "mpsc_queue.hpp"
+
+// std
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <string>
+#include <thread>
+
+namespace setman
+{
+
+// the cold tier of an ai::ResponseCache, in the response_cache table.
+// lookups read on the caller's thread; stores and last-access updates are
+// written behind by a thread of its own, which also evicts the least
+// recently used responses once the table outgrows max_bytes.
+class DatabaseResponseStore : public ai::ResponseStore
+{
+  public:
+    using path = std::filesystem::path;
+
+    DatabaseResponseStore(const path &location, size_t max_bytes = 256 << 20);
+    ~DatabaseResponseStore(); // writes everything queued before returning
+
+    DatabaseResponseStore(const DatabaseResponseStore &) = delete;
+    DatabaseResponseStore &operator=(const DatabaseResponseStore &) = delete;
+
+    std::optional<ai::stored_response>
+    load(const std::string &key,
+         std::chrono::system_clock::time_point not_before) override;
+    void store(const std::string &key, const std::string &body) override;
+
+  private:
+    struct write {
+        std::string key;
+        std::optional<std::string> body; // nullopt: only a lookup
+        int64_t time;
+    };
+
+    void run(std::stop_token stop);
+    Error write_group(std::vector<write> &group);
+    Error evict();
+
+    Database database_;
+    std::mutex mutex_; // the connection is shared with the writer thread
+
+    size_t max_bytes_;
+    size_t bytes_ = 0; // writer thread only, once constructed
+
+    MpscQueue<write> queue_;
+    std::counting_semaphore<> wake_{0};
+    std::jthread thread_;
+};
+
+} // namespace setman
@@ -0,0 +1,106 @@
+// search
+// implementation
+#include "search.hpp"
+#include "statement_cache.hpp"
+
+namespace setman
+{
+
+// trigram tokens need three characters; anything shorter falls back to LIKE,
+// which fts5 still answers from its own table without touching materials
+static size_t utf8_length(const std::string &text)
+{
+    size_t length = 0;
+    for (unsigned char c : text) {
+        if ((c & 0xC0) != 0x80)
+            length++;
+    }
+    return length;
+}
+
+// the query is matched as one literal phrase, never as fts5 syntax
+static std::string as_phrase(const std::string &text)
+{
+    std::string phrase = "\"";
+    for (char c : text) {
+        if (c == '"')
+            phrase.push_back('"');
+        phrase.push_back(c);
+    }
+    phrase.push_back('"');
+    return phrase;
+}
+
+static std::string as_like_pattern(const std::string &text)
+{
+    std::string pattern = "%";
+    for (char c : text) {
+        if (c == '%' || c == '_' || c == '\\')
+            pattern.push_back('\\');
+        pattern.push_back(c);
+    }
+    pattern.push_back('%');
+    return pattern;
+}
+
+std::expected<std::vector<search_hit>, Error>
+search_materials(sqlite3 *connection, StatementCache &statements,
+                 const search_query &query)
+{
+    static constexpr char match_sql[] =
+        "SELECT material_uuid, episode_uuid, "
+        "snippet(material_search, -1, '[', ']', '...', 12), rank "
+        "FROM material_search WHERE material_search MATCH ?1 "
+        "AND (?2 IS NULL OR episode_uuid = ?2) "
+        "ORDER BY rank LIMIT ?3";
+
+    static constexpr char like_sql[] =
+        "SELECT material_uuid, episode_uuid, "
+        "coalesce(nullif(notes, ''), alias, tags, ocr), 0.0 "
+        "FROM material_search "
+        "WHERE (notes LIKE ?1 ESCAPE '\\' OR alias LIKE ?1 ESCAPE '\\' "
+        "OR tags LIKE ?1 ESCAPE '\\' OR ocr LIKE ?1 ESCAPE '\\') "
+        "AND (?2 IS NULL OR episode_uuid = ?2) "
+        "LIMIT ?3";
+
+    if (query.text.empty())
+        return std::vector<search_hit>{};
+
+    bool use_match = utf8_length(query.text) >= 3;
+    sqlite3_stmt *stmt = statements.get(use_match ? match_sql : like_sql);
+    if (!stmt)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(connection)));
+
+    std::string pattern =
+        use_match ? as_phrase(query.text) : as_like_pattern(query.text);
+    sqlite3_bind_text(stmt, 1, pattern.c_str(), pattern.size(), SQLITE_STATIC);
+    if (query.episode_uuid)
+        sqlite3_bind_text(stmt, 2, query.episode_uuid->c_str(),
+                          query.episode_uuid->size(), SQLITE_STATIC);
+    else
+        sqlite3_bind_null(stmt, 2);
+    sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(query.limit));
+
+    auto column = [stmt](int index) {
+        const unsigned char *text = sqlite3_column_text(stmt, index);
+        return text ? std::string(reinterpret_cast<const char *>(text))
+                    : std::string();
+    };
+
+    std::vector<search_hit> hits;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        hits.push_back({column(0), column(1), column(2),
+                        sqlite3_column_double(stmt, 3)});
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE)
+        return std::unexpected(
+            Error(Code::database_error, sqlite3_errmsg(connection)));
+
+    return hits;
+}
+
+} // namespace setman
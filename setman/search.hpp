@@ -0,0 +1,41 @@
+// search
+// full text search over material notes, aliases, tags and ocr text
+#pragma once
+
+// sqlite
+#include <sqlite3.h>
+
+// setman
+#include "error.hpp"
+
+// std
+#include <expected>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace setman
+{
+
+class StatementCache;
+
+struct search_query {
+    std::string text;
+    std::optional<std::string> episode_uuid; // whole database when empty
+    size_t limit = 50;
+};
+
+struct search_hit {
+    std::string material_uuid;
+    std::string episode_uuid;
+    std::string snippet;
+    double rank; // bm25, lower is better
+};
+
+// runs on any connection holding the schema, so it works both on the
+// Database connection and on a ReadPool::Snapshot
+std::expected<std::vector<search_hit>, Error>
+search_materials(sqlite3 *connection, StatementCache &statements,
+                 const search_query &query);
+
+} // namespace setman
@@ -85,4 +85,31 @@ void Series::refresh_tags()
     }
 }
 
+void Series::refresh_perceptual_index()
+{
+    perceptual_index_.clear();
+    for (const auto &episode : episodes_) {
+        for (const auto *file : episode->files()) {
+            const auto &identity = file->identity();
+            if (identity && identity->dhash)
+                perceptual_index_.insert(file->uuid(), *identity->dhash);
+        }
+    }
+}
+
+std::vector<materials::PerceptualIndex::match>
+Series::near_duplicates(const materials::GenericMaterial &image,
+                        int max_distance) const
+{
+    const auto &identity = image.identity();
+    if (!identity || !identity->dhash)
+        return {};
+
+    auto matches = perceptual_index_.within(*identity->dhash, max_distance);
+    std::erase_if(matches, [&](const auto &match) {
+        return match.material == image.uuid();
+    });
+    return matches;
+}
+
 } // namespace setman
@@ -6,6 +6,7 @@
 #include "company.hpp"
 #include "materials/cut.hpp"
 #include "materials/element.hpp"
+#include "materials/perceptual_hash.hpp"
 #include "uuid.hpp"
 
 // std
@@ -38,6 +39,7 @@ class Series
         return naming_convention_;
     }
     constexpr const std::string &id() const { return id_; }
+    constexpr int season() const { return season_; }
     constexpr const std::vector<std::unique_ptr<Episode>> &episodes() const
     {
         return episodes_;
@@ -52,6 +54,19 @@ class Series
     }
     void refresh_tags();
 
+    // near-duplicate lookup over every image in the series that has a
+    // perceptual hash; see refresh_perceptual_hashes
+    const materials::PerceptualIndex &perceptual_index() const
+    {
+        return perceptual_index_;
+    }
+    void refresh_perceptual_index();
+
+    // other images within `max_distance` bits of this one, closest first
+    std::vector<materials::PerceptualIndex::match>
+    near_duplicates(const materials::GenericMaterial &image,
+                    int max_distance = 8) const;
+
     const std::unordered_set<std::unique_ptr<materials::Element>> &elements()
     {
         return elements_;
@@ -81,6 +96,8 @@ class Series
         tag_lookup_;
     std::unordered_set<std::unique_ptr<materials::Element>> elements_;
 
+    materials::PerceptualIndex perceptual_index_;
+
     void build_regex();
 };
 
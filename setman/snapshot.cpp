@@ -0,0 +1,624 @@
+// ProjectSnapshot
+// implementation
+#include "snapshot.hpp"
+
+// setman
+#include "company.hpp"
+#include "episode.hpp"
+#include "materials/element.hpp"
+#include "series.hpp"
+
+// std
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace setman
+{
+
+namespace sf = snapshot_format;
+
+//
+// writing
+//
+
+namespace
+{
+
+class SnapshotBuilder
+{
+  public:
+    void add_company(const Company &company)
+    {
+        company_name_ = intern(company.name());
+        for (const auto &series : company.series())
+            add_series(*series);
+    }
+
+    Error write(uint64_t generation, const std::filesystem::path &file) const;
+
+  private:
+    sf::string_ref intern(std::string_view text)
+    {
+        auto it = interned_.find(std::string(text));
+        if (it != interned_.end())
+            return it->second;
+
+        sf::string_ref ref{static_cast<uint32_t>(strings_.size()),
+                           static_cast<uint32_t>(text.size())};
+        strings_.append(text);
+        interned_.emplace(std::string(text), ref);
+        return ref;
+    }
+
+    template <typename Container> sf::range add_tags(const Container &tags)
+    {
+        sf::range range{static_cast<uint32_t>(tags_.size()), 0};
+        for (const auto &tag : tags) {
+            tags_.push_back({intern(tag)});
+            range.count++;
+        }
+        return range;
+    }
+
+    static void copy_uuid(uint8_t (&dest)[16], const boost::uuids::uuid &uuid)
+    {
+        std::memcpy(dest, uuid.data, sizeof(dest));
+    }
+
+    void add_series(Series &series)
+    {
+        uint32_t index = static_cast<uint32_t>(series_.size());
+        series_.push_back({});
+
+        sf::series_record record{};
+        copy_uuid(record.uuid, series.uuid());
+        record.id = intern(series.id());
+        record.naming_convention = intern(series.naming_convention());
+        record.season = series.season();
+
+        record.elements.first = static_cast<uint32_t>(elements_.size());
+        for (const auto &element : series.elements())
+            add_element(*element, index, sf::none);
+        record.elements.count =
+            static_cast<uint32_t>(elements_.size()) - record.elements.first;
+
+        record.episodes.first = static_cast<uint32_t>(episodes_.size());
+        for (const auto &episode : series.episodes())
+            add_episode(*episode, index);
+        record.episodes.count =
+            static_cast<uint32_t>(episodes_.size()) - record.episodes.first;
+
+        series_[index] = record;
+    }
+
+    void add_episode(Episode &episode, uint32_t series)
+    {
+        uint32_t index = static_cast<uint32_t>(episodes_.size());
+        episodes_.push_back({});
+
+        sf::episode_record record{};
+        copy_uuid(record.uuid, episode.uuid());
+        record.series = series;
+        record.number = episode.number();
+        record.location = intern(episode.root().string());
+        record.up_folder = intern(episode.up_folder().string());
+        record.cels_folder = intern(episode.cels_folder().string());
+        record.notes = intern(episode.notes());
+
+        record.materials.first = static_cast<uint32_t>(materials_.size());
+        record.cuts.first = static_cast<uint32_t>(cuts_.size());
+
+        for (const auto &material : episode.materials())
+            add_material(*material, index, sf::none);
+        for (const auto &cut : episode.active())
+            add_cut(*cut, index, false);
+        for (const auto &cut : episode.archived())
+            add_cut(*cut, index, true);
+
+        record.materials.count =
+            static_cast<uint32_t>(materials_.size()) - record.materials.first;
+        record.cuts.count =
+            static_cast<uint32_t>(cuts_.size()) - record.cuts.first;
+
+        record.elements.first = static_cast<uint32_t>(elements_.size());
+        for (const auto &element : episode.elements())
+            add_element(*element, series, index);
+        record.elements.count =
+            static_cast<uint32_t>(elements_.size()) - record.elements.first;
+
+        episodes_[index] = record;
+    }
+
+    uint32_t add_material(const materials::GenericMaterial &material,
+                          uint32_t episode, uint32_t parent)
+    {
+        uint32_t index = static_cast<uint32_t>(materials_.size());
+
+        sf::material_record record{};
+        copy_uuid(record.uuid, material.uuid());
+        record.episode = episode;
+        record.parent = parent;
+        record.type = static_cast<uint32_t>(material.type());
+        record.path = intern(material.file().string());
+        record.notes = intern(material.notes());
+        record.alias = intern(material.alias());
+        record.tags = add_tags(material.tags());
+        materials_.push_back(record);
+
+        if (material.is_directory()) {
+            const auto &folder =
+                static_cast<const materials::Folder &>(material);
+            for (const auto &child : folder.children())
+                add_material(*child, episode, index);
+        }
+
+        return index;
+    }
+
+    void add_cut(const materials::Cut &cut, uint32_t episode, bool archived)
+    {
+        sf::cut_record record{};
+        copy_uuid(record.uuid, cut.uuid());
+        record.material = add_material(cut, episode, sf::none);
+        record.scene = cut.scene().value_or(INT32_MIN);
+        record.number = cut.number();
+        record.take = cut.take_number();
+        record.stage = static_cast<uint8_t>(cut.stage());
+        record.status = static_cast<uint8_t>(cut.status());
+        record.archived = archived ? 1 : 0;
+        record.suffix = intern(cut.suffix());
+        cuts_.push_back(record);
+    }
+
+    void add_element(const materials::Element &element, uint32_t series,
+                     uint32_t episode)
+    {
+        sf::element_record record{};
+        copy_uuid(record.uuid, element.uuid());
+        record.series = series;
+        record.episode = episode;
+        record.name = intern(element.name());
+        record.aliases = add_tags(element.aliases());
+        record.tags = add_tags(element.tags());
+        elements_.push_back(record);
+    }
+
+    sf::string_ref company_name_{};
+    std::string strings_;
+    std::unordered_map<std::string, sf::string_ref> interned_;
+
+    std::vector<sf::series_record> series_;
+    std::vector<sf::episode_record> episodes_;
+    std::vector<sf::cut_record> cuts_;
+    std::vector<sf::material_record> materials_;
+    std::vector<sf::tag_record> tags_;
+    std::vector<sf::element_record> elements_;
+};
+
+static uint64_t aligned(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+
+Error SnapshotBuilder::write(uint64_t generation,
+                             const std::filesystem::path &file) const
+{
+    sf::header header{};
+    std::memcpy(header.magic, sf::magic, sizeof(header.magic));
+    header.version = sf::version;
+    header.header_size = sizeof(sf::header);
+    header.generation = generation;
+    header.company_name = company_name_;
+
+    struct table_bytes {
+        const void *data;
+        size_t size;
+    };
+    table_bytes tables[sf::table_count] = {
+        {series_.data(), series_.size() * sizeof(sf::series_record)},
+        {episodes_.data(), episodes_.size() * sizeof(sf::episode_record)},
+        {cuts_.data(), cuts_.size() * sizeof(sf::cut_record)},
+        {materials_.data(), materials_.size() * sizeof(sf::material_record)},
+        {tags_.data(), tags_.size() * sizeof(sf::tag_record)},
+        {elements_.data(), elements_.size() * sizeof(sf::element_record)},
+    };
+    const size_t counts[sf::table_count] = {
+        series_.size(),    episodes_.size(), cuts_.size(),
+        materials_.size(), tags_.size(),     elements_.size()};
+
+    uint64_t offset = aligned(sizeof(sf::header));
+    for (size_t i = 0; i < sf::table_count; i++) {
+        header.tables[i] = {offset, counts[i]};
+        offset = aligned(offset + tables[i].size);
+    }
+    header.strings_offset = offset;
+    header.strings_size = strings_.size();
+
+    std::filesystem::path temp = file;
+    temp += ".tmp";
+
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return {Code::file_open_failed, "Failed to open " + temp.string()};
+
+    static constexpr char padding[8] = {};
+    auto write_at = [&](uint64_t at, const void *data, size_t size) {
+        uint64_t pos = static_cast<uint64_t>(out.tellp());
+        out.write(padding, static_cast<std::streamsize>(at - pos));
+        out.write(static_cast<const char *>(data),
+                  static_cast<std::streamsize>(size));
+    };
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (size_t i = 0; i < sf::table_count; i++)
+        write_at(header.tables[i].offset, tables[i].data, tables[i].size);
+    write_at(header.strings_offset, strings_.data(), strings_.size());
+
+    out.close();
+    if (!out)
+        return {Code::file_write_failed, "Failed to write " + temp.string()};
+
+    std::error_code ec;
+    std::filesystem::rename(temp, file, ec);
+    if (ec)
+        return {Code::generic_filesystem_error, ec.message()};
+
+    return Code::success;
+}
+
+} // namespace
+
+Error ProjectSnapshot::write(const Company &company, uint64_t generation,
+                             const std::filesystem::path &file)
+{
+    SnapshotBuilder builder;
+    builder.add_company(company);
+    return builder.write(generation, file);
+}
+
+//
+// opening
+//
+
+std::expected<std::unique_ptr<ProjectSnapshot>, Error>
+ProjectSnapshot::open(const std::filesystem::path &file,
+                      std::optional<uint64_t> expected_generation)
+{
+    auto mapped =
+        materials::MappedFile::open(file, materials::MappedFile::access::random);
+    if (!mapped)
+        return std::unexpected(mapped.error());
+
+    const size_t size = mapped->size();
+    if (size < sizeof(sf::header))
+        return std::unexpected(Error(Code::snapshot_invalid));
+
+    std::unique_ptr<ProjectSnapshot> snapshot(
+        new ProjectSnapshot(std::move(*mapped)));
+
+    // only the header and table bounds are checked here; record contents
+    // are checked as they are read so opening stays independent of size
+    const sf::header &header = snapshot->header();
+    if (std::memcmp(header.magic, sf::magic, sizeof(sf::magic)) != 0 ||
+        header.version != sf::version ||
+        header.header_size != sizeof(sf::header))
+        return std::unexpected(Error(Code::snapshot_invalid));
+
+    const size_t record_sizes[sf::table_count] = {
+        sizeof(sf::series_record),   sizeof(sf::episode_record),
+        sizeof(sf::cut_record),      sizeof(sf::material_record),
+        sizeof(sf::tag_record),      sizeof(sf::element_record)};
+    for (size_t i = 0; i < sf::table_count; i++) {
+        const auto &table = header.tables[i];
+        if (table.offset % 8 != 0 || table.offset > size ||
+            table.count > UINT32_MAX ||
+            table.count > (size - table.offset) / record_sizes[i])
+            return std::unexpected(Error(Code::snapshot_invalid));
+    }
+    if (header.strings_offset > size ||
+        header.strings_size > size - header.strings_offset)
+        return std::unexpected(Error(Code::snapshot_invalid));
+
+    if (expected_generation && header.generation != *expected_generation)
+        return std::unexpected(Error(Code::snapshot_stale));
+
+    return snapshot;
+}
+
+ProjectSnapshot::~ProjectSnapshot() = default;
+
+std::string_view ProjectSnapshot::string(sf::string_ref ref) const
+{
+    const sf::header &h = header();
+    if (uint64_t(ref.offset) + ref.length > h.strings_size)
+        return {};
+    return {reinterpret_cast<const char *>(data_ + h.strings_offset) +
+                ref.offset,
+            ref.length};
+}
+
+std::string_view ProjectSnapshot::tag(sf::range tags, size_t index) const
+{
+    if (index >= tags.count || uint64_t(tags.first) + index >= count(sf::tag_table))
+        return {};
+    return string(
+        record<sf::tag_record>(sf::tag_table, tags.first + index).text);
+}
+
+// how many entries of a range really exist in its table
+static size_t clamp(sf::range range, uint32_t table_size)
+{
+    if (range.first >= table_size)
+        return 0;
+    return std::min<size_t>(range.count, table_size - range.first);
+}
+
+static boost::uuids::uuid to_uuid(const uint8_t (&bytes)[16])
+{
+    boost::uuids::uuid uuid;
+    std::memcpy(uuid.data, bytes, sizeof(bytes));
+    return uuid;
+}
+
+std::string_view ProjectSnapshot::company_name() const
+{
+    return string(header().company_name);
+}
+
+size_t ProjectSnapshot::series_count() const { return count(sf::series_table); }
+
+SeriesView ProjectSnapshot::series(size_t index) const
+{
+    return {this, static_cast<uint32_t>(index)};
+}
+
+std::optional<EpisodeView>
+ProjectSnapshot::find_episode(const boost::uuids::uuid &uuid) const
+{
+    for (uint32_t i = 0; i < count(sf::episode_table); i++) {
+        if (std::memcmp(record<sf::episode_record>(sf::episode_table, i).uuid,
+                        uuid.data, 16) == 0)
+            return EpisodeView(this, i);
+    }
+    return std::nullopt;
+}
+
+std::optional<MaterialView>
+ProjectSnapshot::find_material(const boost::uuids::uuid &uuid) const
+{
+    for (uint32_t i = 0; i < count(sf::material_table); i++) {
+        if (std::memcmp(
+                record<sf::material_record>(sf::material_table, i).uuid,
+                uuid.data, 16) == 0)
+            return MaterialView(this, i);
+    }
+    return std::nullopt;
+}
+
+//
+// SeriesView
+//
+
+const sf::series_record &SeriesView::record() const
+{
+    return snapshot_->record<sf::series_record>(sf::series_table, index_);
+}
+
+boost::uuids::uuid SeriesView::uuid() const { return to_uuid(record().uuid); }
+
+std::string_view SeriesView::id() const
+{
+    return snapshot_->string(record().id);
+}
+
+std::string_view SeriesView::naming_convention() const
+{
+    return snapshot_->string(record().naming_convention);
+}
+
+int SeriesView::season() const { return record().season; }
+
+size_t SeriesView::episode_count() const
+{
+    return clamp(record().episodes, snapshot_->count(sf::episode_table));
+}
+
+EpisodeView SeriesView::episode(size_t index) const
+{
+    return {snapshot_, record().episodes.first + static_cast<uint32_t>(index)};
+}
+
+size_t SeriesView::element_count() const
+{
+    return clamp(record().elements, snapshot_->count(sf::element_table));
+}
+
+ElementView SeriesView::element(size_t index) const
+{
+    return {snapshot_, record().elements.first + static_cast<uint32_t>(index)};
+}
+
+//
+// EpisodeView
+//
+
+const sf::episode_record &EpisodeView::record() const
+{
+    return snapshot_->record<sf::episode_record>(sf::episode_table, index_);
+}
+
+boost::uuids::uuid EpisodeView::uuid() const { return to_uuid(record().uuid); }
+
+int EpisodeView::number() const { return record().number; }
+
+std::string_view EpisodeView::root() const
+{
+    return snapshot_->string(record().location);
+}
+
+std::string_view EpisodeView::up_folder() const
+{
+    return snapshot_->string(record().up_folder);
+}
+
+std::string_view EpisodeView::cels_folder() const
+{
+    return snapshot_->string(record().cels_folder);
+}
+
+std::string_view EpisodeView::notes() const
+{
+    return snapshot_->string(record().notes);
+}
+
+size_t EpisodeView::material_count() const
+{
+    return clamp(record().materials, snapshot_->count(sf::material_table));
+}
+
+MaterialView EpisodeView::material(size_t index) const
+{
+    return {snapshot_,
+            record().materials.first + static_cast<uint32_t>(index)};
+}
+
+size_t EpisodeView::cut_count() const
+{
+    return clamp(record().cuts, snapshot_->count(sf::cut_table));
+}
+
+CutView EpisodeView::cut(size_t index) const
+{
+    return {snapshot_, record().cuts.first + static_cast<uint32_t>(index)};
+}
+
+size_t EpisodeView::element_count() const
+{
+    return clamp(record().elements, snapshot_->count(sf::element_table));
+}
+
+ElementView EpisodeView::element(size_t index) const
+{
+    return {snapshot_, record().elements.first + static_cast<uint32_t>(index)};
+}
+
+//
+// CutView
+//
+
+const sf::cut_record &CutView::record() const
+{
+    return snapshot_->record<sf::cut_record>(sf::cut_table, index_);
+}
+
+boost::uuids::uuid CutView::uuid() const { return to_uuid(record().uuid); }
+
+std::optional<int> CutView::scene() const
+{
+    if (record().scene == INT32_MIN)
+        return std::nullopt;
+    return record().scene;
+}
+
+int CutView::number() const { return record().number; }
+
+int CutView::take_number() const { return record().take; }
+
+materials::stage CutView::stage() const
+{
+    return static_cast<materials::stage>(record().stage);
+}
+
+materials::status CutView::status() const
+{
+    return static_cast<materials::status>(record().status);
+}
+
+bool CutView::archived() const { return record().archived != 0; }
+
+std::string_view CutView::suffix() const
+{
+    return snapshot_->string(record().suffix);
+}
+
+MaterialView CutView::material() const { return {snapshot_, record().material}; }
+
+//
+// MaterialView
+//
+
+const sf::material_record &MaterialView::record() const
+{
+    return snapshot_->record<sf::material_record>(sf::material_table, index_);
+}
+
+boost::uuids::uuid MaterialView::uuid() const { return to_uuid(record().uuid); }
+
+materials::material MaterialView::type() const
+{
+    return static_cast<materials::material>(record().type);
+}
+
+std::string_view MaterialView::path() const
+{
+    return snapshot_->string(record().path);
+}
+
+std::string_view MaterialView::notes() const
+{
+    return snapshot_->string(record().notes);
+}
+
+std::string_view MaterialView::alias() const
+{
+    return snapshot_->string(record().alias);
+}
+
+size_t MaterialView::tag_count() const { return record().tags.count; }
+
+std::string_view MaterialView::tag(size_t index) const
+{
+    return snapshot_->tag(record().tags, index);
+}
+
+std::optional<MaterialView> MaterialView::parent() const
+{
+    uint32_t parent = record().parent;
+    if (parent == sf::none || parent >= snapshot_->count(sf::material_table))
+        return std::nullopt;
+    return MaterialView(snapshot_, parent);
+}
+
+//
+// ElementView
+//
+
+const sf::element_record &ElementView::record() const
+{
+    return snapshot_->record<sf::element_record>(sf::element_table, index_);
+}
+
+boost::uuids::uuid ElementView::uuid() const { return to_uuid(record().uuid); }
+
+std::string_view ElementView::name() const
+{
+    return snapshot_->string(record().name);
+}
+
+size_t ElementView::alias_count() const { return record().aliases.count; }
+
+std::string_view ElementView::alias(size_t index) const
+{
+    return snapshot_->tag(record().aliases, index);
+}
+
+size_t ElementView::tag_count() const { return record().tags.count; }
+
+std::string_view ElementView::tag(size_t index) const
+{
+    return snapshot_->tag(record().tags, index);
+}
+
+} // namespace setman
@@ -0,0 +1,347 @@
+// ProjectSnapshot
+// read-only, memory-mapped image of a loaded Company tree
+#pragma once
+
+// setman
+#include "error.hpp"
+#include "materials/cut.hpp"
+#include "materials/mapped_file.hpp"
+#include "materials/material.hpp"
+
+// boost
+#include <boost/uuid/uuid.hpp>
+
+// std
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+namespace setman
+{
+
+class Company;
+
+//
+// on-disk format
+//
+
+// every table is a flat array of fixed-size records. records refer to each
+// other by index and to text by offset into one shared string pool, so the
+// file can be queried where it is mapped without any parsing.
+
+namespace snapshot_format
+{
+
+inline constexpr char magic[8] = {'S', 'E', 'T', 'S', 'N', 'A', 'P', '\0'};
+inline constexpr uint32_t version = 1;
+inline constexpr uint32_t none = UINT32_MAX;
+
+enum table : uint32_t {
+    series_table,
+    episode_table,
+    cut_table,
+    material_table,
+    tag_table,
+    element_table,
+    table_count,
+};
+
+struct string_ref {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct range {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct table_ref {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t generation;
+    string_ref company_name;
+    table_ref tables[table_count];
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct series_record {
+    uint8_t uuid[16];
+    string_ref id;
+    string_ref naming_convention;
+    int32_t season;
+    range episodes;
+    range elements;
+};
+
+struct episode_record {
+    uint8_t uuid[16];
+    uint32_t series;
+    int32_t number;
+    string_ref location;
+    string_ref up_folder;
+    string_ref cels_folder;
+    string_ref notes;
+    range materials; // every material in the episode, cuts included
+    range cuts;
+    range elements;
+};
+
+struct cut_record {
+    uint8_t uuid[16];
+    uint32_t material; // the cut folder's own material record
+    int32_t scene;     // INT32_MIN when the cut has no scene
+    int32_t number;
+    int32_t take;
+    uint8_t stage;
+    uint8_t status;
+    uint8_t archived;
+    uint8_t reserved;
+    string_ref suffix;
+};
+
+struct material_record {
+    uint8_t uuid[16];
+    uint32_t episode;
+    uint32_t parent; // none for top-level materials
+    uint32_t type;
+    string_ref path;
+    string_ref notes;
+    string_ref alias;
+    range tags;
+};
+
+struct tag_record {
+    string_ref text;
+};
+
+struct element_record {
+    uint8_t uuid[16];
+    uint32_t series;
+    uint32_t episode; // none for series-wide elements
+    string_ref name;
+    range aliases; // into the tag table
+    range tags;    // into the tag table
+};
+
+} // namespace snapshot_format
+
+class ProjectSnapshot;
+
+//
+// views
+//
+
+// views are two words wide and only valid while their snapshot is open.
+// they are handed out by ProjectSnapshot and by each other.
+
+class MaterialView
+{
+  public:
+    boost::uuids::uuid uuid() const;
+    materials::material type() const;
+    std::string_view path() const;
+    std::string_view notes() const;
+    std::string_view alias() const;
+    size_t tag_count() const;
+    std::string_view tag(size_t index) const;
+    std::optional<MaterialView> parent() const;
+
+    MaterialView(const ProjectSnapshot *snapshot, uint32_t index)
+        : snapshot_(snapshot), index_(index)
+    {
+    }
+
+  private:
+    const snapshot_format::material_record &record() const;
+
+    const ProjectSnapshot *snapshot_;
+    uint32_t index_;
+};
+
+class CutView
+{
+  public:
+    boost::uuids::uuid uuid() const;
+    std::optional<int> scene() const;
+    int number() const;
+    int take_number() const;
+    materials::stage stage() const;
+    materials::status status() const;
+    bool archived() const;
+    std::string_view suffix() const;
+    MaterialView material() const;
+
+    CutView(const ProjectSnapshot *snapshot, uint32_t index)
+        : snapshot_(snapshot), index_(index)
+    {
+    }
+
+  private:
+    const snapshot_format::cut_record &record() const;
+
+    const ProjectSnapshot *snapshot_;
+    uint32_t index_;
+};
+
+class ElementView
+{
+  public:
+    boost::uuids::uuid uuid() const;
+    std::string_view name() const;
+    size_t alias_count() const;
+    std::string_view alias(size_t index) const;
+    size_t tag_count() const;
+    std::string_view tag(size_t index) const;
+
+    ElementView(const ProjectSnapshot *snapshot, uint32_t index)
+        : snapshot_(snapshot), index_(index)
+    {
+    }
+
+  private:
+    const snapshot_format::element_record &record() const;
+
+    const ProjectSnapshot *snapshot_;
+    uint32_t index_;
+};
+
+class EpisodeView
+{
+  public:
+    boost::uuids::uuid uuid() const;
+    int number() const;
+    std::string_view root() const;
+    std::string_view up_folder() const;
+    std::string_view cels_folder() const;
+    std::string_view notes() const;
+
+    size_t material_count() const;
+    MaterialView material(size_t index) const;
+    size_t cut_count() const;
+    CutView cut(size_t index) const;
+    size_t element_count() const;
+    ElementView element(size_t index) const;
+
+    EpisodeView(const ProjectSnapshot *snapshot, uint32_t index)
+        : snapshot_(snapshot), index_(index)
+    {
+    }
+
+  private:
+    const snapshot_format::episode_record &record() const;
+
+    const ProjectSnapshot *snapshot_;
+    uint32_t index_;
+};
+
+class SeriesView
+{
+  public:
+    boost::uuids::uuid uuid() const;
+    std::string_view id() const;
+    std::string_view naming_convention() const;
+    int season() const;
+
+    size_t episode_count() const;
+    EpisodeView episode(size_t index) const;
+    size_t element_count() const;
+    ElementView element(size_t index) const;
+
+    SeriesView(const ProjectSnapshot *snapshot, uint32_t index)
+        : snapshot_(snapshot), index_(index)
+    {
+    }
+
+  private:
+    const snapshot_format::series_record &record() const;
+
+    const ProjectSnapshot *snapshot_;
+    uint32_t index_;
+};
+
+//
+// snapshot
+//
+
+class ProjectSnapshot
+{
+  public:
+    // writes atomically: the old snapshot stays readable until the rename
+    static Error write(const Company &company, uint64_t generation,
+                       const std::filesystem::path &file);
+
+    // pass the database's current generation to reject a stale snapshot
+    static std::expected<std::unique_ptr<ProjectSnapshot>, Error>
+    open(const std::filesystem::path &file,
+         std::optional<uint64_t> expected_generation = std::nullopt);
+
+    ~ProjectSnapshot();
+
+    ProjectSnapshot(const ProjectSnapshot &) = delete;
+    ProjectSnapshot &operator=(const ProjectSnapshot &) = delete;
+
+    uint64_t generation() const { return header().generation; }
+    std::string_view company_name() const;
+
+    size_t series_count() const;
+    SeriesView series(size_t index) const;
+
+    std::optional<EpisodeView>
+    find_episode(const boost::uuids::uuid &uuid) const;
+    std::optional<MaterialView>
+    find_material(const boost::uuids::uuid &uuid) const;
+
+  private:
+    friend class SeriesView;
+    friend class EpisodeView;
+    friend class CutView;
+    friend class MaterialView;
+    friend class ElementView;
+
+    ProjectSnapshot(materials::MappedFile file)
+        : file_(std::move(file)), data_(file_.data()), size_(file_.size())
+    {
+    }
+
+    const snapshot_format::header &header() const
+    {
+        return *reinterpret_cast<const snapshot_format::header *>(data_);
+    }
+
+    // a dangling index reads as a zeroed record rather than out of bounds
+    template <typename Record>
+    const Record &record(snapshot_format::table table, uint32_t index) const
+    {
+        static const Record empty{};
+        if (index >= count(table))
+            return empty;
+        return reinterpret_cast<const Record *>(
+            data_ + header().tables[table].offset)[index];
+    }
+
+    uint32_t count(snapshot_format::table table) const
+    {
+        return static_cast<uint32_t>(header().tables[table].count);
+    }
+
+    // out-of-range references read as empty instead of past the mapping
+    std::string_view string(snapshot_format::string_ref ref) const;
+    std::string_view tag(snapshot_format::range tags, size_t index) const;
+
+    materials::MappedFile file_;
+    const unsigned char *data_;
+    size_t size_;
+};
+
+} // namespace setman
@@ -0,0 +1,44 @@
+// StatementCache
+// implementation
+#include "statement_cache.hpp"
+
+namespace setman
+{
+
+StatementCache::~StatementCache() { clear(); }
+
+sqlite3_stmt *StatementCache::get(std::string_view sql)
+{
+    auto it = statements_.find(sql);
+    if (it != statements_.end()) {
+        sqlite3_reset(it->second);
+        sqlite3_clear_bindings(it->second);
+        return it->second;
+    }
+
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v3(connection_, sql.data(), sql.size(),
+                           SQLITE_PREPARE_PERSISTENT, &stmt,
+                           nullptr) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return nullptr;
+    }
+
+    statements_.emplace(std::string(sql), stmt);
+    return stmt;
+}
+
+void StatementCache::reset_all()
+{
+    for (auto &[_, stmt] : statements_)
+        sqlite3_reset(stmt);
+}
+
+void StatementCache::clear()
+{
+    for (auto &[_, stmt] : statements_)
+        sqlite3_finalize(stmt);
+    statements_.clear();
+}
+
+} // namespace setman
@@ -0,0 +1,48 @@
+// StatementCache
+// prepared statements kept alive per sqlite connection
+#pragma once
+
+// sqlite
+#include <sqlite3.h>
+
+// std
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace setman
+{
+
+class StatementCache
+{
+  public:
+    StatementCache(sqlite3 *connection) : connection_(connection) {}
+    ~StatementCache();
+
+    StatementCache(const StatementCache &) = delete;
+    StatementCache &operator=(const StatementCache &) = delete;
+
+    // returns a reset statement with cleared bindings, preparing it on first
+    // use. owned by the cache; never finalize it. nullptr if sql is invalid.
+    sqlite3_stmt *get(std::string_view sql);
+
+    // resets every cached statement so none of them holds a read open
+    void reset_all();
+    void clear();
+
+  private:
+    struct sql_hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view sql) const
+        {
+            return std::hash<std::string_view>{}(sql);
+        }
+    };
+
+    sqlite3 *connection_;
+    std::unordered_map<std::string, sqlite3_stmt *, sql_hash, std::equal_to<>>
+        statements_;
+};
+
+} // namespace setman
@@ -0,0 +1,307 @@
+// sync
+// implementation
+#include "sync.hpp"
+
+// std
+#include <unordered_set>
+
+namespace setman
+{
+
+// structural rows carry no modification time, so the incoming row wins.
+// two sides editing the same material between syncs end up with each
+// other's edit; status and ocr rows are timestamped and always converge.
+const sync_policies &default_sync_policies()
+{
+    static const sync_policies policies = {
+        {"companies", {resolution::take_remote}},
+        {"series", {resolution::take_remote}},
+        {"episodes", {resolution::take_remote}},
+        {"materials", {resolution::take_remote}},
+        {"tags", {resolution::take_remote}},
+        {"cut_history", {resolution::keep_local}},
+        {"cut_status", {resolution::newest, 2}},
+        {"ocr_results", {resolution::newest, 3}},
+    };
+    return policies;
+}
+
+static int is_synced(void *context, const char *table)
+{
+    return static_cast<const sync_policies *>(context)->contains(table);
+}
+
+static Error changeset_error(sqlite3 *connection, int rc)
+{
+    if (connection && rc != SQLITE_CORRUPT)
+        return {Code::database_error, sqlite3_errmsg(connection)};
+    return {Code::database_error, sqlite3_errstr(rc)};
+}
+
+//
+// recorder
+//
+
+ChangeRecorder::ChangeRecorder(sqlite3 *connection,
+                               const sync_policies &policies)
+    : connection_(connection), policies_(policies)
+{
+    start();
+}
+
+ChangeRecorder::~ChangeRecorder() { stop(); }
+
+bool ChangeRecorder::start()
+{
+    if (!connection_ ||
+        sqlite3session_create(connection_, "main", &session_) != SQLITE_OK)
+        return false;
+
+    // attaching every table and filtering keeps tables created later, and
+    // the fts shadow tables, out of the changeset
+    sqlite3session_table_filter(session_, is_synced,
+                                const_cast<sync_policies *>(&policies_));
+    if (sqlite3session_attach(session_, nullptr) != SQLITE_OK) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void ChangeRecorder::stop()
+{
+    if (session_)
+        sqlite3session_delete(session_);
+    session_ = nullptr;
+}
+
+bool ChangeRecorder::empty() const
+{
+    return !session_ || sqlite3session_isempty(session_);
+}
+
+std::expected<changeset, Error> ChangeRecorder::take()
+{
+    if (!session_)
+        return std::unexpected(
+            Error(Code::database_error, "Change recording is not running"));
+
+    int size = 0;
+    void *data = nullptr;
+    if (int rc = sqlite3session_changeset(session_, &size, &data);
+        rc != SQLITE_OK)
+        return std::unexpected(changeset_error(connection_, rc));
+
+    auto bytes = static_cast<const unsigned char *>(data);
+    changeset changes(bytes, bytes + size);
+    sqlite3_free(data);
+
+    stop();
+    start();
+    return changes;
+}
+
+void ChangeRecorder::pause()
+{
+    if (session_)
+        sqlite3session_enable(session_, 0);
+}
+
+void ChangeRecorder::resume()
+{
+    if (session_)
+        sqlite3session_enable(session_, 1);
+}
+
+//
+// changesets
+//
+
+std::expected<changeset, Error>
+combine_changesets(std::span<const changeset> changes)
+{
+    sqlite3_changegroup *group = nullptr;
+    if (int rc = sqlite3changegroup_new(&group); rc != SQLITE_OK)
+        return std::unexpected(changeset_error(nullptr, rc));
+
+    for (const auto &part : changes) {
+        int rc = sqlite3changegroup_add(group, static_cast<int>(part.size()),
+                                        const_cast<unsigned char *>(part.data()));
+        if (rc != SQLITE_OK) {
+            sqlite3changegroup_delete(group);
+            return std::unexpected(changeset_error(nullptr, rc));
+        }
+    }
+
+    int size = 0;
+    void *data = nullptr;
+    int rc = sqlite3changegroup_output(group, &size, &data);
+    sqlite3changegroup_delete(group);
+    if (rc != SQLITE_OK)
+        return std::unexpected(changeset_error(nullptr, rc));
+
+    auto bytes = static_cast<const unsigned char *>(data);
+    changeset combined(bytes, bytes + size);
+    sqlite3_free(data);
+    return combined;
+}
+
+// the iterator api takes a mutable pointer but never writes through it
+static int start_iterator(sqlite3_changeset_iter **iter,
+                          std::span<const unsigned char> changes)
+{
+    return sqlite3changeset_start(
+        iter, static_cast<int>(changes.size()),
+        const_cast<unsigned char *>(changes.data()));
+}
+
+std::expected<std::vector<std::string>, Error>
+changed_materials(std::span<const unsigned char> changes)
+{
+    static const std::unordered_set<std::string_view> keyed_by_material = {
+        "materials", "tags", "ocr_results"};
+
+    sqlite3_changeset_iter *iter = nullptr;
+    if (int rc = start_iterator(&iter, changes); rc != SQLITE_OK)
+        return std::unexpected(changeset_error(nullptr, rc));
+
+    std::vector<std::string> uuids;
+    std::unordered_set<std::string> seen;
+    while (sqlite3changeset_next(iter) == SQLITE_ROW) {
+        const char *table = nullptr;
+        int columns = 0, op = 0, indirect = 0;
+        sqlite3changeset_op(iter, &table, &columns, &op, &indirect);
+        if (!keyed_by_material.contains(table))
+            continue;
+
+        // the material uuid is the first primary key column in all three,
+        // and primary keys are always present in the old values
+        sqlite3_value *value = nullptr;
+        if (op == SQLITE_INSERT)
+            sqlite3changeset_new(iter, 0, &value);
+        else
+            sqlite3changeset_old(iter, 0, &value);
+
+        auto text = value ? sqlite3_value_text(value) : nullptr;
+        if (!text)
+            continue;
+        std::string uuid(reinterpret_cast<const char *>(text));
+        if (seen.insert(uuid).second)
+            uuids.push_back(std::move(uuid));
+    }
+
+    if (int rc = sqlite3changeset_finalize(iter); rc != SQLITE_OK)
+        return std::unexpected(changeset_error(nullptr, rc));
+    return uuids;
+}
+
+static std::expected<size_t, Error>
+count_changes(std::span<const unsigned char> changes)
+{
+    sqlite3_changeset_iter *iter = nullptr;
+    if (int rc = start_iterator(&iter, changes); rc != SQLITE_OK)
+        return std::unexpected(changeset_error(nullptr, rc));
+
+    size_t count = 0;
+    while (sqlite3changeset_next(iter) == SQLITE_ROW)
+        count++;
+
+    if (int rc = sqlite3changeset_finalize(iter); rc != SQLITE_OK)
+        return std::unexpected(changeset_error(nullptr, rc));
+    return count;
+}
+
+// the filter and the conflict handler share one context pointer
+struct apply_context {
+    const sync_policies &policies;
+    sync_report report;
+};
+
+static int is_applied(void *context, const char *table)
+{
+    return static_cast<apply_context *>(context)->policies.contains(table);
+}
+
+// a deleted row compares by its old time, an inserted or updated row by its
+// new one. an update that left the time alone still carries it as old.
+static bool remote_is_newer(sqlite3_changeset_iter *iter, int op, int column)
+{
+    sqlite3_value *remote = nullptr;
+    if (op != SQLITE_DELETE)
+        sqlite3changeset_new(iter, column, &remote);
+    if (!remote && op != SQLITE_INSERT)
+        sqlite3changeset_old(iter, column, &remote);
+
+    sqlite3_value *local = nullptr;
+    sqlite3changeset_conflict(iter, column, &local);
+
+    if (!remote || !local)
+        return remote != nullptr;
+    return sqlite3_value_int64(remote) > sqlite3_value_int64(local);
+}
+
+static int resolve_conflict(void *context, int kind,
+                            sqlite3_changeset_iter *iter)
+{
+    auto &apply = *static_cast<apply_context *>(context);
+    apply.report.conflicts++;
+
+    // a row that is missing locally, or one that breaks a constraint, can
+    // only be skipped; replacing is reserved for rows that exist on both
+    // sides with different values
+    if (kind != SQLITE_CHANGESET_DATA && kind != SQLITE_CHANGESET_CONFLICT) {
+        apply.report.omitted++;
+        return SQLITE_CHANGESET_OMIT;
+    }
+
+    const char *table = nullptr;
+    int columns = 0, op = 0, indirect = 0;
+    sqlite3changeset_op(iter, &table, &columns, &op, &indirect);
+
+    bool take_remote = false;
+    if (auto it = apply.policies.find(table); it != apply.policies.end()) {
+        const conflict_policy &policy = it->second;
+        switch (policy.rule) {
+        case resolution::keep_local:
+            break;
+        case resolution::take_remote:
+            take_remote = true;
+            break;
+        case resolution::newest:
+            take_remote = policy.time_column >= 0 &&
+                          policy.time_column < columns &&
+                          remote_is_newer(iter, op, policy.time_column);
+            break;
+        }
+    }
+
+    if (take_remote) {
+        apply.report.replaced++;
+        return SQLITE_CHANGESET_REPLACE;
+    }
+    apply.report.omitted++;
+    return SQLITE_CHANGESET_OMIT;
+}
+
+std::expected<sync_report, Error>
+apply_changeset(sqlite3 *connection, std::span<const unsigned char> changes,
+                const sync_policies &policies)
+{
+    auto count = count_changes(changes);
+    if (!count)
+        return std::unexpected(count.error());
+
+    apply_context context{policies, {}};
+    context.report.changes = *count;
+
+    int rc = sqlite3changeset_apply(
+        connection, static_cast<int>(changes.size()),
+        const_cast<unsigned char *>(changes.data()), is_applied,
+        resolve_conflict, &context);
+    if (rc != SQLITE_OK)
+        return std::unexpected(changeset_error(connection, rc));
+
+    return context.report;
+}
+
+} // namespace setman
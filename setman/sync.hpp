@@ -0,0 +1,108 @@
+// sync
+// changeset based delta sync between project databases
+#pragma once
+
+// sqlite
+#include <sqlite3.h>
+
+// setman
+#include "error.hpp"
+
+// std
+#include <expected>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace setman
+{
+
+// a serialized sqlite session changeset. only the rows that changed travel,
+// together with their old values so the receiving side can spot conflicts.
+using changeset = std::vector<unsigned char>;
+
+enum class resolution {
+    keep_local,  // the receiving database's row wins
+    take_remote, // the incoming row wins
+    newest,      // the row with the larger time column wins
+};
+
+struct conflict_policy {
+    resolution rule = resolution::take_remote;
+    int time_column = -1; // column index compared by resolution::newest
+};
+
+// keyed by table name. tables missing from the map are not synced at all.
+using sync_policies = std::map<std::string, conflict_policy, std::less<>>;
+
+// the tables that are recorded and exchanged, and how each entity type
+// settles a conflict. cut status is newest-wins; history rows are immutable.
+const sync_policies &default_sync_policies();
+
+struct sync_report {
+    size_t changes = 0;   // rows carried by the changeset
+    size_t conflicts = 0; // rows that did not apply cleanly
+    size_t replaced = 0;  // conflicts settled in favour of the remote row
+    size_t omitted = 0;   // conflicts settled in favour of the local row
+};
+
+//
+// recorder
+//
+
+// records every change the connection makes to the synced tables, using
+// the session extension. sessions live in memory, so Database stashes what
+// was recorded before the connection closes.
+class ChangeRecorder
+{
+  public:
+    ChangeRecorder(sqlite3 *connection, const sync_policies &policies);
+    ~ChangeRecorder();
+
+    ChangeRecorder(const ChangeRecorder &) = delete;
+    ChangeRecorder &operator=(const ChangeRecorder &) = delete;
+
+    bool recording() const { return session_ != nullptr; }
+    bool empty() const;
+
+    // everything recorded so far. recording starts over afterwards.
+    std::expected<changeset, Error> take();
+
+    // changes made while paused are not recorded, which keeps applied
+    // remote changesets from echoing back to where they came from
+    void pause();
+    void resume();
+
+    // ends recording for good. must happen before the connection closes.
+    void stop();
+
+  private:
+    bool start();
+
+    sqlite3 *connection_;
+    const sync_policies &policies_;
+    struct sqlite3_session *session_ = nullptr;
+};
+
+//
+// changesets
+//
+
+// merges changesets, oldest first, into one. a row edited many times ends
+// up as a single change.
+std::expected<changeset, Error>
+combine_changesets(std::span<const changeset> changes);
+
+// the uuid of every material a changeset touches through materials, tags or
+// ocr_results, so their derived search rows can be rebuilt
+std::expected<std::vector<std::string>, Error>
+changed_materials(std::span<const unsigned char> changes);
+
+// applies inside the caller's transaction, resolving conflicts through the
+// policy of the row's table
+std::expected<sync_report, Error>
+apply_changeset(sqlite3 *connection, std::span<const unsigned char> changes,
+                const sync_policies &policies);
+
+} // namespace setman
@@ -0,0 +1,311 @@
+#include "translation_memory.hpp"
+
+// std
+#include <algorithm>
+
+namespace setman::translation_service
+{
+
+// marks the start and end of a segment, so its first and last characters
+// are covered by bigrams too. past the last code point, so it never
+// collides with a real one.
+static constexpr char32_t boundary = 0x110000;
+
+// utf-8 to code points, with the differences that do not change what a
+// segment says folded away: full width ascii and the ideographic space
+// become their ascii forms, whitespace runs collapse, the ends are trimmed
+static std::u32string normalize(std::string_view text)
+{
+    std::u32string out;
+    out.reserve(text.size());
+
+    bool space = false;
+    for (size_t i = 0; i < text.size();) {
+        auto lead = static_cast<unsigned char>(text[i]);
+        int length = lead < 0x80           ? 1
+                     : (lead >> 5) == 0x6  ? 2
+                     : (lead >> 4) == 0xE  ? 3
+                     : (lead >> 3) == 0x1E ? 4
+                                           : 0;
+        char32_t c;
+        if (length == 0 || i + length > text.size()) {
+            c = 0xFFFD;
+            length = 1;
+        } else {
+            c = length == 1 ? lead : lead & (0x7F >> length);
+            for (int k = 1; k < length; k++) {
+                auto next = static_cast<unsigned char>(text[i + k]);
+                c = (c << 6) | (next & 0x3F);
+            }
+        }
+        i += length;
+
+        if (c >= 0xFF01 && c <= 0xFF5E)
+            c -= 0xFEE0;
+        if (c == 0x3000 || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            space = !out.empty();
+            continue;
+        }
+        if (space)
+            out.push_back(' ');
+        space = false;
+        out.push_back(c);
+    }
+    return out;
+}
+
+static uint64_t bigram(language from, language to, char32_t a, char32_t b)
+{
+    return (uint64_t(from) << 58) | (uint64_t(to) << 52) |
+           (uint64_t(a) << 21) | uint64_t(b);
+}
+
+static std::vector<uint64_t> bigrams_of(const std::u32string &text,
+                                        language from, language to)
+{
+    std::vector<uint64_t> grams;
+    grams.reserve(text.size() + 1);
+
+    char32_t previous = boundary;
+    for (char32_t c : text) {
+        grams.push_back(bigram(from, to, previous, c));
+        previous = c;
+    }
+    grams.push_back(bigram(from, to, previous, boundary));
+
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    return grams;
+}
+
+// levenshtein distance, or nothing once it must exceed `limit`
+static std::optional<size_t> edit_distance(const std::u32string &a,
+                                           const std::u32string &b,
+                                           size_t limit)
+{
+    std::vector<size_t> row(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); j++)
+        row[j] = j;
+
+    for (size_t i = 1; i <= a.size(); i++) {
+        size_t diagonal = row[0];
+        row[0] = i;
+        size_t best = row[0];
+        for (size_t j = 1; j <= b.size(); j++) {
+            size_t above = row[j];
+            row[j] = std::min({above + 1, row[j - 1] + 1,
+                               diagonal + (a[i - 1] != b[j - 1])});
+            diagonal = above;
+            best = std::min(best, row[j]);
+        }
+        if (best > limit)
+            return std::nullopt;
+    }
+
+    if (row[b.size()] > limit)
+        return std::nullopt;
+    return row[b.size()];
+}
+
+std::string TranslationMemory::exact_key(const code_points &normalized,
+                                         language from, language to)
+{
+    std::string key;
+    key.reserve(2 + normalized.size() * sizeof(char32_t));
+    key.push_back(static_cast<char>(from));
+    key.push_back(static_cast<char>(to));
+    key.append(reinterpret_cast<const char *>(normalized.data()),
+               normalized.size() * sizeof(char32_t));
+    return key;
+}
+
+void TranslationMemory::add(const tm_segment &segment)
+{
+    const language from = segment.source_language;
+    const language to = segment.target_language;
+
+    entry added{segment, normalize(segment.source), {}};
+    if (added.normalized.empty())
+        return;
+    added.bigrams = bigrams_of(added.normalized, from, to);
+    std::string key = exact_key(added.normalized, from, to);
+
+    std::lock_guard lock(mutex_);
+    const auto id = static_cast<uint32_t>(entries_.size());
+
+    // the replaced entry stays in the postings but is skipped from now on
+    if (auto it = exact_.find(key); it != exact_.end()) {
+        entries_[it->second].live = false;
+        it->second = id;
+    } else {
+        exact_.emplace(std::move(key), id);
+    }
+
+    for (uint64_t gram : added.bigrams)
+        postings_[gram].push_back(id);
+    entries_.push_back(std::move(added));
+}
+
+std::optional<tm_match> TranslationMemory::lookup(std::string_view source,
+                                                  language from, language to)
+{
+    const std::u32string normalized = normalize(source);
+    const std::string key = exact_key(normalized, from, to);
+
+    std::lock_guard lock(mutex_);
+
+    std::optional<tm_match> match;
+    if (auto it = exact_.find(key); it != exact_.end()) {
+        const tm_segment &found = entries_[it->second].segment;
+        match = tm_match{found.source, found.target, 1.0, true};
+        stats_.exact_hits++;
+    } else if ((match = fuzzy(normalized, from, to))) {
+        stats_.fuzzy_hits++;
+    }
+
+    // a fuzzy match still goes to the provider; it only saves review
+    if (match && match->exact)
+        stats_.characters_saved += normalized.size();
+    else
+        stats_.characters_missed += normalized.size();
+    if (!match)
+        stats_.misses++;
+    return match;
+}
+
+// shared bigrams of two sorted, distinct lists
+static size_t overlap(const std::vector<uint64_t> &a,
+                      const std::vector<uint64_t> &b)
+{
+    size_t count = 0;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        if (a[i] < b[j])
+            i++;
+        else if (b[j] < a[i])
+            j++;
+        else
+            count++, i++, j++;
+    }
+    return count;
+}
+
+// the q-gram lemma: one edit removes at most two distinct bigrams, so two
+// segments within d edits share all but 2d of the larger one's bigrams.
+// any such segment must then hold one of the query's 2d + 1 rarest
+// bigrams, and only those postings are read; common bigrams like the
+// particles would otherwise pull in most of the memory.
+std::optional<tm_match>
+TranslationMemory::fuzzy(const code_points &normalized, language from,
+                         language to) const
+{
+    if (normalized.empty() || options_.min_similarity >= 1.0 ||
+        options_.min_similarity <= 0.0)
+        return std::nullopt;
+
+    // how many edits the longer of two segments may take and still be
+    // similar enough
+    auto allowed_edits = [&](size_t longer) {
+        return static_cast<size_t>((1.0 - options_.min_similarity) * longer +
+                                   1e-9);
+    };
+
+    const auto grams = bigrams_of(normalized, from, to);
+    const size_t longest =
+        static_cast<size_t>(normalized.size() / options_.min_similarity);
+    const size_t probes = 2 * allowed_edits(longest) + 1;
+
+    std::vector<const std::vector<uint32_t> *> lists;
+    lists.reserve(grams.size());
+    for (uint64_t gram : grams) {
+        if (auto it = postings_.find(gram); it != postings_.end())
+            lists.push_back(&it->second);
+    }
+    // a segment sharing none of the probed bigrams is too far off, as long
+    // as the absent ones are counted among them
+    const size_t absent = grams.size() - lists.size();
+    if (absent >= probes && probes < grams.size())
+        return std::nullopt;
+    std::sort(lists.begin(), lists.end(),
+              [](const auto *a, const auto *b) {
+                  return a->size() < b->size();
+              });
+    if (probes < grams.size())
+        lists.resize(std::min(lists.size(), probes - absent));
+
+    std::vector<uint32_t> ids;
+    for (const auto *list : lists)
+        ids.insert(ids.end(), list->begin(), list->end());
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    struct candidate {
+        uint32_t id;
+        size_t shared;
+    };
+    std::vector<candidate> candidates;
+    for (uint32_t id : ids) {
+        const entry &e = entries_[id];
+        if (!e.live)
+            continue;
+
+        size_t longer = std::max(normalized.size(), e.normalized.size());
+        size_t shorter = std::min(normalized.size(), e.normalized.size());
+        size_t edits = allowed_edits(longer);
+        if (longer - shorter > edits)
+            continue;
+
+        size_t shared = overlap(grams, e.bigrams);
+        if (shared + 2 * edits < std::max(grams.size(), e.bigrams.size()))
+            continue;
+        candidates.push_back({id, shared});
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const candidate &a, const candidate &b) {
+                  return a.shared > b.shared;
+              });
+    if (candidates.size() > options_.max_candidates)
+        candidates.resize(options_.max_candidates);
+
+    std::optional<tm_match> best;
+    for (const auto &c : candidates) {
+        const entry &e = entries_[c.id];
+        size_t longer = std::max(normalized.size(), e.normalized.size());
+        auto distance =
+            edit_distance(normalized, e.normalized, allowed_edits(longer));
+        if (!distance)
+            continue;
+
+        double similarity = 1.0 - double(*distance) / double(longer);
+        if (!best || similarity > best->similarity)
+            best = tm_match{e.segment.source, e.segment.target, similarity,
+                            false};
+    }
+    return best;
+}
+
+std::vector<tm_segment> TranslationMemory::segments() const
+{
+    std::lock_guard lock(mutex_);
+    std::vector<tm_segment> live;
+    live.reserve(exact_.size());
+    for (const auto &e : entries_) {
+        if (e.live)
+            live.push_back(e.segment);
+    }
+    return live;
+}
+
+size_t TranslationMemory::size() const
+{
+    std::lock_guard lock(mutex_);
+    return exact_.size();
+}
+
+TranslationMemory::stats TranslationMemory::statistics() const
+{
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+} // namespace setman::translation_service
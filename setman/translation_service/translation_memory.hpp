@@ -0,0 +1,109 @@
+// TranslationMemory
+// translated segments, reused instead of asking a provider again
+#pragma once
+
+// setman
+#include "language.hpp"
+
+// std
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace setman::translation_service
+{
+
+struct tm_segment {
+    std::string source;
+    std::string target;
+    language source_language; // not_determined when it was auto detected
+    language target_language;
+};
+
+struct tm_match {
+    std::string source; // as stored, which may differ from the lookup
+    std::string target;
+    double similarity; // 1 for exact matches
+    // only an exact match is the translation. a fuzzy one is a suggestion
+    // for whoever reviews the provider's.
+    bool exact;
+};
+
+struct tm_options {
+    // fuzzy matches below this are misses. a near match is still another
+    // sentence, so keep it high: at 0.95, one edit is only tolerated in
+    // segments of twenty characters or more.
+    double min_similarity = 0.95;
+    // candidates verified by edit distance per lookup, best n-gram
+    // overlap first
+    size_t max_candidates = 32;
+};
+
+// exact lookups go through a hash of the normalized segment. fuzzy ones
+// through an index of character bigrams, code points rather than bytes so
+// japanese text is split per character: segments sharing enough bigrams
+// to possibly reach min_similarity are verified by edit distance.
+// thread safe.
+class TranslationMemory
+{
+  public:
+    explicit TranslationMemory(tm_options options = {}) : options_(options)
+    {
+    }
+
+    // a later segment with the same source replaces the earlier one
+    void add(const tm_segment &segment);
+
+    std::optional<tm_match> lookup(std::string_view source, language from,
+                                   language to);
+
+    // everything stored, for saving it elsewhere
+    std::vector<tm_segment> segments() const;
+    size_t size() const;
+
+    // characters are code points, the unit providers bill by
+    struct stats {
+        size_t exact_hits = 0;
+        size_t fuzzy_hits = 0;
+        size_t misses = 0;
+        size_t characters_saved = 0;  // in segments answered from memory
+        size_t characters_missed = 0; // sent to a provider, fuzzy hits too
+
+        double hit_rate() const
+        {
+            size_t lookups = exact_hits + fuzzy_hits + misses;
+            return lookups ? double(exact_hits + fuzzy_hits) / lookups : 0;
+        }
+    };
+    stats statistics() const;
+
+  private:
+    using code_points = std::u32string;
+
+    struct entry {
+        tm_segment segment;
+        code_points normalized;
+        std::vector<uint64_t> bigrams; // sorted, distinct
+        bool live = true;              // false once replaced
+    };
+
+    static std::string exact_key(const code_points &normalized, language from,
+                                 language to);
+
+    std::optional<tm_match> fuzzy(const code_points &normalized,
+                                  language from, language to) const;
+
+    tm_options options_;
+
+    mutable std::mutex mutex_;
+    std::vector<entry> entries_;
+    std::unordered_map<std::string, uint32_t> exact_;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> postings_;
+    stats stats_;
+};
+
+} // namespace setman::translation_service
@@ -0,0 +1,399 @@
+#include "translation_service.hpp"
+#include "response_converters.hpp"
+
+// std
+#include <cctype>
+#include <charconv>
+#include <future>
+#include <map>
+
+namespace setman
+{
+
+namespace translation_service
+{
+
+// one distinct text to translate, and every message that holds it
+struct pending_text {
+    std::string source;
+    language from;
+    std::vector<Conversation::Message *> messages;
+};
+
+} // namespace translation_service
+
+using translation_service::batch_report;
+using translation_service::pending_text;
+using translation_service::unified_response;
+
+static const char *deepl_target_code(language lang)
+{
+    return lang == language::jp ? "JA" : "EN-US";
+}
+
+static std::optional<std::string> deepl_source_code(language lang)
+{
+    switch (lang) {
+    case language::en:
+        return "EN";
+    case language::jp:
+        return "JA";
+    default:
+        return std::nullopt;
+    }
+}
+
+static const char *language_name(language lang)
+{
+    return lang == language::jp ? "Japanese" : "English";
+}
+
+ai::deepl_request
+TranslationService::deepl_request_for(std::vector<std::string> texts,
+                                      language from) const
+{
+    ai::deepl_request request(texts, deepl_target_code(target_language_));
+    if (deepl_endpoint_)
+        request.endpoint = *deepl_endpoint_;
+    if (auto code = deepl_source_code(from))
+        request.set_source_lang(*code);
+    return request;
+}
+
+ai::openrouter_request
+TranslationService::openrouter_request_for(const std::string &instructions,
+                                           const std::string &message) const
+{
+    ai::openrouter_request request;
+    request.set_model(openrouter_model_)
+        .add_message(ai::role::system, instructions)
+        .add_message(ai::role::user, message);
+    return request;
+}
+
+unified_response TranslationService::translate(const std::string &message)
+{
+    return translate_async(message).get();
+}
+
+std::future<unified_response>
+TranslationService::translate_async(const std::string &message,
+                                    token_callback on_token,
+                                    const ai::call_options &options)
+{
+    const language from = source_language_.value_or(language::not_determined);
+    auto promise = std::make_shared<std::promise<unified_response>>();
+    auto future = promise->get_future();
+
+    // a fuzzy match is another sentence, translated. only an exact one
+    // stands in for the provider's answer.
+    if (memory_) {
+        auto match = memory_->lookup(message, from, target_language_);
+        if (match && match->exact) {
+            if (on_token)
+                on_token(match->target);
+            promise->set_value(
+                {.valid = true, .error = "", .content = {match->target}});
+            return future;
+        }
+    }
+
+    // runs on the transport thread; the memory is thread safe
+    auto finish = [promise, memory = memory_, message, from,
+                   to = target_language_](unified_response response) {
+        if (memory && response.valid && response.content.size() == 1) {
+            memory->add({.source = message,
+                         .target = response.content.front(),
+                         .source_language = from,
+                         .target_language = to});
+        }
+        promise->set_value(std::move(response));
+    };
+
+    if (client_choice_ == SupportedClient::deepl && deepl_) {
+        deepl_->translate(
+            deepl_request_for({message}, from),
+            [finish, on_token](ai::deepl_response response) {
+                if (on_token && response.valid && !response.content.empty())
+                    on_token(response.content.front());
+                finish(translation_service::to_unified(response));
+            },
+            options);
+    } else if (openrouter_) {
+        auto request = openrouter_request_for(
+            std::string("Translate the user's message to ") +
+                language_name(target_language_) +
+                ". Reply with the translation only.",
+            message);
+        auto done = [finish](ai::openrouter_response response) {
+            finish(translation_service::to_unified(response));
+        };
+        if (on_token)
+            openrouter_->chat_stream(request, std::move(on_token),
+                                     std::move(done), options);
+        else
+            openrouter_->chat(request, std::move(done), options);
+    } else {
+        promise->set_value({.valid = false, .error = "no translation client"});
+    }
+    return future;
+}
+
+// groups of indices into `work`, in order, each with one source language
+// and within both limits. a text over the byte limit on its own still gets
+// a batch of its own.
+static std::vector<std::vector<size_t>>
+batches(const std::vector<pending_text> &work,
+        size_t max_texts, size_t max_bytes, size_t overhead)
+{
+    struct open_batch {
+        std::vector<size_t> members;
+        size_t bytes = 0;
+    };
+    std::map<language, open_batch> open;
+    std::vector<std::vector<size_t>> full;
+
+    for (size_t i = 0; i < work.size(); i++) {
+        auto &batch = open[work[i].from];
+        size_t bytes = work[i].source.size() + overhead;
+        if (!batch.members.empty() &&
+            (batch.members.size() == max_texts ||
+             batch.bytes + bytes > max_bytes)) {
+            full.push_back(std::move(batch.members));
+            batch = {};
+        }
+        batch.members.push_back(i);
+        batch.bytes += bytes;
+    }
+
+    for (auto &[from, batch] : open) {
+        if (!batch.members.empty())
+            full.push_back(std::move(batch.members));
+    }
+    return full;
+}
+
+batch_report TranslationService::translate(Conversation &conversation)
+{
+    batch_report report;
+
+    std::vector<pending> work;
+    std::map<std::pair<language, std::string>, size_t> seen;
+
+    for (auto &message : conversation.messages()) {
+        if (message.translation() &&
+            message.translated_language() == target_language_)
+            continue;
+        if (message.original().empty())
+            continue;
+
+        language from = message.original_language();
+        if (from == language::not_determined)
+            from = source_language_.value_or(language::not_determined);
+        if (from == target_language_)
+            continue;
+
+        if (memory_) {
+            auto match =
+                memory_->lookup(message.original(), from, target_language_);
+            if (match && match->exact) {
+                message.new_translation(match->target, target_language_);
+                report.from_memory++;
+                continue;
+            }
+        }
+
+        auto [it, added] = seen.try_emplace({from, message.original()},
+                                            work.size());
+        if (added)
+            work.push_back({message.original(), from, {}});
+        work[it->second].messages.push_back(&message);
+    }
+
+    if (work.empty())
+        return report;
+
+    if (client_choice_ == SupportedClient::deepl && deepl_)
+        translate_deepl(work, report);
+    else if (openrouter_)
+        translate_openrouter(work, report);
+    else {
+        for (const auto &segment : work)
+            report.failed += segment.messages.size();
+        report.errors.push_back("no translation client");
+    }
+    return report;
+}
+
+void TranslationService::learn(const pending &segment,
+                               const std::string &translation,
+                               batch_report &report)
+{
+    for (auto *message : segment.messages)
+        message->new_translation(translation, target_language_);
+    report.translated += segment.messages.size();
+
+    if (memory_) {
+        memory_->add({.source = segment.source,
+                      .target = translation,
+                      .source_language = segment.from,
+                      .target_language = target_language_});
+    }
+}
+
+// deepl json-escapes the texts, so allow a few bytes of quoting each
+void TranslationService::translate_deepl(std::vector<pending> &work,
+                                         batch_report &report)
+{
+    auto groups = batches(work, batch_options_.deepl_texts,
+                          batch_options_.deepl_bytes, 8);
+
+    // all batches are in flight together; the transport caps connections
+    std::vector<std::future<ai::deepl_response>> replies;
+    for (const auto &group : groups) {
+        std::vector<std::string> texts;
+        texts.reserve(group.size());
+        for (size_t i : group)
+            texts.push_back(work[i].source);
+
+        replies.push_back(deepl_->translate_async(
+            deepl_request_for(std::move(texts), work[group.front()].from)));
+    }
+    report.requests += groups.size();
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        const auto &group = groups[g];
+        ai::deepl_response response = replies[g].get();
+        if (!response.valid || response.content.size() != group.size()) {
+            for (size_t i : group)
+                report.failed += work[i].messages.size();
+            report.errors.push_back(response.valid
+                                        ? "deepl returned a wrong count"
+                                        : response.error);
+            continue;
+        }
+
+        for (size_t k = 0; k < group.size(); k++)
+            learn(work[group[k]], response.content[k], report);
+    }
+}
+
+// openrouter batches are one prompt of numbered segments, "[[n]]" on a
+// line of its own before each. the reply is read back the same way.
+static std::string numbered_prompt(
+    const std::vector<pending_text> &work,
+    const std::vector<size_t> &group)
+{
+    std::string prompt;
+    for (size_t k = 0; k < group.size(); k++) {
+        prompt += "[[" + std::to_string(k + 1) + "]]\n";
+        prompt += work[group[k]].source;
+        prompt += '\n';
+    }
+    return prompt;
+}
+
+static std::string_view trim(std::string_view text)
+{
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text[0])))
+        text.remove_prefix(1);
+    while (!text.empty() &&
+           std::isspace(static_cast<unsigned char>(text.back())))
+        text.remove_suffix(1);
+    return text;
+}
+
+// numbers missing from the reply stay empty
+static std::vector<std::string> read_numbered(std::string_view reply,
+                                              size_t count)
+{
+    std::vector<std::string> segments(count);
+
+    auto marker = [&](std::string_view line) -> std::optional<size_t> {
+        line = trim(line);
+        if (line.size() < 5 || !line.starts_with("[[") ||
+            !line.ends_with("]]"))
+            return std::nullopt;
+        size_t number = 0;
+        auto digits = line.substr(2, line.size() - 4);
+        auto [end, ec] = std::from_chars(
+            digits.data(), digits.data() + digits.size(), number);
+        if (ec != std::errc() || end != digits.data() + digits.size() ||
+            number == 0 || number > count)
+            return std::nullopt;
+        return number - 1;
+    };
+
+    std::optional<size_t> current;
+    std::string text;
+    auto finish = [&] {
+        if (current)
+            segments[*current] = std::string(trim(text));
+        text.clear();
+    };
+
+    while (!reply.empty()) {
+        size_t end = reply.find('\n');
+        std::string_view line = reply.substr(0, end);
+        reply.remove_prefix(end == std::string_view::npos ? reply.size()
+                                                          : end + 1);
+        if (auto number = marker(line)) {
+            finish();
+            current = number;
+        } else if (current) {
+            text.append(line);
+            text.push_back('\n');
+        }
+    }
+    finish();
+    return segments;
+}
+
+void TranslationService::translate_openrouter(std::vector<pending> &work,
+                                              batch_report &report)
+{
+    auto groups = batches(work, batch_options_.openrouter_texts,
+                          batch_options_.openrouter_bytes, 8);
+
+    const std::string instructions =
+        std::string("Translate every numbered segment of the user's message "
+                    "to ") +
+        language_name(target_language_) +
+        ". Reply with the segments in the same format, each [[n]] marker on "
+        "a line of its own followed by the translation of that segment, "
+        "and nothing else.";
+
+    std::vector<std::future<ai::openrouter_response>> replies;
+    for (const auto &group : groups) {
+        auto prompt = numbered_prompt(work, group);
+        replies.push_back(openrouter_->chat_async(
+            openrouter_request_for(instructions, prompt)));
+    }
+    report.requests += groups.size();
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        const auto &group = groups[g];
+        ai::openrouter_response response = replies[g].get();
+        if (!response.valid || response.content.empty()) {
+            for (size_t i : group)
+                report.failed += work[i].messages.size();
+            report.errors.push_back(response.error);
+            continue;
+        }
+
+        auto segments = read_numbered(response.content.front(), group.size());
+        bool incomplete = false;
+        for (size_t k = 0; k < group.size(); k++) {
+            if (segments[k].empty()) {
+                report.failed += work[group[k]].messages.size();
+                incomplete = true;
+                continue;
+            }
+            learn(work[group[k]], segments[k], report);
+        }
+        if (incomplete)
+            report.errors.push_back("openrouter left segments out");
+    }
+}
+
+} // namespace setman
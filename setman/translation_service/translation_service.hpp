@@ -1,18 +1,50 @@
 // TranslationService
 #pragma once
 
-// curl
-#include <curl/curl.h>
-
 // setman
 #include "ai_endpoints/deepl.hpp"
 #include "ai_endpoints/openrouter.hpp"
 #include "conversations/conversation.hpp"
 #include "language.hpp"
+#include "translation_memory.hpp"
+#include "unified_response.hpp"
+
+// std
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 namespace setman
 {
 
+namespace translation_service
+{
+
+// how many messages go into one request when translating a conversation
+struct batch_options {
+    // deepl takes at most 50 texts and a 128 KiB body per request
+    size_t deepl_texts = 50;
+    size_t deepl_bytes = 120 << 10;
+    // an openrouter batch is one prompt, and its reply has to fit in the
+    // model's output
+    size_t openrouter_texts = 40;
+    size_t openrouter_bytes = 8 << 10;
+};
+
+struct pending_text; // in the implementation
+
+struct batch_report {
+    size_t from_memory = 0; // exact matches only
+    size_t translated = 0;
+    size_t failed = 0; // left untranslated
+    size_t requests = 0;
+    std::vector<std::string> errors;
+};
+
+} // namespace translation_service
+
 class Conversation;
 
 class TranslationService
@@ -23,17 +55,15 @@ class TranslationService
         openrouter,
     };
 
-    TranslationService(CURL *curl, enum language target_language,
+    TranslationService(enum language target_language,
                        setman::ai::OpenRouterClient *openrouter,
                        setman::ai::DeepLClient *deepl)
-        : curl_(curl), target_language_(target_language)
+        : target_language_(target_language),
+          openrouter_(openrouter), deepl_(deepl)
     {
-        if (!openrouter)
-            client_choice_ = SupportedClient::deepl;
-        else if (!deepl)
-            client_choice_ = SupportedClient::openrouter;
-
-        // placeholder. prefer deepl for now.
+        // prefer deepl when both are there
+        client_choice_ = deepl || !openrouter ? SupportedClient::deepl
+                                              : SupportedClient::openrouter;
     }
 
     ~TranslationService() = default;
@@ -67,12 +97,70 @@ class TranslationService
         return *this;
     }
 
-    std::string translate(const std::string &message);
+    TranslationService &set_openrouter_model(const std::string &model)
+    {
+        openrouter_model_ = model;
+        return *this;
+    }
 
-    void translate(Conversation &conversation); // todo
+    // segments found in the memory are not sent to the provider, and every
+    // provider translation is added to it. null turns it off.
+    TranslationService &
+    set_memory(std::shared_ptr<translation_service::TranslationMemory> memory)
+    {
+        memory_ = std::move(memory);
+        return *this;
+    }
+    translation_service::TranslationMemory *memory() const
+    {
+        return memory_.get();
+    }
+
+    TranslationService &
+    set_batch_options(const translation_service::batch_options &options)
+    {
+        batch_options_ = options;
+        return *this;
+    }
+    // for free plan keys or a local server
+    TranslationService &set_deepl_endpoint(const std::string &endpoint)
+    {
+        deepl_endpoint_ = endpoint;
+        return *this;
+    }
+
+    using token_callback = ai::OpenRouterClient::token_callback;
+
+    // blocks until the translation arrives
+    translation_service::unified_response translate(const std::string &message);
+
+    // for previews. with on_token set, openrouter translations are streamed
+    // to it piece by piece on the transport thread; deepl cannot stream,
+    // and its translations, like memory hits, arrive as one piece
+    std::future<translation_service::unified_response>
+    translate_async(const std::string &message, token_callback on_token = {},
+                    const ai::call_options &options = {});
+
+    // translates every message not yet in the target language. messages
+    // are batched per request and the batches sent at once; identical
+    // messages are only sent once.
+    translation_service::batch_report translate(Conversation &conversation);
 
   private:
-    CURL *curl_;
+    using pending = translation_service::pending_text;
+
+    void translate_deepl(std::vector<pending> &work,
+                         translation_service::batch_report &report);
+    void translate_openrouter(std::vector<pending> &work,
+                              translation_service::batch_report &report);
+    ai::deepl_request deepl_request_for(std::vector<std::string> texts,
+                                        language from) const;
+    ai::openrouter_request
+    openrouter_request_for(const std::string &instructions,
+                           const std::string &message) const;
+
+    void learn(const pending &segment, const std::string &translation,
+               translation_service::batch_report &report);
 
     enum language target_language_;
     std::optional<language> source_language_;
@@ -81,6 +169,12 @@ class TranslationService
 
     setman::ai::OpenRouterClient *openrouter_;
     setman::ai::DeepLClient *deepl_;
+    std::string openrouter_model_ = "google/gemini-2.0-flash-001";
+    std::optional<std::string> deepl_endpoint_;
+    translation_service::batch_options batch_options_;
+
+    std::shared_ptr<translation_service::TranslationMemory> memory_ =
+        std::make_shared<translation_service::TranslationMemory>();
 };
 
 } // namespace setman
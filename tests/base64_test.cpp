@@ -0,0 +1,256 @@
+// base64 round trips
+// the vectorized kernels against a plain reference, across block sizes,
+// tails and every way the input can be invalid
+
+// setman
+#include "base64.hpp"
+#include "error.hpp"
+
+// tests
+#include "check.hpp"
+
+// std
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace setman::materials;
+
+static constexpr char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static bool in_alphabet(unsigned char c)
+{
+    return std::string_view(alphabet).find(static_cast<char>(c)) !=
+           std::string_view::npos;
+}
+
+// one sextet at a time, the way the kernels are checked against
+static std::string reference_encode(const std::vector<unsigned char> &in)
+{
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= in.size(); i += 3) {
+        const uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out += alphabet[v >> 18];
+        out += alphabet[v >> 12 & 63];
+        out += alphabet[v >> 6 & 63];
+        out += alphabet[v & 63];
+    }
+    if (in.size() - i == 1) {
+        const uint32_t v = in[i] << 16;
+        out += alphabet[v >> 18];
+        out += alphabet[v >> 12 & 63];
+        out += "==";
+    } else if (in.size() - i == 2) {
+        const uint32_t v = in[i] << 16 | in[i + 1] << 8;
+        out += alphabet[v >> 18];
+        out += alphabet[v >> 12 & 63];
+        out += alphabet[v >> 6 & 63];
+        out += '=';
+    }
+    return out;
+}
+
+static std::vector<unsigned char> random_bytes(size_t len, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::vector<unsigned char> bytes(len);
+    for (auto &byte : bytes)
+        byte = static_cast<unsigned char>(random());
+    return bytes;
+}
+
+static std::string encode(const std::vector<unsigned char> &in)
+{
+    // a guard past the end catches kernels writing more than they say
+    std::string out(b64_encoded_size(in.size()) + 64, '#');
+    b64_encode(in.data(), in.size(), out.data());
+    for (size_t i = b64_encoded_size(in.size()); i < out.size(); ++i)
+        if (out[i] != '#')
+            return "overrun";
+    out.resize(b64_encoded_size(in.size()));
+    return out;
+}
+
+static std::optional<std::vector<unsigned char>> decode(std::string_view in)
+{
+    std::vector<unsigned char> out(b64_decoded_size(in.size()) + 64, 0xA5);
+    auto written = b64_decode(in.data(), in.size(), out.data());
+    if (!written)
+        return std::nullopt;
+    for (size_t i = b64_decoded_size(in.size()); i < out.size(); ++i)
+        if (out[i] != 0xA5)
+            return std::vector<unsigned char>{}; // overrun, never equal
+    out.resize(*written);
+    return out;
+}
+
+// the AVX2 kernels take 24 bytes in and 32 characters out a step, SSSE3
+// and NEON 12 and 16; every length up to a few blocks of the widest, and a
+// couple of large ones, covers each kernel's loop and every tail after it
+static std::vector<size_t> lengths()
+{
+    std::vector<size_t> out;
+    for (size_t len = 0; len <= 200; ++len)
+        out.push_back(len);
+    for (size_t len : {1000, 4095, 4096, 4097, 65535, 65536, 65537, 1 << 20})
+        out.push_back(len);
+    return out;
+}
+
+static void round_trips()
+{
+    for (size_t len : lengths()) {
+        const auto bytes = random_bytes(len, static_cast<unsigned>(len));
+        const std::string expected = reference_encode(bytes);
+        const std::string encoded = encode(bytes);
+        CHECK(encoded == expected, "encoding %zu bytes", len);
+
+        const auto decoded = decode(expected);
+        CHECK(decoded && *decoded == bytes, "decoding %zu bytes", len);
+
+        auto converted = b64_to_bytes(expected);
+        CHECK(converted && *converted == bytes, "converting %zu bytes", len);
+    }
+
+    // every byte value in every position of a block
+    std::vector<unsigned char> all(768);
+    for (size_t i = 0; i < all.size(); ++i)
+        all[i] = static_cast<unsigned char>(i * 7 + i / 256);
+    CHECK(encode(all) == reference_encode(all), "every byte value");
+    CHECK(decode(reference_encode(all)) == all, "every byte value");
+}
+
+static void invalid_characters()
+{
+    // one bad character anywhere, in the vector loop or the tail, fails
+    // the whole input
+    for (size_t len = 4; len <= 160; len += 4) {
+        std::string valid = reference_encode(random_bytes(len / 4 * 3, 7));
+        for (size_t at = 0; at < valid.size(); ++at) {
+            for (unsigned c = 0; c < 256; ++c) {
+                if (in_alphabet(static_cast<unsigned char>(c)) || c == '=')
+                    continue;
+                std::string broken = valid;
+                broken[at] = static_cast<char>(c);
+                CHECK(!decode(broken), "0x%02x at %zu of %zu", c, at, len);
+            }
+        }
+    }
+
+    // every character of the alphabet decodes, in every lane
+    for (size_t at = 0; at < 64; ++at) {
+        std::string text(64, 'A');
+        for (unsigned c = 0; c < 64; ++c) {
+            text[at] = alphabet[c];
+            CHECK(decode(text), "'%c' at %zu", alphabet[c], at);
+        }
+    }
+}
+
+static void invalid_padding()
+{
+    for (size_t len = 4; len <= 100; len += 4) {
+        std::string valid = reference_encode(random_bytes(len / 4 * 3, 11));
+        // padding anywhere but the last two characters
+        for (size_t at = 0; at + 2 < valid.size(); ++at) {
+            std::string broken = valid;
+            broken[at] = '=';
+            CHECK(!decode(broken), "'=' at %zu of %zu", at, len);
+        }
+    }
+
+    const char *bad[] = {
+        "====",     "A===",     "AA=A",     "AAA==",    "QQ=",
+        "QQ==QQ==", "QQ==AAAA", "Q===",     "=AAA",     "AA==AA==",
+        "QR==",     "QUJ=",     "QQ==\n",   "QUI=A",
+    };
+    for (const char *text : bad)
+        CHECK(!decode(text), "\"%s\"", text);
+
+    // the bits the padding stands for must be zero
+    for (unsigned c = 0; c < 64; ++c) {
+        std::string one = std::string("Q") + alphabet[c] + "==";
+        CHECK(decode(one).has_value() == (c % 16 == 0), "\"%s\"",
+              one.c_str());
+        std::string two = std::string("QU") + alphabet[c] + "=";
+        CHECK(decode(two).has_value() == (c % 4 == 0), "\"%s\"", two.c_str());
+    }
+
+    CHECK(decode("QQ==") == std::vector<unsigned char>{'A'}, "one byte");
+    CHECK(decode("QUI=") == (std::vector<unsigned char>{'A', 'B'}),
+          "two bytes");
+    CHECK(decode("") == std::vector<unsigned char>{}, "nothing");
+}
+
+static void invalid_lengths()
+{
+    const std::string valid = reference_encode(random_bytes(300, 13));
+    for (size_t len = 0; len <= valid.size(); ++len) {
+        if (len % 4 == 0)
+            continue;
+        CHECK(!decode(std::string_view(valid).substr(0, len)), "%zu", len);
+    }
+    CHECK(!b64_to_bytes("QQ="), "b64_to_bytes of a bad length");
+}
+
+static void streams()
+{
+    const auto dir = std::filesystem::temp_directory_path() /
+                     ("setman_base64_test_" +
+                      std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(dir);
+
+    // below and above the size MappedFile starts mapping at
+    for (size_t len : {0, 1, 2, 3, 4, 5, 100, 4097, 70000, 70001, 70002}) {
+        const auto bytes = random_bytes(len, static_cast<unsigned>(len) + 1);
+        const auto path = dir / std::to_string(len);
+        std::ofstream(path, std::ios::binary)
+            .write(reinterpret_cast<const char *>(bytes.data()), len);
+        const std::string expected = reference_encode(bytes);
+
+        for (size_t chunk : {1, 2, 3, 4, 5, 7, 64, 1000, 16384, 1 << 20}) {
+            auto stream = B64Stream::open(path);
+            CHECK(stream, "opening %zu bytes", len);
+            if (!stream)
+                continue;
+            CHECK(stream->size() == expected.size(), "size of %zu", len);
+
+            std::string read;
+            std::vector<char> buffer(chunk);
+            while (size_t n = stream->read(buffer.data(), buffer.size())) {
+                CHECK(n <= chunk, "%zu of %zu", n, chunk);
+                read.append(buffer.data(), n);
+            }
+            CHECK(read == expected, "%zu bytes in chunks of %zu", len, chunk);
+        }
+
+        // copies keep their own position
+        if (auto stream = B64Stream::open(path); stream && len >= 3) {
+            char head[4];
+            stream->read(head, 4);
+            B64Stream copy = *stream;
+            std::string rest(expected.size(), '\0');
+            size_t a = stream->read(rest.data(), rest.size());
+            size_t b = copy.read(rest.data(), rest.size());
+            CHECK(a == b && a == expected.size() - 4, "copy of %zu", len);
+        }
+    }
+    std::filesystem::remove_all(dir);
+
+    CHECK(!B64Stream::open(dir / "missing"), "opening a missing file");
+}
+
+int main()
+{
+    std::printf("base64: %s\n", std::string(b64_implementation()).c_str());
+    round_trips();
+    invalid_characters();
+    invalid_padding();
+    invalid_lengths();
+    streams();
+    return check_result();
+}
@@ -0,0 +1,30 @@
+// CHECK
+// the tests' one assertion: a failed check reports where and why, and the
+// test carries on so a run shows every failure at once
+
+#pragma once
+
+// std
+#include <cstdio>
+
+inline int check_failures = 0;
+
+#define CHECK(condition, ...)                                                  \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            std::fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__,            \
+                         #condition);                                          \
+            std::fprintf(stderr, __VA_ARGS__);                                 \
+            std::fprintf(stderr, "\n");                                        \
+            ++check_failures;                                                  \
+        }                                                                      \
+    } while (false)
+
+// what main returns, so ctest sees the failures
+inline int check_result()
+{
+    if (check_failures == 0)
+        return 0;
+    std::fprintf(stderr, "%d failed\n", check_failures);
+    return 1;
+}
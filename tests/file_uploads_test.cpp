@@ -0,0 +1,483 @@
+// file uploads
+// google requests whose inline images go through a local stand-in for the
+// gemini files api: repeated images are uploaded once and referenced,
+// files the server lost or that expire soon are sent again, and refusals
+// that are not about a file are left alone
+
+// setman
+#include "ai_endpoints/file_uploads.hpp"
+#include "ai_endpoints/google.hpp"
+#include "error.hpp"
+#include "materials/base64.hpp"
+
+// tests
+#include "check.hpp"
+#include "mock_server.hpp"
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// nlohmann
+#include <nlohmann/json.hpp>
+
+using namespace setman::ai;
+using namespace setman::testing;
+using json = nlohmann::json;
+
+// fnv-1a, enough to tell the images apart in an answer
+static std::string digest(std::string_view bytes)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : bytes)
+        hash = (hash ^ c) * 1099511628211ull;
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx",
+                  static_cast<unsigned long long>(hash));
+    return text;
+}
+
+static mock_response answer(int status, const json &body)
+{
+    return {.status = status, .body = body.dump()};
+}
+
+// the files api and generateContent, answering with the mime type and
+// digest of every image, inline or uploaded, and the text asked
+class FilesApi
+{
+  public:
+    mock_response operator()(const mock_request &request)
+    {
+        if (request.path.starts_with("/upload/v1beta/files"))
+            return upload(request);
+        if (request.path.find(":generateContent") != std::string::npos)
+            return generate(request);
+        return {.status = 404};
+    }
+
+    // the server loses every file it has
+    void forget()
+    {
+        std::lock_guard lock(mutex_);
+        files_.clear();
+    }
+
+    void expire_after(std::chrono::minutes lifetime)
+    {
+        std::lock_guard lock(mutex_);
+        lifetime_ = lifetime;
+    }
+
+    // refuses every generateContent, naming no file
+    void deny(bool denied)
+    {
+        std::lock_guard lock(mutex_);
+        denied_ = denied;
+    }
+
+    size_t uploads() const
+    {
+        std::lock_guard lock(mutex_);
+        return uploads_;
+    }
+
+    size_t generated() const
+    {
+        std::lock_guard lock(mutex_);
+        return generated_;
+    }
+
+  private:
+    // multipart/related: the metadata, then the file's bytes
+    mock_response upload(const mock_request &request)
+    {
+        const std::string_view type = request.header("content-type");
+        const size_t at = type.find("boundary=");
+        if (request.header("x-goog-upload-protocol") != "multipart" ||
+            at == std::string_view::npos)
+            return answer(400, {{"error", {{"message", "bad upload"}}}});
+        const std::string separator =
+            "--" + std::string(type.substr(at + 9));
+
+        std::vector<std::string_view> parts;
+        std::string_view rest(request.body);
+        for (size_t next; (next = rest.find(separator)) !=
+                          std::string_view::npos;) {
+            parts.push_back(rest.substr(0, next));
+            rest.remove_prefix(next + separator.size());
+        }
+        parts.push_back(rest);
+        if (parts.size() != 4 || !parts[0].empty() || parts[3] != "--\r\n")
+            return answer(400, {{"error", {{"message", "bad multipart"}}}});
+
+        auto split = [](std::string_view part) {
+            const size_t end = part.find("\r\n\r\n");
+            std::string_view head = part.substr(0, end);
+            std::string_view content = part.substr(end + 4);
+            content.remove_suffix(std::min<size_t>(2, content.size()));
+            return std::pair{head, content};
+        };
+        auto [metadata_head, metadata] = split(parts[1]);
+        auto [media_head, media] = split(parts[2]);
+        const json meta = json::parse(metadata, nullptr, false);
+        const size_t mime = media_head.find("Content-Type: ");
+        if (meta.is_discarded() || mime == std::string_view::npos)
+            return answer(400, {{"error", {{"message", "bad multipart"}}}});
+
+        std::lock_guard lock(mutex_);
+        const std::string name = "files/" + std::to_string(++uploads_);
+        files_[name] = media;
+
+        const std::time_t expires = std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now() + lifetime_);
+        std::tm utc;
+        gmtime_r(&expires, &utc);
+        char expiration[40];
+        std::strftime(expiration, sizeof(expiration),
+                      "%Y-%m-%dT%H:%M:%S.123456Z", &utc);
+
+        return answer(
+            200, {{"file",
+                   {{"name", name},
+                    {"displayName", meta["file"]["display_name"]},
+                    {"mimeType", media_head.substr(mime + 14)},
+                    {"sizeBytes", std::to_string(media.size())},
+                    {"uri", "http://" + std::string(request.header("host")) +
+                                "/v1beta/" + name},
+                    {"expirationTime", expiration},
+                    {"state", "ACTIVE"}}}});
+    }
+
+    mock_response generate(const mock_request &request)
+    {
+        const json body = json::parse(request.body, nullptr, false);
+        if (body.is_discarded())
+            return answer(400, {{"error", {{"message", "bad json"}}}});
+
+        std::lock_guard lock(mutex_);
+        generated_++;
+        if (denied_)
+            return answer(
+                403, {{"error",
+                       {{"code", 403},
+                        {"message", "Method doesn't allow unregistered "
+                                    "callers."},
+                        {"status", "PERMISSION_DENIED"}}}});
+
+        std::string text;
+        for (const auto &part : body["contents"][0]["parts"]) {
+            if (!text.empty())
+                text += ' ';
+            if (part.contains("inline_data")) {
+                auto bytes = setman::materials::b64_to_bytes(
+                    part["inline_data"]["data"].get<std::string>());
+                if (!bytes)
+                    return answer(400, {{"error", {{"message", "bad data"}}}});
+                text += part["inline_data"]["mime_type"].get<std::string>() +
+                        ":" +
+                        digest({reinterpret_cast<const char *>(bytes->data()),
+                                bytes->size()});
+            } else if (part.contains("file_data")) {
+                const std::string uri =
+                    part["file_data"]["file_uri"].get<std::string>();
+                const std::string name = uri.substr(uri.find("files/"));
+                auto file = files_.find(name);
+                if (file == files_.end())
+                    return answer(
+                        403,
+                        {{"error",
+                          {{"code", 403},
+                           {"message", "You do not have permission to access "
+                                       "the File " +
+                                           name + " or it may not exist."},
+                           {"status", "PERMISSION_DENIED"}}}});
+                text += part["file_data"]["mime_type"].get<std::string>() +
+                        ":" + digest(file->second);
+            } else if (part.contains("text")) {
+                text += "q=" + part["text"].get<std::string>();
+            }
+        }
+        return answer(
+            200, {{"candidates",
+                   {{{"content",
+                      {{"parts", {{{"text", text}}}}, {"role", "model"}}},
+                     {"finishReason", "STOP"}}}}});
+    }
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::string> files_;
+    std::chrono::minutes lifetime_{48 * 60};
+    bool denied_ = false;
+    size_t uploads_ = 0;
+    size_t generated_ = 0;
+};
+
+// a copyable cursor over a shared string, for streamed bodies
+struct text_cursor {
+    std::shared_ptr<const std::string> text;
+    size_t offset = 0;
+
+    size_t size() const { return text->size(); }
+    size_t read(char *buffer, size_t size)
+    {
+        size = std::min(size, text->size() - offset);
+        std::copy_n(text->data() + offset, size, buffer);
+        offset += size;
+        return size;
+    }
+};
+
+static std::string random_bytes(size_t size, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::string bytes(size, '\0');
+    for (char &c : bytes)
+        c = static_cast<char>(random());
+    return bytes;
+}
+
+static std::string base64(const std::string &bytes)
+{
+    std::string out(setman::materials::b64_encoded_size(bytes.size()), '\0');
+    setman::materials::b64_encode(
+        reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size(),
+        out.data());
+    return out;
+}
+
+struct image {
+    std::string bytes;
+    std::string data = base64(bytes);
+
+    // what the server answers when asked `question` about it
+    std::string answer(const std::string &question) const
+    {
+        return "image/png:" + digest(bytes) + " q=" + question;
+    }
+};
+
+class Scenario
+{
+  public:
+    Scenario() : server_([this](const mock_request &r) { return api(r); })
+    {
+        auto transport = Transport::create({.http2 = false});
+        client = new_google_client("key", transport);
+    }
+
+    std::shared_ptr<FileUploads> use_uploads(file_upload_options options)
+    {
+        options.endpoint = server_.url("/upload/v1beta/files");
+        auto uploads = std::make_shared<FileUploads>(std::move(options));
+        client->set_file_uploads(uploads);
+        return uploads;
+    }
+
+    google_request ask(const image &picture, bool streamed,
+                       const std::string &question) const
+    {
+        google_request request;
+        request.endpoint = server_.url("/v1beta/models/");
+        request.set_model("gemini");
+        if (streamed)
+            request.add_inline_image(
+                curl_helpers::stream_from(text_cursor{
+                    std::make_shared<const std::string>(picture.data)}),
+                "image/png");
+        else
+            request.add_inline_image(picture.data, "image/png");
+        request.add_text(question);
+        return request;
+    }
+
+    // sends and checks the answer, which is the same however the image went
+    google_response send(const image &picture, bool streamed,
+                         const std::string &question)
+    {
+        auto response = client->send(ask(picture, streamed, question));
+        CHECK(response.valid, "%s: %s", question.c_str(),
+              response.error.c_str());
+        CHECK(response.valid &&
+                  response.content ==
+                      std::vector<std::string>{picture.answer(question)},
+              "%s answered %s", question.c_str(),
+              response.content.empty() ? "nothing"
+                                       : response.content[0].c_str());
+        return response;
+    }
+
+    FilesApi api;
+    std::shared_ptr<GoogleClient> client;
+
+  private:
+    MockServer server_;
+};
+
+// the second send of an image uploads it and later ones reference it,
+// whichever of the three base64 paddings and whether streamed or not
+static void referenced_on_repeat()
+{
+    Scenario scenario;
+    file_upload_options options;
+    options.min_bytes = 1024;
+    auto uploads = scenario.use_uploads(options);
+
+    for (size_t size : {300'001, 300'002, 300'003}) {
+        for (bool streamed : {false, true}) {
+            const image picture{random_bytes(size, size + streamed)};
+            for (int i = 0; i < 3; i++)
+                scenario.send(picture, streamed, "q");
+        }
+    }
+
+    auto stats = uploads->statistics();
+    CHECK(stats.uploads == 6 && scenario.api.uploads() == 6,
+          "%zu uploads, %zu arrived", stats.uploads, scenario.api.uploads());
+    CHECK(stats.references == 12, "%zu references", stats.references);
+    CHECK(stats.failed_uploads == 0, "%zu failed", stats.failed_uploads);
+}
+
+// images sent at once before any upload finished share the one upload
+static void concurrent_first_sightings()
+{
+    Scenario scenario;
+    file_upload_options options;
+    options.min_bytes = 1024;
+    options.min_uses = 1;
+    auto uploads = scenario.use_uploads(options);
+
+    const image picture{random_bytes(500'000, 99)};
+    std::vector<std::future<google_response>> pending;
+    for (int i = 0; i < 8; i++)
+        pending.push_back(
+            scenario.client->send_async(scenario.ask(picture, i % 2, "c")));
+    int answered = 0;
+    for (auto &response : pending) {
+        auto r = response.get();
+        if (r.valid &&
+            r.content == std::vector<std::string>{picture.answer("c")})
+            answered++;
+    }
+    CHECK(answered == 8, "%d of 8 answered", answered);
+    CHECK(uploads->statistics().uploads == 1, "%zu uploads",
+          uploads->statistics().uploads);
+}
+
+// a file the server lost is sent inline at once and uploaded again
+static void recovered_after_loss()
+{
+    Scenario scenario;
+    file_upload_options options;
+    options.min_bytes = 1024;
+    options.min_uses = 1;
+    auto uploads = scenario.use_uploads(options);
+
+    const image picture{random_bytes(400'000, 5)};
+    scenario.send(picture, false, "first");
+    CHECK(uploads->statistics().uploads == 1, "uploaded");
+
+    scenario.api.forget();
+    const size_t generated = scenario.api.generated();
+    scenario.send(picture, false, "after");
+    CHECK(scenario.api.generated() == generated + 2,
+          "refused, then resent: %zu requests",
+          scenario.api.generated() - generated);
+
+    scenario.send(picture, false, "again");
+    auto stats = uploads->statistics();
+    CHECK(stats.uploads == 2, "%zu uploads", stats.uploads);
+    CHECK(scenario.api.generated() == generated + 3,
+          "referenced the new upload");
+}
+
+// a file expiring within the margin is never referenced
+static void short_expiry()
+{
+    Scenario scenario;
+    file_upload_options options;
+    options.min_bytes = 1024;
+    options.min_uses = 1;
+    auto uploads = scenario.use_uploads(options);
+    scenario.api.expire_after(std::chrono::minutes(6));
+
+    const image picture{random_bytes(200'000, 7)};
+    for (int i = 0; i < 3; i++)
+        scenario.send(picture, true, "e");
+    auto stats = uploads->statistics();
+    CHECK(stats.uploads == 3, "%zu uploads for 3 sends", stats.uploads);
+    CHECK(stats.references == 3, "%zu references", stats.references);
+}
+
+// a refusal naming no file is about the request, and is not retried
+static void denied()
+{
+    Scenario scenario;
+    file_upload_options options;
+    options.min_bytes = 1024;
+    options.min_uses = 1;
+    scenario.use_uploads(options);
+
+    const image picture{random_bytes(300'000, 11)};
+    scenario.send(picture, false, "warm");
+
+    scenario.api.deny(true);
+    const size_t generated = scenario.api.generated();
+    auto response = scenario.client->send(scenario.ask(picture, false, "no"));
+    CHECK(!response.valid && response.http_code == 403, "refused: %ld",
+          response.http_code);
+    CHECK(scenario.api.generated() == generated + 1, "%zu requests",
+          scenario.api.generated() - generated);
+}
+
+// an upload endpoint that fails leaves the image inline
+static void failed_upload()
+{
+    Scenario scenario;
+    auto uploads = std::make_shared<FileUploads>(
+        file_upload_options{.endpoint = "http://127.0.0.1:1/upload",
+                            .min_bytes = 1024,
+                            .min_uses = 1});
+    scenario.client->set_file_uploads(uploads);
+
+    scenario.send(image{random_bytes(100'000, 3)}, true, "bad");
+    auto stats = uploads->statistics();
+    CHECK(stats.failed_uploads == 1, "%zu failed", stats.failed_uploads);
+    CHECK(stats.references == 0, "%zu references", stats.references);
+}
+
+// small images are not worth an upload
+static void small_untouched()
+{
+    Scenario scenario;
+    file_upload_options options;
+    options.min_bytes = 1024;
+    auto uploads = scenario.use_uploads(options);
+
+    const image picture{random_bytes(500, 1)};
+    for (int i = 0; i < 3; i++)
+        scenario.send(picture, false, "s");
+    auto stats = uploads->statistics();
+    CHECK(stats.uploads == 0 && stats.references == 0,
+          "%zu uploads, %zu references", stats.uploads, stats.references);
+}
+
+int main()
+{
+    referenced_on_repeat();
+    concurrent_first_sightings();
+    recovered_after_loss();
+    short_expiry();
+    denied();
+    failed_upload();
+    small_untouched();
+    return check_result();
+}
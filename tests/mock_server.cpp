@@ -0,0 +1,318 @@
+// MockServer
+// implementation
+
+#include "mock_server.hpp"
+
+// posix
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// std
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace setman::testing
+{
+
+std::string_view mock_request::header(std::string_view name) const
+{
+    for (const auto &[key, value] : headers)
+        if (key == name)
+            return value;
+    return {};
+}
+
+static std::string lower(std::string text)
+{
+    for (char &c : text)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return text;
+}
+
+static std::string_view trim(std::string_view text)
+{
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+        text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t' ||
+                             text.back() == '\r'))
+        text.remove_suffix(1);
+    return text;
+}
+
+static const char *reason(int status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 429:
+        return "Too Many Requests";
+    case 500:
+        return "Internal Server Error";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Status";
+    }
+}
+
+static bool send_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        ssize_t sent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data.remove_prefix(static_cast<size_t>(sent));
+    }
+    return true;
+}
+
+// buffered reads off one connection
+class connection_reader
+{
+  public:
+    explicit connection_reader(int fd) : fd_(fd) {}
+
+    // up to and including the next "\r\n", without it
+    bool line(std::string &out)
+    {
+        while (true) {
+            size_t end = buffer_.find("\r\n", start_);
+            if (end != std::string::npos) {
+                out.assign(buffer_, start_, end - start_);
+                start_ = end + 2;
+                return true;
+            }
+            if (!fill())
+                return false;
+        }
+    }
+
+    bool bytes(size_t count, std::string &out)
+    {
+        while (buffer_.size() - start_ < count)
+            if (!fill())
+                return false;
+        out.append(buffer_, start_, count);
+        start_ += count;
+        return true;
+    }
+
+  private:
+    bool fill()
+    {
+        if (start_ > 0) {
+            buffer_.erase(0, start_);
+            start_ = 0;
+        }
+        char chunk[16384];
+        ssize_t got;
+        while ((got = ::recv(fd_, chunk, sizeof chunk, 0)) < 0 &&
+               errno == EINTR) {
+        }
+        if (got <= 0)
+            return false;
+        buffer_.append(chunk, static_cast<size_t>(got));
+        return true;
+    }
+
+    int fd_;
+    std::string buffer_;
+    size_t start_ = 0;
+};
+
+// request line, headers and body; a 100 Continue goes out when the client
+// waits for one
+static bool read_request(int fd, connection_reader &in, mock_request &out)
+{
+    std::string line;
+    do {
+        if (!in.line(line))
+            return false;
+    } while (line.empty());
+
+    size_t method_end = line.find(' ');
+    size_t path_end = line.find(' ', method_end + 1);
+    if (method_end == std::string::npos || path_end == std::string::npos)
+        return false;
+    out.method = line.substr(0, method_end);
+    out.path = line.substr(method_end + 1, path_end - method_end - 1);
+
+    while (true) {
+        if (!in.line(line))
+            return false;
+        if (line.empty())
+            break;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        out.headers.emplace_back(lower(line.substr(0, colon)),
+                                 std::string(trim(line.substr(colon + 1))));
+    }
+
+    if (lower(std::string(out.header("expect"))) == "100-continue" &&
+        !send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n"))
+        return false;
+
+    if (lower(std::string(out.header("transfer-encoding"))) == "chunked") {
+        while (true) {
+            if (!in.line(line))
+                return false;
+            size_t size = std::strtoul(line.c_str(), nullptr, 16);
+            if (size == 0)
+                return in.line(line); // the empty line after the last chunk
+            if (!in.bytes(size, out.body) || !in.line(line))
+                return false;
+        }
+    }
+
+    std::string_view length = out.header("content-length");
+    if (!length.empty())
+        return in.bytes(std::strtoul(std::string(length).c_str(), nullptr, 10),
+                        out.body);
+    return true;
+}
+
+MockServer::MockServer(handler respond) : respond_(std::move(respond))
+{
+    listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener_ < 0)
+        throw std::runtime_error("mock server: no socket");
+
+    int yes = 1;
+    ::setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0; // any free port
+    socklen_t size = sizeof address;
+    if (::bind(listener_, reinterpret_cast<sockaddr *>(&address), size) < 0 ||
+        ::listen(listener_, 128) < 0 ||
+        ::getsockname(listener_, reinterpret_cast<sockaddr *>(&address),
+                      &size) < 0) {
+        ::close(listener_);
+        throw std::runtime_error("mock server: cannot listen");
+    }
+    port_ = ntohs(address.sin_port);
+
+    acceptor_ = std::thread([this] { accept_loop(); });
+}
+
+MockServer::~MockServer() { stop(); }
+
+std::string MockServer::url(std::string_view path) const
+{
+    return "http://127.0.0.1:" + std::to_string(port_) + std::string(path);
+}
+
+void MockServer::stop()
+{
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard lock(mutex_);
+        if (stopping_)
+            return;
+        stopping_ = true;
+        // wakes accept() and every recv() blocked on a connection
+        ::shutdown(listener_, SHUT_RDWR);
+        for (int fd : open_)
+            ::shutdown(fd, SHUT_RDWR);
+    }
+    stopped_.notify_all();
+
+    acceptor_.join();
+    ::close(listener_);
+    {
+        std::lock_guard lock(mutex_);
+        workers.swap(workers_);
+    }
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void MockServer::accept_loop()
+{
+    while (true) {
+        int fd = ::accept(listener_, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        std::lock_guard lock(mutex_);
+        if (stopping_) {
+            ::close(fd);
+            return;
+        }
+        open_.push_back(fd);
+        size_t connection = ++connections_;
+        workers_.emplace_back([this, fd, connection] { serve(fd, connection); });
+    }
+}
+
+// false once the server stops
+bool MockServer::wait(std::chrono::milliseconds delay)
+{
+    std::unique_lock lock(mutex_);
+    return !stopped_.wait_for(lock, delay, [this] { return stopping_; });
+}
+
+void MockServer::serve(int fd, size_t connection)
+{
+    connection_reader in(fd);
+    for (size_t sequence = 1;; ++sequence) {
+        mock_request request;
+        request.connection = connection;
+        request.sequence = sequence;
+        if (!read_request(fd, in, request))
+            break;
+        ++requests_;
+
+        mock_response response = respond_(request);
+        if (response.drop)
+            break;
+        if (response.delay.count() > 0 && !wait(response.delay))
+            break;
+
+        std::string head = "HTTP/1.1 " + std::to_string(response.status) +
+                           " " + reason(response.status) + "\r\n";
+        head += "Content-Length: " + std::to_string(response.body.size()) +
+                "\r\n";
+        bool has_type = false;
+        for (const auto &[name, value] : response.headers) {
+            head += name + ": " + value + "\r\n";
+            has_type |= lower(name) == "content-type";
+        }
+        if (!has_type)
+            head += "Content-Type: application/json\r\n";
+        head += "\r\n";
+        if (!send_all(fd, head) || !send_all(fd, response.body))
+            break;
+        if (lower(std::string(request.header("connection"))) == "close")
+            break;
+    }
+
+    std::lock_guard lock(mutex_);
+    open_.erase(std::find(open_.begin(), open_.end(), fd));
+    ::close(fd);
+}
+
+} // namespace setman::testing
@@ -0,0 +1,88 @@
+// MockServer
+// a plain HTTP/1.1 server on a loopback port, answering from a handler, for
+// tests that drive the ai clients without reaching any provider
+
+#pragma once
+
+// std
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace setman::testing
+{
+
+struct mock_request {
+    std::string method;
+    std::string path; // query string included
+    std::vector<std::pair<std::string, std::string>> headers; // lower case
+    std::string body;
+    size_t connection = 0; // which accepted connection, counted from 1
+    size_t sequence = 0;   // which request on that connection, from 1
+
+    // the first header of that name, empty when there is none
+    std::string_view header(std::string_view name) const;
+};
+
+struct mock_response {
+    int status = 200;
+    std::string body;
+    std::vector<std::pair<std::string, std::string>> headers;
+    // waited out before answering, cut short when the server stops
+    std::chrono::milliseconds delay{0};
+    // closes the connection once the request is read, without an answer,
+    // the way a server drops an idle keep-alive connection
+    bool drop = false;
+};
+
+// every connection is served on a thread of its own, so the handler runs
+// concurrently and must be thread safe
+class MockServer
+{
+  public:
+    using handler = std::function<mock_response(const mock_request &)>;
+
+    explicit MockServer(handler respond);
+    ~MockServer(); // stops
+
+    MockServer(const MockServer &) = delete;
+    MockServer &operator=(const MockServer &) = delete;
+
+    // "http://127.0.0.1:<port>" followed by path
+    std::string url(std::string_view path = {}) const;
+
+    size_t connections() const { return connections_; }
+    size_t requests() const { return requests_; }
+
+    // closes every connection; requests waiting on a delay are dropped
+    void stop();
+
+  private:
+    void accept_loop();
+    void serve(int fd, size_t connection);
+    bool wait(std::chrono::milliseconds delay);
+
+    handler respond_;
+    int listener_ = -1;
+    unsigned short port_ = 0;
+
+    std::atomic<size_t> connections_{0};
+    std::atomic<size_t> requests_{0};
+
+    std::mutex mutex_; // guards the rest
+    std::condition_variable stopped_;
+    bool stopping_ = false;
+    std::vector<int> open_;
+    std::vector<std::thread> workers_;
+    std::thread acceptor_;
+};
+
+} // namespace setman::testing
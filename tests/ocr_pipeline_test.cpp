@@ -0,0 +1,266 @@
+// ocr pipeline
+// the pipeline against a local server standing in for gemini: requests
+// refused with 429 and 503 are retried, a cancelled run is resumed by the
+// next, and a request the server rejects outright is not sent again
+
+// setman
+#include "ai_endpoints/google.hpp"
+#include "database.hpp"
+#include "materials/base64.hpp"
+#include "materials/image.hpp"
+#include "ocr_pipeline.hpp"
+
+// tests
+#include "check.hpp"
+#include "mock_server.hpp"
+
+// std
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// nlohmann
+#include <nlohmann/json.hpp>
+
+using namespace setman;
+using namespace setman::testing;
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+// every image is refused twice, first as rate limited and then as
+// unavailable, before it is read. one image may be rejected for good.
+class FlakyOcr
+{
+  public:
+    mock_response operator()(const mock_request &request)
+    {
+        mock_response response;
+        response.delay = std::chrono::milliseconds(10);
+
+        json body = json::parse(request.body, nullptr, false);
+        std::string data;
+        if (!body.is_discarded())
+            for (const auto &part : body["contents"][0]["parts"])
+                if (part.contains("inline_data"))
+                    data = part["inline_data"]["data"].get<std::string>();
+
+        std::lock_guard lock(mutex_);
+        const int attempt = ++attempts_[data];
+        if (data.empty() || data == rejected_) {
+            response.status = 400;
+            response.body = R"({"error":{"message":"unreadable image"}})";
+        } else if (attempt == 1) {
+            // told when, so the transport does not learn a slower pace
+            // from it and the scenario takes moments
+            response.status = 429;
+            response.headers = {{"Retry-After", "0"}};
+            response.body = R"({"error":{"message":"quota exceeded"}})";
+        } else if (attempt == 2) {
+            response.status = 503;
+            response.body = R"({"error":{"message":"overloaded"}})";
+        } else {
+            response.body =
+                json{{"candidates",
+                      {{{"content",
+                         {{"parts",
+                           {{{"text", "len " + std::to_string(
+                                                   data.size())}}}}}}}}}}
+                    .dump();
+        }
+        return response;
+    }
+
+    // the base64 of an image to answer with 400
+    void reject(std::string data)
+    {
+        std::lock_guard lock(mutex_);
+        rejected_ = std::move(data);
+    }
+
+    int attempts(const std::string &data)
+    {
+        std::lock_guard lock(mutex_);
+        return attempts_[data];
+    }
+
+  private:
+    std::mutex mutex_;
+    std::map<std::string, int> attempts_;
+    std::string rejected_;
+};
+
+static std::string base64(const std::string &bytes)
+{
+    std::string out(materials::b64_encoded_size(bytes.size()), '\0');
+    materials::b64_encode(
+        reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size(),
+        out.data());
+    return out;
+}
+
+static int count(Database &database, const char *sql)
+{
+    sqlite3_stmt *stmt = nullptr;
+    int n = -1;
+    if (sqlite3_prepare_v2(database.handle(), sql, -1, &stmt, nullptr) ==
+            SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW)
+        n = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+int main()
+{
+    std::random_device seed;
+    const fs::path dir = fs::temp_directory_path() /
+                         ("setman-ocr-" + std::to_string(seed()));
+    fs::create_directories(dir);
+
+    // random bytes behind a png signature; nothing past it is looked at
+    // but by the server
+    const std::string signature = "\x89PNG\r\n\x1a\n";
+    std::mt19937 random(seed());
+    std::vector<std::unique_ptr<materials::Image>> owned;
+    std::vector<const materials::Image *> images;
+    std::vector<std::string> contents;
+    for (int i = 0; i < 24; i++) {
+        std::string bytes(1000 + i * 37, '\0');
+        for (char &c : bytes)
+            c = static_cast<char>(random());
+        bytes.replace(0, signature.size(), signature);
+        const fs::path file = dir / ("kf" + std::to_string(i) + ".png");
+        std::ofstream(file, std::ios::binary) << bytes;
+        contents.push_back(bytes);
+        owned.push_back(std::make_unique<materials::Image>(
+            nullptr, file, materials::material::keyframe));
+        images.push_back(owned.back().get());
+    }
+
+    Database database((dir / "setman.db").string());
+    CHECK(database.init_schema(), "schema");
+
+    FlakyOcr flaky;
+    MockServer server([&](const mock_request &r) { return flaky(r); });
+
+    auto transport = ai::Transport::create({.http2 = false});
+    auto client = ai::new_google_client("key", transport);
+
+    ocr_options options;
+    options.endpoint = server.url("/models/");
+    options.max_in_flight = 4;
+    options.prepare_threads = 3;
+    options.queue_capacity = 4;
+    options.initial_backoff = std::chrono::milliseconds(20);
+    options.max_backoff = std::chrono::milliseconds(200);
+    options.max_attempts = 8;
+
+    // cancelled part way through; what was read stays read
+    size_t first = 0;
+    {
+        OcrPipeline pipeline(database, *client, options);
+        pipeline.on_progress([&](const ocr_report &report) {
+            if (report.finished() >= 8)
+                pipeline.cancel();
+        });
+        auto report = pipeline.run(images);
+        CHECK(report.has_value(), "first run");
+        if (report) {
+            CHECK(report->cancelled, "first run cancelled");
+            CHECK(report->succeeded >= 8 && report->succeeded < 24,
+                  "%zu read before the cancel", report->succeeded);
+            CHECK(report->failed.empty(), "%zu failed: %s",
+                  report->failed.size(),
+                  report->failed.empty() ? ""
+                                         : report->failed[0].error.c_str());
+            CHECK(report->retries >= 2 * report->succeeded,
+                  "%zu retries for %zu images", report->retries,
+                  report->succeeded);
+            first = report->succeeded;
+        }
+    }
+    CHECK(count(database, "SELECT count(*) FROM ocr_results") ==
+              static_cast<int>(first),
+          "results stored as they arrive");
+
+    // the next run picks up where it stopped, through the same refusals
+    {
+        OcrPipeline pipeline(database, *client, options);
+        auto report = pipeline.run(images);
+        CHECK(report.has_value(), "second run");
+        if (report) {
+            CHECK(!report->cancelled, "second run finished");
+            CHECK(report->skipped == first, "%zu skipped, %zu read before",
+                  report->skipped, first);
+            CHECK(report->skipped + report->succeeded == 24,
+                  "%zu skipped, %zu read", report->skipped,
+                  report->succeeded);
+            CHECK(report->failed.empty(), "%zu failed: %s",
+                  report->failed.size(),
+                  report->failed.empty() ? ""
+                                         : report->failed[0].error.c_str());
+            CHECK(report->retries > 0, "refusals retried");
+        }
+    }
+    CHECK(count(database, "SELECT count(*) FROM ocr_results") == 24,
+          "every image stored");
+    CHECK(count(database,
+                "SELECT count(*) FROM ocr_jobs WHERE state = 'done'") == 24,
+          "every job done");
+    CHECK(count(database, "SELECT count(*) FROM ocr_results WHERE text = "
+                          "'len 1336'") == 1,
+          "text stored as read");
+    for (size_t i = 0; i < contents.size(); i++)
+        CHECK(flaky.attempts(base64(contents[i])) == 3,
+              "image %zu sent %d times", i,
+              flaky.attempts(base64(contents[i])));
+
+    // nothing left to do, nothing sent
+    {
+        const size_t requests = server.requests();
+        OcrPipeline pipeline(database, *client, options);
+        auto report = pipeline.run(images);
+        CHECK(report && report->skipped == 24 && report->succeeded == 0,
+              "third run skips all");
+        CHECK(server.requests() == requests, "%zu requests sent",
+              server.requests() - requests);
+    }
+
+    // a request the server rejects fails at once
+    {
+        const std::string bytes = signature + "truncated";
+        const fs::path file = dir / "broken.png";
+        std::ofstream(file, std::ios::binary) << bytes;
+        flaky.reject(base64(bytes));
+        materials::Image broken(nullptr, file, materials::material::keyframe);
+        const materials::Image *batch[] = {&broken};
+
+        OcrPipeline pipeline(database, *client, options);
+        auto report = pipeline.run(batch);
+        CHECK(report.has_value(), "rejected run");
+        if (report) {
+            CHECK(report->failed.size() == 1 && report->retries == 0,
+                  "%zu failed after %zu retries", report->failed.size(),
+                  report->retries);
+            CHECK(!report->failed.empty() &&
+                      report->failed[0].material == broken.uuid(),
+                  "the broken image failed");
+        }
+        CHECK(flaky.attempts(base64(bytes)) == 1, "sent %d times",
+              flaky.attempts(base64(bytes)));
+        CHECK(count(database,
+                    "SELECT count(*) FROM ocr_jobs WHERE state = 'failed'") ==
+                  1,
+              "failure recorded");
+    }
+
+    server.stop();
+    fs::remove_all(dir);
+    return check_result();
+}
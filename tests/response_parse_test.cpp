@@ -0,0 +1,174 @@
+// provider responses
+// the streaming field readers of the deepl, google and openrouter clients
+// on well formed answers and on arrays whose elements are not all objects
+
+// setman
+#include "ai_endpoints/deepl.hpp"
+#include "ai_endpoints/google.hpp"
+#include "ai_endpoints/openrouter.hpp"
+
+// tests
+#include "check.hpp"
+
+// std
+#include <string>
+#include <vector>
+
+using namespace setman::ai;
+
+using texts = std::vector<std::string>;
+
+static void deepl()
+{
+    auto ok = deepl_response::parse(
+        R"({"translations":[{"text":"a","billed_characters":2},)"
+        R"({"text":"b","billed_characters":3}],"model_type_used":"m"})",
+        200);
+    CHECK(ok.valid, "%s", ok.error.c_str());
+    CHECK(ok.content == (texts{"a", "b"}), "two translations");
+    CHECK(ok.billed_characters == 5, "billed characters summed");
+    CHECK(ok.model_type_used == "m", "model type");
+
+    // an element that is not an object has no text, wherever it sits
+    struct {
+        const char *body;
+        const char *error;
+    } const cases[] = {
+        {R"({"translations":["x",{"text":"y"}]})",
+         "[DEEPL] Translation at index 0 missing 'text' field"},
+        {R"({"translations":[{"text":"y"},"x"]})",
+         "[DEEPL] Translation at index 1 missing 'text' field"},
+        {R"({"translations":[{"text":"y"},7,null,{"text":"z"}]})",
+         "[DEEPL] Translation at index 1 missing 'text' field"},
+        {R"({"translations":[[{"text":"y"}],{"text":"z"},{"text":"w"}]})",
+         "[DEEPL] Translation at index 0 missing 'text' field"},
+        {R"({"translations":[true,false,1.5,{"text":"y"}]})",
+         "[DEEPL] Translation at index 0 missing 'text' field"},
+        {R"({"translations":[{"text":"y"},{"text":["z"]}]})",
+         "[DEEPL] Translation 'text' at index 1 is not a string"},
+        {R"({"translations":[{"text":"y"},{"text":3}]})",
+         "[DEEPL] Translation 'text' at index 1 is not a string"},
+        {R"({"translations":"x"})",
+         "[DEEPL] 'translations' field is empty or not an array"},
+        {R"({"translations":{"text":"y"}})",
+         "[DEEPL] 'translations' field is empty or not an array"},
+        {R"({"translations":[]})",
+         "[DEEPL] 'translations' field is empty or not an array"},
+        {R"({"other":[]})", "[DEEPL] Missing 'translations' field in response"},
+    };
+    for (const auto &c : cases) {
+        auto result = deepl_response::parse(c.body, 200);
+        CHECK(!result.valid, "%s", c.body);
+        CHECK(result.error == c.error, "%s: %s", c.body, result.error.c_str());
+        CHECK(result.content.empty(), "%s", c.body);
+    }
+}
+
+static void google()
+{
+    auto ok = google_response::parse(
+        R"({"candidates":[{"content":{"parts":[{"text":"a"},{"text":"b"}]},)"
+        R"("finishReason":"STOP"},{"content":{"parts":[{"text":"c"}]}}],)"
+        R"("usageMetadata":{"promptTokenCount":4,"totalTokenCount":6}})",
+        200);
+    CHECK(ok.valid, "%s", ok.error.c_str());
+    CHECK(ok.content == (texts{"ab", "c"}), "two candidates");
+    CHECK(ok.finish_reason == "STOP", "finish reason");
+    CHECK(ok.prompt_tokens == 4 && ok.total_tokens == 6, "usage");
+
+    // parts that are not objects carry no text, as before
+    auto parts = google_response::parse(
+        R"({"candidates":[{"content":{"parts":["x",{"text":"a"},3]}}]})", 200);
+    CHECK(parts.valid, "%s", parts.error.c_str());
+    CHECK(parts.content == texts{"a"}, "text of the object parts");
+
+    const char *missing[] = {
+        R"({"candidates":["x",{"content":{"parts":[{"text":"y"}]}}]})",
+        R"({"candidates":[{"content":{"parts":[{"text":"y"}]}},"x"]})",
+        R"({"candidates":[{"content":{"parts":[{"text":"y"}]}},1,)"
+        R"({"content":{"parts":[{"text":"z"}]}}]})",
+        R"({"candidates":[null,{"content":{"parts":[{"text":"y"}]}}]})",
+        R"({"candidates":[[{"content":{"parts":[]}}],)"
+        R"({"content":{"parts":[{"text":"y"}]}}]})",
+    };
+    for (const char *body : missing) {
+        auto result = google_response::parse(body, 200);
+        CHECK(!result.valid, "%s", body);
+        CHECK(result.error == "[GOOGLE] Candidate missing content or parts",
+              "%s: %s", body, result.error.c_str());
+    }
+
+    struct {
+        const char *body;
+        const char *error;
+    } const cases[] = {
+        {R"({"candidates":[{"content":{"parts":{"text":"y"}}}]})",
+         "[GOOGLE] Parts is not an array"},
+        {R"({"candidates":[{"content":{"parts":"y"}}]})",
+         "[GOOGLE] Parts is not an array"},
+        {R"({"candidates":[{"content":"y"}]})",
+         "[GOOGLE] Candidate missing content or parts"},
+        {R"({"candidates":"x"})",
+         "[GOOGLE] 'candidates' field is empty or not an array"},
+        {R"({"candidates":3})",
+         "[GOOGLE] 'candidates' field is empty or not an array"},
+        {R"({"usageMetadata":{}})",
+         "[GOOGLE] Missing 'candidates' field in response"},
+    };
+    for (const auto &c : cases) {
+        auto result = google_response::parse(c.body, 200);
+        CHECK(!result.valid, "%s", c.body);
+        CHECK(result.error == c.error, "%s: %s", c.body, result.error.c_str());
+    }
+}
+
+static void openrouter()
+{
+    auto ok = openrouter_response::parse(
+        R"({"choices":[{"message":{"content":"a"},"finish_reason":"stop"},)"
+        R"({"message":{"content":"b"}}],"model":"m",)"
+        R"("usage":{"prompt_tokens":1,"completion_tokens":2}})",
+        200);
+    CHECK(ok.valid, "%s", ok.error.c_str());
+    CHECK(ok.content == (texts{"a", "b"}), "two choices");
+    CHECK(ok.finish_reason == "stop" && ok.model_used == "m", "fields");
+    CHECK(ok.prompt_tokens == 1 && ok.completion_tokens == 2, "usage");
+
+    struct {
+        const char *body;
+        const char *error;
+    } const cases[] = {
+        {R"({"choices":["x",{"message":{"content":"y"}}]})",
+         "[OPENROUTER] Choice at index 0 missing 'message' field"},
+        {R"({"choices":[{"message":{"content":"y"}},"x"]})",
+         "[OPENROUTER] Choice at index 1 missing 'message' field"},
+        {R"({"choices":[{"message":{"content":"y"}},2,)"
+         R"({"message":{"content":"z"}}]})",
+         "[OPENROUTER] Choice at index 1 missing 'message' field"},
+        {R"({"choices":[false,[],{"message":{"content":"y"}}]})",
+         "[OPENROUTER] Choice at index 0 missing 'message' field"},
+        {R"({"choices":[{"message":{"content":"y"}},{"message":{}}]})",
+         "[OPENROUTER] Message at index 1 missing or invalid 'content'"},
+        {R"({"choices":[{"message":"y"}]})",
+         "[OPENROUTER] Message at index 0 missing or invalid 'content'"},
+        {R"({"choices":[{"message":{"content":1}}]})",
+         "[OPENROUTER] Message at index 0 missing or invalid 'content'"},
+        {R"({"choices":null})",
+         "[OPENROUTER] 'choices' field is empty or not an array"},
+        {R"({"model":"m"})",
+         "[OPENROUTER] Missing 'choices' field in response"},
+    };
+    for (const auto &c : cases) {
+        auto result = openrouter_response::parse(c.body, 200);
+        CHECK(!result.valid, "%s", c.body);
+        CHECK(result.error == c.error, "%s: %s", c.body, result.error.c_str());
+    }
+}
+
+int main()
+{
+    deepl();
+    google();
+    openrouter();
+    return check_result();
+}
@@ -0,0 +1,167 @@
+// sync
+// changesets between two local project databases: export, import, the
+// outbox surviving restarts and failed exports, and conflicts
+
+// setman
+#include "database.hpp"
+#include "journal.hpp"
+
+// tests
+#include "check.hpp"
+
+// std
+#include <filesystem>
+#include <random>
+#include <string>
+
+using namespace setman;
+namespace fs = std::filesystem;
+
+static material_row cut(const std::string &uuid, const std::string &notes)
+{
+    return {.uuid = uuid,
+            .episode_uuid = "episode",
+            .type = "cut",
+            .parent_uuid = std::nullopt,
+            .path = "/episode/" + uuid,
+            .notes = notes,
+            .alias = "",
+            .tags = {"retake"},
+            .identity = std::nullopt};
+}
+
+static std::string query_text(Database &db, const std::string &sql)
+{
+    sqlite3_stmt *stmt = nullptr;
+    std::string out;
+    if (sqlite3_prepare_v2(db.handle(), sql.c_str(), -1, &stmt, nullptr) ==
+            SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0))
+        out = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    return out;
+}
+
+static size_t pending(Database &db)
+{
+    auto changes = db.pending_changeset();
+    return changes ? changes->size() : SIZE_MAX;
+}
+
+static size_t hits(Database &db, const std::string &text)
+{
+    auto found = db.search({.text = text});
+    return found ? found->size() : SIZE_MAX;
+}
+
+int main()
+{
+    const fs::path dir = fs::temp_directory_path() /
+                         ("setman_sync_test_" +
+                          std::to_string(std::random_device{}()));
+    fs::create_directories(dir);
+
+    {
+        Database a(dir / "a.sqlite"), b(dir / "b.sqlite");
+        CHECK(a.init_schema(), "schema of a");
+        CHECK(b.init_schema(), "schema of b");
+
+        journal_batch first;
+        first.episodes.push_back({"episode", "series", 1, "/episode",
+                                  "/episode/up", "/episode/cels"});
+        for (int i = 0; i < 50; i++)
+            first.materials.push_back(
+                cut("cut" + std::to_string(i), "作監修正 note"));
+        first.statuses.push_back({"cut1", "layout", 100});
+        CHECK(a.apply(first), "first batch");
+
+        journal_batch second;
+        second.materials.push_back(cut("cut5", "changed again"));
+        second.statuses.push_back({"cut1", "genga", 200});
+        CHECK(a.apply(second), "second batch");
+        CHECK(pending(a) > 0, "a records its commits");
+
+        // an export that cannot be written keeps the outbox
+        const size_t before = pending(a);
+        CHECK(!a.export_changeset(dir / "missing" / "a.changes"),
+              "export into a missing directory");
+        CHECK(pending(a) == before, "outbox kept after a failed export");
+
+        CHECK(a.export_changeset(dir / "a.changes"), "export");
+        CHECK(fs::exists(dir / "a.changes"), "changeset written");
+        CHECK(!fs::exists(dir / "a.changes.tmp"), "temporary renamed");
+        CHECK(pending(a) == 0, "outbox cleared after export");
+
+        auto report = b.import_changeset(dir / "a.changes");
+        CHECK(report && report->changes > 0 && report->conflicts == 0,
+              "import");
+        CHECK(hits(b, "作監修正") == 49, "search rebuilt on b");
+        CHECK(hits(b, "changed") == 1, "later edit carried");
+        CHECK(query_text(b, "SELECT status FROM cut_status "
+                            "WHERE cut_uuid = 'cut1'") == "genga",
+              "status carried");
+        CHECK(pending(b) == 0, "applied changes are not echoed back");
+
+        // both edit the same rows: the newer status wins on both sides,
+        // and each takes the other's material row
+        journal_batch on_a;
+        on_a.statuses.push_back({"cut1", "douga", 300});
+        on_a.materials.push_back(cut("cut2", "from a"));
+        CHECK(a.apply(on_a), "edit on a");
+        journal_batch on_b;
+        on_b.statuses.push_back({"cut1", "sakkan", 250});
+        on_b.materials.push_back(cut("cut3", "from b"));
+        CHECK(b.apply(on_b), "edit on b");
+
+        CHECK(a.export_changeset(dir / "a2.changes"), "export a");
+        CHECK(b.export_changeset(dir / "b2.changes"), "export b");
+        auto into_b = b.import_changeset(dir / "a2.changes");
+        CHECK(into_b && into_b->conflicts > 0, "b sees a conflict");
+        auto into_a = a.import_changeset(dir / "b2.changes");
+        CHECK(into_a && into_a->conflicts > 0, "a sees a conflict");
+        for (Database *db : {&a, &b}) {
+            CHECK(query_text(*db, "SELECT status FROM cut_status "
+                                  "WHERE cut_uuid = 'cut1'") == "douga",
+                  "newest status wins");
+            CHECK(query_text(*db, "SELECT notes FROM materials "
+                                  "WHERE uuid = 'cut2'") == "from a",
+                  "a's edit on both");
+            CHECK(query_text(*db, "SELECT notes FROM materials "
+                                  "WHERE uuid = 'cut3'") == "from b",
+                  "b's edit on both");
+        }
+
+        journal_batch erase;
+        erase.erased_materials.push_back("cut4");
+        CHECK(a.apply(erase), "erase on a");
+        CHECK(a.export_changeset(dir / "a3.changes"), "export erase");
+        CHECK(b.import_changeset(dir / "a3.changes"), "import erase");
+        CHECK(query_text(b, "SELECT count(*) FROM materials "
+                            "WHERE uuid = 'cut4'") == "0",
+              "erased on b");
+
+        CHECK(!b.apply_changeset(std::vector<unsigned char>{1, 2, 3, 4, 5}),
+              "garbage refused");
+    }
+
+    // the outbox survives the connection closing
+    {
+        Database a(dir / "a.sqlite");
+        journal_batch late;
+        late.materials.push_back(cut("cut7", "before the restart"));
+        CHECK(a.apply(late), "edit before closing");
+    }
+    {
+        Database a(dir / "a.sqlite");
+        Database b(dir / "b.sqlite");
+        CHECK(pending(a) > 0, "outbox after a restart");
+        CHECK(a.export_changeset(dir / "a4.changes"), "export after restart");
+        CHECK(b.import_changeset(dir / "a4.changes"), "import after restart");
+        CHECK(query_text(b, "SELECT notes FROM materials "
+                            "WHERE uuid = 'cut7'") == "before the restart",
+              "change made before the restart arrived");
+    }
+
+    fs::remove_all(dir);
+    return check_result();
+}
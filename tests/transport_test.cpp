@@ -0,0 +1,215 @@
+// transport
+// the shared curl_multi transport against a local server: clients sharing
+// its connections, bodies resent on a new connection, refused connections
+// and shutting down mid-request
+
+// setman
+#include "ai_endpoints/deepl.hpp"
+#include "ai_endpoints/google.hpp"
+
+// tests
+#include "check.hpp"
+#include "mock_server.hpp"
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <string>
+#include <thread>
+#include <vector>
+
+// nlohmann
+#include <nlohmann/json.hpp>
+
+using namespace setman::ai;
+using namespace setman::testing;
+using json = nlohmann::json;
+
+// deepl upper-cases, google answers with the size of its inline image
+static mock_response provider(const mock_request &request)
+{
+    mock_response response;
+    response.delay = std::chrono::milliseconds(20);
+
+    json body = json::parse(request.body, nullptr, false);
+    if (request.path.starts_with("/v2/translate")) {
+        json translations = json::array();
+        for (std::string text : body["text"]) {
+            for (char &c : text)
+                c = static_cast<char>(
+                    std::toupper(static_cast<unsigned char>(c)));
+            translations.push_back({{"text", text}});
+        }
+        response.body = json{{"translations", translations}}.dump();
+    } else if (request.path.find(":generateContent") != std::string::npos) {
+        size_t image = 0;
+        for (const auto &part : body["contents"][0]["parts"])
+            if (part.contains("inline_data"))
+                image += part["inline_data"]["data"].get<std::string>().size();
+        response.body =
+            json{{"candidates",
+                  {{{"content",
+                     {{"parts", {{{"text", std::to_string(image)}}}}}}}}}}
+                .dump();
+    } else if (request.path == "/slow") {
+        response.delay = std::chrono::seconds(10);
+    } else {
+        response.status = 404;
+    }
+    return response;
+}
+
+// a copyable cursor over a shared string, for streamed bodies
+struct text_cursor {
+    std::shared_ptr<const std::string> text;
+    size_t offset = 0;
+
+    size_t size() const { return text->size(); }
+    size_t read(char *buffer, size_t size)
+    {
+        size = std::min(size, text->size() - offset);
+        std::copy_n(text->data() + offset, size, buffer);
+        offset += size;
+        return size;
+    }
+};
+
+static void shared_connections()
+{
+    MockServer server(provider);
+    transport_options options;
+    options.http2 = false; // the mock server only speaks HTTP/1.1
+    options.max_host_connections = 4;
+    auto transport = Transport::create(options);
+    auto deepl = new_deepl_client("key", transport);
+    auto google = new_google_client("key", transport);
+
+    // many callers at once go out over the host's few connections
+    std::atomic<int> answered{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 60; i++) {
+        callers.emplace_back([&, i] {
+            deepl_request request("hello " + std::to_string(i), "DE");
+            request.endpoint = server.url("/v2/translate");
+            auto response = deepl->translate(request);
+            if (response.valid && response.http_code == 200 &&
+                response.content == std::vector<std::string>{
+                                        "HELLO " + std::to_string(i)})
+                ++answered;
+        });
+    }
+    for (auto &caller : callers)
+        caller.join();
+    CHECK(answered == 60, "%d of 60 answered", answered.load());
+    CHECK(server.connections() <= 4, "%zu connections for 60 requests",
+          server.connections());
+
+    // another client on the same transport reuses them, and a streamed
+    // body arrives whole
+    const size_t connections = server.connections();
+    google_request request;
+    request.endpoint = server.url("/models/");
+    request.add_text("describe");
+    request.add_inline_image(
+        curl_helpers::stream_from(text_cursor{
+            std::make_shared<const std::string>(100'000, 'A')}),
+        "image/png");
+    auto response = google->send(request);
+    CHECK(response.valid, "%s", response.error.c_str());
+    CHECK(response.content == std::vector<std::string>{"100000"},
+          "streamed image arrived whole");
+    CHECK(server.connections() == connections,
+          "the google client reused the pool: %zu connections, %zu before",
+          server.connections(), connections);
+}
+
+// a kept-alive connection the server closed on receiving the next request:
+// curl sends that request again on a new connection, rewinding its
+// streamed body to do so
+static void resent_after_drop()
+{
+    MockServer server([](const mock_request &request) {
+        if (request.sequence == 2)
+            return mock_response{.drop = true};
+        return provider(request);
+    });
+    auto transport = Transport::create({.http2 = false});
+    auto google = new_google_client("key", transport);
+
+    auto ask = [&] {
+        google_request request;
+        request.endpoint = server.url("/models/");
+        request.add_text("describe");
+        request.add_inline_image(
+            curl_helpers::stream_from(text_cursor{
+                std::make_shared<const std::string>(100'000, 'A')}),
+            "image/png");
+        return google->send(request);
+    };
+    auto first = ask();
+    CHECK(first.valid, "%s", first.error.c_str());
+
+    auto resent = ask();
+    CHECK(resent.valid, "resent: %s", resent.error.c_str());
+    CHECK(resent.content == std::vector<std::string>{"100000"},
+          "resent image arrived whole");
+    CHECK(server.connections() == 2, "%zu connections",
+          server.connections());
+    CHECK(server.requests() == 3, "%zu requests", server.requests());
+}
+
+static void refused()
+{
+    auto transport = Transport::create({.http2 = false});
+    auto deepl = new_deepl_client("key", transport);
+
+    // nothing listens on port 1
+    deepl_request request("hello", "DE");
+    request.endpoint = "http://127.0.0.1:1/v2/translate";
+    auto response = deepl->translate(request);
+    CHECK(!response.valid, "refused connection");
+    CHECK(response.http_code == 0, "no answer: %ld", response.http_code);
+    CHECK(!response.error.empty(), "refused with an error");
+}
+
+static void shutdown_in_flight()
+{
+    MockServer server(provider);
+    auto transport = Transport::create({.http2 = false});
+
+    auto pending = transport->submit(
+        {.url = server.url("/slow"), .body = "{}"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(server.requests() == 1, "request in flight");
+
+    // the last reference going away ends the request, long before the
+    // server would have answered
+    const auto start = std::chrono::steady_clock::now();
+    transport.reset();
+    CHECK(pending.wait_for(std::chrono::seconds(3)) ==
+              std::future_status::ready,
+          "request completed at shutdown");
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(3),
+          "shutdown did not wait for the server");
+    auto response = pending.get();
+    CHECK(response.http_code == 0 && !response.error.empty(),
+          "completed with an error: %ld %s", response.http_code,
+          response.error.c_str());
+
+    // a transport shut down while idle goes just as quietly
+    auto idle = Transport::create({.http2 = false});
+    auto answered = idle->perform({.url = server.url("/v2/translate"),
+                                   .body = R"({"text":["a"]})"});
+    CHECK(answered.http_code == 200, "%ld", answered.http_code);
+    idle.reset();
+}
+
+int main()
+{
+    shared_connections();
+    resent_after_drop();
+    refused();
+    shutdown_in_flight();
+    return check_result();
+}